@@ -0,0 +1,304 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include "SteganoKernels.h"
+#include "SteganoPayload.h"
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+#if defined(_M_X64) || defined(__x86_64__)
+	#define STEGANO_COSTS_SSE2 1
+	#include <emmintrin.h>
+#endif
+
+namespace Stegano {
+
+namespace {
+constexpr unsigned int TilePixels{TileSize * TileSize};
+// Payload bytes a tile gains with every bit per pixel
+constexpr unsigned int LevelBytes{TilePixels / 8U};
+// Depth map bytes held by a head tile
+constexpr unsigned int MapBytes{LevelBytes * (MapRow + 1U)};
+
+// Tile grid of an image, the last tile is left out when it overlaps the trailer (last 7 pixels)
+TileLayout Grid(const cv::Mat& image) {
+	TileLayout layout;
+	layout.TilesX = static_cast<unsigned int>(image.cols) / TileSize;
+	layout.TilesY = static_cast<unsigned int>(image.rows) / TileSize;
+	layout.tiles = layout.TilesX * layout.TilesY;
+	if(layout.tiles && layout.TilesY * TileSize == static_cast<unsigned int>(image.rows)
+	   && static_cast<unsigned int>(image.cols) - layout.TilesX * TileSize < 7U) {
+		--layout.tiles;
+	}
+	layout.HeadTiles = (layout.tiles + MapBytes - 1U) / MapBytes;
+	layout.depths.assign(layout.tiles, 0U);
+	return layout;
+}
+
+// First channel of row r of a tile
+unsigned int RowStart(const cv::Mat& image, const TileLayout& layout, const unsigned int tile, const unsigned int r) {
+	const unsigned int x{tile % layout.TilesX * TileSize}, y{tile / layout.TilesX * TileSize + r};
+	return (y * static_cast<unsigned int>(image.cols) + x) * static_cast<unsigned int>(image.channels());
+}
+
+// Embeds the bytes of data from offset on, cut at length, in a tile at the given BPCH row. A tile row carries TileSize * (row + 1)
+// bits, a whole number of bytes, so every tile row starts on a byte boundary.
+template <typename Channel>
+void EmbedTile(Channel* const BaseImageData, const cv::Mat& image, const TileLayout& layout, const unsigned int tile,
+			   const unsigned int row, const unsigned char* const data, const unsigned int length, const unsigned int offset) {
+	const unsigned int PixelChannels{static_cast<unsigned int>(image.channels())}, RowBytes{TileSize * (row + 1U) / 8U};
+	VisitBpch(PixelChannels, row, [&](const auto& bpch) {
+		for(unsigned int r{0}; r < TileSize && offset + r * RowBytes < length; ++r) {
+			const unsigned int start{RowStart(image, layout, tile, r)};
+			EmbedRange(BaseImageData, data, length, KernelState{start, offset + r * RowBytes, 0U, 0U}, start + TileSize * PixelChannels, 0U,
+					   bpch);
+		}
+	});
+}
+
+// Extracts what EmbedTile() embedded, tile rows never share a byte
+template <typename Channel>
+void ExtractTile(const Channel* const SourceImageData, const cv::Mat& image, const TileLayout& layout, const unsigned int tile,
+				 const unsigned int row, unsigned char* const data, const unsigned int length, const unsigned int offset) {
+	const unsigned int PixelChannels{static_cast<unsigned int>(image.channels())}, RowBytes{TileSize * (row + 1U) / 8U};
+	VisitBpch(PixelChannels, row, [&](const auto& bpch) {
+		for(unsigned int r{0}; r < TileSize && offset + r * RowBytes < length; ++r) {
+			const unsigned int start{RowStart(image, layout, tile, r)};
+			KernelFragment head, tail;
+			ExtractRange(SourceImageData, data, length, KernelState{start, offset + r * RowBytes, 0U, 0U}, start + TileSize * PixelChannels,
+						 0U, bpch, head, tail);
+		}
+	});
+}
+
+// Tile holding the stream bytes [offset, offset + LevelBytes * (row + 1))
+struct Placement {
+	unsigned int tile, row, offset;
+};
+
+// Stream bytes held by a placed tile
+unsigned int PlacedBytes(const Placement& placement, const unsigned int length) {
+	return std::min(LevelBytes * (placement.row + 1U), length - placement.offset);
+}
+
+// Used tiles in fill order with their stream offsets, up to the tile holding the last stream byte
+std::vector<Placement> PlaceTiles(const TileLayout& layout, const std::string& passphrase, const unsigned int length) {
+	const unsigned int body{layout.tiles - layout.HeadTiles};
+	const ChunkOrder order(passphrase, body);
+	std::vector<Placement> placed;
+	unsigned long long offset{0};
+	for(unsigned int k{0}; k < body && offset < length; ++k) {
+		const unsigned int tile{layout.HeadTiles + order.Place(k)};
+		if(layout.depths[tile]) {
+			placed.push_back({tile, layout.depths[tile] - 1U, static_cast<unsigned int>(offset)});
+			offset += LevelBytes * layout.depths[tile];
+		}
+	}
+	return placed;
+}
+
+// Sum of absolute differences between the samples [0, size) of a and b
+template <typename Sample>
+double Sad(const Sample* const a, const Sample* const b, const unsigned int size) {
+	double sum{0.0};
+	for(unsigned int i{0}; i < size; ++i) {
+		sum += std::abs(static_cast<double>(a[i]) - static_cast<double>(b[i]));
+	}
+	return sum;
+}
+
+#if STEGANO_COSTS_SSE2
+// psadbw sums the absolute differences of 16 bytes at a time
+double Sad(const unsigned char* const a, const unsigned char* const b, const unsigned int size) {
+	__m128i sum{_mm_setzero_si128()};
+	unsigned int i{0};
+	for(; i + 16U <= size; i += 16U) {
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+											  _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i))));
+	}
+	unsigned long long total{static_cast<unsigned long long>(_mm_cvtsi128_si64(sum))
+							 + static_cast<unsigned long long>(_mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum)))};
+	for(; i < size; ++i) {
+		total += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+	}
+	return static_cast<double>(total);
+}
+#endif
+
+// Mean absolute difference between horizontally and vertically neighbouring samples of a tile
+template <typename Sample>
+float Activity(const cv::Mat& image, const unsigned int tx, const unsigned int ty) {
+	const unsigned int PixelChannels{static_cast<unsigned int>(image.channels())}, size{TileSize * PixelChannels};
+	double sum{0.0};
+	for(unsigned int r{0}; r < TileSize; ++r) {
+		const Sample* const row{image.ptr<Sample>(static_cast<int>(ty * TileSize + r)) + tx * size};
+		sum += Sad(row, row + PixelChannels, size - PixelChannels);
+		if(r + 1U < TileSize) {
+			sum += Sad(row, image.ptr<Sample>(static_cast<int>(ty * TileSize + r + 1U)) + tx * size, size);
+		}
+	}
+	return static_cast<float>(sum / (2.0 * TilePixels * PixelChannels));
+}
+}
+
+std::vector<float> TileCosts(const cv::Mat& BaseImage) {
+	const unsigned int TilesX{static_cast<unsigned int>(BaseImage.cols) / TileSize};
+	const unsigned int TilesY{static_cast<unsigned int>(BaseImage.rows) / TileSize};
+	auto start = std::chrono::steady_clock::now();
+	std::vector<float> costs(static_cast<std::size_t>(TilesX) * TilesY);
+	// One task per row of tiles, a task streams through TileSize rows of the base
+	WorkerPool::Instance().Run(TilesY, [&](const unsigned int ty) {
+		for(unsigned int tx{0}; tx < TilesX; ++tx) {
+			switch(BaseImage.depth()) {
+			case CV_16U:
+				costs[ty * TilesX + tx] = Activity<unsigned short>(BaseImage, tx, ty);
+				break;
+			case CV_32F:
+				costs[ty * TilesX + tx] = Activity<float>(BaseImage, tx, ty);
+				break;
+			default:
+				costs[ty * TilesX + tx] = Activity<unsigned char>(BaseImage, tx, ty);
+			}
+		}
+	});
+	auto end = std::chrono::steady_clock::now();
+	Stegano::Logger::Verbose("Cost map of ", costs.size(), " tiles computed in ",
+							 std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count(), " ms", '\n');
+	return costs;
+}
+
+bool PlanTiles(const cv::Mat& BaseImage, const std::vector<float>& costs, const unsigned int length, TileLayout& layout) {
+	layout = Grid(BaseImage);
+	if(layout.tiles <= layout.HeadTiles) {
+		return false;
+	}
+	const unsigned int PixelChannels{static_cast<unsigned int>(BaseImage.channels())};
+	const unsigned int rows{BpchRows(BaseImage.elemSize1(), PixelChannels)};
+	// Noise power of a tile at every BPCH row, a channel carrying b bits gets uniform noise of variance (4^b - 1) / 12
+	std::vector<double> noise(rows, 0.0);
+	for(unsigned int row{0}; row < rows; ++row) {
+		VisitBpch(PixelChannels, row, [&](const auto& bpch) {
+			for(const unsigned int bits : bpch) {
+				noise[row] += std::ldexp(1.0, static_cast<int>(2U * bits)) - 1.0;
+			}
+		});
+	}
+	// A floor on the cost keeps flat tiles usable once the textured ones are deep
+	double floor{0.0};
+	for(unsigned int tile{layout.HeadTiles}; tile < layout.tiles; ++tile) {
+		floor += costs[tile];
+	}
+	floor = floor / (layout.tiles - layout.HeadTiles) / 8.0 + 1e-3;
+
+	// The next bit per pixel goes to the tile where the noise it adds is the smallest against the texture of the tile
+	std::priority_queue<std::pair<double, unsigned int>> queue;
+	for(unsigned int tile{layout.HeadTiles}; tile < layout.tiles; ++tile) {
+		queue.push({(costs[tile] + floor) / noise[0], tile});
+	}
+	unsigned long long capacity{0};
+	while(capacity < length) {
+		if(queue.empty()) {
+			return false;
+		}
+		const unsigned int tile{queue.top().second};
+		queue.pop();
+		capacity += LevelBytes;
+		if(++layout.depths[tile] < rows) {
+			queue.push({(costs[tile] + floor) / noise[layout.depths[tile]], tile});
+		}
+	}
+	std::fill(layout.depths.begin(), layout.depths.begin() + layout.HeadTiles, static_cast<unsigned char>(MapRow + 1U));
+
+	const auto body{layout.depths.begin() + layout.HeadTiles};
+	const unsigned int used{
+		static_cast<unsigned int>(std::count_if(body, layout.depths.end(), [](const unsigned char depth) { return depth != 0U; }))};
+	Stegano::Logger::Verbose("Adaptive layout, ", used, " of ", layout.tiles - layout.HeadTiles, " tiles used, up to ",
+							 static_cast<unsigned int>(*std::max_element(body, layout.depths.end())), " bits per pixel", '\n');
+	return true;
+}
+
+void EmbedTiles(cv::Mat& BaseImage, const TileLayout& layout, const unsigned char* const stream, const unsigned int length) {
+	const std::vector<Placement> placed{PlaceTiles(layout, key, length)};
+	const unsigned int deepest{*std::max_element(layout.depths.begin(), layout.depths.end())};
+	const JobPlan plan{PlanJob(length, deepest - 1U, static_cast<unsigned int>(BaseImage.channels()), false)};
+	const StreamCipher cipher{PayloadCipher(stream)};
+	VisitChannels(BaseImage, [&](auto* const BaseImageData) {
+		WorkerPool::Instance().Run(
+			layout.HeadTiles,
+			[&](const unsigned int h) {
+				EmbedTile(BaseImageData, BaseImage, layout, h, MapRow, layout.depths.data(), layout.tiles, h * MapBytes);
+			},
+			plan.workers);
+		WorkerPool::Instance().Run(
+			static_cast<unsigned int>(placed.size()),
+			[&](const unsigned int k) {
+				if(!cipher.Enabled()) {
+					EmbedTile(BaseImageData, BaseImage, layout, placed[k].tile, placed[k].row, stream, length, placed[k].offset);
+					return;
+				}
+				// Every task encrypts the bytes of its own tile
+				thread_local std::vector<unsigned char> encrypted;
+				const unsigned int size{PlacedBytes(placed[k], length)};
+				encrypted.assign(stream + placed[k].offset, stream + placed[k].offset + size);
+				cipher.Apply(encrypted.data(), size, placed[k].offset);
+				EmbedTile(BaseImageData, BaseImage, layout, placed[k].tile, placed[k].row, encrypted.data(), size, 0U);
+			},
+			plan.workers);
+	});
+}
+
+bool ExtractTiles(const cv::Mat& SourceImage, const unsigned int length, const PayloadMarker& marker, std::vector<unsigned char>& stream) {
+	const unsigned int rows{BpchRows(SourceImage.elemSize1(), static_cast<unsigned int>(SourceImage.channels()))};
+	if(!LengthFits(length, static_cast<unsigned int>(SourceImage.rows * SourceImage.cols - 7), rows)) {
+		return false;
+	}
+	TileLayout layout{Grid(SourceImage)};
+	if(layout.tiles <= layout.HeadTiles || (marker.encrypted && length < NonceBytes)) {
+		return false;
+	}
+	VisitChannels(SourceImage, [&](const auto* const SourceImageData) {
+		WorkerPool::Instance().Run(layout.HeadTiles, [&](const unsigned int h) {
+			ExtractTile(SourceImageData, SourceImage, layout, h, MapRow, layout.depths.data(), layout.tiles, h * MapBytes);
+		});
+	});
+	unsigned long long capacity{0};
+	for(unsigned int tile{0}; tile < layout.tiles; ++tile) {
+		if(tile < layout.HeadTiles ? layout.depths[tile] != MapRow + 1U : layout.depths[tile] > rows) {
+			return false;
+		}
+		capacity += tile < layout.HeadTiles ? 0U : LevelBytes * layout.depths[tile];
+	}
+	if(capacity < length) {
+		return false;
+	}
+
+	const std::vector<Placement> placed{PlaceTiles(layout, marker.keyed ? key : std::string(), length)};
+	const unsigned int deepest{*std::max_element(layout.depths.begin(), layout.depths.end())};
+	const JobPlan plan{PlanJob(length, deepest - 1U, static_cast<unsigned int>(SourceImage.channels()), true)};
+	stream.assign(length, 0U);
+	StreamCipher cipher;
+	VisitChannels(SourceImage, [&](const auto* const SourceImageData) {
+		// Every task decrypts the bytes of its own tile once extracted
+		const auto extract = [&](const unsigned int k) {
+			ExtractTile(SourceImageData, SourceImage, layout, placed[k].tile, placed[k].row, stream.data(), length, placed[k].offset);
+			cipher.Apply(stream.data() + placed[k].offset, PlacedBytes(placed[k], length), placed[k].offset);
+		};
+		unsigned int first{0};
+		if(marker.encrypted && !placed.empty()) {
+			// The nonce is at the start of the first tile
+			extract(0U);
+			cipher = StreamCipher(cipherkey, stream.data());
+			cipher.Apply(stream.data(), PlacedBytes(placed[0], length), 0U);
+			first = 1U;
+		}
+		WorkerPool::Instance().Run(
+			static_cast<unsigned int>(placed.size()) - first, [&](const unsigned int k) { extract(first + k); }, plan.workers);
+	});
+	if(marker.encrypted) {
+		stream.erase(stream.begin(), stream.begin() + NonceBytes);
+	}
+	return true;
+}
+
+}
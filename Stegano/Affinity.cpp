@@ -0,0 +1,174 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include <algorithm>
+
+#if _WIN32
+	#define NOMINMAX
+	#include <Windows.h>
+#else
+	#include <pthread.h>
+	#include <sched.h>
+	#include <fstream>
+	#include <filesystem>
+#endif
+
+namespace Stegano {
+
+namespace {
+struct LogicalProcessor {
+	unsigned int group, index;
+};
+
+// Logical processors grouped by NUMA node, nodes in ascending order
+using Topology = std::vector<std::vector<LogicalProcessor>>;
+
+#if !_WIN32
+/**
+ * @brief Parses a sysfs cpu list, e.g. "0-3,8-11"
+ * @param list -> cpu list string
+ * @param node -> Node to append the processors to
+ */
+void ParseCpuList(const std::string& list, std::vector<LogicalProcessor>& node) {
+	std::size_t pos{0};
+	while(pos < list.size()) {
+		std::size_t end{list.find(',', pos)};
+		if(end == std::string::npos) {
+			end = list.size();
+		}
+		const std::string range{list.substr(pos, end - pos)};
+		const std::size_t dash{range.find('-')};
+		try {
+			const unsigned int first{static_cast<unsigned int>(std::stoul(range))};
+			const unsigned int last{dash == std::string::npos ? first : static_cast<unsigned int>(std::stoul(range.substr(dash + 1)))};
+			for(unsigned int cpu{first}; cpu <= last; ++cpu) {
+				node.push_back({0U, cpu});
+			}
+		}
+		catch(...) {
+		}
+		pos = end + 1;
+	}
+}
+#endif
+
+Topology ReadTopology() {
+	Topology topology;
+#if _WIN32
+	ULONG highest{0};
+	if(GetNumaHighestNodeNumber(&highest)) {
+		for(USHORT node{0}; node <= highest; ++node) {
+			GROUP_AFFINITY mask{};
+			if(!GetNumaNodeProcessorMaskEx(node, &mask) || !mask.Mask) {
+				continue;
+			}
+			std::vector<LogicalProcessor> processors;
+			for(unsigned int bit{0}; bit < 64U; ++bit) {
+				if(mask.Mask & (KAFFINITY{1} << bit)) {
+					processors.push_back({mask.Group, bit});
+				}
+			}
+			topology.push_back(std::move(processors));
+		}
+	}
+#else
+	std::error_code ec;
+	std::vector<std::pair<unsigned int, std::filesystem::path>> nodes;
+	for(const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+		const std::string name{entry.path().filename().string()};
+		if(name.size() > 4 && name.compare(0, 4, "node") == 0 && name.find_first_not_of("0123456789", 4) == std::string::npos) {
+			nodes.emplace_back(static_cast<unsigned int>(std::stoul(name.substr(4))), entry.path());
+		}
+	}
+	std::sort(nodes.begin(), nodes.end());
+	for(const auto& node : nodes) {
+		std::ifstream file(node.second / "cpulist");
+		std::string list;
+		std::vector<LogicalProcessor> processors;
+		if(std::getline(file, list)) {
+			ParseCpuList(list, processors);
+		}
+		if(!processors.empty()) {
+			topology.push_back(std::move(processors));
+		}
+	}
+#endif
+	if(topology.empty()) {
+		// No NUMA information, treat the machine as a single node
+		std::vector<LogicalProcessor> processors;
+		for(unsigned int cpu{0}; cpu < std::thread::hardware_concurrency(); ++cpu) {
+			processors.push_back({0U, cpu});
+		}
+		topology.push_back(std::move(processors));
+	}
+	if(numanodes != 0U && numanodes < topology.size()) {
+		topology.resize(numanodes);
+	}
+	return topology;
+}
+
+const Topology& GetTopology() {
+	static const Topology topology{ReadTopology()};
+	return topology;
+}
+}
+
+unsigned int LogicalProcessorCount() {
+	if(affinity != AFFINITY_NONE) {
+		unsigned int count{0};
+		for(const auto& node : GetTopology()) {
+			count += static_cast<unsigned int>(node.size());
+		}
+		return count;
+	}
+#if _WIN32
+	// hardware_concurrency() only reports the processor group of the calling thread
+	return static_cast<unsigned int>(GetActiveProcessorCount(ALL_PROCESSOR_GROUPS));
+#else
+	return std::thread::hardware_concurrency();
+#endif
+}
+
+unsigned int NumaNodeCount() {
+	return static_cast<unsigned int>(GetTopology().size());
+}
+
+bool PinThread(const unsigned int k) {
+	if(affinity == AFFINITY_NONE) {
+		return false;
+	}
+	const Topology& topology{GetTopology()};
+	const LogicalProcessor* processor{nullptr};
+	if(affinity == AFFINITY_SCATTER) {
+		// Round robin over the nodes, then over the processors of a node
+		const auto& node = topology[k % topology.size()];
+		processor = &node[(k / topology.size()) % node.size()];
+	}
+	else {
+		// Fill a node before moving to the next one
+		unsigned int flat{k % LogicalProcessorCount()};
+		for(const auto& node : topology) {
+			if(flat < node.size()) {
+				processor = &node[flat];
+				break;
+			}
+			flat -= static_cast<unsigned int>(node.size());
+		}
+	}
+	if(!processor) {
+		return false;
+	}
+#if _WIN32
+	GROUP_AFFINITY mask{};
+	mask.Group = static_cast<WORD>(processor->group);
+	mask.Mask = KAFFINITY{1} << processor->index;
+	return SetThreadGroupAffinity(GetCurrentThread(), &mask, nullptr) != 0;
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(processor->index, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) == 0;
+#endif
+}
+
+}
@@ -0,0 +1,258 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include "SteganoKernels.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+namespace Stegano {
+
+namespace {
+// BPCH rows timed during calibration, other rows are interpolated. The last row (8 bits per channel) is only reached by 16 bit
+// and floating point bases, and by the BPCH4 rows of 8 bit BGRA bases, see ChannelCost().
+constexpr std::array<unsigned int, 4> CalibratedRows{0U, 5U, 11U, 23U};
+// Channels walked by a calibration run, large enough to spill out of the last level cache
+constexpr unsigned int CalibrationChannels{24U * 1024U * 1024U};
+// A chunk is sized so that dispatching it costs at most 1 / ChunkOverheadRatio of its work
+constexpr double ChunkOverheadRatio{100.0};
+constexpr unsigned int MaxChunksPerWorker{4U};
+
+struct CostModel {
+	unsigned int processors{0}, affinity{0};
+	// Nanoseconds per walked channel for the calibrated rows, single threaded
+	std::array<double, CalibratedRows.size()> embed{}, extract{};
+	// Nanoseconds per copied byte, single threaded
+	double copy{0.0};
+	// Measured speedup of the embedding kernel with {workers, speedup} pairs, ascending workers
+	std::vector<std::pair<unsigned int, double>> speedup;
+	// Nanoseconds for a pooled Run() and for each additional task
+	double run{0.0}, task{0.0};
+};
+
+CostModel model;
+
+std::filesystem::path CostModelPath() {
+	const std::string path{EnvironmentVariable("STEGANO_TUNE_FILE")};
+	if(!path.empty()) {
+		return path;
+	}
+	std::error_code ec;
+	const std::filesystem::path temp{std::filesystem::temp_directory_path(ec)};
+	return ec ? std::filesystem::path("Stegano.tune") : temp / "Stegano.tune";
+}
+
+bool ReadCostModel(const std::filesystem::path& path, const unsigned int processors) {
+	std::ifstream file(path);
+	std::string key;
+	unsigned int version{0}, count{0};
+	if(!(file >> key >> version) || key != "stegano-costmodel" || version != 3U) {
+		return false;
+	}
+	CostModel loaded;
+	if(!(file >> key >> loaded.processors >> key >> loaded.affinity)) {
+		return false;
+	}
+	if(loaded.processors != processors || loaded.affinity != affinity) {
+		return false;
+	}
+	file >> key;
+	for(double& cost : loaded.embed) {
+		file >> cost;
+	}
+	file >> key;
+	for(double& cost : loaded.extract) {
+		file >> cost;
+	}
+	file >> key >> loaded.copy >> key >> loaded.run >> key >> loaded.task >> key >> count;
+	for(unsigned int k{0}; k < count && file; ++k) {
+		std::pair<unsigned int, double> point;
+		file >> point.first >> point.second;
+		loaded.speedup.push_back(point);
+	}
+	if(!file || loaded.speedup.empty()) {
+		return false;
+	}
+	model = loaded;
+	return true;
+}
+
+void WriteCostModel(const std::filesystem::path& path) {
+	std::ofstream file(path);
+	file << "stegano-costmodel 3" << '\n';
+	file << "processors " << model.processors << '\n' << "affinity " << model.affinity << '\n';
+	file << "embed";
+	for(const double cost : model.embed) {
+		file << ' ' << cost;
+	}
+	file << '\n' << "extract";
+	for(const double cost : model.extract) {
+		file << ' ' << cost;
+	}
+	file << '\n';
+	file << "copy " << model.copy << '\n' << "run " << model.run << '\n' << "task " << model.task << '\n';
+	file << "speedup " << model.speedup.size() << '\n';
+	for(const auto& point : model.speedup) {
+		file << point.first << ' ' << point.second << '\n';
+	}
+	if(!file) {
+		Stegano::Logger::Verbose("Cannot write the cost model to ", path.string(), '\n');
+	}
+}
+
+template <typename Function>
+double TimeNanoseconds(const Function& function) {
+	auto start = std::chrono::steady_clock::now();
+	function();
+	auto end = std::chrono::steady_clock::now();
+	return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+}
+
+void Calibrate(const unsigned int processors) {
+	Stegano::Logger::Verbose("Calibrating the cost model on this host", '\n');
+	std::vector<unsigned char> base(CalibrationChannels), payload(CalibrationChannels / 3U * BPCH.size() / 8U + 1U);
+	std::mt19937 generator(9U);
+	for(auto& byte : base) {
+		byte = static_cast<unsigned char>(generator());
+	}
+	for(auto& byte : payload) {
+		byte = static_cast<unsigned char>(generator());
+	}
+	model = CostModel();
+	model.processors = processors;
+	model.affinity = affinity;
+
+	// Single threaded cost of both kernels, stride 0 => every channel is walked
+	for(unsigned int r{0}; r < CalibratedRows.size(); ++r) {
+		const std::array<unsigned int, 3> bpch{BPCH[CalibratedRows[r]]};
+		const unsigned int bytes{CalibrationChannels / 3U * (CalibratedRows[r] + 1U) / 8U};
+		model.embed[r] = TimeNanoseconds([&] {
+			EmbedRange(base.data(), payload.data(), bytes, KernelState{0U, 0U, 0U, 0U}, CalibrationChannels, 0U, bpch);
+		}) / CalibrationChannels;
+		KernelFragment head, tail;
+		model.extract[r] = TimeNanoseconds([&] {
+			ExtractRange(base.data(), payload.data(), bytes, KernelState{0U, 0U, 0U, 0U}, CalibrationChannels, 0U, bpch, head, tail);
+		}) / CalibrationChannels;
+	}
+
+	std::vector<unsigned char> copied(CalibrationChannels);
+	model.copy = TimeNanoseconds([&] { std::copy(base.begin(), base.end(), copied.begin()); }) / CalibrationChannels;
+
+	// Scaling of the embedding kernel, limited by memory bandwidth rather than by the processor count
+	const std::array<unsigned int, 3> bpch{BPCH[CalibratedRows[1]]};
+	const unsigned int bytes{CalibrationChannels / 3U * (CalibratedRows[1] + 1U) / 8U};
+	double single{0.0};
+	// Powers of two, plus the processor count itself
+	std::vector<unsigned int> counts;
+	for(unsigned int workers{1}; workers < processors; workers *= 2U) {
+		counts.push_back(workers);
+	}
+	counts.push_back(processors);
+	for(const unsigned int workers : counts) {
+		const double elapsed{TimeNanoseconds([&] {
+			WorkerPool::Instance().Run(workers, [&](const unsigned int k) {
+				EmbedRange(base.data(), payload.data(), bytes, BandStart(k, workers, CalibrationChannels, 0U, CalibratedRows[1], bpch),
+						   BandEnd(k, workers, CalibrationChannels), 0U, bpch);
+			});
+		})};
+		if(workers == 1U) {
+			single = elapsed;
+		}
+		model.speedup.emplace_back(workers, single / elapsed);
+	}
+
+	// Dispatch overheads of the pool
+	constexpr unsigned int repeats{64U};
+	const unsigned int size{WorkerPool::Instance().Size()};
+	if(size > 1U) {
+		const double run{TimeNanoseconds([&] {
+			for(unsigned int r{0}; r < repeats; ++r) {
+				WorkerPool::Instance().Run(size, [](unsigned int) {});
+			}
+		})};
+		model.run = run / repeats;
+		const double tasks{TimeNanoseconds([&] { WorkerPool::Instance().Run(size * repeats, [](unsigned int) {}); })};
+		model.task = std::max(0.0, tasks - model.run) / (size * repeats);
+	}
+}
+
+// Single threaded nanoseconds per walked channel for a row of BPCH (3 channels) or BPCH4 (4 channels), interpolated between the
+// calibrated BPCH rows. A BPCH4 row is taken as the BPCH row with the same bits per channel, so every row of every base maps
+// into the calibrated range.
+double ChannelCost(const std::array<double, CalibratedRows.size()>& costs, const unsigned int BitsPerPixel,
+				   const unsigned int PixelChannels) {
+	const double row{(BitsPerPixel + 1.0) * 3.0 / PixelChannels - 1.0};
+	for(unsigned int r{1}; r < CalibratedRows.size(); ++r) {
+		if(row <= CalibratedRows[r]) {
+			const double t{(row - CalibratedRows[r - 1U]) / (CalibratedRows[r] - CalibratedRows[r - 1U])};
+			return costs[r - 1U] + t * (costs[r] - costs[r - 1U]);
+		}
+	}
+	return costs.back();
+}
+
+double Speedup(const unsigned int workers) {
+	auto upper = std::lower_bound(model.speedup.begin(), model.speedup.end(), std::make_pair(workers, 0.0));
+	if(upper == model.speedup.end()) {
+		return model.speedup.back().second;
+	}
+	if(upper->first == workers || upper == model.speedup.begin()) {
+		return upper->second;
+	}
+	auto lower = upper - 1;
+	const double t{static_cast<double>(workers - lower->first) / (upper->first - lower->first)};
+	return lower->second + t * (upper->second - lower->second);
+}
+
+// Worker count and chunk count of a job of the given single threaded nanoseconds
+JobPlan PlanWork(const double work) {
+	JobPlan plan{1U, 1U};
+	double best{work};
+	for(unsigned int workers{2}; workers <= threads; ++workers) {
+		const double predicted{work / Speedup(workers) + model.run + model.task * workers};
+		if(predicted < best) {
+			best = predicted;
+			plan.workers = workers;
+		}
+	}
+	// More chunks than workers balance out preempted workers, as long as a chunk stays much costlier than its dispatch
+	const double chunkwork{model.task * ChunkOverheadRatio};
+	const double chunks{chunkwork > 0.0 ? work / chunkwork : plan.workers};
+	if(plan.workers > 1U) {
+		plan.chunks = plan.workers * std::max(1U, std::min(MaxChunksPerWorker, static_cast<unsigned int>(chunks / plan.workers)));
+	}
+	Stegano::Logger::Verbose("Autotuned plan = ", plan.workers, " worker(s), ", plan.chunks, " chunk(s), run ",
+							 plan.workers == 1U ? "on the calling thread" : "on the pool", ", predicted ", best / 1e6, " ms", '\n');
+	return plan;
+}
+}
+
+void LoadCostModel(const unsigned int processors) {
+	const std::filesystem::path path{CostModelPath()};
+	if(ReadCostModel(path, processors)) {
+		Stegano::Logger::Verbose("Cost model loaded from ", path.string(), '\n');
+		return;
+	}
+	Calibrate(processors);
+	WriteCostModel(path);
+	Stegano::Logger::Verbose("Cost model saved at ", path.string(), '\n');
+}
+
+JobPlan PlanJob(const unsigned int PayloadBytes, const unsigned int BitsPerPixel, const unsigned int PixelChannels, const bool extract) {
+	if(!autotune) {
+		return {threads, threads};
+	}
+	// Channels walked by the kernel, the stride jumps are free
+	const double channels{static_cast<double>(PayloadBytes) * 8.0 / (BitsPerPixel + 1U) * PixelChannels};
+	return PlanWork(channels * ChannelCost(extract ? model.extract : model.embed, BitsPerPixel, PixelChannels));
+}
+
+JobPlan PlanCopy(const std::size_t bytes) {
+	if(!autotune) {
+		return {threads, threads};
+	}
+	return PlanWork(static_cast<double>(bytes) * model.copy);
+}
+
+}
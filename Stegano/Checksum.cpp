@@ -0,0 +1,104 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoKernels.h"
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+	#define STEGANO_CRC32C_SSE42 1
+	#include <nmmintrin.h>
+	#if _WIN32
+		#include <intrin.h>
+		#define STEGANO_TARGET_SSE42
+	#else
+		#define STEGANO_TARGET_SSE42 __attribute__((target("sse4.2")))
+	#endif
+#endif
+
+namespace Stegano {
+
+namespace {
+// Reflected Castagnoli polynomial
+constexpr unsigned int Castagnoli{0x82F63B78U};
+
+// Slicing by 8 tables, row 0 is the classic byte table
+struct CrcTables {
+	std::array<std::array<unsigned int, 256>, 8> rows{};
+	CrcTables() {
+		for(unsigned int b{0}; b < 256U; ++b) {
+			unsigned int crc{b};
+			for(unsigned int bit{0}; bit < 8U; ++bit) {
+				crc = (crc >> 1U) ^ ((crc & 1U) ? Castagnoli : 0U);
+			}
+			rows[0][b] = crc;
+		}
+		for(unsigned int b{0}; b < 256U; ++b) {
+			for(unsigned int r{1}; r < 8U; ++r) {
+				rows[r][b] = (rows[r - 1U][b] >> 8U) ^ rows[0][rows[r - 1U][b] & 0xFFU];
+			}
+		}
+	}
+};
+
+unsigned int SoftwareCrc32c(unsigned int crc, const unsigned char* data, std::size_t size) {
+	static const CrcTables tables;
+	const auto& t{tables.rows};
+	for(; size >= 8U; size -= 8U, data += 8) {
+		unsigned int low, high;
+		std::memcpy(&low, data, 4U);
+		std::memcpy(&high, data + 4, 4U);
+		// Little endian load, the only byte order this tool is built for
+		low ^= crc;
+		crc = t[7][low & 0xFFU] ^ t[6][(low >> 8U) & 0xFFU] ^ t[5][(low >> 16U) & 0xFFU] ^ t[4][low >> 24U] ^ t[3][high & 0xFFU]
+			  ^ t[2][(high >> 8U) & 0xFFU] ^ t[1][(high >> 16U) & 0xFFU] ^ t[0][high >> 24U];
+	}
+	for(; size; --size, ++data) {
+		crc = (crc >> 8U) ^ t[0][(crc ^ *data) & 0xFFU];
+	}
+	return crc;
+}
+
+#if STEGANO_CRC32C_SSE42
+STEGANO_TARGET_SSE42 unsigned int HardwareCrc32c(unsigned int crc, const unsigned char* data, std::size_t size) {
+	#if defined(_M_X64) || defined(__x86_64__)
+	unsigned long long wide{crc};
+	for(; size >= 8U; size -= 8U, data += 8) {
+		unsigned long long word;
+		std::memcpy(&word, data, 8U);
+		wide = _mm_crc32_u64(wide, word);
+	}
+	crc = static_cast<unsigned int>(wide);
+	#endif
+	for(; size >= 4U; size -= 4U, data += 4) {
+		unsigned int word;
+		std::memcpy(&word, data, 4U);
+		crc = _mm_crc32_u32(crc, word);
+	}
+	for(; size; --size, ++data) {
+		crc = _mm_crc32_u8(crc, *data);
+	}
+	return crc;
+}
+
+bool HasSse42() {
+	#if _WIN32
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 20)) != 0;
+	#else
+	return __builtin_cpu_supports("sse4.2");
+	#endif
+}
+#endif
+}
+
+unsigned int Crc32c(const unsigned char* const data, const std::size_t size) {
+#if STEGANO_CRC32C_SSE42
+	static const bool hardware{HasSse42()};
+	if(hardware) {
+		return ~HardwareCrc32c(0xFFFFFFFFU, data, size);
+	}
+#endif
+	return ~SoftwareCrc32c(0xFFFFFFFFU, data, size);
+}
+
+}
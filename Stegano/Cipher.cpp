@@ -0,0 +1,219 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoPayload.h"
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iterator>
+#include <random>
+
+#if defined(_M_X64) || defined(__x86_64__)
+	#define STEGANO_CHACHA_SSE2 1
+	#include <emmintrin.h>
+#endif
+
+namespace Stegano {
+
+namespace {
+constexpr unsigned int BlockBytes{64U};
+
+inline unsigned int Rotate(const unsigned int x, const unsigned int n) {
+	return (x << n) | (x >> (32U - n));
+}
+
+inline void QuarterRound(unsigned int& a, unsigned int& b, unsigned int& c, unsigned int& d) {
+	a += b;
+	d = Rotate(d ^ a, 16U);
+	c += d;
+	b = Rotate(b ^ c, 12U);
+	a += b;
+	d = Rotate(d ^ a, 8U);
+	c += d;
+	b = Rotate(b ^ c, 7U);
+}
+
+// Keystream block "counter", serialised little endian
+void Block(const std::array<unsigned int, 16>& input, const unsigned int counter, unsigned char* const out) {
+	std::array<unsigned int, 16> x{input};
+	x[12] = counter;
+	for(unsigned int round{0}; round < 10U; ++round) {
+		QuarterRound(x[0], x[4], x[8], x[12]);
+		QuarterRound(x[1], x[5], x[9], x[13]);
+		QuarterRound(x[2], x[6], x[10], x[14]);
+		QuarterRound(x[3], x[7], x[11], x[15]);
+		QuarterRound(x[0], x[5], x[10], x[15]);
+		QuarterRound(x[1], x[6], x[11], x[12]);
+		QuarterRound(x[2], x[7], x[8], x[13]);
+		QuarterRound(x[3], x[4], x[9], x[14]);
+	}
+	for(unsigned int i{0}; i < 16U; ++i) {
+		const unsigned int word{x[i] + (i == 12U ? counter : input[i])};
+		for(unsigned int b{0}; b < 4U; ++b) {
+			out[i * 4U + b] = static_cast<unsigned char>(word >> (8U * b));
+		}
+	}
+}
+
+#if STEGANO_CHACHA_SSE2
+template <int n>
+inline __m128i Rotate(const __m128i x) {
+	return _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - n));
+}
+
+inline void QuarterRound(__m128i& a, __m128i& b, __m128i& c, __m128i& d) {
+	a = _mm_add_epi32(a, b);
+	d = Rotate<16>(_mm_xor_si128(d, a));
+	c = _mm_add_epi32(c, d);
+	b = Rotate<12>(_mm_xor_si128(b, c));
+	a = _mm_add_epi32(a, b);
+	d = Rotate<8>(_mm_xor_si128(d, a));
+	c = _mm_add_epi32(c, d);
+	b = Rotate<7>(_mm_xor_si128(b, c));
+}
+
+// XORs the keystream blocks counter to counter + 3 into 256 bytes of data. Lane j of x[i] is word i of block counter + j, the
+// whole state stays in registers and is transposed back to four blocks on the way out.
+void XorBlocks(const std::array<unsigned int, 16>& input, const unsigned int counter, unsigned char* const data) {
+	__m128i x[16], start[16];
+	for(unsigned int i{0}; i < 16U; ++i) {
+		start[i] = _mm_set1_epi32(static_cast<int>(input[i]));
+	}
+	start[12] = _mm_add_epi32(_mm_set1_epi32(static_cast<int>(counter)), _mm_setr_epi32(0, 1, 2, 3));
+	std::copy(std::begin(start), std::end(start), std::begin(x));
+	for(unsigned int round{0}; round < 10U; ++round) {
+		QuarterRound(x[0], x[4], x[8], x[12]);
+		QuarterRound(x[1], x[5], x[9], x[13]);
+		QuarterRound(x[2], x[6], x[10], x[14]);
+		QuarterRound(x[3], x[7], x[11], x[15]);
+		QuarterRound(x[0], x[5], x[10], x[15]);
+		QuarterRound(x[1], x[6], x[11], x[12]);
+		QuarterRound(x[2], x[7], x[8], x[13]);
+		QuarterRound(x[3], x[4], x[9], x[14]);
+	}
+	for(unsigned int i{0}; i < 16U; i += 4U) {
+		const __m128i a{_mm_add_epi32(x[i], start[i])}, b{_mm_add_epi32(x[i + 1U], start[i + 1U])};
+		const __m128i c{_mm_add_epi32(x[i + 2U], start[i + 2U])}, d{_mm_add_epi32(x[i + 3U], start[i + 3U])};
+		const __m128i ab0{_mm_unpacklo_epi32(a, b)}, cd0{_mm_unpacklo_epi32(c, d)};
+		const __m128i ab2{_mm_unpackhi_epi32(a, b)}, cd2{_mm_unpackhi_epi32(c, d)};
+		const __m128i words[4]{_mm_unpacklo_epi64(ab0, cd0), _mm_unpackhi_epi64(ab0, cd0), _mm_unpacklo_epi64(ab2, cd2),
+							   _mm_unpackhi_epi64(ab2, cd2)};
+		for(unsigned int block{0}; block < 4U; ++block) {
+			__m128i* const out{reinterpret_cast<__m128i*>(data + block * BlockBytes + i * 4U)};
+			_mm_storeu_si128(out, _mm_xor_si128(_mm_loadu_si128(out), words[block]));
+		}
+	}
+}
+#endif
+
+int HexDigit(const char c) {
+	if(c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if(c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if(c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+// 32 raw bytes, or 64 hex digits surrounded by white space
+bool ParseCipherKey(const std::string& text, std::array<unsigned char, 32>& CipherKey) {
+	if(text.size() == CipherKey.size()) {
+		std::copy(text.begin(), text.end(), CipherKey.begin());
+		return true;
+	}
+	const auto first{std::find_if(text.begin(), text.end(), [](const char c) { return !std::isspace(static_cast<unsigned char>(c)); })};
+	const auto last{std::find_if(text.rbegin(), text.rend(), [](const char c) { return !std::isspace(static_cast<unsigned char>(c)); })};
+	const std::string digits{first, last.base() > first ? last.base() : first};
+	if(digits.size() != CipherKey.size() * 2U) {
+		return false;
+	}
+	for(std::size_t b{0}; b < CipherKey.size(); ++b) {
+		const int high{HexDigit(digits[b * 2U])}, low{HexDigit(digits[b * 2U + 1U])};
+		if(high < 0 || low < 0) {
+			return false;
+		}
+		CipherKey[b] = static_cast<unsigned char>(high * 16 + low);
+	}
+	return true;
+}
+}
+
+StreamCipher::StreamCipher(const std::array<unsigned char, 32>& CipherKey, const unsigned char* const nonce) : enabled{true} {
+	const auto word = [](const unsigned char* bytes) {
+		return static_cast<unsigned int>(bytes[0]) | static_cast<unsigned int>(bytes[1]) << 8U | static_cast<unsigned int>(bytes[2]) << 16U
+			   | static_cast<unsigned int>(bytes[3]) << 24U;
+	};
+	// "expand 32-byte k"
+	state[0] = 0x61707865U;
+	state[1] = 0x3320646EU;
+	state[2] = 0x79622D32U;
+	state[3] = 0x6B206574U;
+	for(unsigned int i{0}; i < 8U; ++i) {
+		state[4U + i] = word(CipherKey.data() + i * 4U);
+	}
+	for(unsigned int i{0}; i < 3U; ++i) {
+		state[13U + i] = word(nonce + i * 4U);
+	}
+}
+
+void StreamCipher::Apply(unsigned char* const data, const unsigned int size, const unsigned long long position) const {
+	if(!enabled) {
+		return;
+	}
+	// The nonce is not encrypted, the keystream starts right after it
+	unsigned int i{position < NonceBytes ? static_cast<unsigned int>(std::min<unsigned long long>(size, NonceBytes - position)) : 0U};
+	while(i < size) {
+		const unsigned long long offset{position + i - NonceBytes};
+		const unsigned int counter{static_cast<unsigned int>(offset / BlockBytes)}, skip{static_cast<unsigned int>(offset % BlockBytes)};
+#if STEGANO_CHACHA_SSE2
+		if(!skip && size - i >= 4U * BlockBytes) {
+			XorBlocks(state, counter, data + i);
+			i += 4U * BlockBytes;
+			continue;
+		}
+#endif
+		std::array<unsigned char, BlockBytes> keystream;
+		Block(state, counter, keystream.data());
+		const unsigned int count{std::min(BlockBytes - skip, size - i)};
+		for(unsigned int b{0}; b < count; ++b) {
+			data[i + b] ^= keystream[skip + b];
+		}
+		i += count;
+	}
+}
+
+StreamCipher PayloadCipher(const unsigned char* const nonce) {
+	return encrypt ? StreamCipher(cipherkey, nonce) : StreamCipher();
+}
+
+std::array<unsigned char, NonceBytes> MakeNonce() {
+	std::random_device device;
+	std::array<unsigned char, NonceBytes> nonce;
+	for(std::size_t b{0}; b < nonce.size(); b += 4U) {
+		const unsigned int bits{device()};
+		for(std::size_t k{0}; k < 4U; ++k) {
+			nonce[b + k] = static_cast<unsigned char>(bits >> (8U * k));
+		}
+	}
+	return nonce;
+}
+
+bool LoadCipherKey(const std::string& path, std::array<unsigned char, 32>& CipherKey, bool& given) {
+	if(path.empty()) {
+		const std::string text{EnvironmentVariable("STEGANO_CIPHER_KEY")};
+		given = !text.empty();
+		return !given || ParseCipherKey(text, CipherKey);
+	}
+	given = true;
+	std::ifstream file(path, std::ios::binary);
+	if(!file) {
+		return false;
+	}
+	const std::string text{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+	return ParseCipherKey(text, CipherKey);
+}
+
+}
@@ -0,0 +1,413 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include "SteganoKernels.h"
+#include "SteganoPayload.h"
+#include <opencv2/quality.hpp>
+#include <algorithm>
+#include <filesystem>
+#include <map>
+
+namespace Stegano {
+
+namespace {
+/**
+ * @brief Reads the trailer of an image encoded with an extended stream, logs why it cannot be read
+ * @param image -> Encoded image
+ * @param marker -> Layout of the stream, see ReadMarker()
+ * @param length -> Number of embedded bytes
+ * @return true => Extended stream found, with the key and cipher key needed to read it
+ */
+bool ReadStreamTrailer(const cv::Mat& image, PayloadMarker& marker, unsigned int& length) {
+	const unsigned int PixelChannels{static_cast<unsigned int>(image.channels())};
+	const unsigned int TotalChannels{static_cast<unsigned int>(image.rows * image.cols) * PixelChannels};
+	const std::array<unsigned char, 5> trailer{
+		VisitChannels(image, [&](const auto* const ImageData) { return ReadTrailer(ImageData, TotalChannels); })};
+	const unsigned int checksum{VisitChannels(
+		image, [&](const auto* const ImageData) { return TrailerChecksum(trailer, ImageData, TotalChannels, PixelChannels); })};
+	marker = ReadMarker(checksum, trailer[4]);
+	if(!marker.valid) {
+		Stegano::Logger::Error("Error!", " The given image does not have any data embedded using this application", '\n');
+		return false;
+	}
+	if(!marker.extended) {
+		Stegano::Logger::Error("Error!", " The given image holds a single image payload, not a container", '\n');
+		return false;
+	}
+	if(marker.keyed && key.empty()) {
+		Stegano::Logger::Error("Error!", " The payload is scattered with a key, pass it with \"key\" to decode it", '\n');
+		return false;
+	}
+	if(marker.encrypted && !encrypt) {
+		Stegano::Logger::Error("Error!", " The payload is encrypted, pass its key with \"cipher\" or STEGANO_CIPHER_KEY to decode it",
+							   '\n');
+		return false;
+	}
+	length = 0U;
+	for(unsigned int i{0}; i < 4U; ++i) {
+		length = length * PowersOfTwo[8] + trailer[i];
+	}
+	if(!LengthFits(length, static_cast<unsigned int>(image.rows * image.cols - 7), BpchRows(image.elemSize1(), PixelChannels))) {
+		Stegano::Logger::Error("Error!", " The trailer of the given image is damaged, it records more data than the image can hold", '\n');
+		return false;
+	}
+	return true;
+}
+
+// Extracts a whole extended stream, decrypted and without its nonce if encrypted
+bool ExtractWhole(const cv::Mat& image, const PayloadMarker& marker, const unsigned int length, std::vector<unsigned char>& stream) {
+	if(marker.tiled) {
+		if(!ExtractTiles(image, length, marker, stream)) {
+			Stegano::Logger::Error("Error!", " The tile map of the adaptive layout is damaged", '\n');
+			return false;
+		}
+		return true;
+	}
+	const unsigned int PixelChannels{static_cast<unsigned int>(image.channels())};
+	const std::shared_ptr<const LayoutPlan> layout{PlanLayout(image, length * 8ULL, length, true)};
+	const TileWalk walk(marker.tileorder, static_cast<unsigned int>(image.rows), static_cast<unsigned int>(image.cols));
+	stream.reserve(length);
+	return VisitChannels(image, [&](const auto* const ImageData) {
+		return ExtractStream(ImageData, layout->UsableChannels, PixelChannels, layout->stride, layout->BitsPerPixel, walk, length, marker,
+							 [&stream](const unsigned char* data, std::size_t size) {
+								 stream.insert(stream.end(), data, data + size);
+								 return true;
+							 });
+	});
+}
+
+// Builds the stream of an entry: a source image, packed and compressed with "compress", or any other file as it is
+bool BuildEntry(const std::string& source, std::vector<unsigned char>& stream) {
+	if(!filemode) {
+		PrepackedSource prepacked;
+		if(source != "-" && ReadSource(source, prepacked) && prepacked.image.data) {
+			const cv::Mat& SourceImage{prepacked.image};
+			if(SourceImage.rows > 65535 || SourceImage.cols > 65535) {
+				Stegano::Logger::Error("Error!", " Source image ", source, " too large.",
+									   " Cannot operate on images with dimensions greater than [65536 x 65536].", '\n');
+				return false;
+			}
+			Stegano::Logger::Verbose("Source image ", source, " size = [", SourceImage.rows, " x ", SourceImage.cols, " x ",
+									 SourceImage.channels(), ']', '\n');
+			stream = SourceStream(prepacked);
+			return true;
+		}
+		Stegano::Logger::Verbose(source, " is not an image, embedding it as a file", '\n');
+	}
+	return BuildFileStream(source, stream);
+}
+
+// Entries of the stream held by a carrier, a stream which is not a container is kept as a single entry
+bool SplitEntries(const std::vector<unsigned char>& stream, std::vector<std::vector<unsigned char>>& entries) {
+	PayloadHeader header;
+	if(!ReadPayloadHeader(stream.data(), stream.size(), header)) {
+		Stegano::Logger::Error("Error!", " The header of the embedded payload is damaged", '\n');
+		return false;
+	}
+	if(header.type == PAYLOAD_SHARD) {
+		Stegano::Logger::Error("Error!", " The base holds a shard of a payload, payloads cannot be appended to it", '\n');
+		return false;
+	}
+	if(header.type != PAYLOAD_CONTAINER) {
+		entries.push_back(stream);
+		return true;
+	}
+	std::vector<ContainerEntry> directory;
+	if(!ReadDirectory(stream.data(), stream.size(), directory)) {
+		Stegano::Logger::Error("Error!", " The directory of the embedded container is damaged", '\n');
+		return false;
+	}
+	for(const ContainerEntry& found : directory) {
+		entries.emplace_back(stream.begin() + found.offset, stream.begin() + found.offset + found.length);
+	}
+	return true;
+}
+
+// Files of a container are decoded under the names stored in their headers, two files sharing a name would overwrite each other
+bool UniqueFileNames(const std::vector<std::vector<unsigned char>>& entries) {
+	std::map<std::string, std::size_t> names;
+	for(std::size_t k{0}; k < entries.size(); ++k) {
+		PayloadHeader header;
+		if(!ReadPayloadHeader(entries[k].data(), entries[k].size(), header) || header.type != PAYLOAD_FILE) {
+			continue;
+		}
+		const std::string name{header.name.empty() ? std::string("Decoded.bin") : std::filesystem::path(header.name).filename().string()};
+		const auto [found, inserted]{names.emplace(name, k)};
+		if(!inserted) {
+			Stegano::Logger::Error("Error!", " Payloads ", found->second + 1U, " and ", k + 1U, " are both files named ", name,
+								   ", they would overwrite each other when decoded", '\n');
+			return false;
+		}
+	}
+	return true;
+}
+}
+
+bool SaveContainer(const unsigned char* const stream, const std::size_t length, const std::string& output) {
+	std::vector<ContainerEntry> directory;
+	if(!ReadDirectory(stream, length, directory)) {
+		Stegano::Logger::Error("Error!", " The directory of the embedded container is damaged", '\n');
+		return false;
+	}
+	const unsigned int count{static_cast<unsigned int>(directory.size())};
+	Stegano::Logger::Verbose("Container of ", count, " payloads", '\n');
+	for(unsigned int k{0}; k < count; ++k) {
+		Stegano::Logger::Verbose("Entry ", k + 1U, " - ", directory[k].type == PAYLOAD_FILE ? "file" : "image", ", ", directory[k].length,
+								 " bytes at ", directory[k].offset, '\n');
+	}
+	if(entry > count) {
+		Stegano::Logger::Error("Error!", " The container holds ", count, " payloads, there is no entry ", entry, '\n');
+		return false;
+	}
+	if(entry) {
+		const ContainerEntry& found{directory[entry - 1U]};
+		return SaveStream(stream + found.offset, found.length, output, fileoutput);
+	}
+	// Several files cannot share the output path, they keep the names stored in their headers
+	bool saved{true};
+	for(unsigned int k{0}; k < count; ++k) {
+		saved = SaveStream(stream + directory[k].offset, directory[k].length, NumberedPath(output, k), std::string()) && saved;
+	}
+	return saved;
+}
+
+bool DecodeEntry(const cv::Mat& SourceImage, const std::string& output) {
+	PayloadMarker marker{};
+	unsigned int length{0};
+	if(!ReadStreamTrailer(SourceImage, marker, length)) {
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	const auto finished = [&start](const bool decoded) {
+		if(decoded && !showimages) {
+			auto end = std::chrono::steady_clock::now();
+			const double timetaken =
+				static_cast<double>(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) / 1000.0;
+			Stegano::Logger::Verbose('\n', "Decoding took: ", timetaken, " seconds");
+		}
+		return decoded;
+	};
+
+	if(marker.tiled || marker.fec) {
+		// Tiles and interleaved codewords do not map stream bytes to channels on their own
+		Stegano::Logger::Verbose(marker.fec ? "Error corrected" : "Adaptive", " payload, extracting it in full", '\n');
+		std::vector<unsigned char> stream;
+		if(!ExtractWhole(SourceImage, marker, length, stream)) {
+			return false;
+		}
+		if(!DirectoryLength(stream.data(), stream.size())) {
+			Stegano::Logger::Error("Error!", " The embedded payload is not a container, decode it without \"entry\"", '\n');
+			return false;
+		}
+		return finished(SaveContainer(stream.data(), stream.size(), output));
+	}
+
+	const unsigned int PixelChannels{static_cast<unsigned int>(SourceImage.channels())};
+	const std::shared_ptr<const LayoutPlan> layout{PlanLayout(SourceImage, length * 8ULL, length, true)};
+	const unsigned int BitsPerPixel{layout->BitsPerPixel}, stride{layout->stride}, UsableChannels{layout->UsableChannels};
+	const ChunkOrder order{marker.keyed ? ChunkOrder(key, (length + ChunkBytes(BitsPerPixel) - 1U) / ChunkBytes(BitsPerPixel))
+										: ChunkOrder()};
+	const TileWalk walk(marker.tileorder, static_cast<unsigned int>(SourceImage.rows), static_cast<unsigned int>(SourceImage.cols));
+	// Encrypted streams start with their nonce, positions below are in the container stream which follows it
+	const unsigned int skip{marker.encrypted ? NonceBytes : 0U};
+	if(length <= skip) {
+		Stegano::Logger::Error("Error!", " The embedded payload is empty", '\n');
+		return false;
+	}
+	StreamCipher cipher;
+	if(marker.encrypted) {
+		std::array<unsigned char, NonceBytes> nonce{};
+		VisitChannels(SourceImage, [&](const auto* const SourceImageData) {
+			ExtractBytes(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, 0U, NonceBytes, nonce.data(), order,
+						 walk);
+		});
+		cipher = StreamCipher(cipherkey, nonce.data());
+	}
+	// Only the channels carrying bytes [position, position + size) of the container are read
+	const auto read = [&](const unsigned int position, const unsigned int size) {
+		std::vector<unsigned char> bytes(std::min(size, length - skip - std::min(position, length - skip)));
+		VisitChannels(SourceImage, [&](const auto* const SourceImageData) {
+			ExtractBytes(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, position + skip,
+						 static_cast<unsigned int>(bytes.size()), bytes.data(), order, walk);
+		});
+		cipher.Apply(bytes.data(), static_cast<unsigned int>(bytes.size()), position + skip);
+		return bytes;
+	};
+
+	std::vector<unsigned char> head{read(0U, HeaderProbe)};
+	const unsigned int DirectoryEnd{DirectoryLength(head.data(), head.size())};
+	if(!DirectoryEnd) {
+		Stegano::Logger::Error("Error!", " The embedded payload is not a container or its header is damaged, decode it without \"entry\"",
+							   '\n');
+		return false;
+	}
+	if(DirectoryEnd > head.size()) {
+		head = read(0U, DirectoryEnd);
+	}
+	std::vector<ContainerEntry> directory;
+	if(!ReadDirectory(head.data(), head.size(), directory)) {
+		Stegano::Logger::Error("Error!", " The directory of the embedded container is damaged", '\n');
+		return false;
+	}
+	if(entry > directory.size()) {
+		Stegano::Logger::Error("Error!", " The container holds ", directory.size(), " payloads, there is no entry ", entry, '\n');
+		return false;
+	}
+	const ContainerEntry& found{directory[entry - 1U]};
+	Stegano::Logger::Verbose("Entry ", entry, " of ", directory.size(), " - ", found.type == PAYLOAD_FILE ? "file" : "image", ", ",
+							 found.length, " bytes at ", found.offset, ", reading only the channels which carry it", '\n');
+	const std::vector<unsigned char> stream{read(found.offset, found.length)};
+	if(stream.size() != found.length) {
+		Stegano::Logger::Error("Error!", " The entry lies beyond the embedded payload, the directory is damaged", '\n');
+		return false;
+	}
+	return finished(SaveStream(stream.data(), stream.size(), output, fileoutput));
+}
+
+bool EncodeContainer(const std::string& base, const std::vector<std::string>& sources, const std::string& output) {
+	Stegano::Logger::Verbose("Payloads = ", sources.size(), append ? ", appended to the payloads of the base" : "", '\n');
+	Stegano::Logger::Verbose("Compress payload = ", compress ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Payload encryption = ", encrypt ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Error correction parity = ", fecparity, '\n');
+
+	cv::Mat BaseImage;
+	std::thread loadbase([&base, &BaseImage] {
+		Stegano::Logger::Verbose("Reading base image", '\n');
+		BaseImage = ReadCarrier(base);
+	});
+	std::vector<std::vector<unsigned char>> entries(sources.size());
+	bool built{true};
+	for(std::size_t k{0}; k < sources.size() && built; ++k) {
+		built = BuildEntry(sources[k], entries[k]);
+	}
+	loadbase.join();
+	if(!built) {
+		return false;
+	}
+	if(!BaseImage.data) {
+		Stegano::Logger::Error("Error!", " Cannot open base image.", " Please check if the path is correct and if the file is an 8 bit,",
+							   " 16 bit or floating point color image.", '\n');
+		return false;
+	}
+	if(BaseImage.rows > 65535 || BaseImage.cols > 65535) {
+		Stegano::Logger::Error("Error!", " Base image too large.",
+							   " Cannot operate on images with dimensions greater than [65536 x 65536].", '\n');
+		return false;
+	}
+	if(!CheckCarrierDepth(BaseImage, output)) {
+		return false;
+	}
+
+	if(append) {
+		// The payloads already in the base come first, the base is then encoded again over them
+		PayloadMarker marker{};
+		unsigned int length{0};
+		std::vector<unsigned char> stream;
+		if(!ReadStreamTrailer(BaseImage, marker, length) || !ExtractWhole(BaseImage, marker, length, stream)) {
+			Stegano::Logger::Error("Error!", " Cannot read the payloads of the base, pass the \"key\" and \"cipher\" it was encoded with",
+								   '\n');
+			return false;
+		}
+		std::vector<std::vector<unsigned char>> kept;
+		if(!SplitEntries(stream, kept)) {
+			return false;
+		}
+		Stegano::Logger::Verbose("Base holds ", kept.size(), " payloads", '\n');
+		entries.insert(entries.begin(), std::make_move_iterator(kept.begin()), std::make_move_iterator(kept.end()));
+	}
+	if(entries.size() > 65535U) {
+		Stegano::Logger::Error("Error!", " A container cannot hold more than 65535 payloads.", '\n');
+		return false;
+	}
+	if(!UniqueFileNames(entries)) {
+		return false;
+	}
+	unsigned long long total{0};
+	for(const auto& stream : entries) {
+		total += stream.size();
+	}
+	if(total > 0xFFFFFF00ULL - entries.size() * ContainerEntryBytes) {
+		Stegano::Logger::Error("Error!", " Payloads too large.", " Cannot embed more than 4 GiB.", '\n');
+		return false;
+	}
+
+	std::vector<unsigned char> container{PackContainer(entries)};
+	entries.clear();
+	if(encrypt) {
+		// Encrypted streams start with their nonce in clear, EmbedStream() encrypts the rest
+		const std::array<unsigned char, NonceBytes> nonce{MakeNonce()};
+		container.insert(container.begin(), nonce.begin(), nonce.end());
+	}
+	if(FecLength(container.size(), fecparity) > 0xFFFFFFFFULL) {
+		Stegano::Logger::Error("Error!", " Payloads too large.", " Cannot embed more than 4 GiB.", '\n');
+		return false;
+	}
+	const unsigned int StreamLength{static_cast<unsigned int>(container.size())};
+
+	const cv::Mat BaseImageCopy{BaseImage.clone()};
+	const unsigned int PixelChannels{static_cast<unsigned int>(BaseImage.channels())};
+	const unsigned int UsableRows{BpchRows(BaseImage.elemSize1(), PixelChannels)};
+	// Using 7 pixels for the trailer
+	const unsigned int AvailableBasePixels{static_cast<unsigned int>(BaseImage.rows * BaseImage.cols - 7)};
+	const unsigned int TotalBaseChannels{(AvailableBasePixels + 7U) * PixelChannels};
+	const unsigned long long BitsToEncode{EmbeddedLength(FecLength(StreamLength, fecparity), AvailableBasePixels, UsableRows) * 8U};
+
+	Stegano::Logger::Verbose("Base image size = [", BaseImage.rows, " x ", BaseImage.cols, " x ", BaseImage.channels(), ']', '\n',
+							 "Container stream = ", StreamLength, " bytes", "\n\n");
+
+	// Entries are never reduced, a container either fits or is rejected
+	if(BitsToEncode / AvailableBasePixels >= UsableRows) {
+		Stegano::Logger::Error("Error!", " Base image is not large enough to store the payloads", '\n');
+		Stegano::Logger::Log("Choose a larger base image or fewer payloads", '\n');
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	const std::shared_ptr<const LayoutPlan> layout{PlanLayout(BaseImage, BitsToEncode, StreamLength, false)};
+	const unsigned int BitsPerPixel{layout->BitsPerPixel}, stride{layout->stride};
+
+	Stegano::Logger::Verbose("Encoding now...", '\n');
+	const TileWalk walk(tileorder, static_cast<unsigned int>(BaseImage.rows), static_cast<unsigned int>(BaseImage.cols));
+	VisitChannels(BaseImage, [&](auto* const BaseImageData) {
+		EmbedStream(BaseImageData, AvailableBasePixels * PixelChannels, PixelChannels, stride, BitsPerPixel, walk, container.data(),
+					StreamLength);
+		WriteExtendedTrailer(BaseImageData, TotalBaseChannels, PixelChannels, static_cast<unsigned int>(BitsToEncode / 8U));
+	});
+
+	std::thread saveimage([&output, &BaseImage] {
+		Stegano::Logger::Verbose("Finished encoding", '\n', "Saving encoded image", '\n');
+
+		SaveImage(output, BaseImage, "Encoded", tileorder);
+	});
+
+	if(showimages) {
+		cv::Mat EncodedCopy{BaseImage};
+#if _WIN32
+		ResizeToSmall(BaseImage, EncodedCopy, "Encoded Image");
+#endif
+		cv::namedWindow("Encoded Base", cv::WINDOW_AUTOSIZE);
+		cv::imshow("Encoded Base", EncodedCopy);
+		cv::waitKey(0);
+	}
+
+	saveimage.join();
+
+	if(!showimages) {
+		auto end = std::chrono::steady_clock::now();
+		const double timetaken = static_cast<double>(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) / 1000.0;
+		Stegano::Logger::Verbose('\n', "Encoding took: ", timetaken, " seconds");
+	}
+
+	auto PSNR = cv::quality::QualityPSNR::compute(BaseImage, BaseImageCopy, cv::noArray(), PeakValue(BaseImage));
+	Stegano::Logger::Verbose("\n\n", "Per channel PSNR = ", PSNR, '\n');
+
+	if(analyse) {
+		ReportDetectability(AnalyseLsb(BaseImageCopy), AnalyseLsb(BaseImage), "encoded image");
+	}
+
+	return true;
+}
+
+}
@@ -1,20 +1,25 @@
 /* Copyright 2020 Prakhar Agarwal*/
 
-#include "SteganoCommon.h"
+#include "SteganoPayload.h"
 
 namespace Stegano {
 
 bool Decode(const std::string& source, const std::string& output) {
 	Stegano::Logger::Verbose("Reading source image", '\n');
 
-	cv::Mat SourceImage{cv::imread(source, cv::IMREAD_COLOR)};
+	const cv::Mat SourceImage{ReadCarrier(source)};
 	if(!SourceImage.data) {
-		Stegano::Logger::Error("Error!", " Cannot open base image.",
-							   " Please check if the path is correct and if the file is an 8 bit color image.", '\n');
+		Stegano::Logger::Error("Error!", " Cannot open base image.", " Please check if the path is correct and if the file is an 8 bit,",
+							   " 16 bit or floating point color image.", '\n');
 		return false;
 	}
 	Stegano::Logger::Verbose("Source image size = [", SourceImage.rows, " x ", SourceImage.cols, " x ", SourceImage.channels(), ']',
 							 "\n\n");
+	if(roidecode || entry || SourceImage.depth() != CV_8U || SourceImage.channels() != 3) {
+		// Region and entry decodes seek to the bytes they need, wide and BGRA carriers need the kernels of their channel type, all
+		// are done by the pool (inline with a single thread)
+		return ParallelDecode(SourceImage, output);
+	}
 
 	const unsigned int AvailableBasePixels{static_cast<unsigned int>(SourceImage.rows * SourceImage.cols - 7)};
 	const unsigned int TotalSourceChannels{AvailableBasePixels * 3U + 21U};
@@ -31,7 +36,13 @@ bool Decode(const std::string& source, const std::string& output) {
 	}
 
 	// Checking validity of the trailer
-	if((trailer[0] ^ trailer[1] ^ trailer[2] ^ trailer[3] ^ SourceImage.data[TotalSourceChannels - 1]) != trailer[4]) {
+	const unsigned int checksum{
+		static_cast<unsigned int>(trailer[0] ^ trailer[1] ^ trailer[2] ^ trailer[3] ^ SourceImage.data[TotalSourceChannels - 1])};
+	if(ReadMarker(checksum, trailer[4]).extended) {
+		// Extended stream, decoded by the pool (inline with a single thread)
+		return ParallelDecode(SourceImage, output);
+	}
+	if(checksum != trailer[4]) {
 		Stegano::Logger::Error("Error!", " The given image does not have any data embedded using this application", '\n');
 		return false;
 	}
@@ -107,27 +118,7 @@ bool Decode(const std::string& source, const std::string& output) {
 
 	Stegano::Logger::Verbose("Finished decoding", '\n', "Saving decoded image", '\n');
 
-	try {
-		cv::imwrite(output, DecodedImage,
-					std::vector<int>{cv::IMWRITE_PNG_COMPRESSION, 4, cv::IMWRITE_PNG_STRATEGY, cv::IMWRITE_PNG_STRATEGY_FILTERED});
-		Stegano::Logger::Log("Image saved at - ", output, '\n');
-	}
-	catch(cv::Exception& e) {
-		if(e.code == -2) {
-			Stegano::Logger::Error("Error!", " Cannot save the output file with the given name!", '\n');
-			Stegano::Logger::Log("If this is a privileged directory, please run this application in elevated mode.", '\n',
-								 "Saving as Decoded.png in the working directory");
-			try {
-				cv::imwrite("Decoded.png", DecodedImage);
-				Stegano::Logger::Log("Image saved at - .\\Decoded.png", '\n');
-			}
-			catch(cv::Exception& E) {
-				if(E.code == -2) {
-					Stegano::Logger::Error("Error!", " Cannot save as Decoded.png as well, skipping save step.", '\n');
-				}
-			}
-		}
-	}
+	SaveImage(output, DecodedImage, "Decoded");
 
 	if(showimages) {
 #if _WIN32
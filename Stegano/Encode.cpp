@@ -1,17 +1,16 @@
 /* Copyright 2020 Prakhar Agarwal*/
 
 #include "SteganoCommon.h"
+#include "SteganoPayload.h"
 #include <opencv2/quality.hpp>
 #include <cmath>
 
-/* TODO
-** Add functionality to support images with FP16/32 channel types
-*/
-
 namespace Stegano {
 
 extern bool expandbase, force, noreduc, nograyscale;
 
+bool ParallelEncode(const std::string& base, const std::string& source, const std::string& output);
+
 #if _WIN32
 extern long DesktopWidth, DesktopHeight;
 /**
@@ -24,8 +23,7 @@ extern long DesktopWidth, DesktopHeight;
 void ResizeToSmall(const cv::Mat& input, cv::Mat& output, const std::string& name, double extrashrinkfactor) {
 	const double hRatio{extrashrinkfactor * static_cast<double>(DesktopWidth) / static_cast<double>(input.cols)};
 	const double vRatio{extrashrinkfactor * static_cast<double>(DesktopHeight) / static_cast<double>(input.rows)};
-	auto defaultprecision{std::cout.precision()};
-	std::cout.precision(3);
+	const auto defaultprecision{Stegano::Logger::Precision(3)};
 	if(hRatio < 1.0) {
 		Stegano::Logger::Verbose(name, " too large to display, constrained ");
 		if(hRatio < vRatio) {
@@ -41,19 +39,25 @@ void ResizeToSmall(const cv::Mat& input, cv::Mat& output, const std::string& nam
 		Stegano::Logger::Verbose(name, " too large to display, constrained ", "vertically. Shrinking by a factor of ", vRatio, '\n');
 		cv::resize(input, output, cv::Size(), vRatio, vRatio, cv::INTER_AREA);
 	}
-	std::cout.precision(defaultprecision);
+	Stegano::Logger::Precision(defaultprecision);
 }
 #endif
 
 bool Encode(const std::string& base, const std::string& source, const std::string& output) {
-	Stegano::Logger::Verbose("Exapnd base = ", expandbase ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Expand base = ", expandbase ? "true" : "false", '\n');
 	Stegano::Logger::Verbose("No reduction = ", noreduc ? "true" : "false", '\n');
 	Stegano::Logger::Verbose("No grayscale = ", nograyscale ? "true" : "false", '\n');
 	Stegano::Logger::Verbose("Forced encode = ", force ? "true" : "false", '\n');
 	Stegano::Logger::Verbose("Reading base image", '\n');
-	cv::Mat BaseImage{cv::imread(base, cv::IMREAD_COLOR)};
+	cv::Mat BaseImage{ReadCarrier(base)};
+	if(BaseImage.data && (BaseImage.depth() != CV_8U || BaseImage.channels() != 3)) {
+		// Wide or BGRA base channels need the kernels of their channel type, run by the pool (inline with a single thread)
+		return ParallelEncode(base, source, output);
+	}
 	Stegano::Logger::Verbose("Reading source image", '\n');
-	cv::Mat SourceImage{cv::imread(source, cv::IMREAD_COLOR)};
+	PrepackedSource prepacked;
+	ReadSource(source, prepacked);
+	cv::Mat SourceImage{prepacked.image};
 	if(!BaseImage.data) {
 		Stegano::Logger::Error("Error!", " Cannot open base image.",
 							   " Please check if the path is correct and if the file is an 8 bit color image.", '\n');
@@ -207,6 +211,9 @@ bool Encode(const std::string& base, const std::string& source, const std::strin
 		}
 		BitsPerPixel = overflow ? 11U : BitsToEncode / AvailableBasePixels;
 	}
+	if(!prepackfile.empty()) {
+		WritePrepacked(prepackfile, PackImage(SourceImage), BaseImageCopy);
+	}
 
 	if(showimages) {
 		cv::Mat BaseCopy{BaseImage}, SourceCopy{SourceImage};
@@ -290,27 +297,7 @@ bool Encode(const std::string& base, const std::string& source, const std::strin
 
 	Stegano::Logger::Verbose("Finished encoding", '\n', "Saving encoded image", '\n');
 
-	try {
-		cv::imwrite(output, BaseImage,
-					std::vector<int>{cv::IMWRITE_PNG_COMPRESSION, 4, cv::IMWRITE_PNG_STRATEGY, cv::IMWRITE_PNG_STRATEGY_FILTERED});
-		Stegano::Logger::Log("Image saved at - ", output, '\n');
-	}
-	catch(cv::Exception& e) {
-		if(e.code == -2) {
-			Stegano::Logger::Error("Error!", " Cannot save the output file with the given name!", '\n');
-			Stegano::Logger::Log("If this is a privileged directory, please run this application in elevated mode.", '\n',
-								 "Saving as Encoded.png in the working directory");
-			try {
-				cv::imwrite("Encoded.png", BaseImage);
-				Stegano::Logger::Log("Image saved at - .\\Encoded.png", '\n');
-			}
-			catch(cv::Exception& E) {
-				if(E.code == -2) {
-					Stegano::Logger::Error("Error!", " Cannot save as Encoded.png as well, skipping save step.", '\n');
-				}
-			}
-		}
-	}
+	SaveImage(output, BaseImage, "Encoded");
 
 	if(!showimages) {
 		auto end = std::chrono::high_resolution_clock::now();
@@ -318,15 +305,21 @@ bool Encode(const std::string& base, const std::string& source, const std::strin
 		Stegano::Logger::Verbose('\n', "Encoding took: ", timetaken, " seconds");
 	}
 
+	const int channels{BaseImage.channels()};
 	auto MSE = cv::quality::QualityMSE::compute(BaseImage, BaseImageCopy, cv::noArray());
-	Stegano::Logger::Verbose("\n\n", "Per channel MSE = ", MSE, '\n', "Total MSE = ", (MSE[0] + MSE[1] + MSE[2]) / 3);
+	Stegano::Logger::Verbose("\n\n", "Per channel MSE = ", MSE, '\n', "Total MSE = ", ChannelMean(MSE, channels));
 
-	auto PSNR = cv::quality::QualityPSNR::compute(BaseImage, BaseImageCopy, cv::noArray());
-	uint32_t temp{255 * 255 * 4};
-	Stegano::Logger::Verbose("\n\n", "Per channel PSNR = ", PSNR, '\n', "Total PSNR = ", 10.0 * log10(temp / (MSE[0] + MSE[1] + MSE[2])));
+	// 16 bit and floating point bases peak at 65535 and 1.0
+	const double peak{PeakValue(BaseImage)};
+	auto PSNR = cv::quality::QualityPSNR::compute(BaseImage, BaseImageCopy, cv::noArray(), peak);
+	Stegano::Logger::Verbose("\n\n", "Per channel PSNR = ", PSNR, '\n', "Total PSNR = ", TotalPsnr(MSE, BaseImage));
 
 	auto SSIM = cv::quality::QualitySSIM::compute(BaseImage, BaseImageCopy, cv::noArray());
-	Stegano::Logger::Verbose("\n\n", "Per channel SSIM = ", SSIM, '\n', "Total SSIM = ", (SSIM[0] + SSIM[1] + SSIM[2]) / 3, '\n');
+	Stegano::Logger::Verbose("\n\n", "Per channel SSIM = ", SSIM, '\n', "Total SSIM = ", ChannelMean(SSIM, channels), '\n');
+
+	if(analyse) {
+		ReportDetectability(AnalyseLsb(BaseImageCopy), AnalyseLsb(BaseImage), "encoded image");
+	}
 
 	if(showimages) {
 #if _WIN32
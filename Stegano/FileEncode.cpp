@@ -0,0 +1,233 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include "SteganoKernels.h"
+#include "SteganoPayload.h"
+#include <opencv2/quality.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#if _WIN32
+	#include <fcntl.h>
+	#include <io.h>
+#endif
+
+namespace Stegano {
+
+extern bool expandbase, force;
+
+bool EncodeFile(const std::string& base, const std::string& source, const std::string& output) {
+	Stegano::Logger::Verbose("Expand base = ", expandbase ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Forced encode = ", force ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Payload encryption = ", encrypt ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Error correction parity = ", fecparity, '\n');
+
+	cv::Mat BaseImage;
+	std::thread loadbase([&base, &BaseImage] {
+		Stegano::Logger::Verbose("Reading base image", '\n');
+		BaseImage = ReadCarrier(base);
+	});
+
+	// The layout depends on the payload length, a regular file is measured and streamed, stdin ("-") and other files without a
+	// size (named pipes, devices) have to be read in full first
+	std::error_code ec;
+	const bool piped{source == "-" || !std::filesystem::is_regular_file(source, ec)};
+	std::ifstream file;
+	std::vector<unsigned char> buffered;
+	unsigned long long FileLength{0};
+	PayloadHeader header;
+	header.type = PAYLOAD_FILE;
+	if(source == "-") {
+		Stegano::Logger::Verbose("Reading source from standard input", '\n');
+#if _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		buffered.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+		FileLength = buffered.size();
+	}
+	else {
+		file.open(source, std::ios::binary);
+		if(piped && file && !std::filesystem::is_directory(source, ec)) {
+			Stegano::Logger::Verbose("Source is not a regular file, reading it in full", '\n');
+			buffered.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+			FileLength = buffered.size();
+		}
+		else if(file) {
+			FileLength = std::filesystem::file_size(source, ec);
+			if(ec) {
+				file.close();
+			}
+		}
+		header.name = std::filesystem::path(source).filename().string();
+	}
+	loadbase.join();
+
+	if(!BaseImage.data) {
+		Stegano::Logger::Error("Error!", " Cannot open base image.", " Please check if the path is correct and if the file is an 8 bit,",
+							   " 16 bit or floating point color image.", '\n');
+		return false;
+	}
+	if(source != "-" && (!file || std::filesystem::is_directory(source, ec))) {
+		Stegano::Logger::Error("Error!", " Cannot open source file. Please check if the path is correct.", '\n');
+		return false;
+	}
+	if(BaseImage.rows > 65535 || BaseImage.cols > 65535) {
+		Stegano::Logger::Error("Error!", " Base image too large.",
+							   " Cannot operate on images with dimensions greater than [65536 x 65536].", '\n');
+		return false;
+	}
+	if(!CheckCarrierDepth(BaseImage, output)) {
+		return false;
+	}
+	const unsigned int PixelChannels{static_cast<unsigned int>(BaseImage.channels())};
+	const unsigned int UsableRows{BpchRows(BaseImage.elemSize1(), PixelChannels)};
+
+	// The trailer holds the stream length in 32 bits
+	header.length = static_cast<unsigned int>(std::min(FileLength, 0xFFFFFFFFULL));
+	std::vector<unsigned char> HeaderBytes{WritePayloadHeader(header)};
+	if(encrypt) {
+		// Encrypted streams start with their nonce in clear, EmbedStream() encrypts the rest
+		const std::array<unsigned char, NonceBytes> nonce{MakeNonce()};
+		HeaderBytes.insert(HeaderBytes.begin(), nonce.begin(), nonce.end());
+	}
+	if(FecLength(FileLength + HeaderBytes.size(), fecparity) > 0xFFFFFFFFULL) {
+		Stegano::Logger::Error("Error!", " Source file too large.", " Cannot embed more than 4 GiB.", '\n');
+		return false;
+	}
+	const unsigned int StreamLength{static_cast<unsigned int>(FileLength + HeaderBytes.size())};
+
+	cv::Mat BaseImageCopy{BaseImage.clone()};
+
+	// Using 7 pixels for the trailer
+	unsigned int AvailableBasePixels{static_cast<unsigned int>(BaseImage.rows * BaseImage.cols - 7)};
+	unsigned int TotalBaseChannels{(AvailableBasePixels + 7U) * PixelChannels};
+	unsigned long long BitsToEncode{EmbeddedLength(FecLength(StreamLength, fecparity), AvailableBasePixels, UsableRows) * 8U};
+
+	Stegano::Logger::Verbose("Base image size = [", BaseImage.rows, " x ", BaseImage.cols, " x ", BaseImage.channels(), ']', '\n',
+							 "Source file size = ", FileLength, " bytes", "\n\n");
+
+	auto start = std::chrono::steady_clock::now();
+
+	// A file cannot be reduced, only the base can grow
+	if(BitsToEncode / AvailableBasePixels >= UsableRows) {
+		if(!expandbase) {
+			Stegano::Logger::Error("Error!", " Base image is not large enough to store the source file", '\n');
+			Stegano::Logger::Log("Rerun with \"base\" flag or choose a larger base image", '\n');
+			return false;
+		}
+		const unsigned long long ExpansionFactor{
+			(BitsToEncode / UsableRows + 8U) / static_cast<unsigned int>(BaseImage.rows * BaseImage.cols) + 1U};
+		if(ExpansionFactor > 8U && !force) {
+			Stegano::Logger::Error(
+				"Error!", " Cannot encode without significant loss in visual fidelity. Please choose a larger base image", '\n');
+			return false;
+		}
+		const double ScalingFactor{std::sqrt(static_cast<double>(ExpansionFactor))};
+		if(BaseImage.rows * ScalingFactor > 65535.0 || BaseImage.cols * ScalingFactor > 65535.0) {
+			Stegano::Logger::Error("Error!", " Source file too large for this base image, even once expanded.", '\n');
+			return false;
+		}
+		Stegano::Logger::Log("Expanding base image area by ", ExpansionFactor, '\n');
+		cv::resize(BaseImage, BaseImage, cv::Size(), ScalingFactor, ScalingFactor, cv::INTER_LANCZOS4);
+		cv::resize(BaseImageCopy, BaseImageCopy, cv::Size(), ScalingFactor, ScalingFactor, cv::INTER_LANCZOS4);
+		AvailableBasePixels = static_cast<unsigned int>(BaseImage.rows * BaseImage.cols - 7);
+		TotalBaseChannels = (AvailableBasePixels + 7U) * PixelChannels;
+		BitsToEncode = EmbeddedLength(FecLength(StreamLength, fecparity), AvailableBasePixels, UsableRows) * 8U;
+		Stegano::Logger::Verbose("Modified base image size = [", BaseImage.rows, " x ", BaseImage.cols, " x ", BaseImage.channels(), ']',
+								 "\n\n");
+	}
+	if(BitsToEncode / AvailableBasePixels >= UsableRows) {
+		Stegano::Logger::Error("Error!", " Base image is not large enough to store the source file", '\n');
+		return false;
+	}
+
+	const std::shared_ptr<const LayoutPlan> layout{PlanLayout(BaseImage, BitsToEncode, StreamLength, false)};
+	const unsigned int BitsPerPixel{layout->BitsPerPixel}, stride{layout->stride};
+
+	Stegano::Logger::Verbose("Encoding now...", '\n');
+
+	// Header bytes first, then the file, block by block
+	std::size_t served{0};
+	const StreamReader read{[&](unsigned char* buffer, std::size_t size) {
+		std::size_t done{0};
+		if(served < HeaderBytes.size()) {
+			done = std::min(size, HeaderBytes.size() - served);
+			std::memcpy(buffer, HeaderBytes.data() + served, done);
+		}
+		if(done < size) {
+			if(piped) {
+				const std::size_t from{served + done - HeaderBytes.size()};
+				const std::size_t count{std::min(size - done, buffered.size() - from)};
+				std::memcpy(buffer + done, buffered.data() + from, count);
+				done += count;
+			}
+			else {
+				file.read(reinterpret_cast<char*>(buffer + done), static_cast<std::streamsize>(size - done));
+				done += static_cast<std::size_t>(file.gcount());
+			}
+		}
+		served += done;
+		return done;
+	}};
+	const TileWalk walk(tileorder, static_cast<unsigned int>(BaseImage.rows), static_cast<unsigned int>(BaseImage.cols));
+	const bool embedded{VisitChannels(BaseImage, [&](auto* const BaseImageData) {
+		if(!EmbedStream(BaseImageData, AvailableBasePixels * PixelChannels, PixelChannels, stride, BitsPerPixel, walk, StreamLength,
+						read)) {
+			return false;
+		}
+		WriteExtendedTrailer(BaseImageData, TotalBaseChannels, PixelChannels, static_cast<unsigned int>(BitsToEncode / 8U));
+		return true;
+	})};
+	if(!embedded) {
+		Stegano::Logger::Error("Error!", " Cannot read the source file in full, it may have changed while encoding.", '\n');
+		return false;
+	}
+
+	std::thread saveimage([&output, &BaseImage] {
+		Stegano::Logger::Verbose("Finished encoding", '\n', "Saving encoded image", '\n');
+
+		SaveImage(output, BaseImage, "Encoded", tileorder);
+	});
+
+	if(showimages) {
+		// saveimage is still reading BaseImage, the shrunk copy is made next to it
+		cv::Mat EncodedCopy{BaseImage};
+#if _WIN32
+		ResizeToSmall(BaseImage, EncodedCopy, "Encoded Image");
+#endif
+		cv::namedWindow("Encoded Base", cv::WINDOW_AUTOSIZE);
+		cv::imshow("Encoded Base", EncodedCopy);
+		cv::waitKey(0);
+	}
+
+	saveimage.join();
+
+	if(!showimages) {
+		auto end = std::chrono::steady_clock::now();
+		const double timetaken = static_cast<double>(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) / 1000.0;
+		Stegano::Logger::Verbose('\n', "Encoding took: ", timetaken, " seconds");
+	}
+
+	const int channels{BaseImage.channels()};
+	auto MSE = cv::quality::QualityMSE::compute(BaseImage, BaseImageCopy, cv::noArray());
+	Stegano::Logger::Verbose("\n\n", "Per channel MSE = ", MSE, '\n', "Total MSE = ", ChannelMean(MSE, channels));
+
+	// 16 bit and floating point bases peak at 65535 and 1.0
+	const double peak{PeakValue(BaseImage)};
+	auto PSNR = cv::quality::QualityPSNR::compute(BaseImage, BaseImageCopy, cv::noArray(), peak);
+	Stegano::Logger::Verbose("\n\n", "Per channel PSNR = ", PSNR, '\n', "Total PSNR = ", TotalPsnr(MSE, BaseImage));
+
+	auto SSIM = cv::quality::QualitySSIM::compute(BaseImage, BaseImageCopy, cv::noArray());
+	Stegano::Logger::Verbose("\n\n", "Per channel SSIM = ", SSIM, '\n', "Total SSIM = ", ChannelMean(SSIM, channels), '\n');
+
+	if(analyse) {
+		ReportDetectability(AnalyseLsb(BaseImageCopy), AnalyseLsb(BaseImage), "encoded image");
+	}
+
+	return true;
+}
+
+}
@@ -4,7 +4,8 @@
 #include <limits>
 #include <thread>
 #include <chrono>
-#include "SteganoLogger.h"
+#include "SteganoThreadedCommon.h"
+#include "SteganoPayload.h"
 
 #if _WIN32
 	#define NOMINMAX // to protect from conflict in std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n')
@@ -12,8 +13,15 @@
 #endif
 
 namespace Stegano {
-bool quiet{false}, verbose{false}, showimages{false}, expandbase{false}, force{false}, noreduc{false}, nograyscale{false};
-unsigned int threads{1U};
+bool quiet{false}, verbose{false}, logdetails{false}, showimages{false}, expandbase{false}, force{false}, noreduc{false},
+	 nograyscale{false}, autotune{false}, mempool{false}, compress{false}, filemode{false}, roidecode{false}, adaptive{false},
+	 encrypt{false}, analyse{false}, append{false}, update{false};
+unsigned int threads{1U}, affinity{0U}, numanodes{0U}, previewstep{1U}, fecparity{0U}, entry{0U}, tileorder{0U};
+int pnglevel{4}, pngstrategy{cv::IMWRITE_PNG_STRATEGY_FILTERED};
+std::string fileoutput, key, cipherfile, prepackfile;
+std::array<unsigned char, 32> cipherkey{};
+std::vector<std::string> carriers, payloads;
+cv::Rect roi;
 
 #if _WIN32
 long DesktopWidth{0}, DesktopHeight{0};
@@ -40,9 +48,64 @@ inline bool Encode(const std::string& base, const std::string& source, const std
 inline bool Decode(const std::string& source, const std::string& output);
 inline bool ParallelEncode(const std::string& base, const std::string& source, const std::string& output);
 inline bool ParallelDecode(const std::string& source, const std::string& output);
+/**
+ * @brief Encodes any file (or standard input if source is "-") in base, streaming it into the embedding kernel
+ * @param base -> Base image path
+ * @param source -> Source file path
+ * @param output -> Output image path
+ * @return true => Success
+ */
+bool EncodeFile(const std::string& base, const std::string& source, const std::string& output);
+/**
+ * @brief Shards the source across several base images, encoded in parallel
+ * @param bases -> Base image paths, carrier k is saved as <output stem>_<k + 1> with the extension of output
+ * @param source -> Source image path (or file path in file mode)
+ * @param output -> Output image path
+ * @return true => Success
+ */
+bool EncodeShards(const std::vector<std::string>& bases, const std::string& source, const std::string& output);
+/**
+ * @brief Decodes the carriers of a sharded payload, given in any order, and reassembles it
+ * @param sources -> Encoded image paths
+ * @param output -> Output image path
+ * @return true => Success
+ */
+bool DecodeShards(const std::vector<std::string>& sources, const std::string& output);
+/**
+ * @brief Encodes several sources in base as the entries of a payload container, after the payloads already in base with "append"
+ * @param base -> Base image path
+ * @param sources -> Source image or file paths, in entry order
+ * @param output -> Output image path
+ * @return true => Success
+ */
+bool EncodeContainer(const std::string& base, const std::vector<std::string>& sources, const std::string& output);
+/**
+ * @brief Replaces the payload of an encoded image, rewriting only the chunks which differ when the layout stays the same
+ * @param carrier -> Encoded image path
+ * @param source -> New source image path (or file path in file mode)
+ * @param output -> Output image path, patched in place when it is the PAM or BMP carrier itself or a copy of it
+ * @return true => Success
+ */
+bool UpdateCarrier(const std::string& carrier, const std::string& source, const std::string& output);
+/**
+ * @brief Encodes source in the quantised DCT coefficients of a JPEG base, one pool task per MCU row, without decoding it to pixels
+ * @param base -> JPEG base image path
+ * @param source -> Source image path (or file path in file mode)
+ * @param output -> Output JPEG path
+ * @return true => Success
+ */
+bool EncodeJpeg(const std::string& base, const std::string& source, const std::string& output);
+/**
+ * @brief Decodes the payload held by the DCT coefficients of a JPEG image encoded by EncodeJpeg()
+ * @param source -> Encoded JPEG image path
+ * @param output -> Output image path
+ * @return true => Success
+ */
+bool DecodeJpeg(const std::string& source, const std::string& output);
 
 // Hold Screen
 static inline void hold() {
+	Stegano::Logger::Flush();
 	std::cout << "Press enter/return to exit";
 	std::cin.get();
 }
@@ -62,7 +125,25 @@ static inline void help() {
 			  << "\n\t"
 			  << "[{output | /o | /O} <path>] {quiet | /q | /Q} {verbose | /v | /V} {show | /s | /S} {noreduc | /nr | /NR}"
 			  << "\n\t"
-			  << "{force | /f | /F} {nogray | /ng | /NG} {base | /b | /B} [{threads | /t | /T} 1...512]"
+			  << "{force | /f | /F} {nogray | /ng | /NG} {base | /b | /B} [{affinity | /af | /AF} [compact | scatter]]"
+			  << "\n\t"
+			  << "[{nodes | /n | /N} <count>] {logdetails | /ld | /LD}"
+			  << "\n\t"
+			  << "{mempool | /mp | /MP} {compress | /c | /C} {file | /fl | /FL} [{carrier | /cr | /CR} <path>]..."
+			  << "\n\t"
+			  << "[{roi | /r | /R} <x> <y> <width> <height>] [{rows | /rw | /RW} <first> <count>]"
+			  << "\n\t"
+			  << "[{preview | /p | /P} <step>] {adaptive | /ad | /AD} [{cipher | /ci | /CI} <keyfile>]"
+			  << "\n\t"
+			  << "[{fec | /fe | /FE} 2...128] {analyse | /an | /AN} [{prepack | /pk | /PK} <path>]"
+			  << "\n\t"
+			  << "[{payload | /py | /PY} <path>]... {append | /ap | /AP} [{entry | /en | /EN} <index>] {update | /up | /UP}"
+			  << "\n\t"
+			  << "[{tileorder | /to | /TO} 64 | 256] [{pnglevel | /pl | /PL} 0...9] [{key | /k | /K} <passphrase>]"
+			  << "\n\t"
+			  << "[{pngstrategy | /ps | /PS} default | filtered | huffman | rle | fixed]"
+			  << "\n\t"
+			  << "[{threads | /t | /T} 1...512 | auto]"
 			  << "\n\n";
 	std::cout << "DESCRIPTION"
 			  << "\n\t"
@@ -80,15 +161,31 @@ static inline void help() {
 			  << "\n\t\t"
 			  << "e.g. - Stegano.exe encode ..\\Base.png ..\\Source.png"
 			  << "\n\n\t";
-	std::cout << "c) decode - Decodes the hidden image within the source image (must be a losslessly encoded image)."
+	std::cout << "c) decode - Decodes the hidden image within the source image (must be a losslessly encoded image, or a JPEG"
 			  << "\n\t\t"
-			  << "e.g. - Stegano.exe decode ..\\Encoded.png"
+			  << "image encoded with a .jpg output). e.g. - Stegano.exe decode ..\\Encoded.png"
 			  << "\n\n\t";
 	std::cout << "------------------------------------------------- Flags --------------------------------------------------"
 			  << "\n\n\t";
-	std::cout << "1) output (optional, default = Encoded.png / Decoded.png) - Sets the output image path. Must end with .png"
+	std::cout << "1) output (optional, default = Encoded.png / Decoded.png) - Sets the output image path. Must end with .png,"
+			  << "\n\t\t"
+			  << ".tif (uncompressed), .qoi, .pam or .bmp (uncompressed). Non-PNG formats save much faster at the cost of size."
+			  << "\n\t\t"
+			  << "e.g. - Stegano.exe encode ..\\Base.png ..\\Source.png output ..\\Output.qoi"
+			  << "\n\t\t"
+			  << "16 bit bases are kept 16 bit and take more bits per channel, they can be saved as .png, .tif or .pam."
 			  << "\n\t\t"
-			  << "extension. e.g. - Stegano.exe encode ..\\Base.png ..\\Source.png output ..\\Output.png"
+			  << "Floating point bases must be saved as .tif."
+			  << "\n\t\t"
+			  << "The alpha channel of a base is kept and carries data as well."
+			  << "\n\t\t"
+			  << "A .jpg or .jpeg output needs a JPEG base, the payload then changes the LSB of its quantised AC coefficients"
+			  << "\n\t\t"
+			  << "of magnitude 2 or more, without decoding it to pixels. The source is not reduced, \"key\", \"adaptive\", \"fec\""
+			  << "\n\t\t"
+			  << "and \"tileorder\" are not used. Needs a build with libjpeg (STEGANO_WITH_LIBJPEG)."
+			  << "\n\t\t"
+			  << "e.g. - Stegano.exe encode ..\\Photo.jpg ..\\Source.png output ..\\Encoded.jpg"
 			  << "\n\n\t";
 	std::cout << "2) quiet (optional) - No output to console except for error messages."
 			  << "\n\n\t";
@@ -114,7 +211,189 @@ static inline void help() {
 			  << "\n\n\t";
 	std::cout << "9) threads (optional, default = 1, max = 512) - Enable multithreading with the specified number of threads."
 			  << "\n\t\t"
-			  << "Should be the last argument passed. e.g. - Stegano.exe decode ..\\Encoded.png threads 8"
+			  << "e.g. - Stegano.exe decode ..\\Encoded.png threads 8"
+			  << "\n\t\t"
+			  << "With \"auto\" (or without a value as the last argument), each job picks its thread count and chunk size, and"
+			  << "\n\t\t"
+			  << "so whether it runs on the calling thread or on the pool, from a cost model of this host."
+			  << "\n\t\t"
+			  << "The model is calibrated on first use and cached in Stegano.tune in the temporary directory (override the"
+			  << "\n\t\t"
+			  << "path with the STEGANO_TUNE_FILE environment variable)."
+			  << "\n\n\t";
+	std::cout << "10) affinity (optional) - Pins the worker threads to logical processors, in one of two modes. \"compact\""
+			  << "\n\t\t"
+			  << "(used when no mode is given) pins worker k to the k-th processor counting node by node, filling every"
+			  << "\n\t\t"
+			  << "processor of a NUMA node before using the next node. \"scatter\" deals the workers round robin over the"
+			  << "\n\t\t"
+			  << "nodes, worker k going to node k % nodes. The main thread is not pinned. When encoding, band k of the"
+			  << "\n\t\t"
+			  << "image always goes to worker 1 + k % workers, which first touches it in the encoded image and in the copy"
+			  << "\n\t\t"
+			  << "kept for the quality metrics, so the band is placed on the node of that worker. Extended, tiled and tile"
+			  << "\n\t\t"
+			  << "order streams are then embedded with a split of their own and may write a band from another node. These"
+			  << "\n\t\t"
+			  << "buffers do not come from \"mempool\". Decoding runs on the same pinned workers, but the decoded image is"
+			  << "\n\t\t"
+			  << "not placed per node."
+			  << "\n\n\t";
+	std::cout << "11) nodes (optional, requires => affinity) - Restricts the workers to the first <count> NUMA nodes. The"
+			  << "\n\t\t"
+			  << "thread count is capped at the number of logical processors in those nodes. Node local pages only apply"
+			  << "\n\t\t"
+			  << "to encoding, see \"affinity\"."
+			  << "\n\n\t";
+	std::cout << "12) logdetails (optional) - Prefixes every logged line with its time, logging thread and level (E/I/V)."
+			  << "\n\n\t";
+	std::cout << "13) mempool (optional) - Allocates the pixel buffers from a pool that recycles them by size class and requests"
+			  << "\n\t\t"
+			  << "huge pages for the large ones. Pool statistics are logged in verbose mode."
+			  << "\n\n\t";
+	std::cout << "14) compress (optional) - Compresses the source losslessly (PNG filters + Rice coding) before embedding it."
+			  << "\n\t\t"
+			  << "Fewer base channels are touched and the source is reduced only if it does not fit once compressed."
+			  << "\n\t\t"
+			  << "Decoding detects compressed payloads by itself. Compressed, file and sharded payloads carry a CRC32C"
+			  << "\n\t\t"
+			  << "per chunk, the damaged regions of a payload are reported when decoding."
+			  << "\n\n\t";
+	std::cout << "15) file (optional) - The source is any file, embedded byte for byte without being read as an image."
+			  << "\n\t\t"
+			  << "Pass - as the source to read it from standard input. Decoding detects file payloads by itself and"
+			  << "\n\t\t"
+			  << "writes them to the given output path, or under their original name if none is given."
+			  << "\n\t\t"
+			  << "e.g. - Stegano.exe encode ..\\Base.png ..\\Report.pdf file"
+			  << "\n\n\t";
+	std::cout << "16) carrier (optional, repeatable) - Adds a base image when encoding, the source is split across all the base"
+			  << "\n\t\t"
+			  << "images in proportion to their size and every base is encoded in parallel. Carrier k is saved as"
+			  << "\n\t\t"
+			  << "<output>_k, in the format of output. When decoding, adds an encoded image, the carriers can be given"
+			  << "\n\t\t"
+			  << "in any order."
+			  << "\n\t\t"
+			  << "e.g. - Stegano.exe decode ..\\Encoded_2.png carrier ..\\Encoded_1.png output ..\\Decoded.png"
+			  << "\n\n\t";
+	std::cout << "17) roi (optional, decode only) - Decodes only the given rectangle of the hidden image. Only the base pixels"
+			  << "\n\t\t"
+			  << "carrying its rows are read, compressed payloads are decoded in full and cropped. A width or height of 0"
+			  << "\n\t\t"
+			  << "extends the region to the edge of the image. e.g. - Stegano.exe decode ..\\Encoded.png roi 0 100 640 50"
+			  << "\n\n\t";
+	std::cout << "18) rows (optional, decode only) - Decodes only <count> rows of the hidden image starting at row <first>,"
+			  << "\n\t\t"
+			  << "same as roi 0 <first> 0 <count>."
+			  << "\n\n\t";
+	std::cout << "19) preview (optional, decode only) - Decodes a thumbnail made of every <step>th row and column of the hidden"
+			  << "\n\t\t"
+			  << "image (or of the roi). Only the bits of the sampled pixels are read. e.g. - Stegano.exe decode"
+			  << "\n\t\t"
+			  << "..\\Encoded.png preview 8 output ..\\Thumbnail.png"
+			  << "\n\n\t";
+	std::cout << "20) pnglevel (optional, default = 4) - zlib compression level (0-9) of .png outputs. 0 stores the image"
+			  << "\n\t\t"
+			  << "uncompressed and saves fastest, 9 gives the smallest file. e.g. - Stegano.exe encode ..\\Base.png"
+			  << "\n\t\t"
+			  << "..\\Source.png pnglevel 1"
+			  << "\n\n\t";
+	std::cout << "21) pngstrategy (optional, default = filtered) - zlib strategy of .png outputs, one of default, filtered,"
+			  << "\n\t\t"
+			  << "huffman, rle or fixed. huffman and rle are faster, filtered usually compresses encoded images best."
+			  << "\n\t\t"
+			  << "e.g. - Stegano.exe encode ..\\Base.png ..\\Source.png pnglevel 2 pngstrategy rle"
+			  << "\n\n\t";
+	std::cout << "22) key (optional) - Scatters the payload across the base in blocks of a few KB shuffled with the given"
+			  << "\n\t\t"
+			  << "passphrase, instead of laying it out in order. The same key is needed to decode. Images are then embedded"
+			  << "\n\t\t"
+			  << "as extended streams. e.g. - Stegano.exe encode ..\\Base.png ..\\Source.png key \"correct horse\""
+			  << "\n\n\t";
+	std::cout << "23) adaptive (optional) - Spreads the payload over 64 x 64 tiles of the base, textured tiles taking more bits"
+			  << "\n\t\t"
+			  << "per pixel than smooth ones, where changes show the least. Falls back to the uniform layout if the payload"
+			  << "\n\t\t"
+			  << "does not fit in the tiles."
+			  << "\n\t\t"
+			  << "Decoding detects it by itself. e.g. - Stegano.exe encode ..\\Base.png ..\\Source.png adaptive"
+			  << "\n\n\t";
+	std::cout << "24) cipher (optional) - Encrypts the payload with ChaCha20 as it is embedded, and decrypts it as it is"
+			  << "\n\t\t"
+			  << "extracted. The key file holds 32 raw bytes or 64 hex digits, without the flag the key is read from the"
+			  << "\n\t\t"
+			  << "STEGANO_CIPHER_KEY environment variable (64 hex digits) if it is set. Images are then embedded as extended"
+			  << "\n\t\t"
+			  << "streams. Sharded payloads cannot be encrypted. e.g. - Stegano.exe encode ..\\Base.png ..\\Source.png cipher key.bin"
+			  << "\n\n\t";
+	std::cout << "25) fec (optional, encode only) - Adds Reed-Solomon error correction with the given number of parity bytes per"
+			  << "\n\t\t"
+			  << "255 byte codeword, 16 codewords interleaved. Up to 8 x parity damaged bytes in a row are corrected per block of"
+			  << "\n\t\t"
+			  << "4080 bytes, at the cost of parity / 255 of the capacity. Uses the uniform layout, sharded payloads cannot be"
+			  << "\n\t\t"
+			  << "error corrected. Decoding detects it by itself. e.g. - Stegano.exe encode ..\\Base.png ..\\Source.png fec 32"
+			  << "\n\n\t";
+	std::cout << "26) analyse (optional, encode only) - Runs the chi-square attack, RS analysis and sample pair analysis on the"
+			  << "\n\t\t"
+			  << "base and on the encoded image, logs how much each statistic moved and warns if the encoded image is exposed"
+			  << "\n\t\t"
+			  << "to LSB steganalysis. e.g. - Stegano.exe encode ..\\Base.png ..\\Source.png analyse"
+			  << "\n\n\t";
+	std::cout << "27) prepack (optional, encode only) - Also saves the source, as reduced for the base and packed (compressed with"
+			  << "\n\t\t"
+			  << "\"compress\"), as a prepacked payload at the given path. Passing it as the source of later encodes skips reading,"
+			  << "\n\t\t"
+			  << "reducing and packing the source again, bases too small for it still reduce it further. Not used with \"file\" or"
+			  << "\n\t\t"
+			  << "\"carrier\". e.g. - Stegano.exe encode ..\\Base.png ..\\Source.png prepack Source.sgpk, then"
+			  << "\n\t\t"
+			  << "Stegano.exe encode ..\\Base2.png Source.sgpk"
+			  << "\n\n\t";
+	std::cout << "28) payload (optional, encode only, repeatable) - Adds another source, the base then holds a container of"
+			  << "\n\t\t"
+			  << "independent payloads, the source first. Images are packed (compressed with \"compress\"), anything else is"
+			  << "\n\t\t"
+			  << "embedded as a file, with \"file\" every source is. Payloads are not reduced, the base must fit them all."
+			  << "\n\t\t"
+			  << "Decoding saves entry k of n as <output>_k, files under their own name. e.g. - Stegano.exe encode ..\\Base.png"
+			  << "\n\t\t"
+			  << "..\\Source.png payload ..\\Other.png payload notes.txt"
+			  << "\n\n\t";
+	std::cout << "29) append (optional, encode only) - The base is an encoded image, its payloads are kept and the source (and"
+			  << "\n\t\t"
+			  << "\"payload\" sources) are added after them as new entries. Pass the \"key\" and \"cipher\" it was encoded with."
+			  << "\n\t\t"
+			  << "e.g. - Stegano.exe encode ..\\Encoded.png ..\\Third.png append output ..\\Encoded2.png"
+			  << "\n\n\t";
+	std::cout << "30) entry (optional, decode only) - Decodes only the given entry (1 for the first) of a container. Uniform"
+			  << "\n\t\t"
+			  << "layouts read the directory and the channels holding that entry, nothing else. e.g. - Stegano.exe decode"
+			  << "\n\t\t"
+			  << "..\\Encoded.png entry 2"
+			  << "\n\n\t";
+	std::cout << "31) update (optional, encode only) - The base is an encoded image, its payload is replaced by the source. The"
+			  << "\n\t\t"
+			  << "new payload must keep the embedded length of the previous one, which fixes the layout: only the chunks whose"
+			  << "\n\t\t"
+			  << "bytes differ are rewritten, and a PAM or BMP output of the same format is patched row band by row band. A"
+			  << "\n\t\t"
+			  << "payload of another length is refused, it is encoded into the original base. Encrypted payloads get a"
+			  << "\n\t\t"
+			  << "fresh nonce and are rewritten in full."
+			  << "\n\t\t"
+			  << "e.g. - Stegano.exe encode ..\\Encoded.pam ..\\Source2.png update output ..\\Encoded.pam"
+			  << "\n\n\t";
+	std::cout << "32) tileorder (optional, encode only) - Lays the payload out tile by tile instead of row by row, in tiles of"
+			  << "\n\t\t"
+			  << "64 x 64 or 256 x 256 pixels. Every tile is embedded in place by a task of its own and a run of payload bytes"
+			  << "\n\t\t"
+			  << "stays in neighbouring tiles. TIFF outputs are written in tiles of the same size. Decoding reads the tile size"
+			  << "\n\t\t"
+			  << "from the trailer. Not used with \"adaptive\" or \"carrier\"."
+			  << "\n\t\t"
+			  << "e.g. - Stegano.exe encode ..\\Base.png ..\\Source.png tileorder 256"
 			  << "\n\n";
 	std::cout << "AUTHOR"
 			  << "\n\t"
@@ -135,24 +414,33 @@ static inline void invalidargs() {
  * @param argc -> Argument count
  * @param argv -> Argument vector
  * @param output -> Sets output file path string
+ * @param decode -> Decode mode, output paths that are not images are kept for file payloads
  * @param expandbase -> Sets expandbase boolean
  * @param force -> Sets force boolean
  * @param noreduc -> Sets noreduc boolean
  * @param nograyscale -> Sets nograyscale boolean
  * @return true => Success
  */
-static inline bool LoopThroughArgs(const int start, const int& argc, const char** argv, std::string* output) {
+static inline bool LoopThroughArgs(const int start, const int& argc, const char** argv, std::string* output, const bool decode) {
 	for(int i = start; i < argc; ++i) {
 		if(std::string(argv[i]) == "/o" || std::string(argv[i]) == "/O" || std::string(argv[i]) == "output") {
 			++i;
 			if(i < argc) {
-				std::string ext{argv[i]};
-				ext = ext.substr(ext.find_last_of('.') + 1);
-				if(ext == "png" || ext == "PNG") {
+				if(decode) {
+					fileoutput = argv[i];
+				}
+				// Decoded images are never saved as JPEG
+				const ImageFormat format{OutputFormat(argv[i])};
+				if(format != FORMAT_NONE && !(decode && format == FORMAT_JPEG)) {
 					*output = argv[i];
 				}
+				else if(decode) {
+					Stegano::Logger::Verbose("Output path is not a .png, .tif, .qoi, .pam or .bmp image,",
+											 " it is used only if the payload is a file", '\n');
+				}
 				else {
-					Stegano::Logger::Log('\n', "Given output path - \"", argv[i], "\" does not end in .png, reverting to default.", '\n');
+					Stegano::Logger::Log('\n', "Given output path - \"", argv[i], "\" is not a .png, .tif, .qoi, .pam, .bmp or .jpg image,",
+										 " reverting to default.", '\n');
 				}
 			}
 			else {
@@ -166,6 +454,235 @@ static inline bool LoopThroughArgs(const int start, const int& argc, const char*
 		else if(std::string(argv[i]) == "/v" || std::string(argv[i]) == "/V" || std::string(argv[i]) == "verbose") {
 			verbose = true;
 		}
+		else if(std::string(argv[i]) == "/ld" || std::string(argv[i]) == "/LD" || std::string(argv[i]) == "logdetails") {
+			logdetails = true;
+		}
+		else if(std::string(argv[i]) == "/mp" || std::string(argv[i]) == "/MP" || std::string(argv[i]) == "mempool") {
+			mempool = true;
+		}
+		else if(std::string(argv[i]) == "/an" || std::string(argv[i]) == "/AN" || std::string(argv[i]) == "analyse") {
+			analyse = true;
+		}
+		else if(std::string(argv[i]) == "/c" || std::string(argv[i]) == "/C" || std::string(argv[i]) == "compress") {
+			compress = true;
+		}
+		else if(std::string(argv[i]) == "/ad" || std::string(argv[i]) == "/AD" || std::string(argv[i]) == "adaptive") {
+			adaptive = true;
+		}
+		else if(std::string(argv[i]) == "/fl" || std::string(argv[i]) == "/FL" || std::string(argv[i]) == "file") {
+			filemode = true;
+		}
+		else if(std::string(argv[i]) == "/cr" || std::string(argv[i]) == "/CR" || std::string(argv[i]) == "carrier") {
+			++i;
+			if(i < argc) {
+				carriers.emplace_back(argv[i]);
+			}
+			else {
+				Stegano::Logger::Log('\n', "Carrier path not found", '\n');
+				return false;
+			}
+		}
+		else if(std::string(argv[i]) == "/py" || std::string(argv[i]) == "/PY" || std::string(argv[i]) == "payload") {
+			++i;
+			if(i < argc && argv[i][0] != '\0') {
+				payloads.emplace_back(argv[i]);
+			}
+			else {
+				Stegano::Logger::Log('\n', "Payload path not found", '\n');
+				return false;
+			}
+		}
+		else if(std::string(argv[i]) == "/ap" || std::string(argv[i]) == "/AP" || std::string(argv[i]) == "append") {
+			append = true;
+		}
+		else if(std::string(argv[i]) == "/up" || std::string(argv[i]) == "/UP" || std::string(argv[i]) == "update") {
+			update = true;
+		}
+		else if(std::string(argv[i]) == "/en" || std::string(argv[i]) == "/EN" || std::string(argv[i]) == "entry") {
+			++i;
+			if(i < argc) {
+				try {
+					entry = static_cast<unsigned int>(std::stoi(argv[i]));
+				}
+				catch(...) {
+					entry = 0U;
+				}
+				if(entry < 1U || entry > 65535U) {
+					Stegano::Logger::Log('\n', "Improper value for entry passed, expected 1 to 65535", '\n');
+					return false;
+				}
+			}
+			else {
+				Stegano::Logger::Log('\n', "Entry index not found", '\n');
+				return false;
+			}
+		}
+		else if(std::string(argv[i]) == "/k" || std::string(argv[i]) == "/K" || std::string(argv[i]) == "key") {
+			++i;
+			if(i < argc && argv[i][0] != '\0') {
+				key = argv[i];
+			}
+			else {
+				Stegano::Logger::Log('\n', "Key not found", '\n');
+				return false;
+			}
+		}
+		else if(std::string(argv[i]) == "/pk" || std::string(argv[i]) == "/PK" || std::string(argv[i]) == "prepack") {
+			++i;
+			if(i < argc && argv[i][0] != '\0') {
+				prepackfile = argv[i];
+			}
+			else {
+				Stegano::Logger::Log('\n', "Prepacked payload path not found", '\n');
+				return false;
+			}
+		}
+		else if(std::string(argv[i]) == "/ci" || std::string(argv[i]) == "/CI" || std::string(argv[i]) == "cipher") {
+			++i;
+			if(i < argc && argv[i][0] != '\0') {
+				cipherfile = argv[i];
+			}
+			else {
+				Stegano::Logger::Log('\n', "Cipher key file not found", '\n');
+				return false;
+			}
+		}
+		else if(std::string(argv[i]) == "/fe" || std::string(argv[i]) == "/FE" || std::string(argv[i]) == "fec") {
+			++i;
+			if(i < argc) {
+				try {
+					fecparity = static_cast<unsigned int>(std::stoi(argv[i]));
+				}
+				catch(...) {
+					fecparity = 0U;
+				}
+				if(fecparity < 2U || fecparity > 128U) {
+					Stegano::Logger::Log('\n', "Improper value for fec passed, expected 2 to 128 parity bytes", '\n');
+					return false;
+				}
+			}
+			else {
+				Stegano::Logger::Log('\n', "Parity bytes not found", '\n');
+				return false;
+			}
+		}
+		else if(std::string(argv[i]) == "/to" || std::string(argv[i]) == "/TO" || std::string(argv[i]) == "tileorder") {
+			++i;
+			if(i < argc) {
+				try {
+					tileorder = static_cast<unsigned int>(std::stoi(argv[i]));
+				}
+				catch(...) {
+					tileorder = 0U;
+				}
+				if(tileorder != 64U && tileorder != 256U) {
+					Stegano::Logger::Log('\n', "Improper value for tileorder passed, expected 64 or 256", '\n');
+					return false;
+				}
+			}
+			else {
+				Stegano::Logger::Log('\n', "Tile size not found", '\n');
+				return false;
+			}
+		}
+		else if(std::string(argv[i]) == "/r" || std::string(argv[i]) == "/R" || std::string(argv[i]) == "roi") {
+			if(i + 4 >= argc) {
+				Stegano::Logger::Log('\n', "Region not found, expected <x> <y> <width> <height>", '\n');
+				return false;
+			}
+			try {
+				roi = cv::Rect(std::stoi(argv[i + 1]), std::stoi(argv[i + 2]), std::stoi(argv[i + 3]), std::stoi(argv[i + 4]));
+			}
+			catch(...) {
+				Stegano::Logger::Log('\n', "Improper value for roi passed", '\n');
+				return false;
+			}
+			roidecode = true;
+			i += 4;
+		}
+		else if(std::string(argv[i]) == "/rw" || std::string(argv[i]) == "/RW" || std::string(argv[i]) == "rows") {
+			if(i + 2 >= argc) {
+				Stegano::Logger::Log('\n', "Row range not found, expected <first> <count>", '\n');
+				return false;
+			}
+			try {
+				roi = cv::Rect(0, std::stoi(argv[i + 1]), 0, std::stoi(argv[i + 2]));
+			}
+			catch(...) {
+				Stegano::Logger::Log('\n', "Improper value for rows passed", '\n');
+				return false;
+			}
+			roidecode = true;
+			i += 2;
+		}
+		else if(std::string(argv[i]) == "/p" || std::string(argv[i]) == "/P" || std::string(argv[i]) == "preview") {
+			++i;
+			if(i < argc) {
+				try {
+					previewstep = static_cast<unsigned int>(std::stoi(argv[i]));
+				}
+				catch(...) {
+					previewstep = 0U;
+				}
+				if(previewstep < 1U || previewstep > 65535U) {
+					Stegano::Logger::Log('\n', "Improper value for preview passed", '\n');
+					return false;
+				}
+				roidecode = true;
+			}
+			else {
+				Stegano::Logger::Log('\n', "Preview step not found", '\n');
+				return false;
+			}
+		}
+		else if(std::string(argv[i]) == "/pl" || std::string(argv[i]) == "/PL" || std::string(argv[i]) == "pnglevel") {
+			++i;
+			if(i < argc) {
+				try {
+					pnglevel = std::stoi(argv[i]);
+				}
+				catch(...) {
+					pnglevel = -1;
+				}
+				if(pnglevel < 0 || pnglevel > 9) {
+					Stegano::Logger::Log('\n', "Improper value for pnglevel passed", '\n');
+					return false;
+				}
+			}
+			else {
+				Stegano::Logger::Log('\n', "PNG compression level not found", '\n');
+				return false;
+			}
+		}
+		else if(std::string(argv[i]) == "/ps" || std::string(argv[i]) == "/PS" || std::string(argv[i]) == "pngstrategy") {
+			++i;
+			if(i < argc) {
+				const std::string strategy{argv[i]};
+				if(strategy == "default") {
+					pngstrategy = cv::IMWRITE_PNG_STRATEGY_DEFAULT;
+				}
+				else if(strategy == "filtered") {
+					pngstrategy = cv::IMWRITE_PNG_STRATEGY_FILTERED;
+				}
+				else if(strategy == "huffman") {
+					pngstrategy = cv::IMWRITE_PNG_STRATEGY_HUFFMAN_ONLY;
+				}
+				else if(strategy == "rle") {
+					pngstrategy = cv::IMWRITE_PNG_STRATEGY_RLE;
+				}
+				else if(strategy == "fixed") {
+					pngstrategy = cv::IMWRITE_PNG_STRATEGY_FIXED;
+				}
+				else {
+					Stegano::Logger::Log('\n', "Improper value for pngstrategy passed", '\n');
+					return false;
+				}
+			}
+			else {
+				Stegano::Logger::Log('\n', "PNG strategy not found", '\n');
+				return false;
+			}
+		}
 		else if(std::string(argv[i]) == "/s" || std::string(argv[i]) == "/S" || std::string(argv[i]) == "show") {
 			showimages = true;
 		}
@@ -180,7 +697,10 @@ static inline bool LoopThroughArgs(const int start, const int& argc, const char*
 		}
 		else if(std::string(argv[i]) == "/t" || std::string(argv[i]) == "/T" || std::string(argv[i]) == "threads") {
 			++i;
-			if(i < argc) {
+			if(i < argc && std::string(argv[i]) == "auto") {
+				threads = 0U;
+			}
+			else if(i < argc) {
 				try {
 					threads = static_cast<unsigned int>(std::stoi(argv[i]));
 				}
@@ -200,6 +720,40 @@ static inline bool LoopThroughArgs(const int start, const int& argc, const char*
 		else if(std::string(argv[i]) == "/b" || std::string(argv[i]) == "/B" || std::string(argv[i]) == "base") {
 			expandbase = true;
 		}
+		else if(std::string(argv[i]) == "/af" || std::string(argv[i]) == "/AF" || std::string(argv[i]) == "affinity") {
+			affinity = AFFINITY_COMPACT;
+			if(i + 1 < argc) {
+				if(std::string(argv[i + 1]) == "scatter") {
+					affinity = AFFINITY_SCATTER;
+					++i;
+				}
+				else if(std::string(argv[i + 1]) == "compact") {
+					++i;
+				}
+			}
+		}
+		else if(std::string(argv[i]) == "/n" || std::string(argv[i]) == "/N" || std::string(argv[i]) == "nodes") {
+			++i;
+			if(i < argc) {
+				int count{0};
+				try {
+					count = std::stoi(argv[i]);
+				}
+				catch(...) {
+					count = 0;
+				}
+				// Negative counts would wrap around to huge node counts
+				if(count < 1) {
+					Stegano::Logger::Log('\n', "Improper value for nodes passed, using all NUMA nodes.", '\n');
+					count = 0;
+				}
+				numanodes = static_cast<unsigned int>(count);
+			}
+			else {
+				Stegano::Logger::Log('\n', "NUMA node count not found", '\n');
+				return false;
+			}
+		}
 		else {
 			return false;
 		}
@@ -228,7 +782,7 @@ static inline bool handler(const int& argc, const char** argv) {
 				decode = true;
 				Source = argv[2];
 				output = "Decoded.png";
-				if(!LoopThroughArgs(3, argc, argv, &output)) {
+				if(!LoopThroughArgs(3, argc, argv, &output, true)) {
 					invalidargs();
 					return false;
 				}
@@ -240,7 +794,7 @@ static inline bool handler(const int& argc, const char** argv) {
 				}
 				Base = argv[2];
 				Source = argv[3];
-				if(!LoopThroughArgs(4, argc, argv, &output)) {
+				if(!LoopThroughArgs(4, argc, argv, &output, false)) {
 					invalidargs();
 					return false;
 				}
@@ -294,6 +848,7 @@ static inline bool handler(const int& argc, const char** argv) {
 		}
 	}
 
+	Stegano::Logger::Flush();
 	std::cout << '\n';
 
 #if _WIN32
@@ -304,26 +859,139 @@ static inline bool handler(const int& argc, const char** argv) {
 	Stegano::Logger::Verbose("Screen resolution is: [", DesktopWidth, " x ", DesktopHeight, ']', '\n');
 #endif
 
+	if(mempool) {
+		InstallMatPool();
+	}
+
 	Stegano::Logger::Verbose("Output file path = ", output, '\n');
 	showimages ? Stegano::Logger::Verbose("Show Images = ", "true", '\n') : Stegano::Logger::Verbose("Show Images = ", "false", '\n');
 
+	if(numanodes != 0U && affinity == AFFINITY_NONE) {
+		Stegano::Logger::Log("NUMA node restriction requires \"affinity\", ignoring it.", '\n');
+		numanodes = 0U;
+	}
+	if(affinity != AFFINITY_NONE) {
+		Stegano::Logger::Verbose("Affinity = ", affinity == AFFINITY_SCATTER ? "scatter" : "compact", " over ", NumaNodeCount(),
+								 " NUMA node(s)", '\n');
+	}
+
+	const unsigned int processors{LogicalProcessorCount()};
 	if(threads == 0U) {
-		threads = std::thread::hardware_concurrency();
+		// "threads auto", or "threads" without a value => every job picks its own thread count from the cost model of this host
+		autotune = true;
+		threads = processors;
+	}
+
+	SetupWorkerPool(threads > processors ? processors : threads);
+	// Every job below, the JPEG, shard, update, container and file ones included, plans its threads and chunks from this count
+	if(threads > processors) {
+		threads = processors;
+		Stegano::Logger::Log('\n',
+							 "Entered value of threads greater than supported by the platform. Setting thread count to maximum value "
+							 "this platform allows.",
+							 '\n');
+	}
+	if(autotune) {
+		LoadCostModel(processors);
 	}
 
-	if(threads == 1U) {
+	if(roidecode && !decode) {
+		Stegano::Logger::Log("Regions and previews only apply to decoding, ignoring \"roi\" and \"preview\".", '\n');
+		roidecode = false;
+	}
+	if(decode && (!payloads.empty() || append)) {
+		Stegano::Logger::Log("Containers are built when encoding, ignoring \"payload\" and \"append\".", '\n');
+		payloads.clear();
+		append = false;
+	}
+	if(update && decode) {
+		Stegano::Logger::Log("Payloads are updated when encoding, ignoring \"update\".", '\n');
+		update = false;
+	}
+	if(update && (!carriers.empty() || !payloads.empty() || append)) {
+		Stegano::Logger::Error("Error!", " \"update\" replaces the single payload of one encoded image, it cannot be sharded or",
+							   " hold a container", '\n');
+		return false;
+	}
+	const bool container{!decode && (!payloads.empty() || append)};
+	if(entry && !decode) {
+		Stegano::Logger::Log("Entries are picked when decoding, ignoring \"entry\".", '\n');
+		entry = 0U;
+	}
+	if(container && !carriers.empty()) {
+		Stegano::Logger::Error("Error!", " Payload containers cannot be sharded", '\n');
+		return false;
+	}
+	if(adaptive && !decode && (filemode || !carriers.empty() || container || update)) {
+		Stegano::Logger::Log("File, sharded, container and updated payloads use the uniform layout, ignoring \"adaptive\".", '\n');
+		adaptive = false;
+	}
+	if(!prepackfile.empty() && (decode || filemode || !carriers.empty() || container || update)) {
+		Stegano::Logger::Log("Only image sources encoded into one base are prepacked, ignoring \"prepack\".", '\n');
+		prepackfile.clear();
+	}
+	if(adaptive && !decode && fecparity) {
+		Stegano::Logger::Log("Error corrected payloads use the uniform layout, ignoring \"adaptive\".", '\n');
+		adaptive = false;
+	}
+	if(fecparity && !decode && !carriers.empty()) {
+		Stegano::Logger::Error("Error!", " Sharded payloads cannot be error corrected", '\n');
+		return false;
+	}
+	if(tileorder && (decode || update)) {
+		Stegano::Logger::Log("The tile order of an encoded image is read from its trailer, ignoring \"tileorder\".", '\n');
+		tileorder = 0U;
+	}
+	if(tileorder && (adaptive || !carriers.empty())) {
+		Stegano::Logger::Log("Adaptive and sharded payloads are laid out in their own order, ignoring \"tileorder\".", '\n');
+		tileorder = 0U;
+	}
+	// The cipher key comes from "cipher", or from STEGANO_CIPHER_KEY without it
+	if(!LoadCipherKey(cipherfile, cipherkey, encrypt)) {
+		Stegano::Logger::Error("Error!", " Cannot read the cipher key, expected 32 bytes or 64 hex digits", '\n');
+		return false;
+	}
+	if(encrypt && !decode && !carriers.empty()) {
+		Stegano::Logger::Error("Error!", " Sharded payloads cannot be encrypted", '\n');
+		return false;
+	}
+	// JPEG outputs are encoded in the DCT coefficients of a JPEG base, decoding recognises JPEG images by their signature
+	if(decode ? JpegFile(Source) : OutputFormat(output) == FORMAT_JPEG) {
+		if(!carriers.empty() || container || update) {
+			Stegano::Logger::Error("Error!", " JPEG images hold a single payload, it cannot be sharded, hold a container or be updated",
+								   '\n');
+			return false;
+		}
+		if(!key.empty() || adaptive || fecparity || tileorder || analyse || !prepackfile.empty()) {
+			Stegano::Logger::Log("JPEG payloads fill the DCT coefficients in order, ignoring \"key\", \"adaptive\", \"fec\",",
+								 " \"tileorder\", \"analyse\" and \"prepack\".", '\n');
+		}
+		return decode ? DecodeJpeg(Source, output) : EncodeJpeg(Base, Source, output);
+	}
+	if(!carriers.empty()) {
+		carriers.insert(carriers.begin(), decode ? Source : Base);
+		return decode ? DecodeShards(carriers, output) : EncodeShards(carriers, Source, output);
+	}
+	if(update) {
+		return UpdateCarrier(Base, Source, output);
+	}
+	if(container) {
+		payloads.insert(payloads.begin(), Source);
+		return EncodeContainer(Base, payloads, output);
+	}
+	if(filemode && !decode) {
+		if(compress) {
+			Stegano::Logger::Log("File payloads are embedded as they are, ignoring \"compress\".", '\n');
+		}
+		return EncodeFile(Base, Source, output);
+	}
+	// Extended streams (compress, key, adaptive, cipher, fec, tileorder) are only encoded by the pool, inline with a single thread
+	if(threads == 1U && !autotune && (decode || (!compress && key.empty() && !adaptive && !encrypt && !fecparity && !tileorder))) {
 		if(decode ? !Decode(Source, output) : !Encode(Base, Source, output)) {
 			return false;
 		}
 	}
 	else {
-		if(threads > std::thread::hardware_concurrency()) {
-			threads = std::thread::hardware_concurrency();
-			Stegano::Logger::Log('\n',
-								 "Entered value of threads greater than supported by the platform. Setting thread count to maximum value "
-								 "this platform allows.",
-								 '\n');
-		}
 		Stegano::Logger::Verbose("Thread count = ", threads, "\n\n");
 		if(decode ? !ParallelDecode(Source, output) : !ParallelEncode(Base, Source, output)) {
 			return false;
@@ -348,11 +1016,13 @@ int run(const int& argc, const char** argv) {
 		return 1;
 	}
 
+	ReportMatPool();
 	// For successful run of interactive mode
 	if(argc == 1) {
 		hold();
 	}
 	else {
+		Stegano::Logger::Flush();
 		std::cout << '\n';
 	}
 	if(!showimages) {
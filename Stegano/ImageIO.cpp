@@ -0,0 +1,710 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoCommon.h"
+#include "SteganoThreadedCommon.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace Stegano {
+
+namespace {
+/* QOI (Quite OK Image format)
+** 14 byte header ("qoif", width and height in big endian, channels, colorspace), then one op per pixel or run of pixels:
+** index into a 64 entry table of recently seen pixels, small difference to the previous pixel, run of the previous pixel or
+** literal RGB(A). The stream ends with 7 zero bytes and a 1. Pixels are RGBA, cv::Mat pixels BGR(A).
+*/
+constexpr unsigned char QoiIndex{0x00}, QoiDiff{0x40}, QoiLuma{0x80}, QoiRun{0xC0}, QoiRgb{0xFE}, QoiRgba{0xFF};
+constexpr unsigned int QoiHeaderBytes{14U};
+constexpr std::array<unsigned char, 8> QoiEnd{0, 0, 0, 0, 0, 0, 0, 1};
+
+struct QoiPixel {
+	unsigned char r, g, b, a;
+	bool operator==(const QoiPixel& other) const {
+		return r == other.r && g == other.g && b == other.b && a == other.a;
+	}
+};
+
+unsigned int QoiHash(const QoiPixel& px) {
+	return (px.r * 3U + px.g * 5U + px.b * 7U + px.a * 11U) % 64U;
+}
+
+void PutBigEndian(std::vector<unsigned char>& out, const unsigned int value) {
+	for(unsigned int b{4}; b > 0U; --b) {
+		out.push_back(static_cast<unsigned char>(value >> (8U * (b - 1U))));
+	}
+}
+
+// 8 bit grayscale images are written as RGB
+bool WriteQoi(const std::string& path, const cv::Mat& image) {
+	if(image.depth() != CV_8U) {
+		return false;
+	}
+	const int channels{image.channels()};
+	std::vector<unsigned char> out{'q', 'o', 'i', 'f'};
+	// Worst case is a literal op per pixel
+	out.reserve(QoiHeaderBytes + image.total() * (channels == 4 ? 5U : 4U) + QoiEnd.size());
+	PutBigEndian(out, static_cast<unsigned int>(image.cols));
+	PutBigEndian(out, static_cast<unsigned int>(image.rows));
+	out.push_back(channels == 4 ? 4U : 3U);
+	out.push_back(0U);
+
+	std::array<QoiPixel, 64> seen{};
+	QoiPixel previous{0, 0, 0, 255};
+	unsigned int run{0};
+	for(int r{0}; r < image.rows; ++r) {
+		const unsigned char* data{image.ptr(r)};
+		for(int c{0}; c < image.cols; ++c, data += channels) {
+			const unsigned char alpha{channels == 4 ? data[3] : static_cast<unsigned char>(255)};
+			const QoiPixel px{channels == 1 ? QoiPixel{data[0], data[0], data[0], 255} : QoiPixel{data[2], data[1], data[0], alpha}};
+			if(px == previous) {
+				if(++run == 62U) {
+					out.push_back(static_cast<unsigned char>(QoiRun | (run - 1U)));
+					run = 0U;
+				}
+				continue;
+			}
+			if(run) {
+				out.push_back(static_cast<unsigned char>(QoiRun | (run - 1U)));
+				run = 0U;
+			}
+			const unsigned int hash{QoiHash(px)};
+			if(seen[hash] == px) {
+				out.push_back(static_cast<unsigned char>(QoiIndex | hash));
+			}
+			else if(px.a != previous.a) {
+				seen[hash] = px;
+				out.insert(out.end(), {QoiRgba, px.r, px.g, px.b, px.a});
+			}
+			else {
+				seen[hash] = px;
+				const int dr{static_cast<signed char>(px.r - previous.r)}, dg{static_cast<signed char>(px.g - previous.g)},
+					db{static_cast<signed char>(px.b - previous.b)};
+				if(dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+					out.push_back(static_cast<unsigned char>(QoiDiff | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+				}
+				else if(dg >= -32 && dg <= 31 && dr - dg >= -8 && dr - dg <= 7 && db - dg >= -8 && db - dg <= 7) {
+					out.push_back(static_cast<unsigned char>(QoiLuma | (dg + 32)));
+					out.push_back(static_cast<unsigned char>((dr - dg + 8) << 4 | (db - dg + 8)));
+				}
+				else {
+					out.insert(out.end(), {QoiRgb, px.r, px.g, px.b});
+				}
+			}
+			previous = px;
+		}
+	}
+	if(run) {
+		out.push_back(static_cast<unsigned char>(QoiRun | (run - 1U)));
+	}
+	out.insert(out.end(), QoiEnd.begin(), QoiEnd.end());
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write(reinterpret_cast<const char*>(out.data()), static_cast<std::streamsize>(out.size()));
+	return static_cast<bool>(file);
+}
+
+// Empty matrix if the file is not a valid QOI image, alpha => keep the alpha channel of RGBA images
+cv::Mat ReadQoi(const std::string& path, const bool alpha) {
+	std::ifstream file(path, std::ios::binary);
+	const std::vector<unsigned char> in{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+	if(in.size() < QoiHeaderBytes + QoiEnd.size() || !std::equal(in.begin(), in.begin() + 4, "qoif")) {
+		return cv::Mat();
+	}
+	unsigned int cols{0}, rows{0};
+	for(unsigned int b{0}; b < 4U; ++b) {
+		cols = cols << 8U | in[4U + b];
+		rows = rows << 8U | in[8U + b];
+	}
+	const unsigned int FileChannels{in[12]};
+	if(!cols || !rows || cols > 65535U || rows > 65535U || (FileChannels != 3U && FileChannels != 4U)) {
+		return cv::Mat();
+	}
+	const int channels{alpha && FileChannels == 4U ? 4 : 3};
+	cv::Mat image(static_cast<int>(rows), static_cast<int>(cols), CV_MAKETYPE(CV_8U, channels));
+
+	std::array<QoiPixel, 64> seen{};
+	QoiPixel px{0, 0, 0, 255};
+	std::size_t p{QoiHeaderBytes};
+	const std::size_t end{in.size() - QoiEnd.size()};
+	unsigned int run{0};
+	for(int r{0}; r < image.rows; ++r) {
+		unsigned char* data{image.ptr(r)};
+		for(int c{0}; c < image.cols; ++c, data += channels) {
+			if(run) {
+				--run;
+			}
+			else if(p < end) {
+				const unsigned char op{in[p++]};
+				if(op == QoiRgb || op == QoiRgba) {
+					if(p + (op == QoiRgb ? 3U : 4U) > end) {
+						return cv::Mat();
+					}
+					px = {in[p], in[p + 1U], in[p + 2U], op == QoiRgb ? px.a : in[p + 3U]};
+					p += op == QoiRgb ? 3U : 4U;
+				}
+				else if((op & 0xC0U) == QoiIndex) {
+					px = seen[op];
+				}
+				else if((op & 0xC0U) == QoiDiff) {
+					px.r = static_cast<unsigned char>(px.r + ((op >> 4U) & 3U) - 2U);
+					px.g = static_cast<unsigned char>(px.g + ((op >> 2U) & 3U) - 2U);
+					px.b = static_cast<unsigned char>(px.b + (op & 3U) - 2U);
+				}
+				else if((op & 0xC0U) == QoiLuma) {
+					if(p == end) {
+						return cv::Mat();
+					}
+					const unsigned int dg{(op & 0x3FU) - 32U}, next{in[p++]};
+					px.r = static_cast<unsigned char>(px.r + dg + (next >> 4U) - 8U);
+					px.g = static_cast<unsigned char>(px.g + dg);
+					px.b = static_cast<unsigned char>(px.b + dg + (next & 0x0FU) - 8U);
+				}
+				else {
+					run = op & 0x3FU;
+				}
+				seen[QoiHash(px)] = px;
+			}
+			else {
+				// Truncated stream
+				return cv::Mat();
+			}
+			data[0] = px.b;
+			data[1] = px.g;
+			data[2] = px.r;
+			if(channels == 4) {
+				data[3] = px.a;
+			}
+		}
+	}
+	return image;
+}
+
+// Rows of an uncompressed PAM or BMP file
+struct RawLayout {
+	// File offset of the first stored row, bytes per stored row (padding included)
+	std::streamoff offset{0}, pitch{0};
+	// Rows stored bottom up (BMP), RGB instead of BGR, 16 bit samples in big endian (PAM)
+	bool BottomUp{false}, swap{false}, BigEndian{false};
+};
+
+unsigned int GetLittleEndian(const unsigned char* const data, const unsigned int bytes) {
+	unsigned int value{0};
+	for(unsigned int b{bytes}; b > 0U; --b) {
+		value = value << 8U | data[b - 1U];
+	}
+	return value;
+}
+
+// Reads the header of an uncompressed PAM or BMP file, false if it does not store image as it is
+bool ReadRawLayout(std::istream& file, const ImageFormat format, const cv::Mat& image, RawLayout& layout) {
+	const unsigned int channels{static_cast<unsigned int>(image.channels())}, depth{static_cast<unsigned int>(image.elemSize1())};
+	if(format == FORMAT_BMP) {
+		std::array<unsigned char, 54> header{};
+		if(!file.read(reinterpret_cast<char*>(header.data()), header.size()) || header[0] != 'B' || header[1] != 'M') {
+			return false;
+		}
+		const int height{static_cast<int>(GetLittleEndian(header.data() + 22, 4U))};
+		if(GetLittleEndian(header.data() + 18, 4U) != static_cast<unsigned int>(image.cols) || std::abs(height) != image.rows
+		   || GetLittleEndian(header.data() + 28, 2U) != channels * 8U * depth || GetLittleEndian(header.data() + 30, 4U) != 0U) {
+			return false;
+		}
+		layout.offset = GetLittleEndian(header.data() + 10, 4U);
+		layout.pitch = (static_cast<std::streamoff>(image.cols) * channels * depth + 3) / 4 * 4;
+		layout.BottomUp = height > 0;
+		return true;
+	}
+	// PAM, "P7" then one "NAME value" line per field up to ENDHDR
+	std::string line;
+	if(!std::getline(file, line) || line != "P7") {
+		return false;
+	}
+	unsigned long width{0}, height{0}, planes{0}, maximum{0};
+	while(std::getline(file, line) && line != "ENDHDR") {
+		const std::size_t space{line.find(' ')};
+		const std::string name{line.substr(0, space)};
+		const unsigned long value{space == std::string::npos ? 0UL : std::strtoul(line.c_str() + space + 1U, nullptr, 10)};
+		if(name == "WIDTH") {
+			width = value;
+		}
+		else if(name == "HEIGHT") {
+			height = value;
+		}
+		else if(name == "DEPTH") {
+			planes = value;
+		}
+		else if(name == "MAXVAL") {
+			maximum = value;
+		}
+	}
+	if(!file || width != static_cast<unsigned long>(image.cols) || height != static_cast<unsigned long>(image.rows) || planes != channels
+	   || maximum != (depth == 1U ? 255UL : 65535UL)) {
+		return false;
+	}
+	layout.offset = file.tellg();
+	layout.pitch = static_cast<std::streamoff>(image.cols) * channels * depth;
+	layout.BigEndian = depth == 2U;
+	return true;
+}
+
+// Bytes of row r of an image as the file stores them
+void RawRow(const cv::Mat& image, const int r, const RawLayout& layout, std::vector<unsigned char>& out) {
+	const std::size_t channels{static_cast<std::size_t>(image.channels())}, depth{image.elemSize1()};
+	out.assign(static_cast<std::size_t>(layout.pitch), 0U);
+	const unsigned char* const row{image.ptr(r)};
+	for(std::size_t p{0}; p < static_cast<std::size_t>(image.cols); ++p) {
+		for(std::size_t ch{0}; ch < channels; ++ch) {
+			// Blue and red trade places in RGB files, alpha stays last
+			const std::size_t from{layout.swap && ch < 3U && channels >= 3U ? 2U - ch : ch};
+			for(std::size_t b{0}; b < depth; ++b) {
+				out[(p * channels + ch) * depth + b] = row[(p * channels + from) * depth + (layout.BigEndian ? depth - 1U - b : b)];
+			}
+		}
+	}
+}
+
+/* Tiled TIFF
+** Little endian baseline TIFF holding one image in uncompressed edge x edge tiles, channels interleaved in RGB(A) order, 8 bit,
+** 16 bit or floating point samples. Tiles crossing the right and bottom edges are padded with zeros. Images encoded in tile order
+** are saved in the tiles of their layout, a tile of the file then holds the pixels of a tile of the payload, and every row of
+** tiles is written or read by a pool task of its own.
+*/
+constexpr unsigned int TiffShort{3U}, TiffLong{4U};
+// Classic TIFF offsets are 32 bit
+constexpr unsigned long long TiffMaxBytes{0xFFFFFFFFULL};
+// Largest tile edge read, above the 64 and 256 written, so that every pool task reading a row of tiles stays small
+constexpr unsigned int TiffMaxEdge{1024U};
+
+void PutLittleEndian(std::vector<unsigned char>& out, const unsigned int value, const unsigned int bytes) {
+	for(unsigned int b{0}; b < bytes; ++b) {
+		out.push_back(static_cast<unsigned char>(value >> (8U * b)));
+	}
+}
+
+// Copies the pixels of the tile at (x, y) between an image and a tile of edge x edge pixels as the file stores it
+template <bool load>
+void CopyTile(const cv::Mat& image, unsigned char* const tile, const unsigned int x, const unsigned int y, const unsigned int edge) {
+	const std::size_t channels{static_cast<std::size_t>(image.channels())}, depth{image.elemSize1()}, PixelBytes{image.elemSize()};
+	const unsigned int w{std::min(edge, static_cast<unsigned int>(image.cols) - x)};
+	const unsigned int h{std::min(edge, static_cast<unsigned int>(image.rows) - y)};
+	for(unsigned int r{0}; r < h; ++r) {
+		unsigned char* const row{image.data + (y + r) * image.step[0] + x * PixelBytes};
+		unsigned char* const stored{tile + static_cast<std::size_t>(r) * edge * PixelBytes};
+		for(std::size_t p{0}; p < w; ++p) {
+			for(std::size_t ch{0}; ch < channels; ++ch) {
+				// Blue and red trade places, alpha stays last
+				unsigned char* const pixel{row + p * PixelBytes + (ch < 3U ? 2U - ch : ch) * depth};
+				unsigned char* const sample{stored + p * PixelBytes + ch * depth};
+				if constexpr(load) {
+					std::memcpy(pixel, sample, depth);
+				}
+				else {
+					std::memcpy(sample, pixel, depth);
+				}
+			}
+		}
+	}
+}
+
+bool WriteTiffStrips(const std::string& path, const cv::Mat& image) {
+	// 1 => COMPRESSION_NONE
+	return cv::imwrite(path, image, std::vector<int>{cv::IMWRITE_TIFF_COMPRESSION, 1});
+}
+
+// BGR and BGRA images, others and images past the 4 GiB of classic TIFF are written in strips
+bool WriteTiledTiff(const std::string& path, const cv::Mat& image, const unsigned int edge) {
+	const unsigned int channels{static_cast<unsigned int>(image.channels())}, depth{static_cast<unsigned int>(image.elemSize1())};
+	const unsigned int TilesX{(static_cast<unsigned int>(image.cols) + edge - 1U) / edge};
+	const unsigned int TilesY{(static_cast<unsigned int>(image.rows) + edge - 1U) / edge}, tiles{TilesX * TilesY};
+	const std::size_t TileBytes{static_cast<std::size_t>(edge) * edge * image.elemSize()};
+	const unsigned int entries{channels == 4U ? 13U : 12U};
+	// Header, IFD, bits per sample and sample formats, tile offsets and byte counts, then the tiles
+	const unsigned int samples{8U + 2U + entries * 12U + 4U}, formats{samples + channels * 2U}, offsets{formats + channels * 2U};
+	const unsigned int counts{offsets + tiles * 4U}, data{counts + tiles * 4U};
+	if((channels != 3U && channels != 4U) || data + static_cast<unsigned long long>(tiles) * TileBytes > TiffMaxBytes) {
+		return WriteTiffStrips(path, image);
+	}
+	std::vector<unsigned char> out{'I', 'I', 42, 0};
+	PutLittleEndian(out, 8U, 4U);
+	PutLittleEndian(out, entries, 2U);
+	const auto entry = [&out](const unsigned int tag, const unsigned int type, const unsigned int count, const unsigned int value) {
+		PutLittleEndian(out, tag, 2U);
+		PutLittleEndian(out, type, 2U);
+		PutLittleEndian(out, count, 4U);
+		PutLittleEndian(out, value, 4U);
+	};
+	entry(256U, TiffLong, 1U, static_cast<unsigned int>(image.cols));
+	entry(257U, TiffLong, 1U, static_cast<unsigned int>(image.rows));
+	entry(258U, TiffShort, channels, samples);
+	// No compression, RGB, interleaved channels
+	entry(259U, TiffShort, 1U, 1U);
+	entry(262U, TiffShort, 1U, 2U);
+	entry(277U, TiffShort, 1U, channels);
+	entry(284U, TiffShort, 1U, 1U);
+	entry(322U, TiffLong, 1U, edge);
+	entry(323U, TiffLong, 1U, edge);
+	// A single value is held by the entry itself
+	entry(324U, TiffLong, tiles, tiles == 1U ? data : offsets);
+	entry(325U, TiffLong, tiles, tiles == 1U ? static_cast<unsigned int>(TileBytes) : counts);
+	if(channels == 4U) {
+		// Unassociated alpha
+		entry(338U, TiffShort, 1U, 2U);
+	}
+	entry(339U, TiffShort, channels, formats);
+	PutLittleEndian(out, 0U, 4U);
+	for(unsigned int ch{0}; ch < channels; ++ch) {
+		PutLittleEndian(out, depth * 8U, 2U);
+	}
+	for(unsigned int ch{0}; ch < channels; ++ch) {
+		// 1 => unsigned integer, 3 => IEEE floating point
+		PutLittleEndian(out, image.depth() == CV_32F ? 3U : 1U, 2U);
+	}
+	for(unsigned int t{0}; t < tiles; ++t) {
+		PutLittleEndian(out, static_cast<unsigned int>(data + t * TileBytes), 4U);
+	}
+	for(unsigned int t{0}; t < tiles; ++t) {
+		PutLittleEndian(out, static_cast<unsigned int>(TileBytes), 4U);
+	}
+	out.resize(data);
+	{
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		if(!file.write(reinterpret_cast<const char*>(out.data()), static_cast<std::streamsize>(out.size()))) {
+			return false;
+		}
+	}
+	std::error_code ec;
+	std::filesystem::resize_file(path, data + tiles * TileBytes, ec);
+	if(ec) {
+		return false;
+	}
+	std::vector<char> written(TilesY, 0);
+	const JobPlan plan{PlanCopy(image.total() * image.elemSize())};
+	WorkerPool::Instance().Run(
+		TilesY,
+		[&](const unsigned int ty) {
+			std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+			std::vector<unsigned char> tile(TileBytes);
+			file.seekp(static_cast<std::streamoff>(data + static_cast<std::size_t>(ty) * TilesX * TileBytes));
+			for(unsigned int tx{0}; tx < TilesX; ++tx) {
+				if((tx + 1U) * edge > static_cast<unsigned int>(image.cols) || (ty + 1U) * edge > static_cast<unsigned int>(image.rows)) {
+					std::fill(tile.begin(), tile.end(), 0U);
+				}
+				CopyTile<false>(image, tile.data(), tx * edge, ty * edge, edge);
+				file.write(reinterpret_cast<const char*>(tile.data()), static_cast<std::streamsize>(TileBytes));
+			}
+			written[ty] = static_cast<bool>(file.flush());
+		},
+		plan.workers);
+	return std::all_of(written.begin(), written.end(), [](const char done) { return done; });
+}
+
+// SHORT or LONG values of an IFD entry, held by the entry itself or at the offset it records
+bool ReadTiffValues(std::istream& file, const unsigned char* const entry, std::vector<unsigned int>& values) {
+	const unsigned int type{GetLittleEndian(entry + 2, 2U)}, count{GetLittleEndian(entry + 4, 4U)};
+	const unsigned int size{type == TiffShort ? 2U : type == TiffLong ? 4U : 0U};
+	// Up to a tile per pixel of the largest image
+	if(!size || !count || count > 65535U * 65535U / 256U) {
+		return false;
+	}
+	std::vector<unsigned char> bytes(static_cast<std::size_t>(count) * size);
+	if(bytes.size() <= 4U) {
+		std::copy(entry + 8, entry + 8 + bytes.size(), bytes.begin());
+	}
+	else if(!file.seekg(GetLittleEndian(entry + 8, 4U)) || !file.read(reinterpret_cast<char*>(bytes.data()), bytes.size())) {
+		return false;
+	}
+	values.resize(count);
+	for(unsigned int v{0}; v < count; ++v) {
+		values[v] = GetLittleEndian(bytes.data() + v * size, size);
+	}
+	return true;
+}
+
+// Empty matrix unless the file is a tiled TIFF laid out as WriteTiledTiff() writes it, any other TIFF is left to cv::imread()
+cv::Mat ReadTiledTiff(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	std::array<unsigned char, 8> header{};
+	if(!file.read(reinterpret_cast<char*>(header.data()), header.size()) || header[0] != 'I' || header[1] != 'I'
+	   || GetLittleEndian(header.data() + 2, 2U) != 42U) {
+		return cv::Mat();
+	}
+	std::array<unsigned char, 2> count{};
+	file.seekg(GetLittleEndian(header.data() + 4, 4U));
+	if(!file.read(reinterpret_cast<char*>(count.data()), count.size())) {
+		return cv::Mat();
+	}
+	std::vector<unsigned char> entries(GetLittleEndian(count.data(), 2U) * 12U);
+	if(!file.read(reinterpret_cast<char*>(entries.data()), static_cast<std::streamsize>(entries.size()))) {
+		return cv::Mat();
+	}
+	std::map<unsigned int, std::vector<unsigned int>> fields;
+	for(std::size_t e{0}; e < entries.size(); e += 12U) {
+		std::vector<unsigned int> values;
+		if(ReadTiffValues(file, entries.data() + e, values)) {
+			fields[GetLittleEndian(entries.data() + e, 2U)] = std::move(values);
+		}
+	}
+	// First value of a field, every value has to be the same
+	const auto field = [&fields](const unsigned int tag, const unsigned int fallback) {
+		const auto found = fields.find(tag);
+		if(found == fields.end()) {
+			return fallback;
+		}
+		const std::vector<unsigned int>& values{found->second};
+		return std::all_of(values.begin(), values.end(), [&values](const unsigned int value) { return value == values[0]; }) ? values[0]
+																												 : 0U;
+	};
+	const unsigned int cols{field(256U, 0U)}, rows{field(257U, 0U)}, channels{field(277U, 1U)}, bits{field(258U, 1U)};
+	const unsigned int edge{field(322U, 0U)}, format{field(339U, 1U)};
+	const int depth{bits == 8U && format == 1U ? CV_8U : bits == 16U && format == 1U ? CV_16U : bits == 32U && format == 3U ? CV_32F : -1};
+	if(!cols || !rows || cols > 65535U || rows > 65535U || (channels != 3U && channels != 4U) || depth < 0 || !edge || edge % 16U
+	   || edge > TiffMaxEdge || field(323U, 0U) != edge || field(259U, 1U) != 1U || field(262U, 0U) != 2U || field(284U, 1U) != 1U
+	   || (channels == 4U && field(338U, 0U) != 2U)) {
+		return cv::Mat();
+	}
+	cv::Mat image(static_cast<int>(rows), static_cast<int>(cols), CV_MAKETYPE(depth, static_cast<int>(channels)));
+	const unsigned int TilesX{(cols + edge - 1U) / edge}, TilesY{(rows + edge - 1U) / edge};
+	const std::size_t TileBytes{static_cast<std::size_t>(edge) * edge * image.elemSize()};
+	const std::vector<unsigned int>& offsets{fields[324U]};
+	if(offsets.size() != static_cast<std::size_t>(TilesX) * TilesY || field(325U, 0U) != TileBytes) {
+		return cv::Mat();
+	}
+	std::vector<char> loaded(TilesY, 0);
+	const JobPlan plan{PlanCopy(image.total() * image.elemSize())};
+	WorkerPool::Instance().Run(
+		TilesY,
+		[&](const unsigned int ty) {
+			std::ifstream tiles(path, std::ios::binary);
+			std::vector<unsigned char> tile(TileBytes);
+			for(unsigned int tx{0}; tx < TilesX; ++tx) {
+				tiles.seekg(offsets[ty * TilesX + tx]);
+				if(!tiles.read(reinterpret_cast<char*>(tile.data()), static_cast<std::streamsize>(TileBytes))) {
+					return;
+				}
+				CopyTile<true>(image, tile.data(), tx * edge, ty * edge, edge);
+			}
+			loaded[ty] = 1;
+		},
+		plan.workers);
+	return std::all_of(loaded.begin(), loaded.end(), [](const char done) { return done; }) ? image : cv::Mat();
+}
+
+// Lowercase extension, dot included
+std::string Extension(const std::string& path) {
+	std::string ext{std::filesystem::path(path).extension().string()};
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](const unsigned char c) { return static_cast<char>(std::tolower(c)); });
+	return ext;
+}
+
+// Extensions listed when a base cannot be saved in the requested format
+constexpr std::array<std::pair<ImageFormat, const char*>, 5> Formats{
+	{{FORMAT_PNG, " .png"}, {FORMAT_TIFF, " .tif"}, {FORMAT_QOI, " .qoi"}, {FORMAT_PAM, " .pam"}, {FORMAT_BMP, " .bmp"}}};
+
+// Whether a format stores images of the given depth and channel count without altering any bit
+bool KeepsBits(const ImageFormat format, const int depth, const int channels) {
+	switch(format) {
+	case FORMAT_TIFF:
+		return true;
+	case FORMAT_PNG:
+	case FORMAT_PAM:
+		return depth == CV_8U || depth == CV_16U;
+	case FORMAT_QOI:
+		return depth == CV_8U;
+	case FORMAT_BMP:
+		return depth == CV_8U && channels != 4;
+	default:
+		return false;
+	}
+}
+}
+
+ImageFormat OutputFormat(const std::string& path) {
+	const std::string ext{Extension(path)};
+	if(ext == ".png") {
+		return FORMAT_PNG;
+	}
+	if(ext == ".tif" || ext == ".tiff") {
+		return FORMAT_TIFF;
+	}
+	if(ext == ".qoi") {
+		return FORMAT_QOI;
+	}
+	if(ext == ".pam") {
+		return FORMAT_PAM;
+	}
+	if(ext == ".bmp") {
+		return FORMAT_BMP;
+	}
+	if(ext == ".jpg" || ext == ".jpeg") {
+		return FORMAT_JPEG;
+	}
+	return FORMAT_NONE;
+}
+
+bool JpegFile(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	std::array<unsigned char, 3> signature{};
+	file.read(reinterpret_cast<char*>(signature.data()), signature.size());
+	return file && signature == std::array<unsigned char, 3>{0xFF, 0xD8, 0xFF};
+}
+
+bool WriteImage(const std::string& path, const cv::Mat& image, const unsigned int edge) {
+	try {
+		switch(OutputFormat(path)) {
+		case FORMAT_PNG:
+			return cv::imwrite(path, image,
+							   std::vector<int>{cv::IMWRITE_PNG_COMPRESSION, pnglevel, cv::IMWRITE_PNG_STRATEGY, pngstrategy});
+		case FORMAT_TIFF:
+			return edge ? WriteTiledTiff(path, image, edge) : WriteTiffStrips(path, image);
+		case FORMAT_QOI:
+			return WriteQoi(path, image);
+		case FORMAT_JPEG:
+			// Pixels would go through a lossy DCT, JPEG outputs are written from coefficients by EncodeJpeg()
+			return false;
+		default:
+			// PAM and BMP are always written uncompressed
+			return cv::imwrite(path, image);
+		}
+	}
+	catch(cv::Exception&) {
+		return false;
+	}
+}
+
+bool PatchImage(const std::string& path, const cv::Mat& image, const std::vector<std::pair<int, int>>& bands) {
+	const ImageFormat format{OutputFormat(path)};
+	if(format != FORMAT_PAM && format != FORMAT_BMP) {
+		return false;
+	}
+	std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+	RawLayout layout;
+	if(!file || !ReadRawLayout(file, format, image, layout)) {
+		return false;
+	}
+	const auto position = [&layout, &image](const int r) {
+		return layout.offset + layout.pitch * (layout.BottomUp ? image.rows - 1 - r : r);
+	};
+	// A row outside the bands must match the file as it is, in one of the channel orders the format allows
+	std::vector<std::pair<int, int>> sorted{bands};
+	std::sort(sorted.begin(), sorted.end());
+	int reference{0};
+	for(const auto& [first, last] : sorted) {
+		if(reference >= first && reference < last) {
+			reference = last;
+		}
+	}
+	if(reference >= image.rows) {
+		return false;
+	}
+	std::vector<unsigned char> stored(static_cast<std::size_t>(layout.pitch)), expected;
+	file.seekg(position(reference));
+	if(!file.read(reinterpret_cast<char*>(stored.data()), layout.pitch)) {
+		return false;
+	}
+	bool matched{false};
+	for(const bool swap : {format == FORMAT_PAM, false}) {
+		layout.swap = swap;
+		RawRow(image, reference, layout, expected);
+		if(expected == stored) {
+			matched = true;
+			break;
+		}
+	}
+	if(!matched) {
+		return false;
+	}
+	for(const auto& [first, last] : bands) {
+		for(int r{first}; r < last; ++r) {
+			RawRow(image, r, layout, expected);
+			file.seekp(position(r));
+			file.write(reinterpret_cast<const char*>(expected.data()), layout.pitch);
+		}
+	}
+	return static_cast<bool>(file.flush());
+}
+
+bool SaveImage(const std::string& output, const cv::Mat& image, const std::string& fallback, const unsigned int edge) {
+	if(WriteImage(output, image, edge)) {
+		Stegano::Logger::Log("Image saved at - ", output, '\n');
+		return true;
+	}
+	const std::string local{fallback + Extension(output)};
+	Stegano::Logger::Error("Error!", " Cannot save the output file with the given name!", '\n');
+	Stegano::Logger::Log("If this is a privileged directory, please run this application in elevated mode.", '\n', "Saving as ", local,
+						 " in the working directory", '\n');
+	if(WriteImage(local, image, edge)) {
+		Stegano::Logger::Log("Image saved at - .\\", local, '\n');
+		return true;
+	}
+	Stegano::Logger::Error("Error!", " Cannot save as ", local, " as well, skipping save step.", '\n');
+	return false;
+}
+
+cv::Mat ReadImage(const std::string& path, const int flags) {
+	if(OutputFormat(path) == FORMAT_QOI) {
+		return ReadQoi(path, flags == cv::IMREAD_UNCHANGED);
+	}
+	if(OutputFormat(path) == FORMAT_TIFF && flags == cv::IMREAD_UNCHANGED) {
+		cv::Mat image{ReadTiledTiff(path)};
+		if(image.data) {
+			return image;
+		}
+	}
+	return cv::imread(path, flags);
+}
+
+cv::Mat ReadCarrier(const std::string& path) {
+	// IMREAD_COLOR would drop the alpha channel
+	cv::Mat image{ReadImage(path, cv::IMREAD_UNCHANGED)};
+	if(!image.data) {
+		return image;
+	}
+	if(image.channels() == 1) {
+		cv::cvtColor(image, image, cv::COLOR_GRAY2BGR);
+	}
+	if(image.depth() != CV_8U && image.depth() != CV_16U && image.depth() != CV_32F) {
+		Stegano::Logger::Verbose("Unsupported channel type, converting ", path, " to 8 bit", '\n');
+		image.convertTo(image, CV_8U);
+	}
+	return image;
+}
+
+bool CheckCarrierDepth(const cv::Mat& BaseImage, const std::string& output) {
+	const int depth{BaseImage.depth()}, channels{BaseImage.channels()};
+	if(!KeepsBits(OutputFormat(output), depth, channels)) {
+		const std::string kind{std::string(depth == CV_32F ? "Floating point" : depth == CV_16U ? "16 bit" : "8 bit")
+							   + (channels == 4 ? " BGRA" : "")};
+		std::string formats;
+		for(const auto& [format, name] : Formats) {
+			if(KeepsBits(format, depth, channels)) {
+				formats += name;
+			}
+		}
+		Stegano::Logger::Error("Error!", " ", kind, " bases cannot be saved as ", output, " without losing the embedded bits", '\n');
+		Stegano::Logger::Log("Save the encoded image as one of -", formats, '\n');
+		return false;
+	}
+	if(depth == CV_32F && !cv::checkRange(BaseImage)) {
+		// The low bits of the mantissa of an infinity make it a NaN
+		Stegano::Logger::Error("Error!", " The floating point base image holds NaN or infinite values, which cannot carry data", '\n');
+		return false;
+	}
+	if(channels == 4) {
+		Stegano::Logger::Verbose("Base image has an alpha channel, embedding in 4 channels per pixel", '\n');
+	}
+	if(depth != CV_8U) {
+		Stegano::Logger::Verbose("Base image has ", depth == CV_32F ? "floating point" : "16 bit",
+								 " channels, embedding up to 8 bits per channel", '\n');
+	}
+	return true;
+}
+
+}
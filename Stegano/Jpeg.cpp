@@ -0,0 +1,495 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include "SteganoKernels.h"
+#include "SteganoPayload.h"
+
+#if STEGANO_WITH_LIBJPEG
+	#include <algorithm>
+	#include <csetjmp>
+	#include <cstdio>
+	#include <cstdlib>
+	#include <cstring>
+	#include <limits>
+	#include <jpeglib.h>
+#endif
+
+namespace Stegano {
+
+#if STEGANO_WITH_LIBJPEG
+namespace {
+// Bytes ahead of the stream in the coefficients: stream length, CRC32C of the stream (both big endian) and flags
+constexpr unsigned int JpegHeaderBytes{9U};
+constexpr unsigned char JpegEncrypted{0x01};
+
+// Error manager returning to the failed libjpeg call instead of exiting
+struct JpegError {
+	jpeg_error_mgr manager;
+	std::jmp_buf jump;
+};
+
+[[noreturn]] void JpegExit(j_common_ptr info) {
+	char message[JMSG_LENGTH_MAX];
+	(*info->err->format_message)(info, message);
+	Stegano::Logger::Error("Error!", " ", message, '\n');
+	std::longjmp(reinterpret_cast<JpegError*>(info->err)->jump, 1);
+}
+
+// Warnings (corrupt data recovered by libjpeg) are only logged in verbose mode
+void JpegMessage(j_common_ptr info) {
+	char message[JMSG_LENGTH_MAX];
+	(*info->err->format_message)(info, message);
+	Stegano::Logger::Verbose("libjpeg - ", message, '\n');
+}
+
+// Row of blocks of one component
+struct BlockRow {
+	JBLOCKROW blocks;
+	JDIMENSION count;
+};
+
+// Quantised DCT coefficients of a JPEG file, read and written with the coefficient API of libjpeg, never taken to pixels
+class JpegCoefficients {
+public:
+	JpegCoefficients() {
+		info.err = jpeg_std_error(&error.manager);
+		error.manager.error_exit = JpegExit;
+		error.manager.output_message = JpegMessage;
+	}
+	~JpegCoefficients() {
+		jpeg_destroy_decompress(&info);
+	}
+	JpegCoefficients(const JpegCoefficients&) = delete;
+	JpegCoefficients& operator=(const JpegCoefficients&) = delete;
+
+	/**
+	 * @brief Reads the coefficients of a JPEG file and the block rows of every MCU row, see rows
+	 * @param path -> JPEG file
+	 * @param writable -> The coefficients are modified and written back
+	 * @return true => Success
+	 */
+	bool Read(const std::string& path, const bool writable) {
+		std::FILE* const file{std::fopen(path.c_str(), "rb")};
+		if(!file) {
+			return false;
+		}
+		const bool read{ReadFile(file)};
+		std::fclose(file);
+		return read && ReadRows(writable);
+	}
+
+	/**
+	 * @brief Writes the coefficients as a JPEG file with the quantisation tables, sampling and markers of the file read, Huffman
+	 * tables fitted to the coefficients. Progressive files are written with the standard libjpeg scan script, not their own.
+	 * @param path -> Output path
+	 * @return true => Success
+	 */
+	bool Write(const std::string& path) {
+		std::FILE* const file{std::fopen(path.c_str(), "wb")};
+		if(!file) {
+			return false;
+		}
+		jpeg_compress_struct target{};
+		JpegError TargetError{};
+		const bool written{WriteFile(file, target, TargetError)};
+		jpeg_destroy_compress(&target);
+		return std::fclose(file) == 0 && written;
+	}
+
+	const jpeg_decompress_struct& Info() const {
+		return info;
+	}
+	std::size_t MCURows() const {
+		return first.size() - 1U;
+	}
+	// Block rows [Rows(r), Rows(r + 1)) make MCU row r, the rows of its components one after the other
+	const BlockRow* Rows(const std::size_t r) const {
+		return rows.data() + first[r];
+	}
+	unsigned long long Blocks() const {
+		unsigned long long blocks{0};
+		for(const BlockRow& row : rows) {
+			blocks += row.count;
+		}
+		return blocks;
+	}
+
+private:
+	// Only C state lives in the functions calling setjmp, a failed call unwinds nothing
+	bool ReadFile(std::FILE* const file) {
+		if(setjmp(error.jump)) {
+			return false;
+		}
+		jpeg_create_decompress(&info);
+		// Row pointers are taken once and used by every task, the arrays must never be swapped out to a backing store
+		info.mem->max_memory_to_use = std::numeric_limits<long>::max();
+		jpeg_stdio_src(&info, file);
+		jpeg_save_markers(&info, JPEG_COM, 0xFFFF);
+		for(int marker{0}; marker < 16; ++marker) {
+			jpeg_save_markers(&info, JPEG_APP0 + marker, 0xFFFF);
+		}
+		jpeg_read_header(&info, TRUE);
+		coefficients = jpeg_read_coefficients(&info);
+		return true;
+	}
+
+	bool ReadRows(const bool writable) {
+		std::size_t count{0};
+		for(int c{0}; c < info.num_components; ++c) {
+			count += info.comp_info[c].height_in_blocks;
+		}
+		rows.assign(count, BlockRow{nullptr, 0U});
+		first.assign(info.total_iMCU_rows + 1U, 0U);
+		if(setjmp(error.jump)) {
+			return false;
+		}
+		std::size_t k{0};
+		for(JDIMENSION r{0}; r < info.total_iMCU_rows; ++r) {
+			first[r] = k;
+			for(int c{0}; c < info.num_components; ++c) {
+				const jpeg_component_info& component{info.comp_info[c]};
+				for(int v{0}; v < component.v_samp_factor; ++v) {
+					const JDIMENSION row{r * static_cast<JDIMENSION>(component.v_samp_factor) + static_cast<JDIMENSION>(v)};
+					if(row < component.height_in_blocks) {
+						rows[k++] = {(*info.mem->access_virt_barray)(reinterpret_cast<j_common_ptr>(&info), coefficients[c], row, 1U,
+																	 writable ? TRUE : FALSE)[0],
+									 component.width_in_blocks};
+					}
+				}
+			}
+		}
+		first[info.total_iMCU_rows] = k;
+		return true;
+	}
+
+	bool WriteFile(std::FILE* const file, jpeg_compress_struct& target, JpegError& TargetError) {
+		target.err = jpeg_std_error(&TargetError.manager);
+		TargetError.manager.error_exit = JpegExit;
+		TargetError.manager.output_message = JpegMessage;
+		if(setjmp(TargetError.jump)) {
+			return false;
+		}
+		jpeg_create_compress(&target);
+		jpeg_stdio_dest(&target, file);
+		jpeg_copy_critical_parameters(&info, &target);
+		target.optimize_coding = TRUE;
+		// Progressive files stay progressive, they are usually the smaller ones. The scan script of the file read is not kept.
+		if(info.progressive_mode) {
+			jpeg_simple_progression(&target);
+		}
+		jpeg_write_coefficients(&target, coefficients);
+		for(jpeg_saved_marker_ptr marker{info.marker_list}; marker; marker = marker->next) {
+			// The JFIF and Adobe markers are written by libjpeg itself
+			const bool jfif{marker->marker == JPEG_APP0 && marker->data_length >= 5U && !std::memcmp(marker->data, "JFIF", 5U)};
+			const bool adobe{marker->marker == JPEG_APP0 + 14 && marker->data_length >= 5U && !std::memcmp(marker->data, "Adobe", 5U)};
+			if(!(jfif && target.write_JFIF_header) && !(adobe && target.write_Adobe_marker)) {
+				jpeg_write_marker(&target, marker->marker, marker->data, marker->data_length);
+			}
+		}
+		jpeg_finish_compress(&target);
+		return true;
+	}
+
+	jpeg_decompress_struct info{};
+	JpegError error{};
+	jvirt_barray_ptr* coefficients{nullptr};
+	std::vector<BlockRow> rows;
+	// First block row of every MCU row, followed by the number of block rows
+	std::vector<std::size_t> first;
+};
+
+/* A coefficient carries a bit if it is an AC coefficient of magnitude 2 or more, the bit is the LSB of its magnitude. Changing it
+** keeps the magnitude at 2 or more, so the decoder finds the same coefficients. Zeros and +-1, most of the AC coefficients of a
+** JPEG and the ones whose change would show, are never touched.
+*/
+inline bool Usable(const JCOEF coefficient) {
+	return coefficient >= 2 || coefficient <= -2;
+}
+
+// Number of usable coefficients of the block rows [row, last)
+unsigned long long CountRows(const BlockRow* row, const BlockRow* const last) {
+	unsigned long long count{0};
+	for(; row != last; ++row) {
+		for(JDIMENSION b{0}; b < row->count; ++b) {
+			for(unsigned int k{1}; k < DCTSIZE2; ++k) {
+				count += Usable(row->blocks[b][k]);
+			}
+		}
+	}
+	return count;
+}
+
+/**
+ * @brief Embeds payload bits in the usable coefficients of an MCU row
+ * @param row, last -> Block rows of the MCU row
+ * @param data -> Payload bytes, most significant bit first
+ * @param bit -> Payload bit carried by the first usable coefficient of the MCU row
+ * @param bits -> Number of payload bits
+ */
+void EmbedRows(const BlockRow* row, const BlockRow* const last, const unsigned char* const data, unsigned long long bit,
+			   const unsigned long long bits) {
+	for(; row != last; ++row) {
+		for(JDIMENSION b{0}; b < row->count; ++b) {
+			for(unsigned int k{1}; k < DCTSIZE2; ++k) {
+				JCOEF& coefficient{row->blocks[b][k]};
+				if(!Usable(coefficient)) {
+					continue;
+				}
+				if(bit >= bits) {
+					return;
+				}
+				const int value{(data[bit / 8U] >> (7U - bit % 8U)) & 1};
+				const int magnitude{(std::abs(static_cast<int>(coefficient)) & ~1) | value};
+				coefficient = static_cast<JCOEF>(coefficient < 0 ? -magnitude : magnitude);
+				++bit;
+			}
+		}
+	}
+}
+
+/**
+ * @brief Extracts payload bits from the usable coefficients of an MCU row. Bytes completed inside the MCU row are written
+ * directly, bits of the bytes shared with the neighbouring MCU rows are returned as fragments (see ExtractRange())
+ * @param data -> Payload bytes
+ * @param bit -> Payload bit carried by the first usable coefficient of the MCU row
+ * @param bits -> Number of payload bits
+ * @param head -> Bits of the first byte if it was started by the previous MCU row
+ * @param tail -> Bits of the last byte if it is completed by the next MCU row
+ */
+void ExtractRows(const BlockRow* row, const BlockRow* const last, unsigned char* const data, unsigned long long bit,
+				 const unsigned long long bits, KernelFragment& head, KernelFragment& tail) {
+	const unsigned int skipped{static_cast<unsigned int>(bit % 8U)};
+	unsigned int assembled{0U}, assembling{skipped};
+	bool shared{skipped != 0U};
+	head = {static_cast<unsigned int>(bit / 8U), 0U, 0U};
+	tail = head;
+	for(; row != last && bit < bits; ++row) {
+		for(JDIMENSION b{0}; b < row->count && bit < bits; ++b) {
+			for(unsigned int k{1}; k < DCTSIZE2 && bit < bits; ++k) {
+				const JCOEF coefficient{row->blocks[b][k]};
+				if(!Usable(coefficient)) {
+					continue;
+				}
+				assembled = assembled * 2U + (static_cast<unsigned int>(std::abs(static_cast<int>(coefficient))) & 1U);
+				++bit;
+				if(++assembling == 8U) {
+					const unsigned int index{static_cast<unsigned int>((bit - 1U) / 8U)};
+					if(shared) {
+						head = {index, assembled, 8U - skipped};
+						shared = false;
+					}
+					else {
+						data[index] = static_cast<unsigned char>(assembled);
+					}
+					assembled = 0U;
+					assembling = 0U;
+				}
+			}
+		}
+	}
+	if(shared) {
+		head = {static_cast<unsigned int>(bit / 8U), assembled, assembling - skipped};
+	}
+	else {
+		tail = {static_cast<unsigned int>(bit / 8U), assembled, assembling};
+	}
+}
+
+/**
+ * @brief Counts the usable coefficients of every MCU row, one pool task per MCU row
+ * @return Payload bit carried by the first usable coefficient of every MCU row, followed by the capacity in bits
+ */
+std::vector<unsigned long long> RowStarts(const JpegCoefficients& coefficients, const unsigned int workers) {
+	const std::size_t MCURows{coefficients.MCURows()};
+	std::vector<unsigned long long> starts(MCURows + 1U, 0ULL);
+	WorkerPool::Instance().Run(
+		static_cast<unsigned int>(MCURows),
+		[&](const unsigned int r) { starts[r + 1U] = CountRows(coefficients.Rows(r), coefficients.Rows(r + 1U)); }, workers);
+	for(std::size_t r{0}; r < MCURows; ++r) {
+		starts[r + 1U] += starts[r];
+	}
+	return starts;
+}
+
+// Bytes of coefficients, sizes the jobs (see PlanCopy())
+std::size_t CoefficientBytes(const JpegCoefficients& coefficients) {
+	return static_cast<std::size_t>(coefficients.Blocks()) * sizeof(JBLOCK);
+}
+
+/**
+ * @brief Extracts the bytes [0, length) embedded in the coefficients, the MCU rows carrying them spread over the worker pool
+ * @param starts -> See RowStarts()
+ */
+std::vector<unsigned char> ExtractCoefficients(const JpegCoefficients& coefficients, const std::vector<unsigned long long>& starts,
+											   const unsigned int length, const unsigned int workers) {
+	std::vector<unsigned char> data(length, 0U);
+	const unsigned long long bits{length * 8ULL};
+	const unsigned int MCURows{static_cast<unsigned int>(std::lower_bound(starts.begin(), starts.end() - 1, bits) - starts.begin())};
+	std::vector<KernelFragment> fragments(MCURows * 2U, KernelFragment{0U, 0U, 0U});
+	WorkerPool::Instance().Run(
+		MCURows,
+		[&](const unsigned int r) {
+			ExtractRows(coefficients.Rows(r), coefficients.Rows(r + 1U), data.data(), starts[r], bits, fragments[r * 2U],
+						fragments[r * 2U + 1U]);
+		},
+		workers);
+	MergeFragments(data.data(), length, fragments);
+	return data;
+}
+}
+
+bool EncodeJpeg(const std::string& base, const std::string& source, const std::string& output) {
+	Stegano::Logger::Verbose("Compress payload = ", compress ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Payload encryption = ", encrypt ? "true" : "false", '\n');
+	if(!JpegFile(base)) {
+		Stegano::Logger::Error("Error!", " JPEG outputs hold the payload in the DCT coefficients of a JPEG base, ", base, " is not one",
+							   '\n');
+		return false;
+	}
+
+	JpegCoefficients coefficients;
+	bool loaded{false};
+	std::thread loadbase([&base, &coefficients, &loaded] {
+		Stegano::Logger::Verbose("Reading DCT coefficients of the base", '\n');
+		loaded = coefficients.Read(base, true);
+	});
+	std::vector<unsigned char> stream;
+	const bool built{BuildStream(source, stream)};
+	loadbase.join();
+	if(!built) {
+		return false;
+	}
+	if(!loaded) {
+		Stegano::Logger::Error("Error!", " Cannot read the DCT coefficients of the base image.", " Please check if the path is correct",
+							   " and if the file is a JPEG image.", '\n');
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	if(encrypt) {
+		const std::array<unsigned char, NonceBytes> nonce{MakeNonce()};
+		stream.insert(stream.begin(), nonce.begin(), nonce.end());
+		PayloadCipher(stream.data()).Apply(stream.data(), static_cast<unsigned int>(stream.size()), 0U);
+	}
+	if(stream.size() > 0xFFFFFFFFU - JpegHeaderBytes) {
+		Stegano::Logger::Error("Error!", " Source too large.", " Cannot embed more than 4 GiB.", '\n');
+		return false;
+	}
+	const unsigned int StreamLength{static_cast<unsigned int>(stream.size())};
+	const unsigned int checksum{Crc32c(stream.data(), stream.size())};
+	const std::array<unsigned char, JpegHeaderBytes> header{
+		static_cast<unsigned char>(StreamLength >> 24U), static_cast<unsigned char>(StreamLength >> 16U),
+		static_cast<unsigned char>(StreamLength >> 8U),	 static_cast<unsigned char>(StreamLength),
+		static_cast<unsigned char>(checksum >> 24U),	 static_cast<unsigned char>(checksum >> 16U),
+		static_cast<unsigned char>(checksum >> 8U),		 static_cast<unsigned char>(checksum),
+		static_cast<unsigned char>(encrypt ? JpegEncrypted : 0U)};
+	stream.insert(stream.begin(), header.begin(), header.end());
+
+	const jpeg_decompress_struct& info{coefficients.Info()};
+	const JobPlan plan{PlanCopy(CoefficientBytes(coefficients))};
+	const std::vector<unsigned long long> starts{RowStarts(coefficients, plan.workers)};
+	const unsigned long long bits{stream.size() * 8ULL}, capacity{starts.back()};
+	Stegano::Logger::Verbose("Base image size = [", info.image_height, " x ", info.image_width, " x ", info.num_components, "], ",
+							 info.total_iMCU_rows, " MCU rows", '\n', "Payload stream = ", StreamLength, " bytes, capacity = ",
+							 capacity / 8U, " bytes", "\n\n");
+	if(bits > capacity) {
+		Stegano::Logger::Error("Error!", " The base image is not large enough to store the source in its DCT coefficients, it holds ",
+							   capacity / 8U > JpegHeaderBytes ? capacity / 8U - JpegHeaderBytes : 0U, " payload bytes", '\n');
+		return false;
+	}
+
+	Stegano::Logger::Verbose("Encoding now...", '\n');
+	WorkerPool::Instance().Run(
+		info.total_iMCU_rows,
+		[&](const unsigned int r) {
+			if(starts[r] < bits) {
+				EmbedRows(coefficients.Rows(r), coefficients.Rows(r + 1U), stream.data(), starts[r], bits);
+			}
+		},
+		plan.workers);
+	Stegano::Logger::Verbose("Changed the LSB of up to ", bits, " of ", capacity, " usable AC coefficients", '\n');
+
+	if(!coefficients.Write(output)) {
+		Stegano::Logger::Error("Error!", " Cannot save the output file with the given name!", '\n');
+		return false;
+	}
+	Stegano::Logger::Log("Image saved at - ", output, '\n');
+
+	auto end = std::chrono::steady_clock::now();
+	const double timetaken = static_cast<double>(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) / 1000.0;
+	Stegano::Logger::Verbose('\n', "Encoding took: ", timetaken, " seconds");
+	return true;
+}
+
+bool DecodeJpeg(const std::string& source, const std::string& output) {
+	JpegCoefficients coefficients;
+	Stegano::Logger::Verbose("Reading DCT coefficients of the encoded image", '\n');
+	if(!coefficients.Read(source, false)) {
+		Stegano::Logger::Error("Error!", " Cannot read the DCT coefficients of the encoded image.", '\n');
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	const JobPlan plan{PlanCopy(CoefficientBytes(coefficients))};
+	const std::vector<unsigned long long> starts{RowStarts(coefficients, plan.workers)};
+	const unsigned long long capacity{starts.back()};
+	const std::vector<unsigned char> header{capacity >= JpegHeaderBytes * 8U
+												? ExtractCoefficients(coefficients, starts, JpegHeaderBytes, plan.workers)
+												: std::vector<unsigned char>{}};
+	unsigned int StreamLength{0}, checksum{0};
+	for(unsigned int i{0}; i < 4U && !header.empty(); ++i) {
+		StreamLength = StreamLength * PowersOfTwo[8] + header[i];
+		checksum = checksum * PowersOfTwo[8] + header[4U + i];
+	}
+	if(header.empty() || (StreamLength + static_cast<unsigned long long>(JpegHeaderBytes)) * 8U > capacity
+	   || (header[8] & ~JpegEncrypted) != 0U) {
+		Stegano::Logger::Error("Error!", " The given image does not have any data embedded using this application", '\n');
+		return false;
+	}
+	const bool encrypted{(header[8] & JpegEncrypted) != 0U};
+	if(encrypted && !encrypt) {
+		Stegano::Logger::Error("Error!", " The payload is encrypted, pass its key with \"cipher\" or STEGANO_CIPHER_KEY to decode it",
+							   '\n');
+		return false;
+	}
+
+	Stegano::Logger::Verbose("Decoding now...", '\n');
+	std::vector<unsigned char> stream{ExtractCoefficients(coefficients, starts, JpegHeaderBytes + StreamLength, plan.workers)};
+	stream.erase(stream.begin(), stream.begin() + JpegHeaderBytes);
+	if(Crc32c(stream.data(), stream.size()) != checksum) {
+		Stegano::Logger::Error("Error!", " The given image does not have any data embedded using this application, or it is damaged",
+							   '\n');
+		return false;
+	}
+	unsigned int skipped{0};
+	if(encrypted) {
+		if(StreamLength < NonceBytes) {
+			Stegano::Logger::Error("Error!", " The nonce of the encrypted payload is damaged", '\n');
+			return false;
+		}
+		PayloadCipher(stream.data()).Apply(stream.data(), StreamLength, 0U);
+		skipped = NonceBytes;
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	const double timetaken = static_cast<double>(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) / 1000.0;
+	Stegano::Logger::Verbose("Decoding took: ", timetaken, " seconds", '\n');
+	return SaveStream(stream.data() + skipped, stream.size() - skipped, output, fileoutput);
+}
+#else
+bool EncodeJpeg(const std::string&, const std::string&, const std::string&) {
+	Stegano::Logger::Error("Error!", " This build cannot write JPEG images, rebuild it with libjpeg and STEGANO_WITH_LIBJPEG defined",
+						   '\n');
+	return false;
+}
+
+bool DecodeJpeg(const std::string&, const std::string&) {
+	Stegano::Logger::Error("Error!", " This build cannot read JPEG images, rebuild it with libjpeg and STEGANO_WITH_LIBJPEG defined",
+						   '\n');
+	return false;
+}
+#endif
+
+}
@@ -0,0 +1,69 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include "SteganoKernels.h"
+#include <map>
+#include <mutex>
+#include <tuple>
+
+namespace Stegano {
+
+namespace {
+// Distinct shapes kept at once, the memo is cleared when it is full
+constexpr std::size_t MaxPlans{64U};
+
+// rows, cols, channels, channel bytes, embedded bits, workers, bands
+using LayoutKey = std::tuple<int, int, int, std::size_t, unsigned long long, unsigned int, unsigned int>;
+
+std::mutex PlansMutex;
+std::map<LayoutKey, std::shared_ptr<const LayoutPlan>> plans;
+}
+
+std::shared_ptr<const LayoutPlan> PlanLayout(const cv::Mat& base, const unsigned long long EmbeddedBits, const unsigned int PayloadBytes,
+											 const bool extract) {
+	const unsigned int AvailableBasePixels{static_cast<unsigned int>(base.rows * base.cols - 7)};
+	const unsigned int PixelChannels{static_cast<unsigned int>(base.channels())};
+	const unsigned int UsableRows{BpchRows(base.elemSize1(), PixelChannels)};
+	unsigned int BitsPerPixel{static_cast<unsigned int>(std::min<unsigned long long>(EmbeddedBits / AvailableBasePixels, UsableRows))};
+	unsigned int stride{EmbeddedBits ? static_cast<unsigned int>((AvailableBasePixels * (BitsPerPixel + 1ULL) / EmbeddedBits) - 1U) : 0U};
+	if(BitsPerPixel >= UsableRows) {
+		BitsPerPixel = UsableRows - 1U;
+		stride = 0U;
+	}
+	// The job split depends on the cost model and thread count, it is part of the shape
+	const JobPlan job{PlanJob(PayloadBytes, BitsPerPixel, PixelChannels, extract)};
+	const LayoutKey key{base.rows, base.cols, base.channels(), base.elemSize1(), EmbeddedBits, job.workers, job.chunks};
+	{
+		const std::lock_guard<std::mutex> lock(PlansMutex);
+		const auto found{plans.find(key)};
+		if(found != plans.end()) {
+			return found->second;
+		}
+	}
+
+	auto plan{std::make_shared<LayoutPlan>()};
+	plan->AvailableBasePixels = AvailableBasePixels;
+	plan->PixelChannels = PixelChannels;
+	plan->TotalBaseChannels = (AvailableBasePixels + 7U) * PixelChannels;
+	plan->UsableChannels = AvailableBasePixels * PixelChannels;
+	plan->BitsPerPixel = BitsPerPixel;
+	plan->stride = stride;
+	plan->job = job;
+	plan->starts.resize(job.chunks);
+	plan->ends.resize(job.chunks);
+	VisitBpch(PixelChannels, BitsPerPixel, [&](const auto& bpch) {
+		for(unsigned int k{0}; k < job.chunks; ++k) {
+			plan->starts[k] = BandStart(k, job.chunks, plan->UsableChannels, stride, BitsPerPixel, bpch);
+			plan->ends[k] = BandEnd(k, job.chunks, plan->UsableChannels);
+		}
+	});
+
+	const std::lock_guard<std::mutex> lock(PlansMutex);
+	if(plans.size() >= MaxPlans) {
+		plans.clear();
+	}
+	// A plan built meanwhile by another thread is identical, keep the first one
+	return plans.emplace(key, std::move(plan)).first->second;
+}
+
+}
@@ -0,0 +1,234 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoLogger.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Stegano {
+
+namespace {
+// Messages a thread can have in flight before it has to wait for the writer
+constexpr unsigned int RingCapacity{1024U};
+
+struct Record {
+	std::chrono::system_clock::time_point time;
+	LogLevel level;
+	// logdetails when the message was logged, the writer never reads the option itself
+	bool details;
+	std::string text;
+};
+
+// Single producer (owning thread), single consumer (writer) ring
+struct Ring {
+	std::array<Record, RingCapacity> records;
+	// head = records pushed, tail = records taken by the writer, written = records printed by the writer
+	std::atomic<unsigned int> head{0U}, tail{0U}, written{0U};
+	unsigned int thread{0U};
+	std::atomic<bool> retired{false};
+};
+
+class Sink {
+	std::mutex mutex;
+	std::condition_variable wake, drained;
+	std::vector<std::shared_ptr<Ring>> rings;
+	unsigned int threadcount{0U};
+	bool stop{false};
+	// Set while the writer waits for records, producers only wake it then
+	std::atomic<bool> sleeping{false};
+	// Whether the last character written to std::cout/std::cerr ended a line
+	bool outline{true}, errline{true};
+	std::thread writer;
+
+	void Emit(const Record& record, const Ring& ring) {
+		std::ostream& stream{record.level == LogLevel::Error ? std::cerr : std::cout};
+		bool& linestart{record.level == LogLevel::Error ? errline : outline};
+		if(!record.details) {
+			stream << record.text;
+			return;
+		}
+		// Prefix every line with the time, thread and level of the message
+		const std::time_t seconds{std::chrono::system_clock::to_time_t(record.time)};
+		const auto milliseconds{
+			std::chrono::duration_cast<std::chrono::milliseconds>(record.time.time_since_epoch()).count() % 1000};
+		std::tm local{};
+#if _WIN32
+		localtime_s(&local, &seconds);
+#else
+		localtime_r(&seconds, &local);
+#endif
+		static constexpr std::array<const char*, 3> levels{"E", "I", "V"};
+		std::size_t start{0};
+		while(start < record.text.size()) {
+			if(linestart) {
+				stream << '[' << std::put_time(&local, "%H:%M:%S") << '.' << std::setw(3) << std::setfill('0') << milliseconds << "] [T"
+					   << ring.thread << "] [" << levels[static_cast<unsigned int>(record.level)] << "] ";
+			}
+			std::size_t end{record.text.find('\n', start)};
+			end = (end == std::string::npos) ? record.text.size() : end + 1U;
+			stream.write(record.text.data() + start, static_cast<std::streamsize>(end - start));
+			linestart = record.text[end - 1U] == '\n';
+			start = end;
+		}
+	}
+
+	void Drain() {
+		std::vector<std::pair<Record, Ring*>> batch;
+		std::vector<std::pair<Ring*, unsigned int>> taken;
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true) {
+			batch.clear();
+			taken.clear();
+			for(const auto& ring : rings) {
+				const unsigned int head{ring->head.load(std::memory_order_acquire)};
+				unsigned int tail{ring->tail.load(std::memory_order_relaxed)};
+				if(head == tail) {
+					continue;
+				}
+				for(; tail != head; ++tail) {
+					batch.emplace_back(std::move(ring->records[tail % RingCapacity]), ring.get());
+				}
+				ring->tail.store(tail, std::memory_order_release);
+				taken.emplace_back(ring.get(), tail);
+			}
+			if(batch.empty()) {
+				// Rings of finished threads go away once empty
+				rings.erase(std::remove_if(rings.begin(), rings.end(),
+										   [](const std::shared_ptr<Ring>& ring) {
+											   return ring->retired.load() && ring->tail.load() == ring->head.load();
+										   }),
+							rings.end());
+				drained.notify_all();
+				if(stop) {
+					return;
+				}
+				// A producer either sees sleeping set and wakes the writer, or pushed before the rings are checked again below
+				sleeping.store(true);
+				wake.wait(lock, [this] {
+					return stop || std::any_of(rings.begin(), rings.end(), [](const std::shared_ptr<Ring>& ring) {
+							   return ring->head.load() != ring->tail.load(std::memory_order_relaxed);
+						   });
+				});
+				sleeping.store(false);
+				continue;
+			}
+			lock.unlock();
+			std::stable_sort(batch.begin(), batch.end(), [](const auto& a, const auto& b) { return a.first.time < b.first.time; });
+			for(const auto& entry : batch) {
+				Emit(entry.first, *entry.second);
+			}
+			std::cout.flush();
+			std::cerr.flush();
+			lock.lock();
+			for(const auto& entry : taken) {
+				entry.first->written.store(entry.second, std::memory_order_release);
+			}
+		}
+	}
+
+public:
+	Sink() : writer([this] { Drain(); }) {
+	}
+
+	~Sink() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wake.notify_all();
+		writer.join();
+	}
+
+	std::shared_ptr<Ring> Register() {
+		auto ring{std::make_shared<Ring>()};
+		std::lock_guard<std::mutex> lock(mutex);
+		ring->thread = threadcount++;
+		rings.push_back(ring);
+		return ring;
+	}
+
+	// Taking the mutex orders the wake after the check of the writer, which then sees the record or is already waiting
+	void Wake() {
+		if(sleeping.load()) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+			}
+			wake.notify_all();
+		}
+	}
+
+	void Flush() {
+		std::unique_lock<std::mutex> lock(mutex);
+		std::vector<std::pair<std::shared_ptr<Ring>, unsigned int>> targets;
+		for(const auto& ring : rings) {
+			targets.emplace_back(ring, ring->head.load(std::memory_order_acquire));
+		}
+		wake.notify_all();
+		drained.wait(lock, [&targets] {
+			for(const auto& target : targets) {
+				if(static_cast<int>(target.first->written.load(std::memory_order_acquire) - target.second) < 0) {
+					return false;
+				}
+			}
+			return true;
+		});
+	}
+};
+
+Sink& GetSink() {
+	static Sink sink;
+	return sink;
+}
+
+// Ring of the calling thread, handed over to the writer when the thread exits
+struct LocalRing {
+	std::shared_ptr<Ring> ring;
+	~LocalRing() {
+		if(ring) {
+			ring->retired.store(true);
+		}
+	}
+};
+}
+
+std::ostringstream& Logger::Formatter() {
+	thread_local std::ostringstream stream;
+	return stream;
+}
+
+std::streamsize Logger::Precision(const std::streamsize precision) {
+	return Formatter().precision(precision);
+}
+
+void Logger::Push(const LogLevel level, std::string&& text) {
+	Sink& sink{GetSink()};
+	thread_local LocalRing local;
+	if(!local.ring) {
+		local.ring = sink.Register();
+	}
+	Ring& ring{*local.ring};
+	const unsigned int head{ring.head.load(std::memory_order_relaxed)};
+	// Ring full => wait for the writer, only happens on bursts of more than RingCapacity messages
+	while(head - ring.tail.load(std::memory_order_acquire) >= RingCapacity) {
+		sink.Wake();
+		std::this_thread::yield();
+	}
+	ring.records[head % RingCapacity] = Record{std::chrono::system_clock::now(), level, logdetails, std::move(text)};
+	// Sequentially consistent with the sleeping flag of the writer, see Sink::Drain()
+	ring.head.store(head + 1U);
+	sink.Wake();
+}
+
+void Logger::Flush() {
+	GetSink().Flush();
+}
+
+}
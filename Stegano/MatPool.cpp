@@ -0,0 +1,236 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoCommon.h"
+#include <algorithm>
+#include <cmath>
+#include <new>
+#include <mutex>
+#include <vector>
+
+#if _WIN32
+	#define NOMINMAX
+	#include <Windows.h>
+#else
+	#include <sys/mman.h>
+#endif
+
+namespace Stegano {
+
+namespace {
+// Buffers below this size go to cv::fastMalloc, they are cheap and do not cause page fault storms
+constexpr std::size_t PooledMinimum{std::size_t{1} << 16};
+constexpr std::size_t HugePage{std::size_t{2} << 20};
+// Size classes grow by 2^(1/4), wasting at most ~19% of a recycled buffer
+constexpr double ClassesPerDoubling{4.0};
+// Bytes kept in the free lists at most, the rest is returned to the system
+constexpr std::size_t RetainLimit{std::size_t{2} << 30};
+
+struct PoolStatistics {
+	std::size_t allocations{0}, reused{0}, mapped{0}, released{0}, hugerequested{0}, retained{0}, peakretained{0}, peakinuse{0}, inuse{0};
+};
+
+/**
+ * Pixel buffer allocator recycling large buffers by size class. Buffers of 2 MiB and more are mapped directly with huge pages
+ * requested for them (advised to transparent huge pages on Linux, large pages on Windows when the process holds the lock memory
+ * privilege). The kernel may still back an advised mapping with base pages.
+ */
+class PoolAllocator : public cv::MatAllocator {
+	mutable std::mutex mutex;
+	mutable std::vector<std::vector<void*>> freelists;
+	mutable PoolStatistics statistics;
+
+	static unsigned int SizeClass(const std::size_t size) {
+		return static_cast<unsigned int>(std::ceil(std::log2(static_cast<double>(size)) * ClassesPerDoubling));
+	}
+
+	static std::size_t ClassCapacity(const unsigned int sizeclass) {
+		std::size_t capacity{static_cast<std::size_t>(std::ceil(std::exp2(sizeclass / ClassesPerDoubling)))};
+		if(capacity >= HugePage) {
+			capacity = (capacity + HugePage - 1U) / HugePage * HugePage;
+		}
+		return capacity;
+	}
+
+	/**
+	 * @brief Maps a new buffer, called without the pool lock held
+	 * @param capacity -> Capacity of the size class
+	 * @param huge -> true => Huge pages were granted (Windows) or advised (Linux)
+	 */
+	static void* Map(const std::size_t capacity, bool& huge) {
+		void* block{nullptr};
+		huge = false;
+#if _WIN32
+		const SIZE_T large{GetLargePageMinimum()};
+		if(large && capacity % large == 0U) {
+			block = VirtualAlloc(nullptr, capacity, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			huge = block != nullptr;
+		}
+		if(!block) {
+			block = VirtualAlloc(nullptr, capacity, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		}
+#else
+		block = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(block == MAP_FAILED) {
+			block = nullptr;
+		}
+	#ifdef MADV_HUGEPAGE
+		else if(capacity >= HugePage) {
+			huge = madvise(block, capacity, MADV_HUGEPAGE) == 0;
+		}
+	#endif
+#endif
+		if(!block) {
+			throw std::bad_alloc();
+		}
+		return block;
+	}
+
+	static void Unmap(void* const block, const std::size_t capacity) {
+#if _WIN32
+		(void)capacity;
+		VirtualFree(block, 0, MEM_RELEASE);
+#else
+		munmap(block, capacity);
+#endif
+	}
+
+public:
+	cv::UMatData* allocate(int dims, const int* sizes, int type, void* data0, size_t* step, cv::AccessFlag,
+						   cv::UMatUsageFlags) const override {
+		// Same layout computation as OpenCV's default allocator
+		std::size_t total{static_cast<std::size_t>(CV_ELEM_SIZE(type))};
+		for(int i{dims - 1}; i >= 0; --i) {
+			if(step) {
+				if(data0 && step[i] != CV_AUTOSTEP) {
+					total = step[i];
+				}
+				else {
+					step[i] = total;
+				}
+			}
+			total *= static_cast<std::size_t>(sizes[i]);
+		}
+
+		cv::UMatData* u{new cv::UMatData(this)};
+		u->size = total;
+		u->allocatorFlags_ = 0;
+		if(data0) {
+			u->data = u->origdata = static_cast<uchar*>(data0);
+			u->flags |= cv::UMatData::USER_ALLOCATED;
+			return u;
+		}
+		if(total < PooledMinimum) {
+			u->data = u->origdata = static_cast<uchar*>(cv::fastMalloc(total));
+			return u;
+		}
+
+		const unsigned int sizeclass{SizeClass(total)};
+		const std::size_t capacity{ClassCapacity(sizeclass)};
+		void* block{nullptr};
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			++statistics.allocations;
+			if(sizeclass < freelists.size() && !freelists[sizeclass].empty()) {
+				block = freelists[sizeclass].back();
+				freelists[sizeclass].pop_back();
+				statistics.retained -= capacity;
+				++statistics.reused;
+				statistics.inuse += capacity;
+				statistics.peakinuse = std::max(statistics.peakinuse, statistics.inuse);
+			}
+		}
+		if(!block) {
+			// The lock only covers the free lists, mapping and advising a new buffer runs outside of it
+			bool huge;
+			try {
+				block = Map(capacity, huge);
+			}
+			catch(...) {
+				delete u;
+				throw;
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			++statistics.mapped;
+			if(huge) {
+				statistics.hugerequested += capacity;
+			}
+			statistics.inuse += capacity;
+			statistics.peakinuse = std::max(statistics.peakinuse, statistics.inuse);
+		}
+		u->data = u->origdata = static_cast<uchar*>(block);
+		// Size class + 1, 0 => not pooled
+		u->allocatorFlags_ = static_cast<int>(sizeclass) + 1;
+		return u;
+	}
+
+	bool allocate(cv::UMatData* u, cv::AccessFlag, cv::UMatUsageFlags) const override {
+		return u != nullptr;
+	}
+
+	void deallocate(cv::UMatData* u) const override {
+		if(!u) {
+			return;
+		}
+		if(!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+			if(u->allocatorFlags_ == 0) {
+				cv::fastFree(u->origdata);
+			}
+			else {
+				const unsigned int sizeclass{static_cast<unsigned int>(u->allocatorFlags_ - 1)};
+				const std::size_t capacity{ClassCapacity(sizeclass)};
+				bool retain;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					statistics.inuse -= capacity;
+					retain = statistics.retained + capacity <= RetainLimit;
+					if(retain) {
+						if(freelists.size() <= sizeclass) {
+							freelists.resize(sizeclass + 1U);
+						}
+						freelists[sizeclass].push_back(u->origdata);
+						statistics.retained += capacity;
+						statistics.peakretained = std::max(statistics.peakretained, statistics.retained);
+					}
+					else {
+						++statistics.released;
+					}
+				}
+				if(!retain) {
+					Unmap(u->origdata, capacity);
+				}
+			}
+			u->origdata = nullptr;
+		}
+		delete u;
+	}
+
+	PoolStatistics Statistics() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return statistics;
+	}
+};
+
+// Never destroyed, matrices may still be released during static destruction
+PoolAllocator* pool{nullptr};
+}
+
+void InstallMatPool() {
+	if(!pool) {
+		pool = new PoolAllocator;
+		cv::Mat::setDefaultAllocator(pool);
+	}
+}
+
+void ReportMatPool() {
+	if(!pool) {
+		return;
+	}
+	const PoolStatistics statistics{pool->Statistics()};
+	constexpr double MiB{1024.0 * 1024.0};
+	Stegano::Logger::Verbose("Pixel buffer pool: ", statistics.allocations, " pooled allocations, ", statistics.reused, " reused, ",
+							 statistics.mapped, " mapped, ", statistics.released, " released", '\n', "Pixel buffer pool: peak in use = ",
+							 statistics.peakinuse / MiB, " MiB, peak retained = ", statistics.peakretained / MiB,
+							 " MiB, huge pages requested = ", statistics.hugerequested / MiB, " MiB", '\n');
+}
+
+}
@@ -1,40 +1,200 @@
 /* Copyright 2020 Prakhar Agarwal*/
 
 #include "SteganoThreadedCommon.h"
+#include "SteganoKernels.h"
+#include "SteganoPayload.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
 
 namespace Stegano {
 
+/**
+ * @brief Extracts an extended stream. Image payloads are unpacked to DecodedImage, file payloads are written to disk block by block
+ * as they are extracted and containers are saved by SaveContainer(), both leave DecodedImage empty.
+ * @param SourceImageData -> Encoded image channels
+ * @param UsableChannels -> Channels holding the stream (trailer excluded)
+ * @param PixelChannels -> Channels per pixel
+ * @param stride -> Pixels skipped between two encoding pixels
+ * @param BitsPerPixel -> Zero indexed row of BPCH
+ * @param walk -> Pixels holding the stream, see the tile order recorded by the marker
+ * @param StreamLength -> Number of embedded bytes
+ * @param marker -> Layout of the stream, see ReadMarker()
+ * @param output -> Output image path of the entries of containers
+ * @param DecodedImage -> Decoded image
+ * @return true => Success
+ */
+template <typename Channel>
+static bool DecodeStream(const Channel* const SourceImageData, const unsigned int UsableChannels, const unsigned int PixelChannels,
+						 const unsigned int stride, const unsigned int BitsPerPixel, const TileWalk& walk, const unsigned int StreamLength,
+						 const PayloadMarker& marker, const std::string& output, cv::Mat& DecodedImage) {
+	Stegano::Logger::Verbose("Extended payload of ", StreamLength, " bytes", marker.checked ? ", checksums included" : "",
+							 marker.keyed ? ", keyed layout" : "", marker.encrypted ? ", encrypted" : "",
+							 marker.fec ? ", error corrected" : "", '\n');
+	PayloadHeader header;
+	unsigned int HeaderLength{0}, FileBytes{0};
+	ImageUnpacker unpacker;
+	std::vector<unsigned char> stream;
+	std::ofstream file;
+	std::string path;
+	const StreamWriter write{[&](const unsigned char* data, std::size_t size) {
+		if(!HeaderLength) {
+			// The header always fits in the first block
+			HeaderLength = ReadPayloadHeader(data, size, header);
+			if(!HeaderLength) {
+				return false;
+			}
+			if(header.type == PAYLOAD_SHARD) {
+				return false;
+			}
+			if(header.type == PAYLOAD_IMAGE) {
+				// Rows are decoded as the body is extracted, the stream itself is not kept
+				if(!unpacker.Start(header)) {
+					return false;
+				}
+				data += HeaderLength;
+				size -= HeaderLength;
+			}
+			else if(header.type != PAYLOAD_FILE) {
+				stream.reserve(StreamLength);
+			}
+			else {
+				path = fileoutput;
+				if(path.empty()) {
+					path = header.name.empty() ? std::string("Decoded.bin") : std::filesystem::path(header.name).filename().string();
+				}
+				file.open(path, std::ios::binary | std::ios::trunc);
+				data += HeaderLength;
+				size -= HeaderLength;
+			}
+		}
+		if(header.type == PAYLOAD_FILE) {
+			// A stream whose tail is damaged is extracted as far as the embedded length allows, the file ends where its header says
+			size = std::min<std::size_t>(size, header.length - FileBytes);
+			FileBytes += static_cast<unsigned int>(size);
+			file.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+			return static_cast<bool>(file);
+		}
+		if(header.type == PAYLOAD_IMAGE) {
+			return unpacker.Write(data, size);
+		}
+		stream.insert(stream.end(), data, data + size);
+		return true;
+	}};
+	const bool extracted{
+		ExtractStream(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, walk, StreamLength, marker, write)};
+
+	if(!HeaderLength) {
+		Stegano::Logger::Error("Error!", " The header of the embedded payload is damaged", '\n');
+		return false;
+	}
+	if(header.type == PAYLOAD_SHARD) {
+		Stegano::Logger::Error("Error!", " This image holds shard ", header.shard + 1U, " of ", header.shards, " of a payload", '\n');
+		Stegano::Logger::Log("Pass the other encoded images with \"carrier\" to decode it", '\n');
+		return false;
+	}
+	if(header.type == PAYLOAD_FILE) {
+		if(!extracted) {
+			Stegano::Logger::Error("Error!", " Cannot write the decoded file at ", path, '\n');
+			return false;
+		}
+		Stegano::Logger::Log("File saved at - ", path, " (", header.length, " bytes)", '\n');
+		return true;
+	}
+	if(header.type == PAYLOAD_CONTAINER) {
+		return SaveContainer(stream.data(), stream.size(), output);
+	}
+	if(unpacker.Image().empty()) {
+		Stegano::Logger::Error("Error!", " The embedded payload is not an image or its header is damaged", '\n');
+		return false;
+	}
+	if(!unpacker.Finish()) {
+		Stegano::Logger::Error("Warning!", " The embedded payload is damaged or truncated, the decoded image is incomplete", '\n');
+	}
+	DecodedImage = unpacker.Image();
+	return true;
+}
+
+/**
+ * @brief Extracts a tiled stream (see EmbedTiles()) and unpacks the image it holds, containers are saved by SaveContainer()
+ * @param SourceImage -> Encoded image
+ * @param StreamLength -> Number of embedded bytes
+ * @param marker -> Layout of the stream, see ReadMarker()
+ * @param output -> Output image path of the entries of containers
+ * @param DecodedImage -> Decoded image
+ * @return true => Success
+ */
+static bool DecodeTiles(const cv::Mat& SourceImage, const unsigned int StreamLength, const PayloadMarker& marker, const std::string& output,
+						cv::Mat& DecodedImage) {
+	Stegano::Logger::Verbose("Adaptive payload of ", StreamLength, " bytes", marker.keyed ? ", keyed layout" : "",
+							 marker.encrypted ? ", encrypted" : "", '\n');
+	std::vector<unsigned char> stream;
+	if(!ExtractTiles(SourceImage, StreamLength, marker, stream)) {
+		Stegano::Logger::Error("Error!", " The tile map of the adaptive layout is damaged", '\n');
+		return false;
+	}
+	if(DirectoryLength(stream.data(), stream.size())) {
+		return SaveContainer(stream.data(), stream.size(), output);
+	}
+	if(!UnpackImage(stream.data(), stream.size(), DecodedImage)) {
+		if(DecodedImage.empty()) {
+			Stegano::Logger::Error("Error!", " The embedded payload is not an image or its header is damaged", '\n');
+			return false;
+		}
+		Stegano::Logger::Error("Warning!", " The embedded payload is damaged or truncated, the decoded image is incomplete", '\n');
+	}
+	return true;
+}
+
 bool ParallelDecode(const std::string& source, const std::string& output) {
 	Stegano::Logger::Verbose("Reading source image", '\n');
 
-	cv::Mat SourceImage{cv::imread(source, cv::IMREAD_COLOR)};
+	const cv::Mat SourceImage{ReadCarrier(source)};
 	if(!SourceImage.data) {
-		Stegano::Logger::Error("Error!", " Cannot open base image.",
-							   " Please check if the path is correct and if the file is an 8 bit color image.", '\n');
+		Stegano::Logger::Error("Error!", " Cannot open base image.", " Please check if the path is correct and if the file is an 8 bit,",
+							   " 16 bit or floating point color image.", '\n');
 		return false;
 	}
 	Stegano::Logger::Verbose("Source image size = [", SourceImage.rows, " x ", SourceImage.cols, " x ", SourceImage.channels(), ']',
 							 "\n\n");
+	return ParallelDecode(SourceImage, output);
+}
+
+bool ParallelDecode(const cv::Mat& SourceImage, const std::string& output) {
+	if(entry) {
+		return DecodeEntry(SourceImage, output);
+	}
+	if(roidecode) {
+		return ParallelDecodeRegion(SourceImage, output);
+	}
 
 	const unsigned int AvailableBasePixels{static_cast<unsigned int>(SourceImage.rows * SourceImage.cols - 7)};
-	const unsigned int TotalSourceChannels{AvailableBasePixels * 3U + 21U};
+	const unsigned int PixelChannels{static_cast<unsigned int>(SourceImage.channels())};
+	const unsigned int TotalSourceChannels{(AvailableBasePixels + 7U) * PixelChannels};
 
 	// Reading Trailer
-	std::array<unsigned char, 5> trailer{0, 0, 0, 0, 0};
-	for(unsigned int ch{21}, i{0}, done{0}; ch > 1; --ch, done += 2) {
-		if(done == 8U) {
-			done = 0U;
-			++i;
-		}
-		trailer[i] *= PowersOfTwo[2];
-		trailer[i] += static_cast<unsigned char>(SourceImage.data[TotalSourceChannels - ch] % 4U);
-	}
+	const std::array<unsigned char, 5> trailer{
+		VisitChannels(SourceImage, [&](const auto* const SourceImageData) { return ReadTrailer(SourceImageData, TotalSourceChannels); })};
 
 	// Checking validity of the trailer
-	if((trailer[0] ^ trailer[1] ^ trailer[2] ^ trailer[3] ^ SourceImage.data[TotalSourceChannels - 1]) != trailer[4]) {
+	const unsigned int checksum{VisitChannels(
+		SourceImage,
+		[&](const auto* const SourceImageData) { return TrailerChecksum(trailer, SourceImageData, TotalSourceChannels, PixelChannels); })};
+	const PayloadMarker marker{ReadMarker(checksum, trailer[4])};
+	const bool extended{marker.extended};
+	if(!marker.valid) {
 		Stegano::Logger::Error("Error!", " The given image does not have any data embedded using this application", '\n');
 		return false;
 	}
+	if(marker.keyed && key.empty()) {
+		Stegano::Logger::Error("Error!", " The payload is scattered with a key, pass it with \"key\" to decode it", '\n');
+		return false;
+	}
+	if(marker.encrypted && !encrypt) {
+		Stegano::Logger::Error("Error!", " The payload is encrypted, pass its key with \"cipher\" or STEGANO_CIPHER_KEY to decode it",
+							   '\n');
+		return false;
+	}
 
 	std::thread displaysource([&SourceImage] {
 		if(showimages) {
@@ -53,129 +213,86 @@ bool ParallelDecode(const std::string& source, const std::string& output) {
 
 	Stegano::Logger::Verbose("Encoded image found, decoding...", '\n');
 
-	unsigned int DecodedImageRows{trailer[0]}, DecodedImageColumns{trailer[2]};
-	DecodedImageRows *= PowersOfTwo[8];
-	DecodedImageRows += trailer[1];
-	bool DecodedImageGrayscale = false;
-	if(DecodedImageColumns >= PowersOfTwo[7]) {
-		DecodedImageColumns -= PowersOfTwo[7];
-		DecodedImageGrayscale = true;
-	}
-	DecodedImageColumns *= PowersOfTwo[8];
-	DecodedImageColumns += trailer[3];
-
-	cv::Mat DecodedImage{cv::Mat::zeros(static_cast<int>(DecodedImageRows), static_cast<int>(DecodedImageColumns),
-										DecodedImageGrayscale ? CV_8UC1 : CV_8UC3)};
-
-	const unsigned int TotalDecodedImageChannels{DecodedImageRows * DecodedImageColumns * (DecodedImageGrayscale ? 1U : 3U)};
-	const unsigned int BitsEncoded{TotalDecodedImageChannels * 8U};
-	unsigned int BitsPerPixel{BitsEncoded / AvailableBasePixels};
-	unsigned int stride{(AvailableBasePixels * (BitsPerPixel + 1U) / BitsEncoded) - 1U};
-	if(BitsPerPixel >= 12U) {
-		BitsPerPixel = 11U;
-		stride = 0U;
-	}
-	const std::array<unsigned int, 3> bpch{BPCH[BitsPerPixel]};
-	unsigned char *const DecodedImageData{DecodedImage.data}, *const SourceImageData{SourceImage.data};
-
-	// Extracting Encoded bits
-	std::vector<std::thread> thread_pool;
-	thread_pool.reserve(threads);
-	for(unsigned int k{0}; k < threads; ++k) {
-		thread_pool.emplace_back(std::thread(
-			[k, &stride, &bpch, &BitsPerPixel, &SourceImageData, &DecodedImageData, &TotalSourceChannels, &TotalDecodedImageChannels] {
-				unsigned int i{0}, j{0}, TransferredBits{0}, BGR{0};
-				// Exactly same thread generation as ParallelEncode, except i and j are swapped
-				// And ofcourse encoding/decoding loops are different
-				if(k > 0) {
-					const unsigned int n{((TotalSourceChannels - 21U) / threads) * k};
-					j = n;
-					const unsigned int stridechjump{(stride + 1U) * 3U};
-					unsigned int tbt{0};
-					if(stride != 0U) {
-						BGR = j % stridechjump;
-						if(BGR > 2U) {
-							j += stridechjump - BGR;
-							BGR = 0U;
-						}
-						unsigned int pixelsdone = n / (stridechjump);
-
-						if(n % stridechjump != 0U) {
-							++pixelsdone;
-						}
-						tbt = pixelsdone * (BitsPerPixel + 1U);
-					}
-					else {
-						BGR = j % 3U;
-						tbt = (j / 3U) * (BitsPerPixel + 1U);
-					}
-					if(BGR == 1U) {
-						tbt += bpch[0];
-					}
-					else if(BGR == 2U) {
-						tbt += bpch[0] + bpch[1];
-					}
-					i = tbt / 8U;
-					TransferredBits = tbt % 8U;
-				}
-				for(; i < TotalDecodedImageChannels
-					  && j < ((k == threads - 1) ? (TotalSourceChannels - 21U) : (TotalSourceChannels - 21U) / threads * (k + 1U));
-					++BGR, ++j) {
-					if(BGR == 3U) {
-						BGR = 0U;
-						j += stride * 3U;
-					}
-					unsigned int ChannelBits{bpch[BGR]};
-					if(ChannelBits) {
-						if(TransferredBits + ChannelBits > 8U) {
-							unsigned int NextChannelBits{ChannelBits + TransferredBits};
-							NextChannelBits -= 8U;
-							DecodedImageData[i] *= PowersOfTwo[8U - TransferredBits];
-							DecodedImageData[i] += (SourceImageData[j] / PowersOfTwo[NextChannelBits]) % PowersOfTwo[8U - TransferredBits];
-							++i;
-							DecodedImageData[i] += SourceImageData[j] % PowersOfTwo[NextChannelBits];
-							TransferredBits = NextChannelBits;
-						}
-						else {
-							DecodedImageData[i] *= PowersOfTwo[ChannelBits];
-							DecodedImageData[i] += SourceImageData[j] % PowersOfTwo[ChannelBits];
-							TransferredBits += ChannelBits;
-							if(TransferredBits == 8U) {
-								TransferredBits = 0U;
-								++i;
-							}
-						}
-					}
-				}
-			}));
+	cv::Mat DecodedImage;
+	// Extended streams => number of embedded bytes
+	unsigned int TotalDecodedImageChannels{0};
+	if(extended) {
+		for(unsigned int i{0}; i < 4U; ++i) {
+			TotalDecodedImageChannels = TotalDecodedImageChannels * PowersOfTwo[8] + trailer[i];
+		}
+		// Forced encodes of legacy payloads record the whole hidden image even if the base only holds part of it, extended ones
+		// never record more than the base holds
+		if(!LengthFits(TotalDecodedImageChannels, AvailableBasePixels, BpchRows(SourceImage.elemSize1(), PixelChannels))) {
+			Stegano::Logger::Error("Error!", " The trailer of the given image is damaged, it records more data than the image can hold",
+								   '\n');
+			displaysource.join();
+			return false;
+		}
 	}
-	for(unsigned int k{0}; k < threads; ++k) {
-		thread_pool[k].join();
+	else {
+		unsigned int DecodedImageRows{trailer[0]}, DecodedImageColumns{trailer[2]};
+		DecodedImageRows *= PowersOfTwo[8];
+		DecodedImageRows += trailer[1];
+		bool DecodedImageGrayscale = false;
+		if(DecodedImageColumns >= PowersOfTwo[7]) {
+			DecodedImageColumns -= PowersOfTwo[7];
+			DecodedImageGrayscale = true;
+		}
+		DecodedImageColumns *= PowersOfTwo[8];
+		DecodedImageColumns += trailer[3];
+
+		DecodedImage = cv::Mat::zeros(static_cast<int>(DecodedImageRows), static_cast<int>(DecodedImageColumns),
+									  DecodedImageGrayscale ? CV_8UC1 : CV_8UC3);
+		TotalDecodedImageChannels = DecodedImageRows * DecodedImageColumns * (DecodedImageGrayscale ? 1U : 3U);
 	}
+	// Same plan as the encode of this shape
+	const std::shared_ptr<const LayoutPlan> plan{
+		PlanLayout(SourceImage, TotalDecodedImageChannels * 8ULL, TotalDecodedImageChannels, true)};
+	const LayoutPlan& layout{*plan};
+	const unsigned int BitsPerPixel{layout.BitsPerPixel}, stride{layout.stride}, UsableChannels{layout.UsableChannels};
 
-	std::thread saveimage([&output, &DecodedImage] {
-		Stegano::Logger::Verbose("Finished decoding", '\n', "Saving decoded image", '\n');
-		try {
-			cv::imwrite(output, DecodedImage,
-						std::vector<int>{cv::IMWRITE_PNG_COMPRESSION, 4, cv::IMWRITE_PNG_STRATEGY, cv::IMWRITE_PNG_STRATEGY_FILTERED});
-			Stegano::Logger::Log("Image saved at - ", output, '\n');
-		}
-		catch(cv::Exception& e) {
-			if(e.code == -2) {
-				Stegano::Logger::Error("Error!", " Cannot save the output file with the given name!", '\n');
-				Stegano::Logger::Log("If this is a privileged directory, please run this application in elevated mode.", '\n',
-									 "Saving as Decoded.png in the working directory");
-				try {
-					cv::imwrite("Decoded.png", DecodedImage);
-					Stegano::Logger::Log("Image saved at - .\\Decoded.png", '\n');
-				}
-				catch(cv::Exception& E) {
-					if(E.code == -2) {
-						Stegano::Logger::Error("Error!", " Cannot save as Decoded.png as well, skipping save step.", '\n');
-					}
-				}
+	if(extended) {
+		const TileWalk walk(marker.tileorder, static_cast<unsigned int>(SourceImage.rows), static_cast<unsigned int>(SourceImage.cols));
+		const bool decoded{marker.tiled ? DecodeTiles(SourceImage, TotalDecodedImageChannels, marker, output, DecodedImage)
+										: VisitChannels(SourceImage, [&](const auto* const SourceImageData) {
+											  return DecodeStream(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel,
+																  walk, TotalDecodedImageChannels, marker, output, DecodedImage);
+										  })};
+		// File payloads and containers are written by DecodeStream() and DecodeTiles()
+		if(!decoded || DecodedImage.empty()) {
+			displaysource.join();
+			if(decoded && !showimages) {
+				auto end = std::chrono::steady_clock::now();
+				const double timetaken =
+					static_cast<double>(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) / 1000.0;
+				Stegano::Logger::Verbose('\n', "Decoding took: ", timetaken, " seconds");
 			}
+			return decoded;
 		}
+	}
+	else {
+		// Extracting Encoded bits
+		unsigned char* const DecodedImageData{DecodedImage.data};
+		const unsigned int bands{layout.job.chunks};
+		std::vector<KernelFragment> fragments(bands * 2U);
+		VisitChannels(SourceImage, [&](const auto* const SourceImageData) {
+			VisitBpch(PixelChannels, BitsPerPixel, [&](const auto& bpch) {
+				WorkerPool::Instance().Run(
+					bands,
+					[&](const unsigned int k) {
+						// Exactly same band split as ParallelEncode, except the kernel extracts instead of embedding
+						ExtractRange(SourceImageData, DecodedImageData, TotalDecodedImageChannels, layout.starts[k], layout.ends[k],
+									 stride, bpch, fragments[k * 2U], fragments[k * 2U + 1U]);
+					},
+					layout.job.workers);
+			});
+		});
+		MergeFragments(DecodedImageData, TotalDecodedImageChannels, fragments);
+	}
+
+	std::thread saveimage([&output, &DecodedImage] {
+		Stegano::Logger::Verbose("Finished decoding", '\n', "Saving decoded image", '\n');
+		SaveImage(output, DecodedImage, "Decoded");
 	});
 
 	displaysource.join();
@@ -1,36 +1,46 @@
 /* Copyright 2020 Prakhar Agarwal*/
 
 #include "SteganoThreadedCommon.h"
+#include "SteganoKernels.h"
+#include "SteganoPayload.h"
 #include <opencv2/quality.hpp>
 #include <cmath>
+#include <cstring>
 
 namespace Stegano {
 
 extern bool expandbase, force, noreduc, nograyscale;
 
 bool ParallelEncode(const std::string& base, const std::string& source, const std::string& output) {
-	Stegano::Logger::Verbose("Exapnd base = ", expandbase ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Expand base = ", expandbase ? "true" : "false", '\n');
 	Stegano::Logger::Verbose("No reduction = ", noreduc ? "true" : "false", '\n');
 	Stegano::Logger::Verbose("No grayscale = ", nograyscale ? "true" : "false", '\n');
 	Stegano::Logger::Verbose("Forced encode = ", force ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Compress payload = ", compress ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Keyed layout = ", key.empty() ? "false" : "true", '\n');
+	Stegano::Logger::Verbose("Adaptive layout = ", adaptive ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Payload encryption = ", encrypt ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Error correction parity = ", fecparity, '\n');
 
 	cv::Mat BaseImage, SourceImage;
+	PrepackedSource prepacked;
 	{
 		std::thread loadbase([&base, &BaseImage] {
 			Stegano::Logger::Verbose("Reading base image", '\n');
-			BaseImage = cv::imread(base, cv::IMREAD_COLOR);
+			BaseImage = ReadCarrier(base);
 		});
-		std::thread loadsource([&source, &SourceImage] {
+		std::thread loadsource([&source, &prepacked] {
 			Stegano::Logger::Verbose("Reading source image", '\n');
-			SourceImage = cv::imread(source, cv::IMREAD_COLOR);
+			ReadSource(source, prepacked);
 		});
 		loadbase.join();
 		loadsource.join();
+		SourceImage = prepacked.image;
 	}
 
 	if(!BaseImage.data) {
-		Stegano::Logger::Error("Error!", " Cannot open base image.",
-							   " Please check if the path is correct and if the file is an 8 bit color image.", '\n');
+		Stegano::Logger::Error("Error!", " Cannot open base image.", " Please check if the path is correct and if the file is an 8 bit,",
+							   " 16 bit or floating point color image.", '\n');
 		return false;
 	}
 	if(!SourceImage.data) {
@@ -48,12 +58,19 @@ bool ParallelEncode(const std::string& base, const std::string& source, const st
 							   " Cannot operate on images with dimensions greater than [65536 x 65536].", '\n');
 		return false;
 	}
+	if(!CheckCarrierDepth(BaseImage, output)) {
+		return false;
+	}
+	// Wider base channels take more bits each, the same payload is spread over fewer pixels, and so does an alpha channel
+	const unsigned int PixelChannels{static_cast<unsigned int>(BaseImage.channels())};
+	const unsigned int UsableRows{BpchRows(BaseImage.elemSize1(), PixelChannels)};
 
-	cv::Mat BaseImageCopy{BaseImage.clone()};
+	// With affinity the copy is taken band by band by the pinned workers (see below), until then it shares the loaded base
+	cv::Mat BaseImageCopy{affinity != AFFINITY_NONE ? BaseImage : BaseImage.clone()};
 
 	// Using 7 pixels for the trailer (see definition below)
 	unsigned int AvailableBasePixels{static_cast<unsigned int>(BaseImage.rows * BaseImage.cols - 7)};
-	unsigned int TotalBaseChannels{AvailableBasePixels * 3U + 21U};
+	unsigned int TotalBaseChannels{(AvailableBasePixels + 7U) * PixelChannels};
 	unsigned int BitsToEncode{static_cast<unsigned int>(SourceImage.rows * SourceImage.cols * 24)};
 	unsigned int BitsPerPixel{BitsToEncode / AvailableBasePixels}; // zero indexed for BPCH, add 1 to get actual value
 
@@ -62,13 +79,35 @@ bool ParallelEncode(const std::string& base, const std::string& source, const st
 							 "\n\n");
 	bool overflow{false};
 
+	// Compressed, keyed, adaptive, encrypted and error corrected payloads are embedded as extended streams, the reduction phase only
+	// kicks in if the stream does not fit
+	const bool extended{compress || !key.empty() || adaptive || encrypt || fecparity || tileorder};
+	// Encrypted streams are encrypted by the embedding tasks, behind a clear nonce
+	const std::array<unsigned char, NonceBytes> nonce{encrypt ? MakeNonce() : std::array<unsigned char, NonceBytes>{}};
+	const auto pack = [&nonce](std::vector<unsigned char> packed) {
+		if(encrypt) {
+			packed.insert(packed.begin(), nonce.begin(), nonce.end());
+		}
+		return packed;
+	};
+	// Bits embedded for a stream, error correction and checksums included
+	const auto StreamBits = [&AvailableBasePixels, UsableRows](const std::vector<unsigned char>& packed) {
+		return static_cast<unsigned int>(EmbeddedLength(FecLength(packed.size(), fecparity), AvailableBasePixels, UsableRows) * 8U);
+	};
+	std::vector<unsigned char> stream;
+	if(extended) {
+		stream = pack(SourceStream(prepacked));
+		BitsToEncode = StreamBits(stream);
+		BitsPerPixel = BitsToEncode / AvailableBasePixels;
+	}
+
 	auto start = std::chrono::steady_clock::now();
 
-	if(BitsPerPixel >= 12U) {
+	if(BitsPerPixel >= UsableRows) {
 		if(!noreduc) {
 			if(expandbase) {
-				const unsigned int ExpansionFactor{(BitsToEncode / 12U + 8U) / (static_cast<unsigned int>(BaseImage.rows * BaseImage.cols))
-												   + 1U};
+				const unsigned int ExpansionFactor{
+					(BitsToEncode / UsableRows + 8U) / (static_cast<unsigned int>(BaseImage.rows * BaseImage.cols)) + 1U};
 				if(ExpansionFactor > 8U) {
 					if(!force) {
 						Stegano::Logger::Error(
@@ -93,12 +132,16 @@ bool ParallelEncode(const std::string& base, const std::string& source, const st
 					cv::resize(BaseImage, BaseImage, cv::Size(), sqrt(ExpansionFactor), sqrt(ExpansionFactor), cv::INTER_LANCZOS4);
 				}
 				AvailableBasePixels = static_cast<unsigned int>(BaseImage.rows * BaseImage.cols - 7);
-				TotalBaseChannels = AvailableBasePixels * 3U + 21U;
+				TotalBaseChannels = (AvailableBasePixels + 7U) * PixelChannels;
+				if(extended) {
+					// The checksums depend on the chunk size, hence on the depth in the expanded base
+					BitsToEncode = StreamBits(stream);
+				}
 				Stegano::Logger::Verbose("Modified base image size = [", BaseImage.rows, " x ", BaseImage.cols, " x ", BaseImage.channels(),
 										 ']', "\n\n");
 			}
 			else {
-				unsigned int ReductionFactor{BitsPerPixel / 12U + 1U};
+				unsigned int ReductionFactor{BitsPerPixel / UsableRows + 1U};
 				if(nograyscale) {
 					if(ReductionFactor > 8U) {
 						if(!force) {
@@ -166,6 +209,18 @@ bool ParallelEncode(const std::string& base, const std::string& source, const st
 					}
 				}
 				BitsToEncode = SourceImage.rows * SourceImage.cols * 8 * SourceImage.channels();
+				if(extended) {
+					stream = pack(PackImage(SourceImage));
+					BitsToEncode = StreamBits(stream);
+					// Reduced images compress slightly worse, shrink further until the stream fits
+					while(!overflow && BitsToEncode / AvailableBasePixels >= UsableRows) {
+						const double ScalingFactor{
+							1.0 / std::sqrt(static_cast<double>(BitsToEncode / AvailableBasePixels / UsableRows + 1U))};
+						cv::resize(SourceImage, SourceImage, cv::Size(), ScalingFactor, ScalingFactor, cv::INTER_AREA);
+						stream = pack(PackImage(SourceImage));
+						BitsToEncode = StreamBits(stream);
+					}
+				}
 				Stegano::Logger::Verbose("Modified source image size = [", SourceImage.rows, " x ", SourceImage.cols, " x ",
 										 SourceImage.channels(), ']', "\n\n");
 			}
@@ -179,7 +234,27 @@ bool ParallelEncode(const std::string& base, const std::string& source, const st
 			}
 			overflow = true;
 		}
-		BitsPerPixel = overflow ? 11U : BitsToEncode / AvailableBasePixels;
+		BitsPerPixel = overflow ? UsableRows - 1U : BitsToEncode / AvailableBasePixels;
+	}
+	if(!prepackfile.empty()) {
+		// Saved before the stream is cut to the base, without the nonce of this encode
+		WritePrepacked(prepackfile, extended ? std::vector<unsigned char>(stream.begin() + (encrypt ? NonceBytes : 0U), stream.end())
+											 : PackImage(SourceImage),
+					   BaseImageCopy);
+	}
+	if(extended && (overflow || BitsToEncode / AvailableBasePixels >= UsableRows)) {
+		// The checksums go after the stream, which is cut to what the base can hold
+		stream.resize(FecDataLength(FittingLength(AvailableBasePixels, UsableRows), fecparity));
+		Stegano::Logger::Verbose("Compressed stream cut to ", stream.size(), " bytes", '\n');
+		BitsToEncode = StreamBits(stream);
+		BitsPerPixel = BitsToEncode / AvailableBasePixels;
+		overflow = false;
+	}
+	// The tiles are planned on the loaded base, before the affinity path below swaps it for an untouched buffer
+	TileLayout tiles;
+	const bool tiled{adaptive && PlanTiles(BaseImage, TileCosts(BaseImage), static_cast<unsigned int>(stream.size()), tiles)};
+	if(adaptive && !tiled) {
+		Stegano::Logger::Verbose("The stream does not fit in the tiles of the base, using the uniform layout", '\n');
 	}
 
 	std::thread display([&BaseImage, &SourceImage] {
@@ -200,9 +275,14 @@ bool ParallelEncode(const std::string& base, const std::string& source, const st
 
 	Stegano::Logger::Verbose("Encoding now...", '\n');
 
-	// const unsigned int RequiredPixels = BitsToEncode / (BitsPerPixel + 1U);
-	// Stride between each hiding pixel. Stride = (AvailableBasePixels / RequiredPixels) - 1
-	const unsigned int stride{overflow ? 0U : (AvailableBasePixels * (BitsPerPixel + 1U) / BitsToEncode) - 1U};
+	const unsigned int TotalSourceChannels{
+		extended ? static_cast<unsigned int>(stream.size())
+				 : static_cast<unsigned int>(SourceImage.rows * SourceImage.cols * SourceImage.channels())};
+	// BPCH row, stride between each hiding pixel and band split, planned once per shape of job (see PlanLayout())
+	const std::shared_ptr<const LayoutPlan> plan{PlanLayout(BaseImage, BitsToEncode, TotalSourceChannels, false)};
+	const LayoutPlan& layout{*plan};
+	const unsigned int stride{layout.stride};
+	BitsPerPixel = layout.BitsPerPixel;
 
 	/* Trailer Config (1 pixel + 2 channels of another pixel = 40 bits)
 	** First 16 bits = number of rows in SourceImage
@@ -210,155 +290,115 @@ bool ParallelEncode(const std::string& base, const std::string& source, const st
 	** Next 15 bits = number of cols in SourceImage
 	** Next 8 bits = as they were
 	** Next 8 bits = checksum (see below)
+	** Extended streams use the first 32 bits for the embedded length instead (see SteganoPayload.h)
 	*/
 	std::array<unsigned char, 5> trailer{0, 0, 0, 0, 0};
-	trailer[0] = static_cast<unsigned char>((SourceImage.rows / PowersOfTwo[8]) % PowersOfTwo[8]); // bits 0-7
-	trailer[1] = static_cast<unsigned char>(SourceImage.rows % PowersOfTwo[8]);					   // bits 8-15
-	trailer[2] = static_cast<unsigned char>((SourceImage.channels() == 1 ? PowersOfTwo[7] : 0)
-											+ ((SourceImage.cols / PowersOfTwo[8]) % PowersOfTwo[7])); // bits 16-23
-	trailer[3] = static_cast<unsigned char>(SourceImage.cols % PowersOfTwo[8]);						   // bits 24-31
+	if(extended) {
+		// Tiled streams carry no checksums
+		const unsigned int StreamLength{tiled ? static_cast<unsigned int>(stream.size()) : BitsToEncode / 8U};
+		for(unsigned int i{0}; i < 4U; ++i) {
+			trailer[i] = static_cast<unsigned char>(StreamLength >> (24U - 8U * i));
+		}
+	}
+	else {
+		trailer[0] = static_cast<unsigned char>((SourceImage.rows / PowersOfTwo[8]) % PowersOfTwo[8]); // bits 0-7
+		trailer[1] = static_cast<unsigned char>(SourceImage.rows % PowersOfTwo[8]);					   // bits 8-15
+		trailer[2] = static_cast<unsigned char>((SourceImage.channels() == 1 ? PowersOfTwo[7] : 0)
+												+ ((SourceImage.cols / PowersOfTwo[8]) % PowersOfTwo[7])); // bits 16-23
+		trailer[3] = static_cast<unsigned char>(SourceImage.cols % PowersOfTwo[8]);						   // bits 24-31
+	}
 
 	/* Checksum config
 	** Checksum is the last channel of 2nd pixel used by the trailer
-	** Checksum = XOR(trailer in 8 bit chunks, last channel in BaseImage)
+	** Checksum = XOR(trailer in 8 bit chunks, low byte of the last channel in BaseImage), XOR CheckedMarker for extended streams
+	** (and KeyedMarker for keyed ones, EncryptedMarker for encrypted ones, FecMarker for error corrected ones, TileOrderMarker() for
+	** streams in tile order), AdaptiveMarker instead of CheckedMarker for tiled streams
+	** and BgraMarker for BGRA bases
 	*/
-	trailer[4] = static_cast<unsigned char>(trailer[0] ^ trailer[1] ^ trailer[2] ^ trailer[3] ^ BaseImage.data[TotalBaseChannels - 1]);
+	trailer[4] = static_cast<unsigned char>(VisitChannels(BaseImage, [&](const auto* const BaseImageData) {
+												return TrailerChecksum(trailer, BaseImageData, TotalBaseChannels, PixelChannels);
+											})
+											^ (tiled ? AdaptiveMarker : extended ? CheckedMarker : 0U) ^ (key.empty() ? 0U : KeyedMarker)
+											^ (encrypt ? EncryptedMarker : 0U) ^ (fecparity ? FecMarker : 0U)
+											^ TileOrderMarker(tiled ? 0U : tileorder));
+
+	display.join();
 
-	// Applying Trailer in 2 bits per channel => 6 pixels and 2 channels for the trailer
-	for(unsigned int ch{21}, i{0}, done{0}; ch > 1; --ch, done += 2) {
-		if(done == 8U) {
-			done = 0U;
-			++i;
+	// With affinity the output buffer and the copy of the base are allocated but not touched here. Band k goes to pinned
+	// worker 1 + k % workers (see RunStatic()), which copies the band into both before embedding, so the pages of a band are
+	// first touched, and placed, on the NUMA node of that worker. Extended streams are embedded afterwards with a split of
+	// their own, their chunks may be written from another node. The buffers bypass the pixel buffer pool, whose recycled
+	// buffers are already faulted in. An expanded base keeps its copy of the original size.
+	cv::Mat LoadedBase;
+	unsigned char* CopyData{nullptr};
+	if(affinity != AFFINITY_NONE) {
+		LoadedBase = BaseImage;
+		BaseImage = cv::Mat();
+		BaseImage.allocator = cv::Mat::getStdAllocator();
+		BaseImage.create(LoadedBase.rows, LoadedBase.cols, LoadedBase.type());
+		if(BaseImageCopy.data == LoadedBase.data) {
+			BaseImageCopy = cv::Mat();
+			BaseImageCopy.allocator = cv::Mat::getStdAllocator();
+			BaseImageCopy.create(LoadedBase.rows, LoadedBase.cols, LoadedBase.type());
+			CopyData = BaseImageCopy.data;
 		}
-		BaseImage.data[TotalBaseChannels - ch] -= BaseImage.data[TotalBaseChannels - ch] % PowersOfTwo[2];
-		BaseImage.data[TotalBaseChannels - ch] += static_cast<unsigned char>((trailer[i] / PowersOfTwo[6U - done]) % PowersOfTwo[2]);
 	}
+	const unsigned char* const LoadedBaseData{LoadedBase.data};
+	const unsigned char* const SourceImageData{extended ? stream.data() : SourceImage.data};
+	const std::size_t ChannelBytes{BaseImage.elemSize1()};
+	const unsigned int UsableChannels{layout.UsableChannels};
+	const unsigned int bands{layout.job.chunks};
 
-	const std::array<unsigned int, 3> bpch{BPCH[BitsPerPixel]};
-	const unsigned int TotalSourceChannels{static_cast<unsigned int>(SourceImage.rows * SourceImage.cols * SourceImage.channels())};
-	unsigned char *const SourceImageData{SourceImage.data}, *const BaseImageData{BaseImage.data};
-
-	std::vector<std::thread> thread_pool;
-	thread_pool.reserve(threads);
-	display.join();
-	for(unsigned int k{0}; k < threads; ++k) {
-		thread_pool.emplace_back(
-			std::thread([k, &stride, &bpch, &BitsPerPixel, &BaseImageData, &SourceImageData, &TotalSourceChannels, &TotalBaseChannels] {
-				// i = index pointing to Base Image
-				// j = index pointing to Source Image
-				// BGR = Active channel (Blue, Green, Red)
-				// TransferredBits = Number of bits transferred which do not make up a full byte, see the encoding loop for details
-				unsigned int i{0}, j{0}, TransferredBits{0}, BGR{0};
-				if(k > 0) {
-					// Number of iterations performed before the new loop
-					const unsigned int n{((TotalBaseChannels - 21U) / threads) * k};
-					i = n;
-					// Jump made by a stride in channels
-					const unsigned int stridechjump{(stride + 1U) * 3U};
-					// Total bits transferred by previous loops
-					unsigned int tbt{0};
-					if(stride != 0U) {
-						// If i points to a channel which will encode bits in it, the following calculation will return a value in [0, 3)
-						// If it will not encode bits in it, the value will be >= 3
-						BGR = i % stridechjump;
-						if(BGR > 2U) {
-							// Jumping to the next suitable pixel for encoding
-							i += stridechjump - BGR;
-							// obviously moving to next fresh pixel implies we are on its first channel, hence BGR = 0
-							BGR = 0U;
-						}
-						// Number of pixels traversed by previous loops = first pixel + number of strides taken
-						unsigned int pixelsdone = n / (stridechjump);
-						// If fully divisible => first pixel is already counted, else need to add it separately
-						if(n % stridechjump != 0U) {
-							++pixelsdone;
-						}
-						// Total bits transferred = (number of pixels) * (bits in each pixel)
-						tbt = pixelsdone * (BitsPerPixel + 1U);
-					}
-					else {
-						// No strides, all encoding pixels are together
-						BGR = i % 3U;
-						tbt = (i / 3U) * (BitsPerPixel + 1U);
+	// The kernels are instantiated for the width of the base channels and the number of channels per pixel
+	VisitChannels(BaseImage, [&](auto* const BaseImageData) {
+		VisitBpch(PixelChannels, BitsPerPixel, [&](const auto& bpch) {
+			const std::function<void(unsigned int)> band{[&](const unsigned int k) {
+				if(LoadedBaseData) {
+					// Last band also carries the trailer channels
+					const std::size_t first{static_cast<std::size_t>(UsableChannels / bands) * k};
+					const std::size_t last{(k == bands - 1U) ? TotalBaseChannels : layout.ends[k]};
+					std::memcpy(BaseImageData + first, LoadedBaseData + first * ChannelBytes, (last - first) * ChannelBytes);
+					if(CopyData) {
+						std::memcpy(CopyData + first * ChannelBytes, LoadedBaseData + first * ChannelBytes, (last - first) * ChannelBytes);
 					}
-					// BGR > 0 => Previous loop encoded extra channels after fully encoded pixels
-					if(BGR == 1U) {
-						tbt += bpch[0];
-					}
-					else if(BGR == 2U) {
-						tbt += bpch[0] + bpch[1];
-					}
-					// Number of bytes transferred
-					j = tbt / 8U;
-					TransferredBits = tbt % 8U;
 				}
-				for(; j < TotalSourceChannels
-					  && i < ((k == threads - 1U) ? (TotalBaseChannels - 21U) : ((TotalBaseChannels - 21U) / threads * (k + 1U)));
-					++BGR, ++i) {
-					if(BGR == 3U) {
-						BGR = 0U;
-						i += stride * 3U;
-					}
-					unsigned int ChannelBits{bpch[BGR]};
-					if(ChannelBits) {
-						BaseImageData[i] -= BaseImageData[i] % PowersOfTwo[ChannelBits];
-						if(TransferredBits + ChannelBits > 8U) {
-							unsigned int NextChannelBits{ChannelBits + TransferredBits};
-							NextChannelBits -= 8U;
-							BaseImageData[i] += ((SourceImageData[j] % PowersOfTwo[8U - TransferredBits]) * PowersOfTwo[NextChannelBits]);
-							++j;
-							BaseImageData[i] += (SourceImageData[j] / PowersOfTwo[8U - NextChannelBits]) % PowersOfTwo[NextChannelBits];
-							TransferredBits = NextChannelBits;
-						}
-						else {
-							BaseImageData[i]
-								+= (SourceImageData[j] / PowersOfTwo[(8U - ChannelBits) - TransferredBits]) % PowersOfTwo[ChannelBits];
-							TransferredBits += ChannelBits;
-							if(TransferredBits == 8U) {
-								TransferredBits = 0U;
-								++j;
-							}
-						}
-					}
+				// Extended streams are embedded chunk by chunk below, once the bands are in place
+				if(!extended) {
+					EmbedRange(BaseImageData, SourceImageData, TotalSourceChannels, layout.starts[k], layout.ends[k], stride, bpch);
 				}
-			}));
-	}
-	for(unsigned int k{0}; k < threads; ++k) {
-		thread_pool[k].join();
-	}
+			}};
+			if(affinity != AFFINITY_NONE) {
+				WorkerPool::Instance().RunStatic(bands, band);
+			}
+			else {
+				WorkerPool::Instance().Run(bands, band, layout.job.workers);
+			}
+		});
+		if(tiled) {
+			EmbedTiles(BaseImage, tiles, SourceImageData, TotalSourceChannels);
+		}
+		else if(extended) {
+			const TileWalk walk(tileorder, static_cast<unsigned int>(BaseImage.rows), static_cast<unsigned int>(BaseImage.cols));
+			EmbedStream(BaseImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, walk, SourceImageData, TotalSourceChannels);
+		}
+		WriteTrailer(BaseImageData, TotalBaseChannels, trailer);
+	});
+	LoadedBase.release();
 
 	std::thread saveimage([&output, &BaseImage] {
 		Stegano::Logger::Verbose("Finished encoding", '\n', "Saving encoded image", '\n');
 
-		try {
-			cv::imwrite(output, BaseImage,
-						std::vector<int>{cv::IMWRITE_PNG_COMPRESSION, 4, cv::IMWRITE_PNG_STRATEGY, cv::IMWRITE_PNG_STRATEGY_FILTERED});
-			Stegano::Logger::Log("Image saved at - ", output, '\n');
-		}
-		catch(cv::Exception& e) {
-			if(e.code == -2) {
-				Stegano::Logger::Error("Error!", " Cannot save the output file with the given name!", '\n');
-				Stegano::Logger::Log("If this is a privileged directory, please run this application in elevated mode.", '\n',
-									 "Saving as Encoded.png in the working directory");
-				try {
-					cv::imwrite("Encoded.png", BaseImage);
-					Stegano::Logger::Log("Image saved at - .\\Encoded.png", '\n');
-				}
-				catch(cv::Exception& E) {
-					if(E.code == -2) {
-						Stegano::Logger::Error("Error!", " Cannot save as Encoded.png as well, skipping save step.", '\n');
-					}
-				}
-			}
-		}
+		SaveImage(output, BaseImage, "Encoded", tileorder);
 	});
 
 	if(showimages) {
+		// saveimage is still reading BaseImage, the shrunk copy is made next to it
+		cv::Mat EncodedCopy{BaseImage};
 #if _WIN32
-		ResizeToSmall(BaseImage, BaseImage, "Encoded Image");
+		ResizeToSmall(BaseImage, EncodedCopy, "Encoded Image");
 #endif
 		cv::namedWindow("Encoded Base", cv::WINDOW_AUTOSIZE);
-		cv::imshow("Encoded Base", BaseImage);
+		cv::imshow("Encoded Base", EncodedCopy);
 		cv::waitKey(0);
 	}
 
@@ -370,15 +410,21 @@ bool ParallelEncode(const std::string& base, const std::string& source, const st
 		Stegano::Logger::Verbose('\n', "Encoding took: ", timetaken, " seconds");
 	}
 
+	const int channels{BaseImage.channels()};
 	auto MSE = cv::quality::QualityMSE::compute(BaseImage, BaseImageCopy, cv::noArray());
-	Stegano::Logger::Verbose("\n\n", "Per channel MSE = ", MSE, '\n', "Total MSE = ", (MSE[0] + MSE[1] + MSE[2]) / 3);
+	Stegano::Logger::Verbose("\n\n", "Per channel MSE = ", MSE, '\n', "Total MSE = ", ChannelMean(MSE, channels));
 
-	auto PSNR = cv::quality::QualityPSNR::compute(BaseImage, BaseImageCopy, cv::noArray());
-	uint32_t temp{255 * 255 * 4};
-	Stegano::Logger::Verbose("\n\n", "Per channel PSNR = ", PSNR, '\n', "Total PSNR = ", 10.0 * log10(temp / (MSE[0] + MSE[1] + MSE[2])));
+	// 16 bit and floating point bases peak at 65535 and 1.0
+	const double peak{PeakValue(BaseImage)};
+	auto PSNR = cv::quality::QualityPSNR::compute(BaseImage, BaseImageCopy, cv::noArray(), peak);
+	Stegano::Logger::Verbose("\n\n", "Per channel PSNR = ", PSNR, '\n', "Total PSNR = ", TotalPsnr(MSE, BaseImage));
 
 	auto SSIM = cv::quality::QualitySSIM::compute(BaseImage, BaseImageCopy, cv::noArray());
-	Stegano::Logger::Verbose("\n\n", "Per channel SSIM = ", SSIM, '\n', "Total SSIM = ", (SSIM[0] + SSIM[1] + SSIM[2]) / 3, '\n');
+	Stegano::Logger::Verbose("\n\n", "Per channel SSIM = ", SSIM, '\n', "Total SSIM = ", ChannelMean(SSIM, channels), '\n');
+
+	if(analyse) {
+		ReportDetectability(AnalyseLsb(BaseImageCopy), AnalyseLsb(BaseImage), "encoded image");
+	}
 
 	return true;
 }
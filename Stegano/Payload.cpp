@@ -0,0 +1,583 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoPayload.h"
+#include "SteganoKernels.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+namespace Stegano {
+
+namespace {
+// Rice codes with a quotient this large are replaced by the escape prefix and the raw 8 bit value
+constexpr unsigned int RiceEscape{24U};
+// Number of samples after which the statistics of a Rice context are halved, lets the coder follow the image content
+constexpr unsigned int RiceWindow{64U};
+constexpr unsigned int FilterBits{3U};
+constexpr std::array<unsigned char, 4> PrepackMagic{'S', 'G', 'P', 'K'};
+
+enum RowFilter : unsigned int { FILTER_NONE = 0U, FILTER_SUB = 1U, FILTER_UP = 2U, FILTER_AVERAGE = 3U, FILTER_PAETH = 4U };
+
+void PutLittleEndian(std::vector<unsigned char>& out, const unsigned int value, const unsigned int bytes) {
+	for(unsigned int b{0}; b < bytes; ++b) {
+		out.push_back(static_cast<unsigned char>(value >> (8U * b)));
+	}
+}
+
+unsigned int GetLittleEndian(const unsigned char* const data, const unsigned int bytes) {
+	unsigned int value{0};
+	for(unsigned int b{0}; b < bytes; ++b) {
+		value |= static_cast<unsigned int>(data[b]) << (8U * b);
+	}
+	return value;
+}
+
+void PutRecord(std::vector<unsigned char>& out, const PayloadTag tag, const unsigned int value, const unsigned int bytes) {
+	out.push_back(tag);
+	out.push_back(static_cast<unsigned char>(bytes));
+	PutLittleEndian(out, value, bytes);
+}
+
+class BitWriter {
+	std::vector<unsigned char>& out;
+	std::uint64_t bits{0};
+	unsigned int count{0};
+
+public:
+	explicit BitWriter(std::vector<unsigned char>& buffer) : out(buffer) {
+	}
+
+	// n <= 32
+	void Put(const unsigned int value, const unsigned int n) {
+		bits = (bits << n) | (value & ((std::uint64_t{1} << n) - 1U));
+		count += n;
+		while(count >= 8U) {
+			count -= 8U;
+			out.push_back(static_cast<unsigned char>(bits >> count));
+		}
+		bits &= (std::uint64_t{1} << count) - 1U;
+	}
+
+	void Finish() {
+		if(count) {
+			Put(0U, 8U - count);
+		}
+	}
+};
+
+class BitReader {
+	const unsigned char* data;
+	std::size_t length;
+	std::size_t position{0};
+	std::uint64_t bits{0};
+	unsigned int count{0};
+
+public:
+	bool overrun{false};
+
+	BitReader(const unsigned char* const buffer, const std::size_t size) : data(buffer), length(size) {
+	}
+
+	// Carries on reading from the start of another buffer, the bits already read ahead are kept
+	void Refill(const unsigned char* const buffer, const std::size_t size) {
+		data = buffer;
+		length = size;
+		position = 0U;
+	}
+
+	// Bytes of the current buffer read so far
+	std::size_t Position() const {
+		return position;
+	}
+
+	// Bits left, read ahead or not
+	std::size_t Available() const {
+		return (length - position) * 8U + count;
+	}
+
+	// n <= 32
+	unsigned int Get(const unsigned int n) {
+		while(count < n) {
+			if(position < length) {
+				bits = (bits << 8U) | data[position++];
+			}
+			else {
+				bits <<= 8U;
+				overrun = true;
+			}
+			count += 8U;
+		}
+		count -= n;
+		return static_cast<unsigned int>((bits >> count) & ((std::uint64_t{1} << n) - 1U));
+	}
+};
+
+// Adaptive Rice parameter, as in LOCO-I: the smallest k for which samples * 2^k reaches the sum of the mapped residuals
+struct RiceContext {
+	unsigned int sum{4U}, samples{1U};
+
+	unsigned int Parameter() const {
+		unsigned int k{0};
+		while((samples << k) < sum && k < 7U) {
+			++k;
+		}
+		return k;
+	}
+
+	void Update(const unsigned int mapped) {
+		sum += mapped;
+		if(++samples == RiceWindow) {
+			sum /= 2U;
+			samples /= 2U;
+		}
+	}
+};
+
+inline unsigned int Predict(const unsigned int filter, const int a, const int b, const int c) {
+	switch(filter) {
+		case FILTER_SUB:
+			return static_cast<unsigned int>(a);
+		case FILTER_UP:
+			return static_cast<unsigned int>(b);
+		case FILTER_AVERAGE:
+			return static_cast<unsigned int>((a + b) / 2);
+		case FILTER_PAETH: {
+			const int p{a + b - c}, pa{std::abs(p - a)}, pb{std::abs(p - b)}, pc{std::abs(p - c)};
+			return static_cast<unsigned int>((pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c));
+		}
+		default:
+			return 0U;
+	}
+}
+
+// Signed 8 bit residual => [0, 256) with small magnitudes first
+inline unsigned int ZigZag(const unsigned int value, const unsigned int prediction) {
+	const int residual{static_cast<signed char>(static_cast<unsigned char>(value - prediction))};
+	return residual >= 0 ? static_cast<unsigned int>(residual) * 2U : static_cast<unsigned int>(-residual) * 2U - 1U;
+}
+
+inline unsigned int UnZigZag(const unsigned int mapped, const unsigned int prediction) {
+	const int residual{(mapped & 1U) ? -static_cast<int>((mapped + 1U) / 2U) : static_cast<int>(mapped / 2U)};
+	return static_cast<unsigned char>(static_cast<int>(prediction) + residual);
+}
+
+/**
+ * Every row picks the PNG filter with the smallest sum of absolute residuals (same heuristic as libpng), residuals are then
+ * Rice coded with one adaptive context per channel.
+ */
+void CompressRows(const cv::Mat& image, std::vector<unsigned char>& out) {
+	const unsigned int channels{static_cast<unsigned int>(image.channels())};
+	const unsigned int width{static_cast<unsigned int>(image.cols) * channels};
+	std::vector<unsigned char> zeros(width, 0U);
+	std::vector<RiceContext> contexts(channels);
+	BitWriter writer(out);
+
+	for(int r{0}; r < image.rows; ++r) {
+		const unsigned char* const row{image.ptr(r)};
+		const unsigned char* const up{r ? image.ptr(r - 1) : zeros.data()};
+
+		unsigned int best{FILTER_NONE}, bestcost{~0U};
+		for(unsigned int filter{FILTER_NONE}; filter <= FILTER_PAETH; ++filter) {
+			unsigned int cost{0};
+			for(unsigned int x{0}; x < width; ++x) {
+				const int a{x >= channels ? row[x - channels] : 0}, c{x >= channels ? up[x - channels] : 0};
+				const unsigned int mapped{ZigZag(row[x], Predict(filter, a, up[x], c))};
+				cost += (mapped + 1U) / 2U;
+			}
+			if(cost < bestcost) {
+				bestcost = cost;
+				best = filter;
+			}
+		}
+
+		writer.Put(best, FilterBits);
+		for(unsigned int x{0}, ch{0}; x < width; ++x, ++ch) {
+			if(ch == channels) {
+				ch = 0U;
+			}
+			const int a{x >= channels ? row[x - channels] : 0}, c{x >= channels ? up[x - channels] : 0};
+			const unsigned int mapped{ZigZag(row[x], Predict(best, a, up[x], c))};
+			const unsigned int k{contexts[ch].Parameter()};
+			const unsigned int quotient{mapped >> k};
+			if(quotient < RiceEscape) {
+				writer.Put(((1U << quotient) - 1U) << 1U, quotient + 1U);
+				writer.Put(mapped, k);
+			}
+			else {
+				writer.Put((1U << RiceEscape) - 1U, RiceEscape);
+				writer.Put(mapped, 8U);
+			}
+			contexts[ch].Update(mapped);
+		}
+	}
+	writer.Finish();
+}
+}
+
+std::vector<unsigned char> WritePayloadHeader(const PayloadHeader& header) {
+	std::vector<unsigned char> out{'S', 'G', PayloadVersion, 0U, 0U};
+	PutRecord(out, TAG_TYPE, header.type, 1U);
+	PutRecord(out, TAG_CODEC, header.codec, 1U);
+	if(header.type == PAYLOAD_IMAGE) {
+		out.push_back(TAG_IMAGE);
+		out.push_back(5U);
+		PutLittleEndian(out, header.rows, 2U);
+		PutLittleEndian(out, header.cols, 2U);
+		PutLittleEndian(out, header.channels, 1U);
+	}
+	if(header.type == PAYLOAD_SHARD) {
+		out.push_back(TAG_SHARD);
+		out.push_back(12U);
+		PutLittleEndian(out, header.shard, 2U);
+		PutLittleEndian(out, header.shards, 2U);
+		PutLittleEndian(out, header.offset, 4U);
+		PutLittleEndian(out, header.total, 4U);
+	}
+	if(header.type == PAYLOAD_CONTAINER) {
+		PutRecord(out, TAG_ENTRIES, header.entries, 2U);
+	}
+	if(!header.name.empty()) {
+		const std::size_t size{header.name.size() > 255U ? 255U : header.name.size()};
+		out.push_back(TAG_NAME);
+		out.push_back(static_cast<unsigned char>(size));
+		out.insert(out.end(), header.name.begin(), header.name.begin() + static_cast<std::ptrdiff_t>(size));
+	}
+	PutRecord(out, TAG_LENGTH, header.length, 4U);
+	out[3] = static_cast<unsigned char>(out.size());
+	out[4] = static_cast<unsigned char>(out.size() >> 8U);
+	return out;
+}
+
+unsigned int ReadPayloadHeader(const unsigned char* const stream, const std::size_t length, PayloadHeader& header) {
+	if(length < 5U || stream[0] != 'S' || stream[1] != 'G' || stream[2] == 0U || stream[2] > PayloadVersion) {
+		return 0U;
+	}
+	const unsigned int HeaderLength{GetLittleEndian(stream + 3, 2U)};
+	if(HeaderLength < 5U || HeaderLength > length) {
+		return 0U;
+	}
+	header = PayloadHeader();
+	for(unsigned int position{5}; position + 2U <= HeaderLength;) {
+		const unsigned int tag{stream[position]}, size{stream[position + 1U]};
+		const unsigned char* const value{stream + position + 2U};
+		position += 2U + size;
+		if(position > HeaderLength) {
+			return 0U;
+		}
+		switch(tag) {
+			case TAG_TYPE:
+				header.type = GetLittleEndian(value, size > 4U ? 4U : size);
+				break;
+			case TAG_CODEC:
+				header.codec = GetLittleEndian(value, size > 4U ? 4U : size);
+				break;
+			case TAG_IMAGE:
+				if(size >= 5U) {
+					header.rows = GetLittleEndian(value, 2U);
+					header.cols = GetLittleEndian(value + 2, 2U);
+					header.channels = value[4];
+				}
+				break;
+			case TAG_LENGTH:
+				header.length = GetLittleEndian(value, size > 4U ? 4U : size);
+				break;
+			case TAG_NAME:
+				header.name.assign(reinterpret_cast<const char*>(value), size);
+				break;
+			case TAG_SHARD:
+				if(size >= 12U) {
+					header.shard = GetLittleEndian(value, 2U);
+					header.shards = GetLittleEndian(value + 2, 2U);
+					header.offset = GetLittleEndian(value + 4, 4U);
+					header.total = GetLittleEndian(value + 8, 4U);
+				}
+				break;
+			case TAG_ENTRIES:
+				header.entries = GetLittleEndian(value, size > 4U ? 4U : size);
+				break;
+			default:
+				// Written by a newer version, not needed to decode the body
+				break;
+		}
+	}
+	return HeaderLength;
+}
+
+std::vector<unsigned char> PackContainer(const std::vector<std::vector<unsigned char>>& entries) {
+	PayloadHeader header;
+	header.type = PAYLOAD_CONTAINER;
+	header.entries = static_cast<unsigned int>(entries.size());
+	unsigned long long body{entries.size() * static_cast<unsigned long long>(ContainerEntryBytes)};
+	for(const auto& stream : entries) {
+		body += stream.size();
+	}
+	header.length = static_cast<unsigned int>(body);
+	std::vector<unsigned char> out{WritePayloadHeader(header)};
+	const std::size_t DirectoryEnd{out.size() + entries.size() * ContainerEntryBytes};
+	out.reserve(out.size() + body);
+	// Entries are laid out in order right after the directory
+	std::size_t offset{DirectoryEnd};
+	for(const auto& stream : entries) {
+		PayloadHeader EntryHeader;
+		ReadPayloadHeader(stream.data(), stream.size(), EntryHeader);
+		PutLittleEndian(out, static_cast<unsigned int>(offset), 4U);
+		PutLittleEndian(out, static_cast<unsigned int>(stream.size()), 4U);
+		PutLittleEndian(out, EntryHeader.type, 1U);
+		offset += stream.size();
+	}
+	for(const auto& stream : entries) {
+		out.insert(out.end(), stream.begin(), stream.end());
+	}
+	return out;
+}
+
+unsigned int DirectoryLength(const unsigned char* const stream, const std::size_t length) {
+	PayloadHeader header;
+	const unsigned int HeaderLength{ReadPayloadHeader(stream, length, header)};
+	if(!HeaderLength || header.type != PAYLOAD_CONTAINER || header.entries == 0U
+	   || header.entries * static_cast<unsigned long long>(ContainerEntryBytes) > header.length) {
+		return 0U;
+	}
+	return HeaderLength + header.entries * ContainerEntryBytes;
+}
+
+bool ReadDirectory(const unsigned char* const stream, const std::size_t length, std::vector<ContainerEntry>& directory) {
+	const unsigned int DirectoryEnd{DirectoryLength(stream, length)};
+	if(!DirectoryEnd || DirectoryEnd > length) {
+		return false;
+	}
+	PayloadHeader header;
+	const unsigned int HeaderLength{ReadPayloadHeader(stream, length, header)};
+	const unsigned long long ContainerLength{static_cast<unsigned long long>(HeaderLength) + header.length};
+	directory.resize(header.entries);
+	for(unsigned int k{0}; k < header.entries; ++k) {
+		const unsigned char* const record{stream + HeaderLength + k * ContainerEntryBytes};
+		ContainerEntry& found{directory[k]};
+		found.offset = GetLittleEndian(record, 4U);
+		found.length = GetLittleEndian(record + 4, 4U);
+		found.type = record[8];
+		if(found.offset < DirectoryEnd || static_cast<unsigned long long>(found.offset) + found.length > ContainerLength) {
+			return false;
+		}
+	}
+	return true;
+}
+
+std::vector<unsigned char> PackImage(const cv::Mat& image) {
+	PayloadHeader header;
+	header.type = PAYLOAD_IMAGE;
+	header.rows = static_cast<unsigned int>(image.rows);
+	header.cols = static_cast<unsigned int>(image.cols);
+	header.channels = static_cast<unsigned int>(image.channels());
+	header.length = header.rows * header.cols * header.channels;
+
+	std::vector<unsigned char> body;
+	if(compress) {
+		body.reserve(header.length / 2U);
+		CompressRows(image, body);
+		Stegano::Logger::Verbose("Payload compressed from ", header.length, " to ", body.size(), " bytes", '\n');
+		if(body.size() < header.length) {
+			header.codec = CODEC_PREDICTIVE;
+		}
+		else {
+			Stegano::Logger::Verbose("Compression does not pay off for this payload, embedding it as is", '\n');
+		}
+	}
+	if(header.codec == CODEC_NONE) {
+		const std::size_t RowBytes{static_cast<std::size_t>(header.cols) * header.channels};
+		body.resize(header.length);
+		for(int r{0}; r < image.rows; ++r) {
+			std::memcpy(body.data() + RowBytes * static_cast<std::size_t>(r), image.ptr(r), RowBytes);
+		}
+	}
+
+	std::vector<unsigned char> stream{WritePayloadHeader(header)};
+	stream.insert(stream.end(), body.begin(), body.end());
+	return stream;
+}
+
+struct ImageUnpacker::State {
+	PayloadHeader header;
+	cv::Mat image;
+	std::vector<RiceContext> contexts;
+	// Row above the first one
+	std::vector<unsigned char> zeros;
+	// Body bytes written but not consumed by a decoded row yet
+	std::vector<unsigned char> pending;
+	BitReader reader{nullptr, 0U};
+	int row{0};
+	bool damaged{false};
+
+	// Decodes the rows held by [data, data + size), or every row left once the body is complete, returns the bytes consumed
+	std::size_t Decode(const unsigned char* const data, const std::size_t size, const bool complete) {
+		const unsigned int channels{static_cast<unsigned int>(image.channels())};
+		const unsigned int width{static_cast<unsigned int>(image.cols) * channels};
+		if(header.codec == CODEC_NONE) {
+			std::size_t consumed{0};
+			for(; row < image.rows && size - consumed >= width; ++row, consumed += width) {
+				std::memcpy(image.ptr(row), data + consumed, width);
+			}
+			return consumed;
+		}
+		// A sample takes at most the escape prefix and its raw value
+		const std::size_t RowBits{FilterBits + static_cast<std::size_t>(width) * (RiceEscape + 8U)};
+		reader.Refill(data, size);
+		for(; row < image.rows && !damaged && (complete || reader.Available() >= RowBits); ++row) {
+			unsigned char* const current{image.ptr(row)};
+			const unsigned char* const up{row ? image.ptr(row - 1) : zeros.data()};
+			const unsigned int filter{reader.Get(FilterBits)};
+			if(filter > FILTER_PAETH) {
+				damaged = true;
+				break;
+			}
+			for(unsigned int x{0}, ch{0}; x < width; ++x, ++ch) {
+				if(ch == channels) {
+					ch = 0U;
+				}
+				const unsigned int k{contexts[ch].Parameter()};
+				unsigned int quotient{0};
+				while(quotient < RiceEscape && reader.Get(1U)) {
+					++quotient;
+				}
+				const unsigned int mapped{quotient < RiceEscape ? (quotient << k) | reader.Get(k) : reader.Get(8U)};
+				const int a{x >= channels ? current[x - channels] : 0}, c{x >= channels ? up[x - channels] : 0};
+				current[x] = static_cast<unsigned char>(UnZigZag(mapped, Predict(filter, a, up[x], c)));
+				contexts[ch].Update(mapped);
+			}
+			damaged = reader.overrun;
+		}
+		return reader.Position();
+	}
+};
+
+ImageUnpacker::ImageUnpacker() : state{std::make_unique<State>()} {
+}
+
+ImageUnpacker::~ImageUnpacker() = default;
+
+bool ImageUnpacker::Start(const PayloadHeader& header) {
+	if(header.type != PAYLOAD_IMAGE || !header.rows || !header.cols || (header.channels != 1U && header.channels != 3U)
+	   || (header.codec != CODEC_NONE && header.codec != CODEC_PREDICTIVE)) {
+		return false;
+	}
+	state = std::make_unique<State>();
+	state->header = header;
+	state->image = cv::Mat::zeros(static_cast<int>(header.rows), static_cast<int>(header.cols), header.channels == 1U ? CV_8UC1 : CV_8UC3);
+	state->contexts.resize(header.channels);
+	state->zeros.assign(static_cast<std::size_t>(header.cols) * header.channels, 0U);
+	return true;
+}
+
+bool ImageUnpacker::Write(const unsigned char* const data, const std::size_t size) {
+	State& s{*state};
+	if(s.image.empty() || s.damaged) {
+		return false;
+	}
+	// Bytes are only copied when a row spans two writes
+	if(s.pending.empty()) {
+		const std::size_t consumed{s.Decode(data, size, false)};
+		s.pending.assign(data + consumed, data + size);
+	}
+	else {
+		s.pending.insert(s.pending.end(), data, data + size);
+		const std::size_t consumed{s.Decode(s.pending.data(), s.pending.size(), false)};
+		s.pending.erase(s.pending.begin(), s.pending.begin() + static_cast<std::ptrdiff_t>(consumed));
+	}
+	return !s.damaged;
+}
+
+bool ImageUnpacker::Finish() {
+	State& s{*state};
+	if(s.image.empty()) {
+		return false;
+	}
+	s.Decode(s.pending.data(), s.pending.size(), true);
+	s.pending.clear();
+	return !s.damaged && s.row == s.image.rows;
+}
+
+const cv::Mat& ImageUnpacker::Image() const {
+	return state->image;
+}
+
+bool UnpackImage(const unsigned char* const stream, const std::size_t length, cv::Mat& image) {
+	PayloadHeader header;
+	const unsigned int HeaderLength{ReadPayloadHeader(stream, length, header)};
+	ImageUnpacker unpacker;
+	if(!HeaderLength || !unpacker.Start(header)) {
+		return false;
+	}
+	unpacker.Write(stream + HeaderLength, length - HeaderLength);
+	const bool complete{unpacker.Finish()};
+	image = unpacker.Image();
+	return complete;
+}
+
+bool ReadSource(const std::string& path, PrepackedSource& source) {
+	std::ifstream file(path, std::ios::binary);
+	std::array<unsigned char, 4> magic{};
+	if(!file.read(reinterpret_cast<char*>(magic.data()), magic.size()) || magic != PrepackMagic) {
+		file.close();
+		source.image = ReadImage(path, cv::IMREAD_COLOR);
+		return source.image.data != nullptr;
+	}
+	const std::vector<unsigned char> data{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+	const std::size_t HeaderBytes{PrepackHeaderBytes - magic.size()};
+	if(data.size() < HeaderBytes || data[0] > PrepackVersion) {
+		Stegano::Logger::Error("Error!", " The prepacked payload is truncated or was written by a newer version", '\n');
+		return false;
+	}
+	const unsigned int length{GetLittleEndian(data.data() + 8, 4U)};
+	if(data.size() - HeaderBytes < length || Crc32c(data.data() + HeaderBytes, length) != GetLittleEndian(data.data() + 12, 4U)) {
+		Stegano::Logger::Error("Error!", " The prepacked payload is damaged", '\n');
+		return false;
+	}
+	source.compressed = (data[1] & 1U) != 0U;
+	source.BaseRows = GetLittleEndian(data.data() + 2, 2U);
+	source.BaseCols = GetLittleEndian(data.data() + 4, 2U);
+	source.BaseChannels = data[6];
+	source.BaseChannelBytes = data[7];
+	const auto first{data.begin() + static_cast<std::ptrdiff_t>(HeaderBytes)};
+	source.stream.assign(first, first + length);
+	if(!UnpackImage(source.stream.data(), source.stream.size(), source.image)) {
+		Stegano::Logger::Error("Error!", " The prepacked payload does not hold an image", '\n');
+		return false;
+	}
+	Stegano::Logger::Verbose("Prepacked payload of [", source.image.rows, " x ", source.image.cols, " x ", source.image.channels(),
+							 "], reduced for a base of [", source.BaseRows, " x ", source.BaseCols, " x ", source.BaseChannels, "]", '\n');
+	return true;
+}
+
+std::vector<unsigned char> SourceStream(const PrepackedSource& source) {
+	if(!source.stream.empty() && source.compressed == compress) {
+		Stegano::Logger::Verbose("Reusing the prepacked stream of ", source.stream.size(), " bytes", '\n');
+		return source.stream;
+	}
+	return PackImage(source.image);
+}
+
+bool WritePrepacked(const std::string& path, const std::vector<unsigned char>& stream, const cv::Mat& base) {
+	std::vector<unsigned char> header(PrepackMagic.begin(), PrepackMagic.end());
+	header.push_back(PrepackVersion);
+	header.push_back(compress ? 1U : 0U);
+	PutLittleEndian(header, static_cast<unsigned int>(base.rows), 2U);
+	PutLittleEndian(header, static_cast<unsigned int>(base.cols), 2U);
+	header.push_back(static_cast<unsigned char>(base.channels()));
+	header.push_back(static_cast<unsigned char>(base.elemSize1()));
+	PutLittleEndian(header, static_cast<unsigned int>(stream.size()), 4U);
+	PutLittleEndian(header, Crc32c(stream.data(), stream.size()), 4U);
+
+	std::ofstream file(path, std::ios::binary);
+	file.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+	file.write(reinterpret_cast<const char*>(stream.data()), static_cast<std::streamsize>(stream.size()));
+	if(!file.flush()) {
+		Stegano::Logger::Error("Error!", " Cannot save the prepacked payload at ", path, '\n');
+		return false;
+	}
+	Stegano::Logger::Log("Prepacked payload saved at - ", path, '\n');
+	return true;
+}
+
+}
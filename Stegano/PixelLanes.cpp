@@ -0,0 +1,281 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoKernels.h"
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__)
+	#define STEGANO_LANES_AVX2 1
+	#include <immintrin.h>
+	#if _WIN32
+		#include <intrin.h>
+		#define STEGANO_TARGET_AVX2
+		#define STEGANO_TARGET_AVX512
+	#else
+		#define STEGANO_TARGET_AVX2 __attribute__((target("avx2")))
+		#define STEGANO_TARGET_AVX512 __attribute__((target("avx2,avx512f")))
+	#endif
+#endif
+
+namespace Stegano {
+
+namespace {
+// Where the bits of a pixel go, a pixel carries PixelBits payload bits read MSB first: blue takes the first ones, alpha the last
+struct LaneLayout {
+	std::array<unsigned int, 4> shift, mask;
+	unsigned int keep, PixelBits;
+};
+
+LaneLayout Layout(const std::array<unsigned int, 4>& bpch) {
+	LaneLayout layout{};
+	for(unsigned int c{4}; c > 0U; --c) {
+		layout.shift[c - 1U] = layout.PixelBits;
+		layout.mask[c - 1U] = PowersOfTwo[bpch[c - 1U]] - 1U;
+		layout.PixelBits += bpch[c - 1U];
+	}
+	// Little endian word => byte c of the word is channel c
+	layout.keep = ~(layout.mask[0] | layout.mask[1] << 8U | layout.mask[2] << 16U | layout.mask[3] << 24U);
+	return layout;
+}
+
+void ScalarEmbed(unsigned char* BaseImageData, const unsigned char* SourceImageData, unsigned int groups, const LaneLayout& layout) {
+	const unsigned int n{layout.PixelBits};
+	for(; groups; --groups) {
+		unsigned long long bits{0};
+		unsigned int held{0};
+		for(unsigned int p{0}; p < LanePixels; ++p, BaseImageData += 4) {
+			while(held < n) {
+				bits = bits << 8U | *SourceImageData++;
+				held += 8U;
+			}
+			held -= n;
+			const unsigned int value{static_cast<unsigned int>(bits >> held)};
+			const unsigned int deposit{(value >> layout.shift[0] & layout.mask[0]) | (value >> layout.shift[1] & layout.mask[1]) << 8U
+									   | (value >> layout.shift[2] & layout.mask[2]) << 16U
+									   | (value >> layout.shift[3] & layout.mask[3]) << 24U};
+			unsigned int word;
+			std::memcpy(&word, BaseImageData, 4U);
+			word = (word & layout.keep) | deposit;
+			std::memcpy(BaseImageData, &word, 4U);
+		}
+	}
+}
+
+void ScalarExtract(const unsigned char* SourceImageData, unsigned char* DecodedImageData, unsigned int groups, const LaneLayout& layout) {
+	const unsigned int n{layout.PixelBits};
+	for(; groups; --groups) {
+		unsigned long long bits{0};
+		unsigned int held{0};
+		for(unsigned int p{0}; p < LanePixels; ++p, SourceImageData += 4) {
+			unsigned int word;
+			std::memcpy(&word, SourceImageData, 4U);
+			bits = bits << n | (word & layout.mask[0]) << layout.shift[0] | (word >> 8U & layout.mask[1]) << layout.shift[1]
+				   | (word >> 16U & layout.mask[2]) << layout.shift[2] | (word >> 24U & layout.mask[3]) << layout.shift[3];
+			for(held += n; held >= 8U; held -= 8U) {
+				*DecodedImageData++ = static_cast<unsigned char>(bits >> (held - 8U));
+			}
+		}
+	}
+}
+
+#if STEGANO_LANES_AVX2
+// 8 and 16 bit pixels hold whole payload bytes, a register of 8 pixels maps to 8 or 16 payload bytes without shifting bits across lanes
+
+STEGANO_TARGET_AVX2 __m256i Deposit(const __m256i value, const LaneLayout& layout) {
+	__m256i deposit{_mm256_setzero_si256()};
+	for(unsigned int c{0}; c < 4U; ++c) {
+		const __m256i field{_mm256_and_si256(_mm256_srl_epi32(value, _mm_cvtsi32_si128(static_cast<int>(layout.shift[c]))),
+											 _mm256_set1_epi32(static_cast<int>(layout.mask[c])))};
+		deposit = _mm256_or_si256(deposit, _mm256_sll_epi32(field, _mm_cvtsi32_si128(static_cast<int>(8U * c))));
+	}
+	return deposit;
+}
+
+STEGANO_TARGET_AVX2 __m256i Gather(const __m256i word, const LaneLayout& layout) {
+	__m256i value{_mm256_setzero_si256()};
+	for(unsigned int c{0}; c < 4U; ++c) {
+		const __m256i field{_mm256_and_si256(_mm256_srl_epi32(word, _mm_cvtsi32_si128(static_cast<int>(8U * c))),
+											 _mm256_set1_epi32(static_cast<int>(layout.mask[c])))};
+		value = _mm256_or_si256(value, _mm256_sll_epi32(field, _mm_cvtsi32_si128(static_cast<int>(layout.shift[c]))));
+	}
+	return value;
+}
+
+STEGANO_TARGET_AVX2 void Avx2Embed(unsigned char* BaseImageData, const unsigned char* SourceImageData, unsigned int groups,
+								   const LaneLayout& layout) {
+	const __m256i keep{_mm256_set1_epi32(static_cast<int>(layout.keep))};
+	// Payload bytes are big endian pairs for 16 bit pixels
+	const __m128i swap{_mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14)};
+	for(; groups; --groups, BaseImageData += LanePixels * 4U) {
+		__m256i value;
+		if(layout.PixelBits == 8U) {
+			value = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(SourceImageData)));
+			SourceImageData += 8;
+		}
+		else {
+			value = _mm256_cvtepu16_epi32(_mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(SourceImageData)), swap));
+			SourceImageData += 16;
+		}
+		__m256i* const pixels{reinterpret_cast<__m256i*>(BaseImageData)};
+		_mm256_storeu_si256(pixels, _mm256_or_si256(_mm256_and_si256(_mm256_loadu_si256(pixels), keep), Deposit(value, layout)));
+	}
+}
+
+STEGANO_TARGET_AVX2 void Avx2Extract(const unsigned char* SourceImageData, unsigned char* DecodedImageData, unsigned int groups,
+									 const LaneLayout& layout) {
+	// Low byte of every lane, or its two low bytes in big endian order, packed at the start of each 128 bit half
+	const __m256i bytes{_mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 4, 8, 12, -1, -1, -1, -1, -1, -1,
+										 -1, -1, -1, -1, -1, -1)};
+	const __m256i pairs{_mm256_setr_epi8(1, 0, 5, 4, 9, 8, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1, 1, 0, 5, 4, 9, 8, 13, 12, -1, -1, -1,
+										 -1, -1, -1, -1, -1)};
+	for(; groups; --groups, SourceImageData += LanePixels * 4U) {
+		const __m256i value{Gather(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(SourceImageData)), layout)};
+		if(layout.PixelBits == 8U) {
+			const __m256i packed{_mm256_shuffle_epi8(value, bytes)};
+			const int low{_mm_cvtsi128_si32(_mm256_castsi256_si128(packed))};
+			const int high{_mm_cvtsi128_si32(_mm256_extracti128_si256(packed, 1))};
+			std::memcpy(DecodedImageData, &low, 4U);
+			std::memcpy(DecodedImageData + 4, &high, 4U);
+			DecodedImageData += 8;
+		}
+		else {
+			const __m256i packed{_mm256_shuffle_epi8(value, pairs)};
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(DecodedImageData), _mm256_castsi256_si128(packed));
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(DecodedImageData + 8), _mm256_extracti128_si256(packed, 1));
+			DecodedImageData += 16;
+		}
+	}
+}
+
+// 16 pixels per register, two groups at once. Lanes hold at most 16 payload bits, truncating them to bytes or words packs them.
+
+STEGANO_TARGET_AVX512 __m512i Deposit(const __m512i value, const LaneLayout& layout) {
+	__m512i deposit{_mm512_setzero_si512()};
+	for(unsigned int c{0}; c < 4U; ++c) {
+		const __m512i field{_mm512_and_si512(_mm512_srl_epi32(value, _mm_cvtsi32_si128(static_cast<int>(layout.shift[c]))),
+											 _mm512_set1_epi32(static_cast<int>(layout.mask[c])))};
+		deposit = _mm512_or_si512(deposit, _mm512_sll_epi32(field, _mm_cvtsi32_si128(static_cast<int>(8U * c))));
+	}
+	return deposit;
+}
+
+STEGANO_TARGET_AVX512 __m512i Gather(const __m512i word, const LaneLayout& layout) {
+	__m512i value{_mm512_setzero_si512()};
+	for(unsigned int c{0}; c < 4U; ++c) {
+		const __m512i field{_mm512_and_si512(_mm512_srl_epi32(word, _mm_cvtsi32_si128(static_cast<int>(8U * c))),
+											 _mm512_set1_epi32(static_cast<int>(layout.mask[c])))};
+		value = _mm512_or_si512(value, _mm512_sll_epi32(field, _mm_cvtsi32_si128(static_cast<int>(layout.shift[c]))));
+	}
+	return value;
+}
+
+STEGANO_TARGET_AVX512 void Avx512Embed(unsigned char* BaseImageData, const unsigned char* SourceImageData, unsigned int pairs,
+									   const LaneLayout& layout) {
+	const __m512i keep{_mm512_set1_epi32(static_cast<int>(layout.keep))};
+	const __m256i swap{_mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12,
+										15, 14)};
+	for(; pairs; --pairs, BaseImageData += 2U * LanePixels * 4U) {
+		__m512i value;
+		if(layout.PixelBits == 8U) {
+			value = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(SourceImageData)));
+			SourceImageData += 16;
+		}
+		else {
+			value = _mm512_cvtepu16_epi32(_mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(SourceImageData)), swap));
+			SourceImageData += 32;
+		}
+		_mm512_storeu_si512(BaseImageData,
+							_mm512_or_si512(_mm512_and_si512(_mm512_loadu_si512(BaseImageData), keep), Deposit(value, layout)));
+	}
+}
+
+STEGANO_TARGET_AVX512 void Avx512Extract(const unsigned char* SourceImageData, unsigned char* DecodedImageData, unsigned int pairs,
+										 const LaneLayout& layout) {
+	const __m256i swap{_mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12,
+										15, 14)};
+	for(; pairs; --pairs, SourceImageData += 2U * LanePixels * 4U) {
+		const __m512i value{Gather(_mm512_loadu_si512(SourceImageData), layout)};
+		if(layout.PixelBits == 8U) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(DecodedImageData), _mm512_cvtepi32_epi8(value));
+			DecodedImageData += 16;
+		}
+		else {
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(DecodedImageData), _mm256_shuffle_epi8(_mm512_cvtepi32_epi16(value), swap));
+			DecodedImageData += 32;
+		}
+	}
+}
+
+	#if _WIN32
+// CPUID only reports what the processor has, the OS must also save the wider registers (OSXSAVE set and the state enabled in XCR0)
+bool OsSavesState(const unsigned long long state) {
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & state) == state;
+}
+	#endif
+
+bool HasAvx2() {
+	#if _WIN32
+	int info[4];
+	__cpuidex(info, 7, 0);
+	// XMM and YMM state
+	return (info[1] & (1 << 5)) != 0 && OsSavesState(0x06ULL);
+	#else
+	// Checks XCR0 as well
+	return __builtin_cpu_supports("avx2");
+	#endif
+}
+
+bool HasAvx512() {
+	#if _WIN32
+	int info[4];
+	__cpuidex(info, 7, 0);
+	// AVX512F, on top of AVX2, with the opmask and ZMM state
+	return (info[1] & (1 << 16)) != 0 && (info[1] & (1 << 5)) != 0 && OsSavesState(0xE6ULL);
+	#else
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("avx512f");
+	#endif
+}
+#endif
+}
+
+void EmbedPixels(unsigned char* BaseImageData, const unsigned char* SourceImageData, unsigned int groups,
+				 const std::array<unsigned int, 4>& bpch) {
+	const LaneLayout layout{Layout(bpch)};
+#if STEGANO_LANES_AVX2
+	static const bool avx512{HasAvx512()}, avx2{HasAvx2()};
+	if(avx2 && (layout.PixelBits == 8U || layout.PixelBits == 16U)) {
+		if(avx512) {
+			// Pairs of groups on AVX-512, an odd group is left to AVX2
+			Avx512Embed(BaseImageData, SourceImageData, groups / 2U, layout);
+			BaseImageData += (groups & ~1U) * LanePixels * 4U;
+			SourceImageData += (groups & ~1U) * layout.PixelBits;
+			groups &= 1U;
+		}
+		Avx2Embed(BaseImageData, SourceImageData, groups, layout);
+		return;
+	}
+#endif
+	ScalarEmbed(BaseImageData, SourceImageData, groups, layout);
+}
+
+void ExtractPixels(const unsigned char* SourceImageData, unsigned char* DecodedImageData, unsigned int groups,
+				   const std::array<unsigned int, 4>& bpch) {
+	const LaneLayout layout{Layout(bpch)};
+#if STEGANO_LANES_AVX2
+	static const bool avx512{HasAvx512()}, avx2{HasAvx2()};
+	if(avx2 && (layout.PixelBits == 8U || layout.PixelBits == 16U)) {
+		if(avx512) {
+			Avx512Extract(SourceImageData, DecodedImageData, groups / 2U, layout);
+			SourceImageData += (groups & ~1U) * LanePixels * 4U;
+			DecodedImageData += (groups & ~1U) * layout.PixelBits;
+			groups &= 1U;
+		}
+		Avx2Extract(SourceImageData, DecodedImageData, groups, layout);
+		return;
+	}
+#endif
+	ScalarExtract(SourceImageData, DecodedImageData, groups, layout);
+}
+
+}
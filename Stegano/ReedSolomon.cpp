@@ -0,0 +1,468 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include "SteganoPayload.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+	#define STEGANO_RS_SSSE3 1
+	#include <tmmintrin.h>
+	#if _WIN32
+		#include <intrin.h>
+		#define STEGANO_TARGET_SSSE3
+	#else
+		#define STEGANO_TARGET_SSSE3 __attribute__((target("ssse3")))
+	#endif
+#endif
+
+namespace Stegano {
+
+namespace {
+// Symbols per codeword
+constexpr unsigned int CodewordBytes{255U};
+// Copies of the FEC header, read back by majority vote
+constexpr unsigned int HeaderCopies{3U};
+constexpr unsigned int HeaderCopyBytes{8U};
+constexpr unsigned int MaxParity{128U};
+
+// exp and log of GF(2^8) with the primitive polynomial x^8 + x^4 + x^3 + x^2 + 1, exp is doubled so that no product needs a modulo
+struct GaloisField {
+	std::array<unsigned char, 512> exp{};
+	std::array<unsigned char, 256> log{};
+	GaloisField() {
+		unsigned int x{1U};
+		for(unsigned int i{0}; i < 255U; ++i) {
+			exp[i] = exp[i + 255U] = static_cast<unsigned char>(x);
+			log[x] = static_cast<unsigned char>(i);
+			x <<= 1U;
+			if(x & 0x100U) {
+				x ^= 0x11DU;
+			}
+		}
+	}
+};
+
+const GaloisField& Field() {
+	static const GaloisField field;
+	return field;
+}
+
+inline unsigned char Multiply(const unsigned char a, const unsigned char b) {
+	const GaloisField& gf{Field()};
+	return a && b ? gf.exp[gf.log[a] + gf.log[b]] : 0U;
+}
+
+inline unsigned char Divide(const unsigned char a, const unsigned char b) {
+	const GaloisField& gf{Field()};
+	return a ? gf.exp[gf.log[a] + 255U - gf.log[b]] : 0U;
+}
+
+// Products of a constant with every low and high nibble, a pshufb each
+struct NibbleTable {
+	alignas(16) std::array<unsigned char, 16> low, high;
+	explicit NibbleTable(const unsigned char constant) {
+		for(unsigned int n{0}; n < 16U; ++n) {
+			low[n] = Multiply(constant, static_cast<unsigned char>(n));
+			high[n] = Multiply(constant, static_cast<unsigned char>(n << 4U));
+		}
+	}
+};
+
+// Generator polynomial of a code with parity symbols, and the nibble tables of its coefficients and of the syndrome roots
+struct Code {
+	unsigned int parity;
+	// generator[k] = coefficient of x^k, the coefficient of x^parity is 1
+	std::vector<unsigned char> generator;
+	std::vector<NibbleTable> GeneratorTables, RootTables;
+	explicit Code(const unsigned int ParitySymbols) : parity{ParitySymbols}, generator(ParitySymbols + 1U, 0U) {
+		// (x - a^0)(x - a^1)...(x - a^(parity - 1))
+		generator[0] = 1U;
+		for(unsigned int root{0}; root < parity; ++root) {
+			const unsigned char a{Field().exp[root]};
+			for(unsigned int k{root + 1U}; k > 0U; --k) {
+				generator[k] = generator[k - 1U] ^ Multiply(generator[k], a);
+			}
+			generator[0] = Multiply(generator[0], a);
+		}
+		for(unsigned int k{0}; k < parity; ++k) {
+			GeneratorTables.emplace_back(generator[k]);
+			RootTables.emplace_back(Field().exp[k]);
+		}
+	}
+};
+
+// Every block interleaves FecDepth codewords, symbol i of codeword j is byte i * FecDepth + j. The data symbols of a block come
+// first, so that the stream bytes are kept in order, then its parity symbols.
+struct BlockShape {
+	unsigned int blocks, DataBytes, LastRows;
+};
+
+BlockShape Shape(const unsigned long long length, const unsigned int parity) {
+	const unsigned int DataBytes{(CodewordBytes - parity) * FecDepth};
+	const unsigned int blocks{static_cast<unsigned int>((length + DataBytes - 1U) / DataBytes)};
+	const unsigned int last{static_cast<unsigned int>(length - (blocks ? blocks - 1ULL : 0ULL) * DataBytes)};
+	return BlockShape{blocks, DataBytes, (last + FecDepth - 1U) / FecDepth};
+}
+
+// Data rows of block b, the last block is shortened
+unsigned int DataRows(const BlockShape& shape, const unsigned int b) {
+	return b + 1U == shape.blocks ? shape.LastRows : shape.DataBytes / FecDepth;
+}
+
+void ScalarEncode(const Code& code, const unsigned char* const data, const unsigned int rows, unsigned char* const parity) {
+	for(unsigned int lane{0}; lane < FecDepth; ++lane) {
+		// Remainder of the division by the generator, highest degree first
+		std::array<unsigned char, MaxParity> remainder{};
+		for(unsigned int r{0}; r < rows; ++r) {
+			const unsigned char feedback{static_cast<unsigned char>(data[r * FecDepth + lane] ^ remainder[0])};
+			for(unsigned int k{0}; k + 1U < code.parity; ++k) {
+				remainder[k] = remainder[k + 1U] ^ Multiply(feedback, code.generator[code.parity - 1U - k]);
+			}
+			remainder[code.parity - 1U] = Multiply(feedback, code.generator[0]);
+		}
+		for(unsigned int k{0}; k < code.parity; ++k) {
+			parity[k * FecDepth + lane] = remainder[k];
+		}
+	}
+}
+
+// syndromes[j * FecDepth + lane] = codeword lane evaluated at a^j, returns false if every codeword is clean
+bool ScalarSyndromes(const Code& code, const unsigned char* const block, const unsigned int rows, unsigned char* const syndromes) {
+	unsigned char any{0};
+	for(unsigned int lane{0}; lane < FecDepth; ++lane) {
+		for(unsigned int j{0}; j < code.parity; ++j) {
+			const unsigned char a{Field().exp[j]};
+			unsigned char s{0};
+			for(unsigned int r{0}; r < rows; ++r) {
+				s = Multiply(s, a) ^ block[r * FecDepth + lane];
+			}
+			syndromes[j * FecDepth + lane] = s;
+			any |= s;
+		}
+	}
+	return any != 0U;
+}
+
+#if STEGANO_RS_SSSE3
+STEGANO_TARGET_SSSE3 inline __m128i Multiply(const NibbleTable& table, const __m128i low, const __m128i high) {
+	return _mm_xor_si128(_mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(table.low.data())), low),
+						 _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(table.high.data())), high));
+}
+
+// The FecDepth codewords of a block are the 16 lanes of a register, every row is one symbol of each of them
+STEGANO_TARGET_SSSE3 void Ssse3Encode(const Code& code, const unsigned char* const data, const unsigned int rows,
+									  unsigned char* const parity) {
+	const __m128i nibble{_mm_set1_epi8(0x0F)};
+	__m128i remainder[MaxParity];
+	for(unsigned int k{0}; k < code.parity; ++k) {
+		remainder[k] = _mm_setzero_si128();
+	}
+	for(unsigned int r{0}; r < rows; ++r) {
+		const __m128i feedback{_mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + r * FecDepth)), remainder[0])};
+		const __m128i low{_mm_and_si128(feedback, nibble)}, high{_mm_and_si128(_mm_srli_epi16(feedback, 4), nibble)};
+		for(unsigned int k{0}; k + 1U < code.parity; ++k) {
+			remainder[k] = _mm_xor_si128(remainder[k + 1U], Multiply(code.GeneratorTables[code.parity - 1U - k], low, high));
+		}
+		remainder[code.parity - 1U] = Multiply(code.GeneratorTables[0], low, high);
+	}
+	for(unsigned int k{0}; k < code.parity; ++k) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(parity + k * FecDepth), remainder[k]);
+	}
+}
+
+STEGANO_TARGET_SSSE3 bool Ssse3Syndromes(const Code& code, const unsigned char* const block, const unsigned int rows,
+										 unsigned char* const syndromes) {
+	const __m128i nibble{_mm_set1_epi8(0x0F)};
+	__m128i s[MaxParity];
+	for(unsigned int j{0}; j < code.parity; ++j) {
+		s[j] = _mm_setzero_si128();
+	}
+	// Horner's rule, a multiply by a^j and an XOR per row and syndrome
+	for(unsigned int r{0}; r < rows; ++r) {
+		const __m128i row{_mm_loadu_si128(reinterpret_cast<const __m128i*>(block + r * FecDepth))};
+		for(unsigned int j{0}; j < code.parity; ++j) {
+			const __m128i low{_mm_and_si128(s[j], nibble)}, high{_mm_and_si128(_mm_srli_epi16(s[j], 4), nibble)};
+			s[j] = _mm_xor_si128(Multiply(code.RootTables[j], low, high), row);
+		}
+	}
+	__m128i any{_mm_setzero_si128()};
+	for(unsigned int j{0}; j < code.parity; ++j) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(syndromes + j * FecDepth), s[j]);
+		any = _mm_or_si128(any, s[j]);
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF;
+}
+
+bool HasSsse3() {
+	#if _WIN32
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 9)) != 0;
+	#else
+	return __builtin_cpu_supports("ssse3");
+	#endif
+}
+#endif
+
+void EncodeBlock(const Code& code, const unsigned char* const data, const unsigned int rows, unsigned char* const parity) {
+#if STEGANO_RS_SSSE3
+	static const bool ssse3{HasSsse3()};
+	if(ssse3) {
+		Ssse3Encode(code, data, rows, parity);
+		return;
+	}
+#endif
+	ScalarEncode(code, data, rows, parity);
+}
+
+bool Syndromes(const Code& code, const unsigned char* const block, const unsigned int rows, unsigned char* const syndromes) {
+#if STEGANO_RS_SSSE3
+	static const bool ssse3{HasSsse3()};
+	if(ssse3) {
+		return Ssse3Syndromes(code, block, rows, syndromes);
+	}
+#endif
+	return ScalarSyndromes(code, block, rows, syndromes);
+}
+
+/* Corrects one codeword of a block from its syndromes, only run for the codewords which are damaged
+** Berlekamp-Massey finds the error locator, a Chien search its roots and Forney's formula the error values
+** Returns the number of corrected symbols, -1 => more errors than the code can correct
+*/
+int CorrectCodeword(const Code& code, unsigned char* const block, const unsigned int rows, const unsigned int lane,
+					const unsigned char* const syndromes) {
+	const GaloisField& gf{Field()};
+	const unsigned int parity{code.parity};
+	std::array<unsigned char, MaxParity> s;
+	for(unsigned int j{0}; j < parity; ++j) {
+		s[j] = syndromes[j * FecDepth + lane];
+	}
+
+	std::array<unsigned char, MaxParity + 1U> locator{}, previous{}, saved;
+	locator[0] = previous[0] = 1U;
+	unsigned int errors{0}, shift{1};
+	unsigned char discrepancy{1};
+	for(unsigned int n{0}; n < parity; ++n) {
+		unsigned char d{s[n]};
+		for(unsigned int i{1}; i <= errors; ++i) {
+			d ^= Multiply(locator[i], s[n - i]);
+		}
+		if(!d) {
+			++shift;
+			continue;
+		}
+		const unsigned char scale{Divide(d, discrepancy)};
+		saved = locator;
+		for(unsigned int i{0}; i + shift <= parity; ++i) {
+			locator[i + shift] ^= Multiply(scale, previous[i]);
+		}
+		if(2U * errors <= n) {
+			errors = n + 1U - errors;
+			previous = saved;
+			discrepancy = d;
+			shift = 1U;
+		}
+		else {
+			++shift;
+		}
+	}
+	if(2U * errors > parity) {
+		return -1;
+	}
+
+	// Error evaluator, syndromes times locator modulo x^parity
+	std::array<unsigned char, MaxParity> evaluator{};
+	for(unsigned int i{0}; i < parity; ++i) {
+		for(unsigned int k{0}; k <= std::min(i, errors); ++k) {
+			evaluator[i] ^= Multiply(locator[k], s[i - k]);
+		}
+	}
+
+	// Symbol of row r has degree rows - 1 - r
+	unsigned int found{0};
+	for(unsigned int degree{0}; degree < rows && found < errors; ++degree) {
+		// X^-1 with X = a^degree
+		const unsigned char inverse{gf.exp[(255U - degree % 255U) % 255U]};
+		unsigned char value{0}, power{1};
+		for(unsigned int i{0}; i <= errors; ++i) {
+			value ^= Multiply(locator[i], power);
+			power = Multiply(power, inverse);
+		}
+		if(value) {
+			continue;
+		}
+		unsigned char numerator{0}, denominator{0};
+		power = 1U;
+		for(unsigned int i{0}; i < parity; ++i) {
+			numerator ^= Multiply(evaluator[i], power);
+			power = Multiply(power, inverse);
+		}
+		// Formal derivative of the locator, only its odd powers remain
+		power = 1U;
+		for(unsigned int i{1}; i <= errors; i += 2U) {
+			denominator ^= Multiply(locator[i], power);
+			power = Multiply(Multiply(power, inverse), inverse);
+		}
+		if(!denominator) {
+			return -1;
+		}
+		// e = X * evaluator(X^-1) / locator'(X^-1)
+		block[(rows - 1U - degree) * FecDepth + lane] ^= Multiply(gf.exp[degree % 255U], Divide(numerator, denominator));
+		++found;
+	}
+	return found == errors ? static_cast<int>(errors) : -1;
+}
+
+// Majority vote over the copies of each header byte
+bool ReadFecHeader(const unsigned char* const coded, unsigned int& parity, unsigned long long& length) {
+	std::array<unsigned char, HeaderCopyBytes> header;
+	for(unsigned int b{0}; b < HeaderCopyBytes; ++b) {
+		const unsigned char x{coded[b]}, y{coded[HeaderCopyBytes + b]}, z{coded[2U * HeaderCopyBytes + b]};
+		if(x != y && x != z && y != z) {
+			return false;
+		}
+		header[b] = (x == y || x == z) ? x : y;
+	}
+	parity = header[2];
+	length = static_cast<unsigned long long>(header[4]) | static_cast<unsigned long long>(header[5]) << 8U
+			 | static_cast<unsigned long long>(header[6]) << 16U | static_cast<unsigned long long>(header[7]) << 24U;
+	return header[0] == 'R' && header[1] == 'S' && parity >= 2U && parity <= MaxParity && header[3] == FecDepth;
+}
+}
+
+unsigned long long FecLength(const unsigned long long length, const unsigned int parity) {
+	if(!parity) {
+		return length;
+	}
+	const BlockShape shape{Shape(length, parity)};
+	if(!shape.blocks) {
+		return FecHeaderBytes;
+	}
+	return FecHeaderBytes + (shape.blocks - 1ULL) * CodewordBytes * FecDepth
+		   + (shape.LastRows + parity) * static_cast<unsigned long long>(FecDepth);
+}
+
+unsigned long long FecCodedLength(const unsigned char* const coded) {
+	unsigned int parity{0};
+	unsigned long long length{0};
+	return ReadFecHeader(coded, parity, length) ? FecLength(length, parity) : 0U;
+}
+
+unsigned int FecDataLength(const unsigned int coded, const unsigned int parity) {
+	unsigned int low{0}, high{coded};
+	while(low < high) {
+		const unsigned int middle{low + (high - low + 1U) / 2U};
+		if(FecLength(middle, parity) <= coded) {
+			low = middle;
+		}
+		else {
+			high = middle - 1U;
+		}
+	}
+	return low;
+}
+
+std::vector<unsigned char> FecEncode(const unsigned char* const stream, const unsigned int length, const unsigned int parity,
+									 const StreamCipher& cipher, const unsigned int workers) {
+	const Code code(parity);
+	const BlockShape shape{Shape(length, parity)};
+	std::vector<unsigned char> coded(FecLength(length, parity), 0U);
+	const std::array<unsigned char, HeaderCopyBytes> header{'R',
+															'S',
+															static_cast<unsigned char>(parity),
+															static_cast<unsigned char>(FecDepth),
+															static_cast<unsigned char>(length),
+															static_cast<unsigned char>(length >> 8U),
+															static_cast<unsigned char>(length >> 16U),
+															static_cast<unsigned char>(length >> 24U)};
+	for(unsigned int copy{0}; copy < HeaderCopies; ++copy) {
+		std::copy(header.begin(), header.end(), coded.begin() + copy * HeaderCopyBytes);
+	}
+	WorkerPool::Instance().Run(
+		shape.blocks,
+		[&](const unsigned int b) {
+			unsigned char* const block{coded.data() + FecHeaderBytes + static_cast<std::size_t>(b) * CodewordBytes * FecDepth};
+			const unsigned int first{b * shape.DataBytes}, size{std::min(shape.DataBytes, length - first)}, rows{DataRows(shape, b)};
+			// The block is encrypted in place, then its parity is computed while it is hot in cache
+			std::memcpy(block, stream + first, size);
+			cipher.Apply(block, size, first);
+			EncodeBlock(code, block, rows, block + rows * FecDepth);
+		},
+		workers);
+	return coded;
+}
+
+bool FecDecode(std::vector<unsigned char>& coded, const bool encrypted, const unsigned int workers, std::vector<unsigned char>& stream) {
+	unsigned int parity{0};
+	unsigned long long length{0};
+	if(coded.size() < FecHeaderBytes || !ReadFecHeader(coded.data(), parity, length) || FecLength(length, parity) != coded.size()) {
+		Stegano::Logger::Error("Error!", " The error correction header of the embedded payload is damaged", '\n');
+		return false;
+	}
+	const Code code(parity);
+	const BlockShape shape{Shape(length, parity)};
+	stream.resize(length);
+	std::atomic<unsigned int> symbols{0}, codewords{0}, failed{0};
+	StreamCipher cipher;
+	const auto decode = [&](const unsigned int b) {
+		unsigned char* const block{coded.data() + FecHeaderBytes + static_cast<std::size_t>(b) * CodewordBytes * FecDepth};
+		const unsigned int first{b * shape.DataBytes}, rows{DataRows(shape, b)};
+		const unsigned int size{static_cast<unsigned int>(std::min<unsigned long long>(shape.DataBytes, length - first))};
+		std::array<unsigned char, MaxParity * FecDepth> syndromes;
+		if(Syndromes(code, block, rows + parity, syndromes.data())) {
+			for(unsigned int lane{0}; lane < FecDepth; ++lane) {
+				bool damaged{false};
+				for(unsigned int j{0}; j < parity && !damaged; ++j) {
+					damaged = syndromes[j * FecDepth + lane] != 0U;
+				}
+				if(!damaged) {
+					continue;
+				}
+				const int corrected{CorrectCodeword(code, block, rows + parity, lane, syndromes.data())};
+				if(corrected < 0) {
+					++failed;
+				}
+				else {
+					symbols += static_cast<unsigned int>(corrected);
+					++codewords;
+				}
+			}
+		}
+		std::memcpy(stream.data() + first, block, size);
+		cipher.Apply(stream.data() + first, size, first);
+	};
+	if(shape.blocks) {
+		// The nonce is in the first block, which is corrected before the keystream can be set up
+		decode(0U);
+		if(encrypted) {
+			if(length < NonceBytes) {
+				Stegano::Logger::Error("Error!", " The nonce of the encrypted payload is damaged", '\n');
+				return false;
+			}
+			cipher = StreamCipher(cipherkey, stream.data());
+			cipher.Apply(stream.data(), static_cast<unsigned int>(std::min<unsigned long long>(shape.DataBytes, length)), 0U);
+		}
+		WorkerPool::Instance().Run(
+			shape.blocks - 1U, [&](const unsigned int b) { decode(b + 1U); }, workers);
+	}
+	if(encrypted) {
+		// An empty stream never reaches the check above
+		if(stream.size() < NonceBytes) {
+			Stegano::Logger::Error("Error!", " The nonce of the encrypted payload is damaged", '\n');
+			return false;
+		}
+		stream.erase(stream.begin(), stream.begin() + NonceBytes);
+	}
+	if(codewords) {
+		Stegano::Logger::Verbose("Corrected ", symbols.load(), " bytes in ", codewords.load(), " codewords", '\n');
+	}
+	if(failed) {
+		Stegano::Logger::Error("Warning!", " ", failed.load(), " of ", shape.blocks * FecDepth,
+							   " codewords have more errors than the parity can correct, the payload is damaged", '\n');
+	}
+	return true;
+}
+
+}
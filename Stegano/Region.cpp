@@ -0,0 +1,247 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include "SteganoKernels.h"
+#include "SteganoPayload.h"
+#include <algorithm>
+
+namespace Stegano {
+
+namespace {
+// Unpacks a whole extended stream and crops the hidden image to the region, for layouts whose rows cannot be read on their own
+bool CropStream(const std::vector<unsigned char>& stream, const cv::Rect& region, const unsigned int step, cv::Mat& DecodedRegion) {
+	cv::Mat DecodedImage;
+	if(!UnpackImage(stream.data(), stream.size(), DecodedImage)) {
+		// A partly unpacked image is not cropped, the region could lie in the rows that were not decoded
+		if(DecodedImage.empty()) {
+			Stegano::Logger::Error("Error!", " The embedded payload is not an image or its header is damaged", '\n');
+		}
+		else {
+			Stegano::Logger::Error("Error!", " The embedded payload is damaged or truncated, the region cannot be decoded", '\n');
+		}
+		return false;
+	}
+	const cv::Rect clipped{ClipRegion(region, DecodedImage.rows, DecodedImage.cols)};
+	if(clipped.empty()) {
+		Stegano::Logger::Error("Error!", " The region lies outside the hidden image of [", DecodedImage.rows, " x ", DecodedImage.cols, ']',
+							   '\n');
+		return false;
+	}
+	DecodedRegion = SampleRegion(DecodedImage, clipped, step);
+	return true;
+}
+}
+
+cv::Mat SampleRegion(const cv::Mat& image, const cv::Rect& region, const unsigned int step) {
+	if(step == 1U) {
+		return image(region).clone();
+	}
+	const int s{static_cast<int>(step)};
+	cv::Mat sampled((region.height + s - 1) / s, (region.width + s - 1) / s, image.type());
+	const std::size_t PixelBytes{image.elemSize()};
+	for(int r{0}; r < sampled.rows; ++r) {
+		const unsigned char* const source{image.ptr(region.y + r * s) + region.x * PixelBytes};
+		for(int c{0}; c < sampled.cols; ++c) {
+			std::copy(source + c * s * PixelBytes, source + (c * s + 1) * PixelBytes, sampled.ptr(r) + c * PixelBytes);
+		}
+	}
+	return sampled;
+}
+
+cv::Rect ClipRegion(const cv::Rect& region, const int rows, const int cols) {
+	cv::Rect clipped{region};
+	if(clipped.width == 0) {
+		clipped.width = cols - clipped.x;
+	}
+	if(clipped.height == 0) {
+		clipped.height = rows - clipped.y;
+	}
+	return clipped & cv::Rect(0, 0, cols, rows);
+}
+
+bool DecodeRegion(const cv::Mat& SourceImage, const cv::Rect& region, const unsigned int step, cv::Mat& DecodedRegion) {
+	const unsigned int AvailableBasePixels{static_cast<unsigned int>(SourceImage.rows * SourceImage.cols - 7)};
+	const unsigned int PixelChannels{static_cast<unsigned int>(SourceImage.channels())};
+	const unsigned int TotalSourceChannels{(AvailableBasePixels + 7U) * PixelChannels};
+
+	// Reading Trailer
+	const std::array<unsigned char, 5> trailer{
+		VisitChannels(SourceImage, [&](const auto* const SourceImageData) { return ReadTrailer(SourceImageData, TotalSourceChannels); })};
+	const unsigned int checksum{VisitChannels(
+		SourceImage,
+		[&](const auto* const SourceImageData) { return TrailerChecksum(trailer, SourceImageData, TotalSourceChannels, PixelChannels); })};
+	const PayloadMarker marker{ReadMarker(checksum, trailer[4])};
+	const bool keyed{marker.keyed}, extended{marker.extended};
+	if(!marker.valid) {
+		Stegano::Logger::Error("Error!", " The given image does not have any data embedded using this application", '\n');
+		return false;
+	}
+	if(keyed && key.empty()) {
+		Stegano::Logger::Error("Error!", " The payload is scattered with a key, pass it with \"key\" to decode it", '\n');
+		return false;
+	}
+	if(marker.encrypted && !encrypt) {
+		Stegano::Logger::Error("Error!", " The payload is encrypted, pass its key with \"cipher\" or STEGANO_CIPHER_KEY to decode it",
+							   '\n');
+		return false;
+	}
+
+	// Dimensions of the hidden image and offset of its first pixel in the payload
+	unsigned int rows{0}, cols{0}, channels{0}, length{0}, BodyOffset{0};
+	if(extended) {
+		for(unsigned int i{0}; i < 4U; ++i) {
+			length = length * PowersOfTwo[8] + trailer[i];
+		}
+		if(marker.tiled) {
+			// Tile rows are not rows of the hidden image
+			Stegano::Logger::Verbose("Adaptive payload, decoding it in full before cropping", '\n');
+			std::vector<unsigned char> stream;
+			if(!ExtractTiles(SourceImage, length, marker, stream)) {
+				Stegano::Logger::Error("Error!", " The tile map of the adaptive layout is damaged", '\n');
+				return false;
+			}
+			return CropStream(stream, region, step, DecodedRegion);
+		}
+	}
+	else {
+		rows = trailer[0] * PowersOfTwo[8] + trailer[1];
+		cols = trailer[2] >= PowersOfTwo[7] ? trailer[2] - PowersOfTwo[7] : trailer[2];
+		cols = cols * PowersOfTwo[8] + trailer[3];
+		channels = trailer[2] >= PowersOfTwo[7] ? 1U : 3U;
+		length = rows * cols * channels;
+	}
+	if(extended && !LengthFits(length, AvailableBasePixels, BpchRows(SourceImage.elemSize1(), PixelChannels))) {
+		Stegano::Logger::Error("Error!", " The trailer of the given image is damaged, it records more data than the image can hold", '\n');
+		return false;
+	}
+	// Layout of the whole payload, shared with full decodes of this shape, the job of the region is sized below
+	const std::shared_ptr<const LayoutPlan> layout{PlanLayout(SourceImage, length * 8ULL, length, true)};
+	const unsigned int BitsPerPixel{layout->BitsPerPixel}, stride{layout->stride}, UsableChannels{layout->UsableChannels};
+	// Runs of payload bytes are split at the chunk boundaries of keyed streams
+	const ChunkOrder order{keyed ? ChunkOrder(key, (length + ChunkBytes(BitsPerPixel) - 1U) / ChunkBytes(BitsPerPixel)) : ChunkOrder()};
+	// Runs of streams in tile order are read from the tiles holding them
+	const TileWalk walk(marker.tileorder, static_cast<unsigned int>(SourceImage.rows), static_cast<unsigned int>(SourceImage.cols));
+	// Payloads whose rows cannot be extracted on their own are decoded in full, then cropped
+	const auto WholeStream = [&] {
+		std::vector<unsigned char> stream;
+		stream.reserve(length);
+		VisitChannels(SourceImage, [&](const auto* const SourceImageData) {
+			return ExtractStream(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, walk, length, marker,
+								 [&stream](const unsigned char* data, std::size_t size) {
+									 stream.insert(stream.end(), data, data + size);
+									 return true;
+								 });
+		});
+		return CropStream(stream, region, step, DecodedRegion);
+	};
+	if(marker.fec) {
+		// Corrections need whole codewords, which interleave the bytes of neighbouring pixels
+		Stegano::Logger::Verbose("Error corrected payload, decoding it in full before cropping", '\n');
+		return WholeStream();
+	}
+
+	// The keystream is seekable, every run is decrypted on its own
+	StreamCipher cipher;
+	if(extended) {
+		// Encrypted streams start with their nonce
+		const unsigned int skip{marker.encrypted ? NonceBytes : 0U};
+		std::vector<unsigned char> head(std::min(length, HeaderProbe + skip));
+		VisitChannels(SourceImage, [&](const auto* const SourceImageData) {
+			ExtractBytes(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, 0U, static_cast<unsigned int>(head.size()),
+						 head.data(), order, walk);
+		});
+		if(marker.encrypted && head.size() >= NonceBytes) {
+			cipher = StreamCipher(cipherkey, head.data());
+			cipher.Apply(head.data(), static_cast<unsigned int>(head.size()), 0U);
+		}
+		PayloadHeader header;
+		BodyOffset = head.size() > skip ? ReadPayloadHeader(head.data() + skip, head.size() - skip, header) : 0U;
+		BodyOffset += BodyOffset ? skip : 0U;
+		if(!BodyOffset || header.type != PAYLOAD_IMAGE || (header.channels != 1U && header.channels != 3U)) {
+			Stegano::Logger::Error("Error!", " The embedded payload is not an image, a region of it cannot be decoded", '\n');
+			return false;
+		}
+		rows = header.rows;
+		cols = header.cols;
+		channels = header.channels;
+		if(header.codec != CODEC_NONE) {
+			// Every compressed row depends on the rows above it
+			Stegano::Logger::Verbose("Compressed payload, decoding it in full before cropping", '\n');
+			return WholeStream();
+		}
+	}
+
+	const cv::Rect clipped{ClipRegion(region, static_cast<int>(rows), static_cast<int>(cols))};
+	if(clipped.empty()) {
+		Stegano::Logger::Error("Error!", " The region lies outside the hidden image of [", rows, " x ", cols, ']', '\n');
+		return false;
+	}
+	Stegano::Logger::Verbose("Hidden image size = [", rows, " x ", cols, " x ", channels, "], decoding [", clipped.x, ", ", clipped.y,
+							 "] to [", clipped.x + clipped.width, ", ", clipped.y + clipped.height, ')', '\n');
+
+	const unsigned int SampledRows{(static_cast<unsigned int>(clipped.height) + step - 1U) / step};
+	const unsigned int SampledCols{(static_cast<unsigned int>(clipped.width) + step - 1U) / step};
+	DecodedRegion.create(static_cast<int>(SampledRows), static_cast<int>(SampledCols), channels == 1U ? CV_8UC1 : CV_8UC3);
+	const JobPlan plan{PlanJob(SampledRows * SampledCols * channels, BitsPerPixel, PixelChannels, true)};
+	VisitChannels(SourceImage, [&](const auto* const SourceImageData) {
+		WorkerPool::Instance().Run(
+			SampledRows,
+			[&](const unsigned int r) {
+				const unsigned int first{BodyOffset + ((clipped.y + r * step) * cols + static_cast<unsigned int>(clipped.x)) * channels};
+				unsigned char* const row{DecodedRegion.ptr(static_cast<int>(r))};
+				if(step == 1U) {
+					// Every row of the region is a run of payload bytes, extracted straight from the channels carrying it
+					ExtractBytes(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, first, SampledCols * channels, row,
+								 order, walk);
+					cipher.Apply(row, SampledCols * channels, first);
+					return;
+				}
+				// Each sampled pixel is a separate run, the channels between two samples are never read
+				for(unsigned int c{0}; c < SampledCols; ++c) {
+					ExtractBytes(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, first + c * step * channels,
+								 channels, row + c * channels, order, walk);
+					cipher.Apply(row + c * channels, channels, first + c * step * channels);
+				}
+			},
+			plan.workers);
+	});
+	return true;
+}
+
+bool ParallelDecodeRegion(const cv::Mat& SourceImage, const std::string& output) {
+	auto start = std::chrono::steady_clock::now();
+
+	if(previewstep > 1U) {
+		Stegano::Logger::Verbose("Preview of the hidden image, sampling every ", previewstep, " rows and columns", '\n');
+	}
+	Stegano::Logger::Verbose("Decoding region [", roi.x, ", ", roi.y, ", ", roi.width, " x ", roi.height, "] of the hidden image", '\n');
+	cv::Mat DecodedRegion;
+	if(!DecodeRegion(SourceImage, roi, previewstep, DecodedRegion)) {
+		return false;
+	}
+
+	std::thread saveimage([&output, &DecodedRegion] {
+		Stegano::Logger::Verbose("Finished decoding", '\n', "Saving decoded region", '\n');
+		SaveImage(output, DecodedRegion, "Decoded");
+	});
+
+	if(showimages) {
+#if _WIN32
+		ResizeToSmall(DecodedRegion, DecodedRegion, "Decoded Image");
+#endif
+		cv::namedWindow("Decoded Region", cv::WINDOW_AUTOSIZE);
+		cv::imshow("Decoded Region", DecodedRegion);
+		cv::waitKey(0);
+	}
+
+	saveimage.join();
+
+	if(!showimages) {
+		auto end = std::chrono::steady_clock::now();
+		const double timetaken = static_cast<double>(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) / 1000.0;
+		Stegano::Logger::Verbose('\n', "Decoding took: ", timetaken, " seconds");
+	}
+	return true;
+}
+
+}
@@ -0,0 +1,420 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include "SteganoKernels.h"
+#include "SteganoPayload.h"
+#include <opencv2/quality.hpp>
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+
+#if _WIN32
+	#include <fcntl.h>
+	#include <io.h>
+#endif
+
+namespace Stegano {
+
+std::string NumberedPath(const std::string& output, const unsigned int k) {
+	std::filesystem::path path{output};
+	const std::string extension{path.extension().string()};
+	path.replace_filename(path.stem().string() + '_' + std::to_string(k + 1U) + extension);
+	return path.string();
+}
+
+bool BuildStream(const std::string& source, std::vector<unsigned char>& stream) {
+	if(!filemode) {
+		Stegano::Logger::Verbose("Reading source image", '\n');
+		PrepackedSource prepacked;
+		ReadSource(source, prepacked);
+		const cv::Mat& SourceImage{prepacked.image};
+		if(!SourceImage.data) {
+			Stegano::Logger::Error("Error!", " Cannot open source image.",
+								   " Please check if the path is correct and if the file is an 8 bit color image.", '\n');
+			return false;
+		}
+		if(SourceImage.rows > 65535 || SourceImage.cols > 65535) {
+			Stegano::Logger::Error("Error!", " Source image too large.",
+								   " Cannot operate on images with dimensions greater than [65536 x 65536].", '\n');
+			return false;
+		}
+		Stegano::Logger::Verbose("Source image size = [", SourceImage.rows, " x ", SourceImage.cols, " x ", SourceImage.channels(), ']',
+								 '\n');
+		stream = SourceStream(prepacked);
+		return true;
+	}
+	return BuildFileStream(source, stream);
+}
+
+bool BuildFileStream(const std::string& source, std::vector<unsigned char>& stream) {
+	PayloadHeader header;
+	header.type = PAYLOAD_FILE;
+	std::vector<unsigned char> body;
+	if(source == "-") {
+		Stegano::Logger::Verbose("Reading source from standard input", '\n');
+#if _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		body.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+	}
+	else {
+		std::ifstream file(source, std::ios::binary);
+		if(!file) {
+			Stegano::Logger::Error("Error!", " Cannot open source file. Please check if the path is correct.", '\n');
+			return false;
+		}
+		body.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		header.name = std::filesystem::path(source).filename().string();
+	}
+	Stegano::Logger::Verbose("Source file size = ", body.size(), " bytes", '\n');
+	if(body.size() > 0xFFFFFF00ULL) {
+		Stegano::Logger::Error("Error!", " Source file too large.", " Cannot embed more than 4 GiB.", '\n');
+		return false;
+	}
+	header.length = static_cast<unsigned int>(body.size());
+	stream = WritePayloadHeader(header);
+	stream.insert(stream.end(), body.begin(), body.end());
+	return true;
+}
+
+bool SaveStream(const unsigned char* const stream, const std::size_t length, const std::string& output, const std::string& FileOutput) {
+	PayloadHeader header;
+	const unsigned int HeaderLength{ReadPayloadHeader(stream, length, header)};
+	if(!HeaderLength) {
+		Stegano::Logger::Error("Error!", " The header of the payload is damaged", '\n');
+		return false;
+	}
+	if(header.type == PAYLOAD_CONTAINER) {
+		return SaveContainer(stream, length, output);
+	}
+	if(header.type == PAYLOAD_FILE) {
+		std::string path{FileOutput};
+		if(path.empty()) {
+			path = header.name.empty() ? std::string("Decoded.bin") : std::filesystem::path(header.name).filename().string();
+		}
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(stream + HeaderLength), static_cast<std::streamsize>(length - HeaderLength));
+		if(!file) {
+			Stegano::Logger::Error("Error!", " Cannot write the decoded file at ", path, '\n');
+			return false;
+		}
+		Stegano::Logger::Log("File saved at - ", path, " (", header.length, " bytes)", '\n');
+		return true;
+	}
+
+	cv::Mat DecodedImage;
+	if(!UnpackImage(stream, length, DecodedImage)) {
+		if(DecodedImage.empty()) {
+			Stegano::Logger::Error("Error!", " The payload is not an image or its header is damaged", '\n');
+			return false;
+		}
+		Stegano::Logger::Error("Warning!", " The payload is damaged, the decoded image is incomplete", '\n');
+	}
+	if(roidecode) {
+		const cv::Rect clipped{ClipRegion(roi, DecodedImage.rows, DecodedImage.cols)};
+		if(clipped.empty()) {
+			Stegano::Logger::Error("Error!", " The region lies outside the hidden image of [", DecodedImage.rows, " x ",
+								   DecodedImage.cols, ']', '\n');
+			return false;
+		}
+		DecodedImage = SampleRegion(DecodedImage, clipped, previewstep);
+	}
+	if(!WriteImage(output, DecodedImage)) {
+		Stegano::Logger::Error("Error!", " Cannot save the output file with the given name!", '\n');
+		return false;
+	}
+	Stegano::Logger::Log("Image saved at - ", output, '\n');
+	if(showimages) {
+#if _WIN32
+		ResizeToSmall(DecodedImage, DecodedImage, "Decoded Image");
+#endif
+		cv::namedWindow("Decoded Image", cv::WINDOW_AUTOSIZE);
+		cv::imshow("Decoded Image", DecodedImage);
+		cv::waitKey(0);
+	}
+	return true;
+}
+
+// The payload is built as a single extended stream (image, compressed or not, or file) and cut in as many slices as there are
+// carriers, each slice proportional to the capacity of its carrier so that every carrier is encoded at the same depth. Every
+// carrier holds its slice as a PAYLOAD_SHARD stream whose header records the shard number, the shard count, the offset of the
+// slice and the length of the whole stream, so the carriers can be decoded in any order.
+bool EncodeShards(const std::vector<std::string>& bases, const std::string& source, const std::string& output) {
+	const unsigned int shards{static_cast<unsigned int>(bases.size())};
+	Stegano::Logger::Verbose("Carriers = ", shards, '\n');
+	Stegano::Logger::Verbose("Compress payload = ", compress ? "true" : "false", '\n');
+	if(shards > 65535U) {
+		Stegano::Logger::Error("Error!", " Cannot shard a payload across more than 65535 carriers.", '\n');
+		return false;
+	}
+
+	std::vector<cv::Mat> BaseImages(shards);
+	std::vector<unsigned char> stream;
+	bool built{false};
+	{
+		std::vector<std::thread> loaders;
+		for(unsigned int k{0}; k < shards; ++k) {
+			loaders.emplace_back([&bases, &BaseImages, k] { BaseImages[k] = ReadCarrier(bases[k]); });
+		}
+		built = BuildStream(source, stream);
+		for(auto& loader : loaders) {
+			loader.join();
+		}
+	}
+	if(!built) {
+		return false;
+	}
+
+	// The shard header has the same size for every carrier
+	PayloadHeader header;
+	header.type = PAYLOAD_SHARD;
+	header.shards = shards;
+	header.total = static_cast<unsigned int>(stream.size());
+	const unsigned int HeaderBytes{static_cast<unsigned int>(WritePayloadHeader(header).size())};
+
+	// Capacity of a carrier = longest stream encoded within its BPCH rows with its checksums, minus the shard header
+	std::vector<unsigned long long> capacity(shards, 0ULL);
+	unsigned long long TotalCapacity{0};
+	for(unsigned int k{0}; k < shards; ++k) {
+		if(!BaseImages[k].data) {
+			Stegano::Logger::Error("Error!", " Cannot open base image ", bases[k], '.',
+								   " Please check if the path is correct and if the file is an 8 bit,",
+								   " 16 bit or floating point color image.", '\n');
+			return false;
+		}
+		if(BaseImages[k].rows > 65535 || BaseImages[k].cols > 65535) {
+			Stegano::Logger::Error("Error!", " Base image ", bases[k], " too large.",
+								   " Cannot operate on images with dimensions greater than [65536 x 65536].", '\n');
+			return false;
+		}
+		if(!CheckCarrierDepth(BaseImages[k], NumberedPath(output, k))) {
+			return false;
+		}
+		const unsigned int bytes{FittingLength(static_cast<unsigned int>(BaseImages[k].rows * BaseImages[k].cols - 7),
+											   BpchRows(BaseImages[k].elemSize1(), static_cast<unsigned int>(BaseImages[k].channels())))};
+		if(bytes <= HeaderBytes) {
+			Stegano::Logger::Error("Error!", " Base image ", bases[k], " is too small to carry a shard.", '\n');
+			return false;
+		}
+		capacity[k] = bytes - HeaderBytes;
+		TotalCapacity += capacity[k];
+		Stegano::Logger::Verbose("Carrier ", k + 1U, " size = [", BaseImages[k].rows, " x ", BaseImages[k].cols, " x ",
+								 BaseImages[k].channels(), "], capacity = ", capacity[k], " bytes", '\n');
+	}
+	Stegano::Logger::Verbose("Payload stream = ", stream.size(), " bytes", "\n\n");
+	if(stream.size() > TotalCapacity) {
+		Stegano::Logger::Error("Error!", " The carriers are not large enough to store the source, ", stream.size() - TotalCapacity,
+							   " more bytes are needed", '\n');
+		Stegano::Logger::Log("Add carriers with \"carrier\" or choose larger ones", '\n');
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	Stegano::Logger::Verbose("Encoding now...", '\n');
+
+	// Slice boundaries at the same fraction of the total capacity => every slice fits its carrier
+	std::vector<unsigned int> bounds(shards + 1U, 0U);
+	unsigned long long before{0};
+	for(unsigned int k{0}; k < shards; ++k) {
+		before += capacity[k];
+		bounds[k + 1U] = static_cast<unsigned int>(stream.size() * before / TotalCapacity);
+	}
+	bounds[shards] = static_cast<unsigned int>(stream.size());
+
+	// One thread per carrier, the kernels of all of them share the worker pool
+	std::vector<char> saved(shards, 0);
+	std::vector<cv::Scalar> PSNR(shards);
+	std::vector<LsbStatistics> original(shards), encoded(shards);
+	std::vector<std::thread> encoders;
+	for(unsigned int k{0}; k < shards; ++k) {
+		encoders.emplace_back([&, k] {
+			PayloadHeader shard{header};
+			shard.shard = k;
+			shard.offset = bounds[k];
+			shard.length = bounds[k + 1U] - bounds[k];
+			std::vector<unsigned char> ShardStream{WritePayloadHeader(shard)};
+			ShardStream.insert(ShardStream.end(), stream.begin() + bounds[k], stream.begin() + bounds[k + 1U]);
+
+			cv::Mat& BaseImage{BaseImages[k]};
+			const cv::Mat BaseImageCopy{BaseImage.clone()};
+			const unsigned int PixelChannels{static_cast<unsigned int>(BaseImage.channels())};
+			const unsigned int UsableRows{BpchRows(BaseImage.elemSize1(), PixelChannels)};
+			const unsigned int AvailableBasePixels{static_cast<unsigned int>(BaseImage.rows * BaseImage.cols - 7)};
+			const unsigned int TotalBaseChannels{(AvailableBasePixels + 7U) * PixelChannels};
+			const unsigned int length{static_cast<unsigned int>(ShardStream.size())};
+			const unsigned int embedded{static_cast<unsigned int>(EmbeddedLength(length, AvailableBasePixels, UsableRows))};
+			const std::shared_ptr<const LayoutPlan> layout{PlanLayout(BaseImage, embedded * 8ULL, length, false)};
+			const unsigned int BitsPerPixel{layout->BitsPerPixel}, stride{layout->stride};
+
+			VisitChannels(BaseImage, [&](auto* const BaseImageData) {
+				EmbedStream(BaseImageData, AvailableBasePixels * PixelChannels, PixelChannels, stride, BitsPerPixel, TileWalk(),
+							ShardStream.data(), length);
+				WriteExtendedTrailer(BaseImageData, TotalBaseChannels, PixelChannels, embedded);
+			});
+
+			const std::string path{NumberedPath(output, k)};
+			if(WriteImage(path, BaseImage)) {
+				Stegano::Logger::Log("Image saved at - ", path, " (shard ", k + 1U, " of ", shards, ")", '\n');
+				saved[k] = 1;
+			}
+			else {
+				Stegano::Logger::Error("Error!", " Cannot save shard ", k + 1U, " at ", path, '\n');
+			}
+			PSNR[k] = cv::quality::QualityPSNR::compute(BaseImage, BaseImageCopy, cv::noArray(), PeakValue(BaseImage));
+			if(analyse) {
+				original[k] = AnalyseLsb(BaseImageCopy);
+				encoded[k] = AnalyseLsb(BaseImage);
+			}
+		});
+	}
+	for(auto& encoder : encoders) {
+		encoder.join();
+	}
+
+	if(showimages) {
+		for(unsigned int k{0}; k < shards; ++k) {
+			cv::Mat EncodedCopy{BaseImages[k]};
+#if _WIN32
+			ResizeToSmall(BaseImages[k], EncodedCopy, "Encoded Image");
+#endif
+			cv::namedWindow("Encoded Carrier " + std::to_string(k + 1U), cv::WINDOW_AUTOSIZE);
+			cv::imshow("Encoded Carrier " + std::to_string(k + 1U), EncodedCopy);
+		}
+		cv::waitKey(0);
+		cv::destroyAllWindows();
+	}
+	else {
+		auto end = std::chrono::steady_clock::now();
+		const double timetaken = static_cast<double>(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) / 1000.0;
+		Stegano::Logger::Verbose('\n', "Encoding took: ", timetaken, " seconds", '\n');
+	}
+
+	for(unsigned int k{0}; k < shards; ++k) {
+		Stegano::Logger::Verbose('\n', "Carrier ", k + 1U, " holds bytes [", bounds[k], ", ", bounds[k + 1U], "), per channel PSNR = ",
+								 PSNR[k], '\n');
+	}
+	for(unsigned int k{0}; analyse && k < shards; ++k) {
+		ReportDetectability(original[k], encoded[k], "carrier " + std::to_string(k + 1U));
+	}
+	return std::all_of(saved.begin(), saved.end(), [](const char ok) { return ok != 0; });
+}
+
+bool DecodeShards(const std::vector<std::string>& sources, const std::string& output) {
+	const unsigned int count{static_cast<unsigned int>(sources.size())};
+	Stegano::Logger::Verbose("Carriers = ", count, "\n\n");
+
+	auto start = std::chrono::steady_clock::now();
+
+	// Every carrier is read and extracted on its own thread, in whatever order they were given
+	std::vector<PayloadHeader> headers(count);
+	std::vector<std::vector<unsigned char>> slices(count);
+	std::vector<std::string> errors(count);
+	{
+		std::vector<std::thread> decoders;
+		for(unsigned int k{0}; k < count; ++k) {
+			decoders.emplace_back([&, k] {
+				const cv::Mat SourceImage{ReadCarrier(sources[k])};
+				if(!SourceImage.data) {
+					errors[k] = "Cannot open the encoded image";
+					return;
+				}
+				const unsigned int PixelChannels{static_cast<unsigned int>(SourceImage.channels())};
+				const unsigned int AvailableBasePixels{static_cast<unsigned int>(SourceImage.rows * SourceImage.cols - 7)};
+				const unsigned int TotalSourceChannels{(AvailableBasePixels + 7U) * PixelChannels};
+				unsigned int length{0};
+				PayloadMarker marker{};
+				const bool found{VisitChannels(SourceImage, [&](const auto* const SourceImageData) {
+					return ReadExtendedTrailer(SourceImageData, TotalSourceChannels, PixelChannels, length, marker);
+				})};
+				if(!found || !LengthFits(length, AvailableBasePixels, BpchRows(SourceImage.elemSize1(), PixelChannels))) {
+					errors[k] = "No shard embedded using this application";
+					return;
+				}
+				if(marker.keyed && key.empty()) {
+					errors[k] = "The shard is scattered with a key, pass it with \"key\"";
+					return;
+				}
+				const std::shared_ptr<const LayoutPlan> layout{PlanLayout(SourceImage, length * 8ULL, length, true)};
+				const unsigned int BitsPerPixel{layout->BitsPerPixel}, stride{layout->stride};
+				std::vector<unsigned char>& slice{slices[k]};
+				slice.reserve(length);
+				VisitChannels(SourceImage, [&](const auto* const SourceImageData) {
+					return ExtractStream(SourceImageData, AvailableBasePixels * PixelChannels, PixelChannels, stride, BitsPerPixel,
+										 TileWalk(), length, marker, [&slice](const unsigned char* data, std::size_t size) {
+											 slice.insert(slice.end(), data, data + size);
+											 return true;
+										 });
+				});
+				const unsigned int HeaderLength{ReadPayloadHeader(slice.data(), slice.size(), headers[k])};
+				if(!HeaderLength || headers[k].type != PAYLOAD_SHARD || headers[k].length != slice.size() - HeaderLength) {
+					errors[k] = "The embedded payload is not a shard or its header is damaged";
+					return;
+				}
+				slice.erase(slice.begin(), slice.begin() + HeaderLength);
+			});
+		}
+		for(auto& decoder : decoders) {
+			decoder.join();
+		}
+	}
+
+	bool valid{true};
+	for(unsigned int k{0}; k < count; ++k) {
+		if(!errors[k].empty()) {
+			Stegano::Logger::Error("Error! ", sources[k], " - ", errors[k], '\n');
+			valid = false;
+		}
+	}
+	if(!valid) {
+		return false;
+	}
+
+	// Every shard of the payload exactly once, all agreeing on the stream they were cut from
+	const unsigned int shards{headers[0].shards}, total{headers[0].total};
+	std::vector<unsigned int> owner(shards, count);
+	unsigned long long covered{0};
+	for(unsigned int k{0}; k < count; ++k) {
+		const PayloadHeader& header{headers[k]};
+		if(header.shards != shards || header.total != total || header.shard >= shards
+		   || static_cast<unsigned long long>(header.offset) + header.length > total) {
+			Stegano::Logger::Error("Error! ", sources[k], " - Shard of another payload", '\n');
+			return false;
+		}
+		if(owner[header.shard] != count) {
+			Stegano::Logger::Error("Error! ", sources[k], " - Shard ", header.shard + 1U, " given twice", '\n');
+			return false;
+		}
+		owner[header.shard] = k;
+		covered += header.length;
+		Stegano::Logger::Verbose(sources[k], " holds shard ", header.shard + 1U, " of ", shards, '\n');
+	}
+	for(unsigned int s{0}; s < shards; ++s) {
+		if(owner[s] == count) {
+			Stegano::Logger::Error("Error!", " Shard ", s + 1U, " of ", shards, " is missing, pass every carrier with \"carrier\"", '\n');
+			return false;
+		}
+	}
+
+	if(covered != total) {
+		Stegano::Logger::Error("Error!", " The shards do not add up to the payload, some of them are damaged", '\n');
+		return false;
+	}
+
+	std::vector<unsigned char> stream(total);
+	for(unsigned int k{0}; k < count; ++k) {
+		std::copy(slices[k].begin(), slices[k].end(), stream.begin() + headers[k].offset);
+	}
+	Stegano::Logger::Verbose("Reassembled ", total, " bytes from ", shards, " shards", '\n');
+
+	const bool saved{SaveStream(stream.data(), stream.size(), output, fileoutput)};
+	if(saved && !showimages) {
+		auto end = std::chrono::steady_clock::now();
+		const double timetaken = static_cast<double>(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) / 1000.0;
+		Stegano::Logger::Verbose('\n', "Decoding took: ", timetaken, " seconds");
+	}
+	return saved;
+}
+
+}
@@ -0,0 +1,330 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include "SteganoKernels.h"
+#include <cmath>
+
+#if defined(_M_X64) || defined(__x86_64__)
+	#define STEGANO_STEGANALYSIS_SSE2 1
+	#include <emmintrin.h>
+#endif
+
+namespace Stegano {
+
+namespace {
+// Rows of the image analysed by one pool task
+constexpr unsigned int BandRows{64U};
+// Rise of the estimated embedding rate, or chi-square probability, past which an encoded image is flagged
+constexpr double ExposedRate{0.1};
+constexpr double ExposedChiSquare{0.95};
+// Pairs of values with fewer expected samples are left out of the chi-square statistic
+constexpr double MinimumExpected{5.0};
+
+// Statistics of one channel over a band of rows
+struct ChannelCounts {
+	std::array<unsigned long long, 256> histogram{};
+	// Sample pairs of horizontal neighbours: all of them, X, Y, Z, W (see SpaRate())
+	std::array<unsigned long long, 5> pairs{};
+	// RS groups of 4 horizontal neighbours: all of them, then R_M, S_M, R_-M, S_-M of the image and of the image with every LSB
+	// flipped (see RsRate())
+	std::array<unsigned long long, 9> groups{};
+
+	void Add(const ChannelCounts& other) {
+		for(std::size_t v{0}; v < histogram.size(); ++v) {
+			histogram[v] += other.histogram[v];
+		}
+		for(std::size_t k{0}; k < pairs.size(); ++k) {
+			pairs[k] += other.pairs[k];
+		}
+		for(std::size_t k{0}; k < groups.size(); ++k) {
+			groups[k] += other.groups[k];
+		}
+	}
+};
+
+// Four interleaved histograms, consecutive equal samples do not wait on each other's increments
+void Histogram(const unsigned char* const row, const unsigned int n, std::array<unsigned long long, 256>& histogram) {
+	std::array<std::array<unsigned int, 256>, 4> partial{};
+	unsigned int i{0};
+	for(; i + 4U <= n; i += 4U) {
+		++partial[0][row[i]];
+		++partial[1][row[i + 1U]];
+		++partial[2][row[i + 2U]];
+		++partial[3][row[i + 3U]];
+	}
+	for(; i < n; ++i) {
+		++partial[0][row[i]];
+	}
+	for(unsigned int v{0}; v < 256U; ++v) {
+		histogram[v] += partial[0][v] + partial[1][v] + partial[2][v] + partial[3][v];
+	}
+}
+
+void ScalarPairs(const unsigned char* const row, const unsigned int first, const unsigned int n, std::array<unsigned long long, 5>& pairs) {
+	for(unsigned int i{first}; i + 1U < n; ++i) {
+		const unsigned int u{row[i]}, v{row[i + 1U]};
+		const bool even{(v & 1U) == 0U};
+		pairs[1] += (even && u < v) || (!even && u > v);
+		pairs[2] += (even && u > v) || (!even && u < v);
+		pairs[3] += u == v;
+		pairs[4] += (u ^ v) == 1U;
+	}
+}
+
+// f(G) of Fridrich's RS analysis with the mask [0, 1, 1, 0], flip = F1 or F-1
+template <typename Flip>
+int Smoothness(const int x0, const int x1, const int x2, const int x3, const Flip& flip) {
+	const int y1{flip(x1)}, y2{flip(x2)};
+	return std::abs(y1 - x0) + std::abs(y2 - y1) + std::abs(x3 - y2);
+}
+
+void ScalarGroups(const std::array<const unsigned char*, 4>& x, const unsigned int first, const unsigned int count,
+				  std::array<unsigned long long, 9>& groups) {
+	const auto same = [](const int v) { return v; };
+	const auto positive = [](const int v) { return v ^ 1; };
+	const auto negative = [](const int v) { return ((v + 1) ^ 1) - 1; };
+	for(unsigned int g{first}; g < count; ++g) {
+		for(unsigned int flipped{0}; flipped < 2U; ++flipped) {
+			const int mask{static_cast<int>(flipped)};
+			const int x0{x[0][g] ^ mask}, x1{x[1][g] ^ mask}, x2{x[2][g] ^ mask}, x3{x[3][g] ^ mask};
+			const int f{Smoothness(x0, x1, x2, x3, same)};
+			const int fp{Smoothness(x0, x1, x2, x3, positive)}, fn{Smoothness(x0, x1, x2, x3, negative)};
+			groups[1U + 4U * flipped] += fp > f;
+			groups[2U + 4U * flipped] += fp < f;
+			groups[3U + 4U * flipped] += fn > f;
+			groups[4U + 4U * flipped] += fn < f;
+		}
+	}
+}
+
+#if STEGANO_STEGANALYSIS_SSE2
+// Sums the byte counters of a register into 64 bit totals
+inline unsigned long long SumBytes(const __m128i counters) {
+	const __m128i sums{_mm_sad_epu8(counters, _mm_setzero_si128())};
+	return static_cast<unsigned long long>(_mm_cvtsi128_si32(sums))
+		   + static_cast<unsigned long long>(_mm_cvtsi128_si32(_mm_srli_si128(sums, 8)));
+}
+
+// 16 sample pairs per iteration, the masks of each class are counted in byte counters flushed before they wrap
+unsigned int Sse2Pairs(const unsigned char* const row, const unsigned int n, std::array<unsigned long long, 5>& pairs) {
+	const __m128i bias{_mm_set1_epi8(static_cast<char>(0x80))}, one{_mm_set1_epi8(1)}, zero{_mm_setzero_si128()};
+	unsigned int i{0};
+	while(i + 17U <= n) {
+		__m128i x{zero}, y{zero}, z{zero}, w{zero};
+		for(unsigned int k{0}; k < 255U && i + 17U <= n; ++k, i += 16U) {
+			const __m128i u{_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i))};
+			const __m128i v{_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i + 1U))};
+			const __m128i lt{_mm_cmplt_epi8(_mm_xor_si128(u, bias), _mm_xor_si128(v, bias))};
+			const __m128i gt{_mm_cmpgt_epi8(_mm_xor_si128(u, bias), _mm_xor_si128(v, bias))};
+			const __m128i even{_mm_cmpeq_epi8(_mm_and_si128(v, one), zero)};
+			x = _mm_sub_epi8(x, _mm_or_si128(_mm_and_si128(even, lt), _mm_andnot_si128(even, gt)));
+			y = _mm_sub_epi8(y, _mm_or_si128(_mm_and_si128(even, gt), _mm_andnot_si128(even, lt)));
+			z = _mm_sub_epi8(z, _mm_cmpeq_epi8(u, v));
+			w = _mm_sub_epi8(w, _mm_cmpeq_epi8(_mm_xor_si128(u, v), one));
+		}
+		pairs[1] += SumBytes(x);
+		pairs[2] += SumBytes(y);
+		pairs[3] += SumBytes(z);
+		pairs[4] += SumBytes(w);
+	}
+	return i;
+}
+
+inline __m128i AbsoluteDifference(const __m128i a, const __m128i b) {
+	return _mm_max_epi16(_mm_sub_epi16(a, b), _mm_sub_epi16(b, a));
+}
+
+inline __m128i Smoothness(const __m128i x0, const __m128i y1, const __m128i y2, const __m128i x3) {
+	return _mm_add_epi16(_mm_add_epi16(AbsoluteDifference(y1, x0), AbsoluteDifference(y2, y1)), AbsoluteDifference(x3, y2));
+}
+
+// 8 RS groups per iteration in 16 bit lanes, F-1 reaches -1 and 256
+unsigned int Sse2Groups(const std::array<const unsigned char*, 4>& x, const unsigned int count, std::array<unsigned long long, 9>& groups) {
+	const __m128i one{_mm_set1_epi16(1)}, zero{_mm_setzero_si128()};
+	const auto load = [&zero](const unsigned char* const data) {
+		return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(data)), zero);
+	};
+	const auto negative = [&one](const __m128i v) { return _mm_sub_epi16(_mm_xor_si128(_mm_add_epi16(v, one), one), one); };
+	unsigned int g{0};
+	while(g + 8U <= count) {
+		__m128i counters[8]{zero, zero, zero, zero, zero, zero, zero, zero};
+		for(unsigned int k{0}; k < 4096U && g + 8U <= count; ++k, g += 8U) {
+			for(unsigned int flipped{0}; flipped < 2U; ++flipped) {
+				const __m128i mask{flipped ? one : zero};
+				const __m128i x0{_mm_xor_si128(load(x[0] + g), mask)}, x1{_mm_xor_si128(load(x[1] + g), mask)};
+				const __m128i x2{_mm_xor_si128(load(x[2] + g), mask)}, x3{_mm_xor_si128(load(x[3] + g), mask)};
+				const __m128i f{Smoothness(x0, x1, x2, x3)};
+				const __m128i fp{Smoothness(x0, _mm_xor_si128(x1, one), _mm_xor_si128(x2, one), x3)};
+				const __m128i fn{Smoothness(x0, negative(x1), negative(x2), x3)};
+				__m128i* const c{counters + 4U * flipped};
+				c[0] = _mm_sub_epi16(c[0], _mm_cmpgt_epi16(fp, f));
+				c[1] = _mm_sub_epi16(c[1], _mm_cmplt_epi16(fp, f));
+				c[2] = _mm_sub_epi16(c[2], _mm_cmpgt_epi16(fn, f));
+				c[3] = _mm_sub_epi16(c[3], _mm_cmplt_epi16(fn, f));
+			}
+		}
+		for(unsigned int k{0}; k < 8U; ++k) {
+			alignas(16) std::array<int, 4> sums;
+			_mm_store_si128(reinterpret_cast<__m128i*>(sums.data()), _mm_madd_epi16(counters[k], one));
+			groups[1U + k] += static_cast<unsigned long long>(sums[0]) + sums[1] + sums[2] + sums[3];
+		}
+	}
+	return g;
+}
+#endif
+
+// Counts one row of one channel, row holds its low bytes and x the same bytes split by position in their RS group
+void CountRow(const unsigned char* const row, const unsigned int n, const std::array<const unsigned char*, 4>& x, ChannelCounts& counts) {
+	Histogram(row, n, counts.histogram);
+	unsigned int first{0};
+#if STEGANO_STEGANALYSIS_SSE2
+	first = Sse2Pairs(row, n, counts.pairs);
+#endif
+	ScalarPairs(row, first, n, counts.pairs);
+	counts.pairs[0] += n ? n - 1U : 0U;
+
+	const unsigned int GroupCount{n / 4U};
+	first = 0U;
+#if STEGANO_STEGANALYSIS_SSE2
+	first = Sse2Groups(x, GroupCount, counts.groups);
+#endif
+	ScalarGroups(x, first, GroupCount, counts.groups);
+	counts.groups[0] += GroupCount;
+}
+
+// Regularized upper incomplete gamma function Q(a, x), series below a + 1 and continued fraction above
+double GammaQ(const double a, const double x) {
+	if(x <= 0.0) {
+		return 1.0;
+	}
+	const double scale{std::exp(-x + a * std::log(x) - std::lgamma(a))};
+	if(x < a + 1.0) {
+		double term{1.0 / a}, sum{term};
+		for(unsigned int n{1}; n < 1000U && std::abs(term) > std::abs(sum) * 1e-15; ++n) {
+			term *= x / (a + n);
+			sum += term;
+		}
+		return std::max(0.0, 1.0 - sum * scale);
+	}
+	constexpr double tiny{1e-300};
+	double b{x + 1.0 - a}, c{1.0 / tiny}, d{1.0 / b}, h{d};
+	for(unsigned int i{1}; i < 1000U; ++i) {
+		const double an{-static_cast<double>(i) * (i - a)};
+		b += 2.0;
+		d = an * d + b;
+		d = std::abs(d) < tiny ? tiny : d;
+		c = b + an / c;
+		c = std::abs(c) < tiny ? tiny : c;
+		d = 1.0 / d;
+		h *= d * c;
+		if(std::abs(d * c - 1.0) < 1e-15) {
+			break;
+		}
+	}
+	return scale * h;
+}
+
+// Westfeld and Pfitzmann: LSB replacement evens out the counts of 2k and 2k + 1, the statistic shrinks as the payload grows
+double ChiSquare(const std::array<unsigned long long, 256>& histogram) {
+	double statistic{0.0};
+	unsigned int categories{0};
+	for(unsigned int k{0}; k < 256U; k += 2U) {
+		const double expected{(histogram[k] + histogram[k + 1U]) / 2.0};
+		if(expected < MinimumExpected) {
+			continue;
+		}
+		statistic += (histogram[k] - expected) * (histogram[k] - expected) / expected;
+		++categories;
+	}
+	return categories > 1U ? GammaQ((categories - 1U) / 2.0, statistic / 2.0) : 0.0;
+}
+
+// Smaller root of a p^2 + b p + c, c / b if the roots are not real
+double SmallerRoot(const double a, const double b, const double c) {
+	const double discriminant{b * b - 4.0 * a * c};
+	if(a == 0.0 || discriminant < 0.0) {
+		return b != 0.0 ? -c / b : 0.0;
+	}
+	const double plus{(-b + std::sqrt(discriminant)) / (2.0 * a)}, minus{(-b - std::sqrt(discriminant)) / (2.0 * a)};
+	return std::abs(plus) <= std::abs(minus) ? plus : minus;
+}
+
+// Fridrich, Goljan and Du: regular and singular groups under F1 and F-1 drift apart as the LSBs are randomised
+double RsRate(const std::array<unsigned long long, 9>& groups) {
+	if(!groups[0]) {
+		return 0.0;
+	}
+	const double n{static_cast<double>(groups[0])};
+	const double d0{(groups[1] - static_cast<double>(groups[2])) / n}, dn0{(groups[3] - static_cast<double>(groups[4])) / n};
+	const double d1{(groups[5] - static_cast<double>(groups[6])) / n}, dn1{(groups[7] - static_cast<double>(groups[8])) / n};
+	const double z{SmallerRoot(2.0 * (d1 + d0), dn0 - dn1 - d1 - 3.0 * d0, d0 - dn0)};
+	return z - 0.5 != 0.0 ? std::min(1.0, std::max(0.0, z / (z - 0.5))) : 0.0;
+}
+
+// Dumitrescu, Wu and Wang: sample pair analysis, the embedding rate is the smaller root of (W + Z) / 2 p^2 + (2X - P) p + Y - X
+double SpaRate(const std::array<unsigned long long, 5>& pairs) {
+	const double p{static_cast<double>(pairs[0])}, x{static_cast<double>(pairs[1])}, y{static_cast<double>(pairs[2])};
+	const double z{static_cast<double>(pairs[3])}, w{static_cast<double>(pairs[4])};
+	return std::min(1.0, std::max(0.0, SmallerRoot((w + z) / 2.0, 2.0 * x - p, y - x)));
+}
+}
+
+LsbStatistics AnalyseLsb(const cv::Mat& image) {
+	const unsigned int rows{static_cast<unsigned int>(image.rows)}, cols{static_cast<unsigned int>(image.cols)};
+	const unsigned int channels{static_cast<unsigned int>(image.channels())};
+	const unsigned int bands{(rows + BandRows - 1U) / BandRows};
+	std::vector<std::vector<ChannelCounts>> counts(bands, std::vector<ChannelCounts>(channels));
+	VisitChannels(image, [&](const auto* const ImageData) {
+		WorkerPool::Instance().Run(bands, [&](const unsigned int band) {
+			// Low byte of every sample of a channel, in order and split by position in its RS group
+			thread_local std::vector<unsigned char> row, split;
+			row.resize(cols);
+			split.resize(cols);
+			const std::array<const unsigned char*, 4> x{split.data(), split.data() + cols / 4U, split.data() + cols / 4U * 2U,
+														split.data() + cols / 4U * 3U};
+			for(unsigned int r{band * BandRows}; r < std::min(rows, (band + 1U) * BandRows); ++r) {
+				const auto* const pixels{ImageData + static_cast<std::size_t>(r) * cols * channels};
+				for(unsigned int c{0}; c < channels; ++c) {
+					for(unsigned int i{0}; i < cols; ++i) {
+						row[i] = static_cast<unsigned char>(pixels[i * channels + c]);
+					}
+					for(unsigned int g{0}; g < cols / 4U; ++g) {
+						for(unsigned int k{0}; k < 4U; ++k) {
+							split[k * (cols / 4U) + g] = row[g * 4U + k];
+						}
+					}
+					CountRow(row.data(), cols, x, counts[band][c]);
+				}
+			}
+		});
+	});
+
+	LsbStatistics statistics{};
+	for(unsigned int c{0}; c < channels; ++c) {
+		ChannelCounts total;
+		for(unsigned int band{0}; band < bands; ++band) {
+			total.Add(counts[band][c]);
+		}
+		// The most exposed channel for the chi-square attack, the mean rate over the channels for the estimators
+		statistics.ChiSquare = std::max(statistics.ChiSquare, ChiSquare(total.histogram));
+		statistics.RsRate += RsRate(total.groups) / channels;
+		statistics.SpaRate += SpaRate(total.pairs) / channels;
+	}
+	return statistics;
+}
+
+bool ReportDetectability(const LsbStatistics& original, const LsbStatistics& encoded, const std::string& name) {
+	Stegano::Logger::Log('\n', "LSB steganalysis of the ", name, ", original -> encoded", '\n');
+	Stegano::Logger::Log("Chi-square embedding probability = ", original.ChiSquare, " -> ", encoded.ChiSquare, '\n');
+	Stegano::Logger::Log("RS estimated embedding rate = ", original.RsRate, " -> ", encoded.RsRate, '\n');
+	Stegano::Logger::Log("SPA estimated embedding rate = ", original.SpaRate, " -> ", encoded.SpaRate, '\n');
+	const bool exposed{(encoded.ChiSquare >= ExposedChiSquare && original.ChiSquare < ExposedChiSquare)
+					   || encoded.RsRate - original.RsRate >= ExposedRate || encoded.SpaRate - original.SpaRate >= ExposedRate};
+	if(exposed) {
+		Stegano::Logger::Error("Warning!", " The ", name, " is exposed to LSB steganalysis, use a larger base image, a smaller",
+							   " payload or \"adaptive\"", '\n');
+	}
+	return exposed;
+}
+
+}
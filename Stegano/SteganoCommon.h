@@ -5,17 +5,200 @@
 #include <array>
 #include <tuple>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <string>
 #include <opencv2/opencv.hpp>
 #include "SteganoLogger.h"
 
 namespace Stegano {
-// BPCH = Bits per channel
-constexpr std::array<std::array<unsigned int, 3>, 12> BPCH{
-	{{0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {1, 1, 2}, {2, 1, 2}, {2, 2, 2}, {2, 2, 3}, {3, 2, 3}, {3, 3, 3}, {3, 3, 4}, {4, 3, 4}, {4, 4, 4}}};
+// BPCH = Bits per channel, rows past 11 are only used by 16 bit and floating point bases (see BpchRows())
+constexpr std::array<std::array<unsigned int, 3>, 24> BPCH{
+	{{0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {1, 1, 2}, {2, 1, 2}, {2, 2, 2}, {2, 2, 3}, {3, 2, 3}, {3, 3, 3}, {3, 3, 4}, {4, 3, 4}, {4, 4, 4},
+	 {4, 4, 5}, {5, 4, 5}, {5, 5, 5}, {5, 5, 6}, {6, 5, 6}, {6, 6, 6}, {6, 6, 7}, {7, 6, 7}, {7, 7, 7}, {7, 7, 8}, {8, 7, 8}, {8, 8, 8}}};
+
+// BPCH of BGRA bases, the extra bits of a row go to alpha first, then red, then blue
+constexpr std::array<std::array<unsigned int, 4>, 32> BPCH4{
+	{{0, 0, 0, 1}, {0, 0, 1, 1}, {1, 0, 1, 1}, {1, 1, 1, 1}, {1, 1, 1, 2}, {1, 1, 2, 2}, {2, 1, 2, 2}, {2, 2, 2, 2},
+	 {2, 2, 2, 3}, {2, 2, 3, 3}, {3, 2, 3, 3}, {3, 3, 3, 3}, {3, 3, 3, 4}, {3, 3, 4, 4}, {4, 3, 4, 4}, {4, 4, 4, 4},
+	 {4, 4, 4, 5}, {4, 4, 5, 5}, {5, 4, 5, 5}, {5, 5, 5, 5}, {5, 5, 5, 6}, {5, 5, 6, 6}, {6, 5, 6, 6}, {6, 6, 6, 6},
+	 {6, 6, 6, 7}, {6, 6, 7, 7}, {7, 6, 7, 7}, {7, 7, 7, 7}, {7, 7, 7, 8}, {7, 7, 8, 8}, {8, 7, 8, 8}, {8, 8, 8, 8}}};
+
+/**
+ * @brief Number of BPCH rows usable on base channels of the given width. 8 bit channels take at most 4 bits, wider channels
+ * (16 bit, or the mantissa of a float) take up to 8 bits in their low byte with a far smaller relative change.
+ * @param ChannelBytes -> Bytes per base channel
+ * @param PixelChannels -> Channels per base pixel, 3 => BPCH, 4 => BPCH4
+ */
+constexpr unsigned int BpchRows(const std::size_t ChannelBytes, const unsigned int PixelChannels) {
+	return (ChannelBytes == 1U ? 4U : 8U) * PixelChannels;
+}
 
 constexpr std::array<unsigned int, 9> PowersOfTwo{0x1, 0x2, 0x4, 0x8, 0x10, 0x20, 0x40, 0x80, 0x100};
 
-extern bool showimages;
+extern bool showimages, mempool;
+// Set by "analyse", encoders then report how detectable the encoded image is (see AnalyseLsb())
+extern bool analyse;
+// zlib level and strategy of PNG outputs
+extern int pnglevel, pngstrategy;
+
+/**
+ * @brief Makes every cv::Mat allocate its pixels from a pool recycling large buffers, backed by huge pages where possible
+ */
+void InstallMatPool();
+/**
+ * @brief Logs the statistics of the buffer pool (verbose), does nothing if the pool is not installed
+ */
+void ReportMatPool();
+
+// Output image formats, picked from the extension of the output path
+enum ImageFormat { FORMAT_NONE, FORMAT_PNG, FORMAT_TIFF, FORMAT_QOI, FORMAT_PAM, FORMAT_BMP, FORMAT_JPEG };
+
+/**
+ * @brief Output format of a path: .png, .tif/.tiff, .qoi, .pam, .bmp or .jpg/.jpeg (case insensitive). JPEG outputs are only
+ * written from the DCT coefficients of a JPEG base, see EncodeJpeg().
+ * @param path -> Image path
+ * @return FORMAT_NONE => Not an image format this application writes
+ */
+ImageFormat OutputFormat(const std::string& path);
+/**
+ * @brief Whether a file is a JPEG image, from its signature
+ * @param path -> File path
+ */
+bool JpegFile(const std::string& path);
+/**
+ * @brief Writes an image in the format of its path. PNG uses pnglevel and pngstrategy, QOI is encoded here, PAM, BMP and TIFF are
+ * written uncompressed. With a tile edge, BGR and BGRA TIFF images are written in tiles of that edge, one pool task per row of
+ * tiles.
+ * @param path -> Output path
+ * @param image -> Image
+ * @param edge -> Tile edge of TIFF outputs, 0 => strips
+ * @return true => Saved
+ */
+bool WriteImage(const std::string& path, const cv::Mat& image, unsigned int edge = 0U);
+/**
+ * @brief Rewrites bands of rows of an uncompressed PAM or BMP file in place, the rest of the file is left untouched. The pixel
+ * layout of the file is checked against a row outside the bands first.
+ * @param path -> Image file, holding image everywhere but in the bands
+ * @param image -> Image
+ * @param bands -> [first, last) row ranges to rewrite, in any order
+ * @return true => Patched, false => The file cannot be patched (format, header or layout), it has to be written in full
+ */
+bool PatchImage(const std::string& path, const cv::Mat& image, const std::vector<std::pair<int, int>>& bands);
+/**
+ * @brief Writes an image, falling back to fallback (same extension) in the working directory if output cannot be written. Logs the
+ * saved path.
+ * @param output -> Output path
+ * @param image -> Image
+ * @param fallback -> File name, without extension, used in the working directory
+ * @param edge -> Tile edge of TIFF outputs, see WriteImage()
+ * @return true => Saved
+ */
+bool SaveImage(const std::string& output, const cv::Mat& image, const std::string& fallback, unsigned int edge = 0U);
+/**
+ * @brief Reads an image written by WriteImage() or any other image cv::imread() reads. Tiled TIFF files written by WriteImage()
+ * are read one pool task per row of tiles.
+ * @param path -> Image path
+ * @param flags -> cv::IMREAD_COLOR or cv::IMREAD_UNCHANGED
+ * @return Empty matrix if the image cannot be read
+ */
+cv::Mat ReadImage(const std::string& path, int flags);
+/**
+ * @brief Reads a base or encoded image as BGR, or as BGRA if it has an alpha channel. 16 bit and 32 bit floating point channels are
+ * kept as they are (other depths are converted to 8 bit).
+ * @param path -> Image path
+ * @return Empty matrix if the image cannot be read
+ */
+cv::Mat ReadCarrier(const std::string& path);
+/**
+ * @brief Checks that a base of the given depth can be encoded and saved at output without losing the embedded bits. Floating
+ * point bases must hold finite values only and be saved as TIFF, 16 bit bases as PNG, TIFF or PAM, BGRA bases in anything but BMP.
+ * @param BaseImage -> Base image
+ * @param output -> Output path
+ * @return true => Base and output are usable
+ */
+bool CheckCarrierDepth(const cv::Mat& BaseImage, const std::string& output);
+
+// LSB steganalysis statistics of an image
+struct LsbStatistics {
+	// Chi-square attack, probability that the LSBs carry a payload
+	double ChiSquare;
+	// Embedding rates (changed LSBs per sample x 2) estimated by RS analysis and sample pair analysis
+	double RsRate, SpaRate;
+};
+
+/**
+ * @brief Runs the chi-square attack on pairs of values, RS analysis and sample pair analysis over the low byte of every channel.
+ * Bands of rows are counted by the worker pool, the pair and group statistics with SSE2 kernels.
+ * @param image -> Image of any depth and channel count
+ * @return Most exposed channel for the chi-square attack, mean over the channels for the rates
+ */
+LsbStatistics AnalyseLsb(const cv::Mat& image);
+/**
+ * @brief Logs the statistics of a base before and after encoding, and warns if the encoded image is exposed
+ * @param original -> Statistics of the base
+ * @param encoded -> Statistics of the encoded image
+ * @param name -> Name of the encoded image in the log
+ * @return true => Exposed
+ */
+bool ReportDetectability(const LsbStatistics& original, const LsbStatistics& encoded, const std::string& name);
+
+/**
+ * @brief Peak of the PSNR of an image, the largest value its channels take
+ * @param image -> Image of depth CV_8U (255), CV_16U (65535) or CV_32F (1.0)
+ */
+inline double PeakValue(const cv::Mat& image) {
+	return image.depth() == CV_16U ? 65535.0 : image.depth() == CV_32F ? 1.0 : 255.0;
+}
+
+/**
+ * @brief Mean of a per channel quality score (MSE, SSIM) over the channels of an image
+ * @param score -> Per channel score
+ * @param channels -> Channels of the image
+ */
+inline double ChannelMean(const cv::Scalar& score, const int channels) {
+	double sum{0.0};
+	for(int c{0}; c < channels; ++c) {
+		sum += score[c];
+	}
+	return sum / channels;
+}
+
+/**
+ * @brief PSNR of a whole image from its per channel MSE. 8 bit bases keep the 255 * 255 * 4 / sum of MSE reported since the first
+ * release, wider bases use their peak over the mean MSE.
+ * @param MSE -> Per channel MSE
+ * @param image -> Image the MSE was measured on
+ */
+inline double TotalPsnr(const cv::Scalar& MSE, const cv::Mat& image) {
+	const int channels{image.channels()};
+	if(image.depth() == CV_8U) {
+		return 10.0 * std::log10(255.0 * 255.0 * 4.0 / (ChannelMean(MSE, channels) * channels));
+	}
+	const double peak{PeakValue(image)};
+	return 10.0 * std::log10(peak * peak / ChannelMean(MSE, channels));
+}
+
+/**
+ * @brief Reads an environment variable, with _dupenv_s on Windows where getenv is deprecated
+ * @param name -> Variable name
+ * @return Value of the variable, empty if it is not set
+ */
+inline std::string EnvironmentVariable(const char* const name) {
+#if _WIN32
+	char* value{nullptr};
+	std::size_t size{0};
+	if(_dupenv_s(&value, &size, name) || !value) {
+		return {};
+	}
+	const std::string text{value};
+	std::free(value);
+	return text;
+#else
+	const char* const value{std::getenv(name)};
+	return value ? value : "";
+#endif
+}
 
 #if _WIN32
 inline void ResizeToSmall(const cv::Mat& input, cv::Mat& output, const std::string& name, double extrashrinkfactor = 1.0);
@@ -0,0 +1,729 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "SteganoCommon.h"
+#include "SteganoThreadedCommon.h"
+
+namespace Stegano {
+
+// Loop state of the embedding/extraction kernels
+// base = index pointing to Base Image (the encoded image while decoding)
+// payload = index pointing to Source Image (the decoded image while decoding)
+// BGR = Active channel (Blue, Green, Red, and Alpha on BGRA bases)
+// TransferredBits = Number of bits transferred which do not make up a full byte, see the encoding loop for details
+struct KernelState {
+	unsigned int base, payload, TransferredBits, BGR;
+};
+
+/**
+ * @brief End (exclusive) of band k when the usable base channels are split into equal bands
+ * @param k -> Band index
+ * @param bands -> Number of bands
+ * @param UsableChannels -> Base channels available for the payload (trailer excluded)
+ */
+inline unsigned int BandEnd(const unsigned int k, const unsigned int bands, const unsigned int UsableChannels) {
+	return (k == bands - 1U) ? UsableChannels : UsableChannels / bands * (k + 1U);
+}
+
+/**
+ * @brief Computes the loop state at base channel n, as if the kernel had run over all the channels before it
+ * @param n -> Base channel, a channel skipped by the stride moves the state to the next encoding pixel
+ * @param stride -> Pixels skipped between two encoding pixels
+ * @param BitsPerPixel -> Zero indexed row of BPCH
+ * @param bpch -> Bits per channel, 3 or 4 channels per pixel
+ */
+template <std::size_t Channels>
+inline KernelState ChannelStart(const unsigned int n, const unsigned int stride, const unsigned int BitsPerPixel,
+								const std::array<unsigned int, Channels>& bpch) {
+	constexpr unsigned int PixelChannels{static_cast<unsigned int>(Channels)};
+	KernelState state{n, 0U, 0U, 0U};
+	// Jump made by a stride in channels
+	const unsigned int stridechjump{(stride + 1U) * PixelChannels};
+	// Total bits transferred by previous loops
+	unsigned long long tbt{0};
+	if(stride != 0U) {
+		// If base points to a channel which will encode bits in it, the following calculation will return a value in [0, PixelChannels)
+		// If it will not encode bits in it, the value will be >= PixelChannels
+		state.BGR = n % stridechjump;
+		if(state.BGR >= PixelChannels) {
+			// Jumping to the next suitable pixel for encoding
+			state.base += stridechjump - state.BGR;
+			// obviously moving to next fresh pixel implies we are on its first channel, hence BGR = 0
+			state.BGR = 0U;
+		}
+		// Number of pixels fully traversed by previous loops, a pixel cut in the middle by n is not counted
+		unsigned long long pixelsdone{n / stridechjump};
+		// Jumped over the skipped pixels => the pixel at n was fully encoded by the previous loops
+		if(n % stridechjump >= PixelChannels) {
+			++pixelsdone;
+		}
+		// Total bits transferred = (number of pixels) * (bits in each pixel)
+		tbt = pixelsdone * (BitsPerPixel + 1U);
+	}
+	else {
+		// No strides, all encoding pixels are together
+		state.BGR = n % PixelChannels;
+		tbt = static_cast<unsigned long long>(n / PixelChannels) * (BitsPerPixel + 1U);
+	}
+	// BGR > 0 => Previous loop encoded extra channels after fully encoded pixels
+	for(unsigned int c{0}; c < state.BGR; ++c) {
+		tbt += bpch[c];
+	}
+	// Number of bytes transferred
+	state.payload = static_cast<unsigned int>(tbt / 8U);
+	state.TransferredBits = static_cast<unsigned int>(tbt % 8U);
+	return state;
+}
+
+/**
+ * @brief Computes the loop state at the start of band k, as if the kernel had run over all the previous bands
+ * @param k -> Band index
+ * @param bands -> Number of bands
+ * @param UsableChannels -> Base channels available for the payload (trailer excluded)
+ * @param stride -> Pixels skipped between two encoding pixels
+ * @param BitsPerPixel -> Zero indexed row of BPCH
+ * @param bpch -> Bits per channel, 3 or 4 channels per pixel
+ */
+template <std::size_t Channels>
+inline KernelState BandStart(const unsigned int k, const unsigned int bands, const unsigned int UsableChannels, const unsigned int stride,
+							 const unsigned int BitsPerPixel, const std::array<unsigned int, Channels>& bpch) {
+	if(k == 0U) {
+		return {0U, 0U, 0U, 0U};
+	}
+	// Number of iterations performed before the new loop
+	return ChannelStart((UsableChannels / bands) * k, stride, BitsPerPixel, bpch);
+}
+
+/* Layout plans
+** The BPCH row, stride and band split of a payload depend only on the base dimensions, the channel type, the embedded length and the
+** job split. A plan holds them with the loop state at the start of every band, it is built once per shape and shared by every
+** encode, decode and region decode of that shape (see PlanLayout()).
+*/
+struct LayoutPlan {
+	// Base pixels available for the payload (trailer excluded), channels per pixel, all base channels and the usable ones
+	unsigned int AvailableBasePixels, PixelChannels, TotalBaseChannels, UsableChannels;
+	// Zero indexed row of BPCH and pixels skipped between two encoding pixels, the last row without stride if the payload overflows
+	unsigned int BitsPerPixel, stride;
+	JobPlan job;
+	// Loop state at the start and end (exclusive) of every band, job.chunks of each
+	std::vector<KernelState> starts;
+	std::vector<unsigned int> ends;
+};
+
+/**
+ * @brief Plans the layout of a payload in a base, or returns the memoised plan of an earlier job of the same shape
+ * @param base -> Base image (the encoded image while decoding)
+ * @param EmbeddedBits -> Number of embedded bits, checksums included
+ * @param PayloadBytes -> Number of bytes moved by the kernels, sizes the job (see PlanJob())
+ * @param extract -> Decoding job
+ * @return Immutable plan
+ */
+std::shared_ptr<const LayoutPlan> PlanLayout(const cv::Mat& base, unsigned long long EmbeddedBits, unsigned int PayloadBytes,
+											 bool extract);
+
+/* Payload chunks
+** ChunkPixels encoding pixels carry exactly ChunkBytes() payload bytes, whatever the BPCH row. A chunk thus starts on both a pixel
+** and a byte boundary and can be embedded or extracted without knowing anything about the previous chunks.
+*/
+constexpr unsigned int ChunkPixels{8192U};
+
+/**
+ * @brief Number of payload bytes carried by a chunk
+ * @param BitsPerPixel -> Zero indexed row of BPCH
+ */
+constexpr unsigned int ChunkBytes(const unsigned int BitsPerPixel) {
+	return ChunkPixels / 8U * (BitsPerPixel + 1U);
+}
+
+/**
+ * @brief Loop state at the start of a chunk
+ * @param chunk -> Chunk index
+ * @param stride -> Pixels skipped between two encoding pixels
+ * @param BitsPerPixel -> Zero indexed row of BPCH
+ * @param PixelChannels -> Channels per base pixel
+ */
+inline KernelState ChunkStart(const unsigned int chunk, const unsigned int stride, const unsigned int BitsPerPixel,
+							  const unsigned int PixelChannels) {
+	return {chunk * ChunkPixels * (stride + 1U) * PixelChannels, chunk * ChunkBytes(BitsPerPixel), 0U, 0U};
+}
+
+/**
+ * @brief Loop state at the start of the encoding pixel holding the first bit of a payload byte, the state may point up to two
+ * bytes before it when the pixel straddles bytes
+ * @param byte -> Payload byte index
+ * @param stride -> Pixels skipped between two encoding pixels
+ * @param BitsPerPixel -> Zero indexed row of BPCH
+ * @param PixelChannels -> Channels per base pixel
+ */
+inline KernelState ByteStart(const unsigned int byte, const unsigned int stride, const unsigned int BitsPerPixel,
+							 const unsigned int PixelChannels) {
+	const unsigned long long pixel{byte * 8ULL / (BitsPerPixel + 1U)};
+	const unsigned long long tbt{pixel * (BitsPerPixel + 1U)};
+	const unsigned int base{static_cast<unsigned int>(pixel * (stride + 1U) * PixelChannels)};
+	return {base, static_cast<unsigned int>(tbt / 8U), static_cast<unsigned int>(tbt % 8U), 0U};
+}
+
+/* Keyed chunk order
+** With a key, chunk c of a stream is embedded in the chunk slot Place(c) instead of slot c. Place() is a 4 round Feistel network
+** over the smallest power of 4 holding the slots, walked until it lands on a slot, with round keys drawn from a PRNG seeded by
+** the key. It is a bijection computed in O(1) per chunk, so every worker still finds the slot of any chunk on its own, and inside
+** a slot the bits are written sequentially. The last chunk, the only one which may be partial, keeps its slot. Chunk() runs the
+** rounds backwards, so that a task walking the pixels of a tile finds the chunk of every slot it meets.
+*/
+class ChunkOrder {
+public:
+	// Identity, chunk c in slot c
+	ChunkOrder() = default;
+	/**
+	 * @param passphrase -> Key given on the command line, empty => identity
+	 * @param chunks -> Number of chunks of the stream
+	 */
+	ChunkOrder(const std::string& passphrase, const unsigned int chunks) {
+		if(passphrase.empty() || chunks < 3U) {
+			return;
+		}
+		slots = chunks - 1U;
+		while((1ULL << (2U * half)) < slots) {
+			++half;
+		}
+		// FNV-1a of the key seeds a SplitMix64 generator
+		unsigned long long seed{0xCBF29CE484222325ULL};
+		for(const char c : passphrase) {
+			seed = (seed ^ static_cast<unsigned char>(c)) * 0x100000001B3ULL;
+		}
+		for(unsigned int& round : keys) {
+			seed += 0x9E3779B97F4A7C15ULL;
+			unsigned long long z{seed};
+			z = (z ^ (z >> 30U)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27U)) * 0x94D049BB133111EBULL;
+			round = static_cast<unsigned int>(z ^ (z >> 31U));
+		}
+	}
+
+	// true => chunk c in slot c
+	bool Identity() const {
+		return !half;
+	}
+
+	/**
+	 * @brief Slot holding a chunk
+	 * @param chunk -> Chunk index
+	 */
+	unsigned int Place(const unsigned int chunk) const {
+		if(!half || chunk >= slots) {
+			return chunk;
+		}
+		unsigned int slot{chunk};
+		do {
+			slot = Encrypt(slot);
+		} while(slot >= slots);
+		return slot;
+	}
+
+	/**
+	 * @brief Chunk held by a slot, the inverse of Place()
+	 * @param slot -> Slot index
+	 */
+	unsigned int Chunk(const unsigned int slot) const {
+		if(!half || slot >= slots) {
+			return slot;
+		}
+		unsigned int chunk{slot};
+		do {
+			chunk = Decrypt(chunk);
+		} while(chunk >= slots);
+		return chunk;
+	}
+
+private:
+	// MurmurHash3 finaliser as the round function
+	static unsigned int Round(const unsigned int value, const unsigned int round) {
+		unsigned int f{value ^ round};
+		f = (f ^ (f >> 16U)) * 0x85EBCA6BU;
+		f = (f ^ (f >> 13U)) * 0xC2B2AE35U;
+		return f ^ (f >> 16U);
+	}
+
+	unsigned int Encrypt(const unsigned int value) const {
+		const unsigned int mask{(1U << half) - 1U};
+		unsigned int left{value >> half}, right{value & mask};
+		for(const unsigned int round : keys) {
+			const unsigned int next{left ^ (Round(right, round) & mask)};
+			left = right;
+			right = next;
+		}
+		return left << half | right;
+	}
+
+	unsigned int Decrypt(const unsigned int value) const {
+		const unsigned int mask{(1U << half) - 1U};
+		unsigned int left{value >> half}, right{value & mask};
+		for(auto round = keys.rbegin(); round != keys.rend(); ++round) {
+			const unsigned int previous{right ^ (Round(left, *round) & mask)};
+			right = left;
+			left = previous;
+		}
+		return left << half | right;
+	}
+
+	// Permuted slots (every chunk but the last) and bits per Feistel half, 0 => identity
+	unsigned int slots{0}, half{0};
+	std::array<unsigned int, 4> keys{};
+};
+
+/* Tile order
+** The kernels and chunks of an extended stream run over positions, the usable pixels (trailer excluded) numbered in the order the
+** stream fills them. In row order position p is pixel p. In tile order the base is cut in edge x edge tiles (cut short at the
+** right and bottom edges) taken in raster order, the positions of a tile numbering its pixels row by row, the trailer pixels
+** skipped. Runs() maps positions straight to the rows of pixels holding them, the kernels embed and extract them in place.
+*/
+class TileWalk {
+public:
+	// Row order, position p is pixel p
+	TileWalk() = default;
+	/**
+	 * @param edge -> Tile edge, 0 => row order, as is a base no wider than a tile
+	 * @param rows -> Image rows
+	 * @param cols -> Image columns
+	 */
+	TileWalk(unsigned int edge, unsigned int rows, unsigned int cols);
+
+	// true => position p is pixel p
+	bool RowOrder() const {
+		return !edge;
+	}
+
+	// Number of tiles, 0 in row order
+	unsigned int Tiles() const {
+		return TilesX * TilesY;
+	}
+
+	/**
+	 * @brief First position of a tile
+	 * @param t -> Tile index, Tiles() => end of the usable pixels
+	 */
+	unsigned int Start(const unsigned int t) const {
+		return starts[t];
+	}
+
+	/**
+	 * @brief Tile holding a position
+	 * @param position -> Position, below the number of usable pixels
+	 */
+	unsigned int Tile(const unsigned int position) const {
+		return static_cast<unsigned int>(std::upper_bound(starts.begin(), starts.end(), position) - starts.begin()) - 1U;
+	}
+
+	/**
+	 * @brief Calls body(pixel, position, count) for the runs of consecutive pixels holding the positions [first, last), in position
+	 * order. A run never crosses a row, nor a tile in tile order.
+	 * @param first -> First position
+	 * @param last -> End position (exclusive)
+	 * @param body -> Callable taking the first pixel of the run, its position and its length
+	 */
+	template <typename Body>
+	void Runs(unsigned int first, const unsigned int last, Body&& body) const {
+		if(first >= last) {
+			return;
+		}
+		if(!edge) {
+			body(first, first, last - first);
+			return;
+		}
+		for(unsigned int t{Tile(first)}; first < last; ++t) {
+			const unsigned int x{t % TilesX * edge}, y{t / TilesX * edge}, w{std::min(edge, cols - x)};
+			const unsigned int stop{std::min(last, starts[t + 1U])};
+			while(first < stop) {
+				const unsigned int r{(first - starts[t]) / w}, c{(first - starts[t]) % w}, count{std::min(w - c, stop - first)};
+				body((y + r) * cols + x + c, first, count);
+				first += count;
+			}
+		}
+	}
+
+	/**
+	 * @brief Rows of the image holding the positions [first, last), whole rows of tiles in tile order
+	 * @param first -> First position
+	 * @param last -> End position (exclusive), above first
+	 * @return [first, last) row range
+	 */
+	std::pair<int, int> Rows(unsigned int first, unsigned int last) const;
+
+private:
+	// Tile edge (0 => row order), image shape and tile grid
+	unsigned int edge{0}, rows{0}, cols{0}, TilesX{0}, TilesY{0};
+	// Position of the first pixel of every tile, Tiles() + 1 entries
+	std::vector<unsigned int> starts;
+};
+
+/**
+ * @brief CRC32C (Castagnoli) of a buffer, with the SSE4.2 crc32 instruction where the processor has it
+ * @param data -> Bytes to checksum
+ * @param size -> Number of bytes
+ */
+unsigned int Crc32c(const unsigned char* data, std::size_t size);
+
+/* Pixel lanes
+** The 4 channels of an 8 bit BGRA pixel make up a 32 bit word, a whole pixel is embedded or extracted at once. 8 pixels carry
+** exactly 8 * (BitsPerPixel + 1) payload bits, a group of 8 pixels thus starts and ends on a byte boundary. The kernels below
+** run on AVX-512 (16 pixels per register) or AVX2 (8 pixels per register) where the processor and the OS support them, and on
+** scalar 32 bit words otherwise.
+*/
+constexpr unsigned int LanePixels{8U};
+
+/**
+ * @brief Embeds groups of LanePixels consecutive BGRA pixels (no stride) starting on a byte boundary
+ * @param BaseImageData -> First channel of the first pixel
+ * @param SourceImageData -> First payload byte
+ * @param groups -> Number of groups
+ * @param bpch -> Bits per channel, row of BPCH4
+ */
+void EmbedPixels(unsigned char* BaseImageData, const unsigned char* SourceImageData, unsigned int groups,
+				 const std::array<unsigned int, 4>& bpch);
+/**
+ * @brief Extracts groups of LanePixels consecutive BGRA pixels (no stride), see EmbedPixels()
+ * @param SourceImageData -> First channel of the first pixel
+ * @param DecodedImageData -> First payload byte
+ * @param groups -> Number of groups
+ * @param bpch -> Bits per channel, row of BPCH4
+ */
+void ExtractPixels(const unsigned char* SourceImageData, unsigned char* DecodedImageData, unsigned int groups,
+				   const std::array<unsigned int, 4>& bpch);
+
+// Whole pixels of this channel type and count are handled by EmbedPixels() and ExtractPixels()
+template <typename Channel, std::size_t Channels>
+constexpr bool PixelLanes{sizeof(Channel) == 1U && Channels == 4U};
+
+/**
+ * @brief Calls body with the BPCH row of a base, BPCH4 for BGRA bases and BPCH otherwise
+ * @param PixelChannels -> Channels per base pixel
+ * @param BitsPerPixel -> Zero indexed row of BPCH
+ * @param body -> Generic callable taking the row (std::array of 3 or 4 bits per channel)
+ */
+template <typename Body>
+inline decltype(auto) VisitBpch(const unsigned int PixelChannels, const unsigned int BitsPerPixel, Body&& body) {
+	if(PixelChannels == 4U) {
+		return body(BPCH4[BitsPerPixel]);
+	}
+	return body(BPCH[BitsPerPixel]);
+}
+
+/**
+ * @brief Calls body with the channels of an image as unsigned integers of their own width. Floating point channels are passed as
+ * the bits of the float, so that the kernels write the low bits of the mantissa.
+ * @param image -> Image of depth CV_8U, CV_16U or CV_32F, see ReadCarrier()
+ * @param body -> Generic callable taking a pointer to the first channel
+ */
+template <typename Body>
+inline decltype(auto) VisitChannels(const cv::Mat& image, Body&& body) {
+	switch(image.depth()) {
+	case CV_16U:
+		return body(reinterpret_cast<unsigned short*>(image.data));
+	case CV_32F:
+		return body(reinterpret_cast<unsigned int*>(image.data));
+	default:
+		return body(image.data);
+	}
+}
+
+/* Trailer
+** 40 bits held by the 2 low bits of the last 21 channels, see ParallelEncode() for the layout. The checksum byte is the XOR of
+** the first 4 bytes and of the low byte of the last channel, and of BgraMarker on BGRA bases so that a base which lost or gained
+** its alpha channel is not decoded with the wrong layout.
+*/
+constexpr unsigned char BgraMarker{0x3C};
+
+/**
+ * @brief Reads the trailer of an encoded image
+ * @param SourceImageData -> Encoded image channels
+ * @param TotalSourceChannels -> Number of channels, trailer included
+ */
+template <typename Channel>
+inline std::array<unsigned char, 5> ReadTrailer(const Channel* const SourceImageData, const unsigned int TotalSourceChannels) {
+	std::array<unsigned char, 5> trailer{0, 0, 0, 0, 0};
+	for(unsigned int ch{21}, i{0}, done{0}; ch > 1; --ch, done += 2) {
+		if(done == 8U) {
+			done = 0U;
+			++i;
+		}
+		trailer[i] *= PowersOfTwo[2];
+		trailer[i] += static_cast<unsigned char>(SourceImageData[TotalSourceChannels - ch] % 4U);
+	}
+	return trailer;
+}
+
+/**
+ * @brief Checksum of a trailer, to be compared with trailer[4] (XOR a marker for extended streams)
+ * @param trailer -> Trailer bytes
+ * @param ImageData -> Image channels
+ * @param TotalChannels -> Number of channels, trailer included
+ * @param PixelChannels -> Channels per pixel
+ */
+template <typename Channel>
+inline unsigned int TrailerChecksum(const std::array<unsigned char, 5>& trailer, const Channel* const ImageData,
+								   const unsigned int TotalChannels, const unsigned int PixelChannels) {
+	return static_cast<unsigned char>(trailer[0] ^ trailer[1] ^ trailer[2] ^ trailer[3]
+									  ^ static_cast<unsigned char>(ImageData[TotalChannels - 1]) ^ (PixelChannels == 4U ? BgraMarker : 0U));
+}
+
+/**
+ * @brief Writes a trailer, its checksum byte included, in 2 bits per channel => 6 pixels and 2 channels
+ * @param BaseImageData -> Base image channels
+ * @param TotalBaseChannels -> Number of channels, trailer included
+ * @param trailer -> Trailer bytes
+ */
+template <typename Channel>
+inline void WriteTrailer(Channel* const BaseImageData, const unsigned int TotalBaseChannels, const std::array<unsigned char, 5>& trailer) {
+	for(unsigned int ch{21}, i{0}, done{0}; ch > 1; --ch, done += 2) {
+		if(done == 8U) {
+			done = 0U;
+			++i;
+		}
+		BaseImageData[TotalBaseChannels - ch] -= BaseImageData[TotalBaseChannels - ch] % PowersOfTwo[2];
+		BaseImageData[TotalBaseChannels - ch] += static_cast<unsigned char>((trailer[i] / PowersOfTwo[6U - done]) % PowersOfTwo[2]);
+	}
+}
+
+/**
+ * @brief Embeds payload bytes in the base channels [state.base, end)
+ * @param BaseImageData -> Base image channels
+ * @param SourceImageData -> Payload bytes
+ * @param TotalSourceChannels -> Number of payload bytes
+ * @param state -> Loop state at the start of the range, see BandStart()
+ * @param end -> Base channel at which to stop
+ * @param stride -> Pixels skipped between two encoding pixels
+ * @param bpch -> Bits per channel, 3 or 4 channels per pixel
+ */
+template <typename Channel, std::size_t Channels>
+inline void EmbedRange(Channel* const BaseImageData, const unsigned char* const SourceImageData, const unsigned int TotalSourceChannels,
+					   KernelState state, const unsigned int end, const unsigned int stride,
+					   const std::array<unsigned int, Channels>& bpch) {
+	unsigned int i{state.base}, j{state.payload}, TransferredBits{state.TransferredBits}, BGR{state.BGR};
+	for(; j < TotalSourceChannels && i < end; ++BGR, ++i) {
+		if(BGR == Channels) {
+			BGR = 0U;
+			i += stride * static_cast<unsigned int>(Channels);
+			if(i >= end) {
+				break;
+			}
+		}
+		if constexpr(PixelLanes<Channel, Channels>) {
+			// Pixel and byte boundary => whole groups of pixels go through the lanes
+			if(BGR == 0U && TransferredBits == 0U && stride == 0U) {
+				const unsigned int PixelBits{bpch[0] + bpch[1] + bpch[2] + bpch[3]};
+				const unsigned int groups{std::min((end - i) / (LanePixels * 4U), (TotalSourceChannels - j) / PixelBits)};
+				if(groups) {
+					EmbedPixels(BaseImageData + i, SourceImageData + j, groups, bpch);
+					i += groups * LanePixels * 4U;
+					j += groups * PixelBits;
+					if(i >= end || j >= TotalSourceChannels) {
+						break;
+					}
+				}
+			}
+		}
+		unsigned int ChannelBits{bpch[BGR]};
+		if(ChannelBits) {
+			BaseImageData[i] -= BaseImageData[i] % PowersOfTwo[ChannelBits];
+			if(TransferredBits + ChannelBits > 8U) {
+				unsigned int NextChannelBits{ChannelBits + TransferredBits};
+				NextChannelBits -= 8U;
+				BaseImageData[i] += ((SourceImageData[j] % PowersOfTwo[8U - TransferredBits]) * PowersOfTwo[NextChannelBits]);
+				++j;
+				if(j < TotalSourceChannels) {
+					BaseImageData[i] += (SourceImageData[j] / PowersOfTwo[8U - NextChannelBits]) % PowersOfTwo[NextChannelBits];
+				}
+				TransferredBits = NextChannelBits;
+			}
+			else {
+				BaseImageData[i] += (SourceImageData[j] / PowersOfTwo[(8U - ChannelBits) - TransferredBits]) % PowersOfTwo[ChannelBits];
+				TransferredBits += ChannelBits;
+				if(TransferredBits == 8U) {
+					TransferredBits = 0U;
+					++j;
+				}
+			}
+		}
+	}
+}
+
+// Bits of a payload byte shared between two bands, see ExtractRange()
+struct KernelFragment {
+	unsigned int index, value, bits;
+};
+
+/**
+ * @brief Extracts payload bytes from the encoded channels [state.base, end)
+ * Bytes completed inside the range are written directly. Bits of the bytes shared with the neighbouring bands are returned as
+ * fragments instead, so that bands can run concurrently. Fragments are combined by MergeFragments().
+ * @param SourceImageData -> Encoded image channels
+ * @param DecodedImageData -> Payload bytes
+ * @param TotalDecodedImageChannels -> Number of payload bytes
+ * @param state -> Loop state at the start of the range, see BandStart()
+ * @param end -> Encoded channel at which to stop
+ * @param stride -> Pixels skipped between two encoding pixels
+ * @param bpch -> Bits per channel, 3 or 4 channels per pixel
+ * @param head -> Bits of the first byte if it was started by the previous band
+ * @param tail -> Bits of the last byte if it is completed by the next band
+ */
+template <typename Channel, std::size_t Channels>
+inline void ExtractRange(const Channel* const SourceImageData, unsigned char* const DecodedImageData,
+						 const unsigned int TotalDecodedImageChannels, KernelState state, const unsigned int end, const unsigned int stride,
+						 const std::array<unsigned int, Channels>& bpch, KernelFragment& head, KernelFragment& tail) {
+	unsigned int i{state.payload}, j{state.base}, TransferredBits{state.TransferredBits}, BGR{state.BGR};
+	// Bits of the byte being assembled, written once the byte is complete
+	unsigned int assembled{0U};
+	bool shared{TransferredBits != 0U};
+	head = {i, 0U, 0U};
+	tail = {i, 0U, 0U};
+	for(; i < TotalDecodedImageChannels && j < end; ++BGR, ++j) {
+		if(BGR == Channels) {
+			BGR = 0U;
+			j += stride * static_cast<unsigned int>(Channels);
+			if(j >= end) {
+				break;
+			}
+		}
+		if constexpr(PixelLanes<Channel, Channels>) {
+			// On a byte boundary no byte is shared with the previous band any more, see EmbedRange()
+			if(BGR == 0U && TransferredBits == 0U && stride == 0U) {
+				const unsigned int PixelBits{bpch[0] + bpch[1] + bpch[2] + bpch[3]};
+				const unsigned int groups{std::min((end - j) / (LanePixels * 4U), (TotalDecodedImageChannels - i) / PixelBits)};
+				if(groups) {
+					ExtractPixels(SourceImageData + j, DecodedImageData + i, groups, bpch);
+					j += groups * LanePixels * 4U;
+					i += groups * PixelBits;
+					if(j >= end || i >= TotalDecodedImageChannels) {
+						break;
+					}
+				}
+			}
+		}
+		unsigned int ChannelBits{bpch[BGR]};
+		if(ChannelBits) {
+			const unsigned int bits{SourceImageData[j] % PowersOfTwo[ChannelBits]};
+			if(TransferredBits + ChannelBits >= 8U) {
+				const unsigned int NextChannelBits{ChannelBits + TransferredBits - 8U};
+				assembled = assembled * PowersOfTwo[8U - TransferredBits] + bits / PowersOfTwo[NextChannelBits];
+				if(shared) {
+					head = {i, assembled, 8U - state.TransferredBits};
+					shared = false;
+				}
+				else {
+					DecodedImageData[i] = static_cast<unsigned char>(assembled);
+				}
+				++i;
+				assembled = bits % PowersOfTwo[NextChannelBits];
+				TransferredBits = NextChannelBits;
+			}
+			else {
+				assembled = assembled * PowersOfTwo[ChannelBits] + bits;
+				TransferredBits += ChannelBits;
+			}
+		}
+	}
+	if(shared) {
+		head = {i, assembled, TransferredBits - state.TransferredBits};
+	}
+	else {
+		tail = {i, assembled, TransferredBits};
+	}
+}
+
+/**
+ * @brief Writes the bytes shared between bands
+ * @param DecodedImageData -> Payload bytes
+ * @param TotalDecodedImageChannels -> Number of payload bytes
+ * @param fragments -> Head and tail fragments of every band, in band order
+ */
+inline void MergeFragments(unsigned char* const DecodedImageData, const unsigned int TotalDecodedImageChannels,
+						   const std::vector<KernelFragment>& fragments) {
+	KernelFragment byte{0U, 0U, 0U};
+	for(const KernelFragment& fragment : fragments) {
+		if(!fragment.bits) {
+			continue;
+		}
+		if(fragment.index != byte.index) {
+			byte = {fragment.index, 0U, 0U};
+		}
+		byte.value = byte.value * PowersOfTwo[fragment.bits] + fragment.value;
+		byte.bits += fragment.bits;
+		if(byte.bits >= 8U && byte.index < TotalDecodedImageChannels) {
+			DecodedImageData[byte.index] = static_cast<unsigned char>(byte.value);
+		}
+	}
+}
+
+/**
+ * @brief Extracts the payload bytes [first, first + count) without touching the channels before them
+ * @param SourceImageData -> Encoded image channels
+ * @param UsableChannels -> Channels holding the payload (trailer excluded)
+ * @param PixelChannels -> Channels per pixel
+ * @param stride -> Pixels skipped between two encoding pixels
+ * @param BitsPerPixel -> Zero indexed row of BPCH
+ * @param first -> First payload byte
+ * @param count -> Number of payload bytes
+ * @param DecodedData -> Receives the count bytes
+ * @param order -> Slots of the chunks of a keyed stream, runs crossing a chunk boundary are split at it
+ * @param walk -> Pixels holding the positions of a stream in tile order
+ */
+template <typename Channel>
+inline void ExtractBytes(const Channel* const SourceImageData, const unsigned int UsableChannels, const unsigned int PixelChannels,
+						 const unsigned int stride, const unsigned int BitsPerPixel, unsigned int first, unsigned int count,
+						 unsigned char* DecodedData, const ChunkOrder& order = ChunkOrder(), const TileWalk& walk = TileWalk()) {
+	if(!order.Identity()) {
+		const unsigned int chunk{ChunkBytes(BitsPerPixel)};
+		while(count) {
+			const unsigned int offset{first % chunk}, run{std::min(count, chunk - offset)};
+			ExtractBytes(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order.Place(first / chunk) * chunk + offset,
+						 run, DecodedData, ChunkOrder(), walk);
+			first += run;
+			count -= run;
+			DecodedData += run;
+		}
+		return;
+	}
+	KernelState state{ByteStart(first, stride, BitsPerPixel, PixelChannels)};
+	// The pixel holding the first bit may start inside an earlier byte, those bytes are extracted to a scratch buffer
+	const unsigned int lead{first - state.payload}, origin{state.payload};
+	// Short runs, such as the pixels sampled by a preview, are assembled on the stack
+	std::array<unsigned char, 16> small;
+	std::vector<unsigned char> large;
+	if(lead + count > small.size()) {
+		large.resize(lead + count);
+	}
+	unsigned char* const scratch{large.empty() ? small.data() : large.data()};
+	state.payload = 0U;
+	KernelFragment head, tail;
+	VisitBpch(PixelChannels, BitsPerPixel, [&](const auto& bpch) {
+		if(walk.RowOrder()) {
+			ExtractRange(SourceImageData, scratch, lead + count, state, UsableChannels, stride, bpch, head, tail);
+			return;
+		}
+		// Every run of pixels is extracted in place, the bytes it shares with its neighbours merged once all are read
+		const unsigned int end{ByteStart(first + count, stride, BitsPerPixel, PixelChannels).base + PixelChannels};
+		const unsigned int last{std::min(UsableChannels, end)};
+		std::vector<KernelFragment> fragments;
+		const auto extract = [&](const unsigned int pixel, const unsigned int position, const unsigned int run) {
+			KernelState start{ChannelStart(position * PixelChannels, stride, BitsPerPixel, bpch)};
+			start.base -= position * PixelChannels;
+			start.payload -= origin;
+			ExtractRange(SourceImageData + static_cast<std::size_t>(pixel) * PixelChannels, scratch, lead + count, start,
+						 run * PixelChannels, stride, bpch, head, tail);
+			fragments.push_back(head);
+			fragments.push_back(tail);
+		};
+		walk.Runs(state.base / PixelChannels, last / PixelChannels, extract);
+		MergeFragments(scratch, lead + count, fragments);
+	});
+	std::copy(scratch + lead, scratch + lead + count, DecodedData);
+}
+
+}
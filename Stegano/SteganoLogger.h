@@ -3,49 +3,83 @@
 #pragma once
 
 #include <iostream>
+#include <sstream>
+#include <string>
+
+// Levels above this one are compiled out, 0 = errors only, 1 = + log, 2 = + verbose
+#ifndef STEGANO_LOG_LEVEL
+	#define STEGANO_LOG_LEVEL 2
+#endif
 
 namespace Stegano {
 
-extern bool quiet, verbose;
+extern bool quiet, verbose, logdetails;
+
+enum class LogLevel : unsigned int { Error = 0U, Log = 1U, Verbose = 2U };
 
+/**
+ * Messages are formatted on the calling thread and pushed to a lock free ring owned by that thread. A background writer drains
+ * the rings in timestamp order, so callers never wait on the console. Disabled levels return before formatting anything.
+ */
 class Logger {
 	Logger() {
 	}
 
+	static std::ostringstream& Formatter();
+	static void Push(LogLevel level, std::string&& text);
+
 	template <typename Arg>
-	static void Print(const Arg& arg) {
-		std::cout << arg;
+	static void Print(std::ostringstream& stream, const Arg& arg) {
+		stream << arg;
 	}
 	template <typename Arg, typename... Args>
-	static void Print(const Arg& arg, const Args&... args) {
-		std::cout << arg;
-		Print(args...);
+	static void Print(std::ostringstream& stream, const Arg& arg, const Args&... args) {
+		stream << arg;
+		Print(stream, args...);
+	}
+
+	template <typename... Args>
+	static void Write(const LogLevel level, const Args&... args) {
+		std::ostringstream& stream{Formatter()};
+		stream.str(std::string());
+		Print(stream, args...);
+		Push(level, stream.str());
 	}
 
 public:
 	template <typename... Args>
 	static void Log(const Args&... args) {
-		if(verbose || !quiet) {
-			Print(args...);
+		if constexpr(STEGANO_LOG_LEVEL >= 1) {
+			if(verbose || !quiet) {
+				Write(LogLevel::Log, args...);
+			}
 		}
 	}
 
 	template <typename... Args>
 	static void Verbose(const Args&... args) {
-		if(verbose) {
-			Print(args...);
+		if constexpr(STEGANO_LOG_LEVEL >= 2) {
+			if(verbose) {
+				Write(LogLevel::Verbose, args...);
+			}
 		}
 	}
 
-	template <typename Arg>
-	static void Error(const Arg& arg) {
-		std::cerr << arg;
-	}
-	template <typename Arg, typename... Args>
-	static void Error(const Arg& arg, const Args&... args) {
-		std::cerr << arg;
-		Error(args...);
+	template <typename... Args>
+	static void Error(const Args&... args) {
+		Write(LogLevel::Error, args...);
 	}
+
+	/**
+	 * @brief Blocks until every message logged so far has been written, call before writing to std::cout/std::cin directly
+	 */
+	static void Flush();
+
+	/**
+	 * @brief Sets the floating point precision of the messages formatted by the calling thread
+	 * @return Previous precision
+	 */
+	static std::streamsize Precision(std::streamsize precision);
 };
 
 }
@@ -0,0 +1,680 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#pragma once
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "SteganoCommon.h"
+
+namespace Stegano {
+
+// Order of the pixels of a stream, see SteganoKernels.h
+class TileWalk;
+
+extern bool compress, filemode, roidecode, adaptive;
+// Region of the hidden image decoded with "roi" or "rows", a width or height of 0 extends it to the edge of the image
+extern cv::Rect roi;
+// Every previewstep-th row and column of the region is decoded, set by "preview"
+extern unsigned int previewstep;
+// Output path of file payloads given on the command line, empty => name stored in the payload header
+extern std::string fileoutput;
+// Additional base images (encode) or encoded images (decode) given with "carrier", the payload is sharded across all of them
+extern std::vector<std::string> carriers;
+// Passphrase given with "key", non empty => the chunks of extended streams are shuffled across the base (see ChunkOrder)
+extern std::string key;
+// Set when a cipher key is given with "cipher" or STEGANO_CIPHER_KEY, extended streams are then encrypted (see StreamCipher)
+extern bool encrypt;
+extern std::array<unsigned char, 32> cipherkey;
+// Reed-Solomon parity symbols per codeword set by "fec", non zero => extended streams are error corrected (see FecEncode())
+extern unsigned int fecparity;
+// Path given with "prepack", non empty => the source, once reduced for the base, is also saved there as a prepacked payload
+extern std::string prepackfile;
+// Additional sources given with "payload", every source then becomes an entry of a payload container (see PackContainer())
+extern std::vector<std::string> payloads;
+// Set by "append", the base is an encoded image whose payloads are kept and followed by the new ones
+extern bool append;
+// One indexed entry of a container decoded with "entry", 0 => every entry
+extern unsigned int entry;
+// Set by "update", the base is an encoded image whose payload is replaced by the source (see UpdateStream())
+extern bool update;
+// Tile edge set by "tileorder", 0 => extended streams are laid out in row order (see TileWalk)
+extern unsigned int tileorder;
+
+/* Extended payload streams
+** The trailer checksum is XORed with ExtendedMarker, the 32 trailer bits then hold the byte length of the stream instead of the
+** dimensions of the hidden image. The stream is embedded with the same BPCH/stride walk as a legacy image and starts with a
+** header: "SG", version, header length (16 bits, little endian), followed by {tag, length, value} records. Unknown tags are
+** skipped by the decoder, the body follows the header.
+** Checked streams (CheckedMarker) are padded to whole chunks (see SteganoKernels.h) and followed by a tail: the CRC32C of every
+** chunk (32 bits, little endian), zero padding, the unpadded stream length and the CRC32C of the tail. The trailer then holds the
+** embedded length, tail included. Every stream is written checked, unchecked ones (ExtendedMarker) are still decoded.
+** Streams embedded with a key have their chunks, tail included, in keyed slots (see ChunkOrder) and XOR KeyedMarker on top of
+** CheckedMarker, the key itself is never stored.
+** Encrypted streams start with a NonceBytes nonce in clear, the rest of the stream (the chunk checksums and the tail excluded) is
+** XORed with the ChaCha20 keystream of the cipher key and the nonce, and EncryptedMarker is XORed on top of the other markers.
+** Error corrected streams are Reed-Solomon coded (see FecEncode()) once encrypted, the chunks and the tail then hold the coded
+** stream, and FecMarker is XORed on top of the other markers.
+*/
+constexpr unsigned char ExtendedMarker{0x5A};
+constexpr unsigned char CheckedMarker{0xA5};
+constexpr unsigned char KeyedMarker{0x33};
+// Streams laid out in tiles of adaptive depth, see EmbedTiles(), XOR KeyedMarker on top of it when keyed
+constexpr unsigned char AdaptiveMarker{0xC3};
+constexpr unsigned char EncryptedMarker{0x4B};
+constexpr unsigned char FecMarker{0x50};
+// Streams laid out in tile order (see TileWalk), one marker per tile edge, XORed on top of the other markers
+constexpr unsigned char TileOrder64Marker{0x18};
+constexpr unsigned char TileOrder256Marker{0x81};
+
+/**
+ * @brief Marker of the tile order of a stream
+ * @param edge -> Tile edge, 0 => row order
+ */
+constexpr unsigned char TileOrderMarker(const unsigned int edge) {
+	return edge == 64U ? TileOrder64Marker : edge == 256U ? TileOrder256Marker : 0U;
+}
+
+// Layout of the payload of an encoded image, as recorded by the marker XORed on the trailer checksum
+struct PayloadMarker {
+	// valid => legacy image or extended stream, extended => the trailer holds a stream length
+	bool valid, extended, checked, keyed, tiled, encrypted, fec;
+	// Tile edge of streams laid out in tile order, 0 => row order
+	unsigned int tileorder;
+};
+
+/**
+ * @brief Whether an encoder writes this combination of markers: adaptive streams are never error corrected nor laid out in tile
+ * order (see EmbedTiles()), checked streams take any of the flag markers
+ * @param layout -> CheckedMarker or AdaptiveMarker
+ * @param fec -> FecMarker or 0
+ * @param edge -> Tile edge, 0 => row order
+ */
+constexpr bool MarkerWritten(const unsigned int layout, const unsigned int fec, const unsigned int edge) {
+	return layout == CheckedMarker || (layout == AdaptiveMarker && fec == 0U && edge == 0U);
+}
+
+/**
+ * @brief Identifies the marker XORed on the checksum byte of a trailer, combinations no encoder writes are rejected
+ * @param checksum -> Checksum computed from the trailer, see TrailerChecksum()
+ * @param stored -> Checksum byte stored in the trailer
+ */
+inline PayloadMarker ReadMarker(const unsigned int checksum, const unsigned int stored) {
+	const unsigned int marker{checksum ^ stored};
+	PayloadMarker found{};
+	// KeyedMarker, EncryptedMarker, FecMarker and the tile order markers go on top of CheckedMarker or AdaptiveMarker
+	for(const unsigned int keyed : {0U, static_cast<unsigned int>(KeyedMarker)}) {
+		for(const unsigned int encrypted : {0U, static_cast<unsigned int>(EncryptedMarker)}) {
+			for(const unsigned int fec : {0U, static_cast<unsigned int>(FecMarker)}) {
+				for(const unsigned int edge : {0U, 64U, 256U}) {
+					const unsigned int layout{marker ^ keyed ^ encrypted ^ fec ^ TileOrderMarker(edge)};
+					if(MarkerWritten(layout, fec, edge)) {
+						found.checked = layout == CheckedMarker;
+						found.tiled = layout == AdaptiveMarker;
+						found.keyed = keyed != 0U;
+						found.encrypted = encrypted != 0U;
+						found.fec = fec != 0U;
+						found.tileorder = edge;
+					}
+				}
+			}
+		}
+	}
+	found.extended = found.checked || found.tiled || marker == ExtendedMarker;
+	found.valid = marker == 0U || found.extended;
+	return found;
+}
+
+/**
+ * @brief Whether the markers read by ReadMarker() can be told apart: every combination of CheckedMarker or AdaptiveMarker with
+ * the flag markers that an encoder writes (see MarkerWritten()) differs from the others, from 0 and from ExtendedMarker, and no
+ * two of them differ by the marker of BGRA bases, so that a base which lost or gained its alpha channel is rejected instead of
+ * read with another layout
+ * @param bgra -> Marker XORed on the checksum of BGRA bases, see BgraMarker
+ */
+constexpr bool MarkersApart(const unsigned int bgra) {
+	std::array<unsigned int, 30> markers{0U, ExtendedMarker};
+	std::size_t count{2};
+	for(const unsigned int layout : {CheckedMarker, AdaptiveMarker}) {
+		for(const unsigned int keyed : {0U, static_cast<unsigned int>(KeyedMarker)}) {
+			for(const unsigned int encrypted : {0U, static_cast<unsigned int>(EncryptedMarker)}) {
+				for(const unsigned int fec : {0U, static_cast<unsigned int>(FecMarker)}) {
+					for(const unsigned int edge : {0U, 64U, 256U}) {
+						if(MarkerWritten(layout, fec, edge)) {
+							markers[count++] = layout ^ keyed ^ encrypted ^ fec ^ TileOrderMarker(edge);
+						}
+					}
+				}
+			}
+		}
+	}
+	for(std::size_t i{0}; i < count; ++i) {
+		for(std::size_t j{0}; j < i; ++j) {
+			if(markers[i] == markers[j] || (markers[i] ^ markers[j]) == bgra) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Clear nonce at the start of an encrypted stream
+constexpr unsigned int NonceBytes{12U};
+
+// ChaCha20 (RFC 8439) keystream over the bytes of an encrypted stream, seekable so that every task encrypts or decrypts its own
+// chunk. A default constructed cipher leaves the bytes as they are.
+class StreamCipher {
+public:
+	StreamCipher() = default;
+	/**
+	 * @param CipherKey -> 256 bit key
+	 * @param nonce -> NonceBytes nonce, the first bytes of the stream
+	 */
+	StreamCipher(const std::array<unsigned char, 32>& CipherKey, const unsigned char* nonce);
+
+	// false => the stream is not encrypted
+	bool Enabled() const {
+		return enabled;
+	}
+
+	/**
+	 * @brief XORs bytes of the stream with the keystream, the nonce bytes are left in clear
+	 * @param data -> Stream bytes [position, position + size)
+	 * @param size -> Number of bytes
+	 * @param position -> Index of data[0] in the stream
+	 */
+	void Apply(unsigned char* data, unsigned int size, unsigned long long position) const;
+
+private:
+	// Constants, key, block counter, nonce
+	std::array<unsigned int, 16> state{};
+	bool enabled{false};
+};
+
+/**
+ * @brief Cipher of a stream embedded or extracted with the key set by "cipher"
+ * @param nonce -> First NonceBytes bytes of the stream
+ * @return Identity cipher if no cipher key is set
+ */
+StreamCipher PayloadCipher(const unsigned char* nonce);
+/**
+ * @brief Draws a fresh nonce for an encrypted stream
+ */
+std::array<unsigned char, NonceBytes> MakeNonce();
+/**
+ * @brief Reads a 256 bit cipher key, 32 raw bytes or 64 hex digits
+ * @param path -> Key file, empty => STEGANO_CIPHER_KEY
+ * @param CipherKey -> Key read
+ * @param given -> Set if a key file is given or STEGANO_CIPHER_KEY is set, the stream is then encrypted
+ * @return true => Success, or no key given
+ */
+bool LoadCipherKey(const std::string& path, std::array<unsigned char, 32>& CipherKey, bool& given);
+
+/* Error corrected streams
+** The coded stream starts with a header of FecHeaderBytes, three copies of "RS", parity symbols, interleave depth and the length
+** of the stream (32 bits, little endian), read back by majority vote. Blocks of FecDepth interleaved RS(255, 255 - parity)
+** codewords over GF(2^8) follow, byte i * FecDepth + j of a block being symbol i of codeword j: its data symbols first, in stream
+** order, then its parity symbols. The last block is shortened to the rows of data it holds, zero padded to a whole row. A burst
+** of up to FecDepth * parity / 2 damaged bytes in a block is corrected.
+*/
+constexpr unsigned int FecDepth{16U};
+constexpr unsigned int FecHeaderBytes{24U};
+
+/**
+ * @brief Length of an error corrected stream
+ * @param length -> Number of stream bytes
+ * @param parity -> Parity symbols per codeword, 0 => not error corrected
+ * @return Number of coded bytes, header included
+ */
+unsigned long long FecLength(unsigned long long length, unsigned int parity);
+/**
+ * @brief Length of an error corrected stream read from its own header by majority vote, so that it does not depend on the tail
+ * @param coded -> First FecHeaderBytes of the coded stream
+ * @return Number of coded bytes, header included, 0 => The header is damaged
+ */
+unsigned long long FecCodedLength(const unsigned char* coded);
+/**
+ * @brief Longest stream whose coded length is at most coded, see FecLength()
+ */
+unsigned int FecDataLength(unsigned int coded, unsigned int parity);
+/**
+ * @brief Reed-Solomon codes a stream, one pool task per block of FecDepth codewords, with pshufb multiplies where the processor
+ * has SSSE3. Every task encrypts its block first if the cipher is set.
+ * @param stream -> Stream bytes, starting with the nonce if encrypted
+ * @param length -> Number of stream bytes
+ * @param parity -> Parity symbols per codeword, 2 to 128
+ * @param cipher -> Cipher of the stream, see PayloadCipher()
+ * @param workers -> Pool workers
+ * @return Coded stream
+ */
+std::vector<unsigned char> FecEncode(const unsigned char* stream, unsigned int length, unsigned int parity, const StreamCipher& cipher,
+									 unsigned int workers);
+/**
+ * @brief Corrects a coded stream, one pool task per block, only the damaged codewords leave the vectorised syndrome check.
+ * Corrections and codewords beyond repair are logged.
+ * @param coded -> Coded stream, corrected in place
+ * @param encrypted -> The stream is encrypted, it is decrypted by the task correcting each block
+ * @param workers -> Pool workers
+ * @param stream -> Decoded stream, without its nonce if encrypted
+ * @return true => Success, false => The header is damaged
+ */
+bool FecDecode(std::vector<unsigned char>& coded, bool encrypted, unsigned int workers, std::vector<unsigned char>& stream);
+
+constexpr unsigned char PayloadVersion{1U};
+
+enum PayloadTag : unsigned char {
+	TAG_TYPE = 1U,
+	TAG_CODEC = 2U,
+	TAG_IMAGE = 3U,
+	TAG_LENGTH = 4U,
+	TAG_NAME = 5U,
+	TAG_SHARD = 6U,
+	TAG_ENTRIES = 7U
+};
+
+// PAYLOAD_SHARD = the body is the slice [offset, offset + length) of another extended stream of "total" bytes, spread over "shards" images
+// PAYLOAD_CONTAINER = the body is a directory of "entries" independent extended streams followed by the streams, see PackContainer()
+enum PayloadType : unsigned char { PAYLOAD_IMAGE = 0U, PAYLOAD_FILE = 1U, PAYLOAD_SHARD = 2U, PAYLOAD_CONTAINER = 3U };
+
+// CODEC_PREDICTIVE = PNG filter prediction per row followed by adaptive Rice coding of the residuals
+enum PayloadCodec : unsigned char { CODEC_NONE = 0U, CODEC_PREDICTIVE = 1U };
+
+struct PayloadHeader {
+	unsigned int type{PAYLOAD_IMAGE}, codec{CODEC_NONE};
+	unsigned int rows{0}, cols{0}, channels{0};
+	// Length of the body once decoded
+	unsigned int length{0};
+	// File name of file payloads, without directories
+	std::string name;
+	// Shard streams only, zero indexed shard number
+	unsigned int shard{0}, shards{0}, offset{0}, total{0};
+	// Container streams only, number of entries in the directory
+	unsigned int entries{0};
+};
+
+/**
+ * @brief Serialises the header of an extended stream
+ * @param header -> Header fields
+ * @return Header bytes
+ */
+std::vector<unsigned char> WritePayloadHeader(const PayloadHeader& header);
+/**
+ * @brief Parses the header of an extended stream
+ * @param stream -> Stream bytes
+ * @param length -> Number of stream bytes
+ * @param header -> Parsed header fields
+ * @return Header length, 0 => Not a valid header
+ */
+unsigned int ReadPayloadHeader(const unsigned char* stream, std::size_t length, PayloadHeader& header);
+// Bytes extracted to read the header of an extended stream, header records are at most 257 bytes long
+constexpr unsigned int HeaderProbe{1024U};
+
+/* Payload containers
+** Several independent payloads in one extended stream. The container header (PAYLOAD_CONTAINER) records the number of entries,
+** its body starts with a directory of ContainerEntryBytes per entry: offset and length of the entry in the container stream,
+** header included (32 bits, little endian), and its payload type. The entries follow, each a complete extended stream (packed
+** image or file) with its own header, so a decoder seeks to the directory and then to a single entry without extracting the
+** others. The trailer only has room for the stream length, the directory therefore lives at the head of the stream.
+*/
+constexpr unsigned int ContainerEntryBytes{9U};
+
+struct ContainerEntry {
+	unsigned int offset{0}, length{0}, type{PAYLOAD_IMAGE};
+};
+
+/**
+ * @brief Builds a container stream
+ * @param entries -> Extended streams of the entries, at most 65535
+ * @return Stream bytes (header + directory + entries)
+ */
+std::vector<unsigned char> PackContainer(const std::vector<std::vector<unsigned char>>& entries);
+/**
+ * @brief Length of the header and directory of a container stream, the bytes to read before any entry
+ * @param stream -> First bytes of the stream, header included
+ * @param length -> Number of bytes given
+ * @return Header and directory length, 0 => Not a container
+ */
+unsigned int DirectoryLength(const unsigned char* stream, std::size_t length);
+/**
+ * @brief Parses the directory of a container stream
+ * @param stream -> First bytes of the stream, header and directory included (see DirectoryLength())
+ * @param length -> Number of bytes given
+ * @param directory -> Entries, checked to lie inside the container
+ * @return true => Success, false => Not a container or damaged directory
+ */
+bool ReadDirectory(const unsigned char* stream, std::size_t length, std::vector<ContainerEntry>& directory);
+
+/**
+ * @brief Builds the extended stream of an 8 bit image, compressed if "compress" is set and compression pays off
+ * @param image -> 8 bit grayscale or BGR image
+ * @return Stream bytes (header + body)
+ */
+std::vector<unsigned char> PackImage(const cv::Mat& image);
+/**
+ * @brief Rebuilds the image carried by an extended stream, row by row as the body is decoded
+ * @param stream -> Stream bytes
+ * @param length -> Number of stream bytes
+ * @param image -> Decoded image
+ * @return true => Success, false => Not an image stream or damaged stream (rows decoded so far are kept)
+ */
+bool UnpackImage(const unsigned char* stream, std::size_t length, cv::Mat& image);
+
+// Rebuilds the image of an extended stream while the stream is being extracted. A row is decoded as soon as every bit it can take
+// has arrived, so besides the image only the bytes of the row being received are held.
+class ImageUnpacker {
+	struct State;
+	std::unique_ptr<State> state;
+
+public:
+	ImageUnpacker();
+	ImageUnpacker(const ImageUnpacker&) = delete;
+	ImageUnpacker& operator=(const ImageUnpacker&) = delete;
+	~ImageUnpacker();
+
+	/**
+	 * @brief Sets up the image described by a payload header, every row black until it is decoded
+	 * @param header -> Header read from the start of the stream
+	 * @return false => Not an image header
+	 */
+	bool Start(const PayloadHeader& header);
+	/**
+	 * @brief Decodes the rows completed by the next bytes of the body
+	 * @param data -> Body bytes, in stream order
+	 * @param size -> Number of bytes
+	 * @return false => The body is damaged, later bytes are of no use
+	 */
+	bool Write(const unsigned char* data, std::size_t size);
+	/**
+	 * @brief Decodes the rows left once the whole body is written
+	 * @return true => Every row decoded, false => Damaged or truncated body (rows decoded so far are kept)
+	 */
+	bool Finish();
+	// Image set up by Start(), empty before
+	const cv::Mat& Image() const;
+};
+
+/* Prepacked payloads
+** A source image reduced for a base and packed into its extended stream, saved by "prepack" and read back wherever a source
+** image is expected. Encodes into many bases skip decoding, reducing and packing the source, a base too small for it still
+** reduces it further.
+** Bytes 0-3 = "SGPK", 4 = PrepackVersion, 5 = flags (bit 0 => packed with "compress")
+** Bytes 6-11 = rows, cols (16 bit little endian), channels and channel bytes of the base the source was reduced for
+** Bytes 12-15 = stream length, 16-19 = CRC32C of the stream (32 bit little endian), then the stream (see PackImage())
+*/
+constexpr unsigned char PrepackVersion{1U};
+constexpr unsigned int PrepackHeaderBytes{20U};
+
+struct PrepackedSource {
+	// Source image, as reduced when read from a prepacked payload
+	cv::Mat image;
+	// Extended stream of the image, empty for sources read from an image file
+	std::vector<unsigned char> stream;
+	// The stream was packed with "compress"
+	bool compressed{false};
+	// Base the image was reduced for
+	unsigned int BaseRows{0}, BaseCols{0}, BaseChannels{0}, BaseChannelBytes{0};
+};
+
+/**
+ * @brief Reads a source image, from a prepacked payload if the file is one (detected by its signature) or as a BGR image
+ * @param path -> Image or prepacked payload path
+ * @param source -> Source image, and its stream for prepacked payloads
+ * @return true => Success, false => Unreadable file, or damaged or newer prepacked payload (logged)
+ */
+bool ReadSource(const std::string& path, PrepackedSource& source);
+/**
+ * @brief Extended stream of a source, the prepacked one if it was packed with the current "compress" setting
+ * @param source -> Source read by ReadSource()
+ * @return Stream bytes (header + body)
+ */
+std::vector<unsigned char> SourceStream(const PrepackedSource& source);
+/**
+ * @brief Saves a prepacked payload, logs the saved path or the error
+ * @param path -> Output path
+ * @param stream -> Extended stream of the reduced source, packed with the current "compress" setting and not encrypted
+ * @param base -> Base the source was reduced for, as loaded
+ * @return true => Saved
+ */
+bool WritePrepacked(const std::string& path, const std::vector<unsigned char>& stream, const cv::Mat& base);
+
+/**
+ * @brief Number of bytes embedded for a stream once padded to whole chunks and followed by its checksums
+ * @param length -> Number of stream bytes
+ * @param AvailableBasePixels -> Base pixels available for the stream (trailer excluded)
+ * @param rows -> Usable BPCH rows, see BpchRows()
+ * @return Embedded length, its depth (embedded bits / AvailableBasePixels) is at least rows if the stream does not fit
+ */
+unsigned long long EmbeddedLength(unsigned long long length, unsigned int AvailableBasePixels, unsigned int rows = 12U);
+/**
+ * @brief Longest stream which fits in a base, checksums included
+ * @param AvailableBasePixels -> Base pixels available for the stream (trailer excluded)
+ * @param rows -> Usable BPCH rows, see BpchRows()
+ */
+unsigned int FittingLength(unsigned int AvailableBasePixels, unsigned int rows = 12U);
+/**
+ * @brief Whether a length read from a trailer fits in the base at the deepest BPCH row, checked before anything is allocated for
+ * the stream so that a damaged or forged trailer is rejected instead of reserving up to 4 GiB
+ * @param length -> Number of bytes the trailer records (embedded bytes, or channels of a hidden image)
+ * @param AvailableBasePixels -> Base pixels available for the stream (trailer excluded)
+ * @param rows -> Usable BPCH rows, see BpchRows()
+ */
+bool LengthFits(unsigned long long length, unsigned int AvailableBasePixels, unsigned int rows = 12U);
+
+// Fills the buffer with the next stream bytes, returns the number of bytes written (< size => stream ended early)
+using StreamReader = std::function<std::size_t(unsigned char* buffer, std::size_t size)>;
+// Consumes the next stream bytes, returns false to stop the extraction
+using StreamWriter = std::function<bool(const unsigned char* data, std::size_t size)>;
+
+/**
+ * @brief Embeds an extended stream held in memory and its checksums, chunks are spread over the worker pool and every task
+ * checksums the chunk it embeds. The chunks are shuffled if a key is set and encrypted by their task if a cipher key is set, the
+ * stream then starts with its nonce. Instantiated for the channel types of VisitChannels().
+ * @param BaseImageData -> Base image channels
+ * @param UsableChannels -> Base channels available for the stream (trailer excluded)
+ * @param PixelChannels -> Channels per base pixel, 3 => BGR, 4 => BGRA
+ * @param stride -> Pixels skipped between two encoding pixels, for the embedded length
+ * @param BitsPerPixel -> Zero indexed row of BPCH, for the embedded length
+ * @param walk -> Pixels holding the stream, in row or tile order. In tile order every pool task embeds the runs of a tile.
+ * @param stream -> Stream bytes
+ * @param length -> Number of stream bytes
+ */
+template <typename Channel>
+void EmbedStream(Channel* BaseImageData, unsigned int UsableChannels, unsigned int PixelChannels, unsigned int stride,
+				 unsigned int BitsPerPixel, const TileWalk& walk, const unsigned char* stream, unsigned int length);
+/**
+ * @brief Embeds an extended stream block by block as it is read, reading the next block overlaps with embedding the current one
+ * @param read -> Source of the stream bytes
+ * @return true => Success, false => The reader ended early
+ */
+template <typename Channel>
+bool EmbedStream(Channel* BaseImageData, unsigned int UsableChannels, unsigned int PixelChannels, unsigned int stride,
+				 unsigned int BitsPerPixel, const TileWalk& walk, unsigned int length, const StreamReader& read);
+/**
+ * @brief Embeds an extended stream over the one an encoded image holds with the same embedded length, so with the same layout.
+ * Every chunk is read back from its slot by a pool task and rewritten only if its embedded bytes (coded and encrypted as
+ * EmbedStream() would) differ, the tail is always rewritten. The result is the same as EmbedStream().
+ * @param BaseImageData -> Encoded image channels
+ * @param rewriting -> Called with the slots about to be rewritten, before any of them is written (may be empty)
+ * @return Chunk slots rewritten, tail included, in ascending order (slot s covers the positions from ChunkStart(s))
+ */
+template <typename Channel>
+std::vector<unsigned int> UpdateStream(Channel* BaseImageData, unsigned int UsableChannels, unsigned int PixelChannels, unsigned int stride,
+									   unsigned int BitsPerPixel, const TileWalk& walk, const unsigned char* stream, unsigned int length,
+									   const std::function<void(const std::vector<unsigned int>&)>& rewriting);
+/**
+ * @brief Extracts an extended stream block by block, writing a block overlaps with extracting the next one. Chunks of checked
+ * streams are verified by the task extracting them, damaged regions are logged once the stream is extracted.
+ * @param SourceImageData -> Encoded image channels
+ * @param walk -> Pixels holding the stream, see the tile order recorded by the marker
+ * @param length -> Number of embedded bytes (trailer length)
+ * @param marker -> Layout of the stream (checked, keyed, encrypted), see ReadMarker()
+ * @param write -> Sink of the stream bytes, called in stream order. Encrypted streams are decrypted by the task extracting each
+ * chunk and reach it without their nonce.
+ * @return true => Success, false => The writer stopped the extraction or the checksum table is unusable
+ */
+template <typename Channel>
+bool ExtractStream(const Channel* SourceImageData, unsigned int UsableChannels, unsigned int PixelChannels, unsigned int stride,
+				   unsigned int BitsPerPixel, const TileWalk& walk, unsigned int length, const PayloadMarker& marker,
+				   const StreamWriter& write);
+/**
+ * @brief Writes the trailer of a checked stream in the last 21 channels, keyed if a key is set and encrypted if a cipher key is set
+ * @param BaseImageData -> Base image channels
+ * @param TotalBaseChannels -> Number of base channels
+ * @param PixelChannels -> Channels per base pixel, recorded in the checksum (see BgraMarker)
+ * @param length -> Number of embedded bytes, see EmbeddedLength()
+ */
+template <typename Channel>
+void WriteExtendedTrailer(Channel* BaseImageData, unsigned int TotalBaseChannels, unsigned int PixelChannels, unsigned int length);
+/**
+ * @brief Reads the trailer of an extended stream from the last 21 channels
+ * @param SourceImageData -> Encoded image channels
+ * @param TotalSourceChannels -> Number of encoded image channels
+ * @param PixelChannels -> Channels per encoded image pixel
+ * @param length -> Number of embedded bytes
+ * @param marker -> Layout of the stream, see ReadMarker()
+ * @return true => Extended stream found, tiled and encrypted streams excluded
+ */
+template <typename Channel>
+bool ReadExtendedTrailer(const Channel* SourceImageData, unsigned int TotalSourceChannels, unsigned int PixelChannels, unsigned int& length,
+						 PayloadMarker& marker);
+
+/* Adaptive layout
+** The full TileSize x TileSize tiles of the base (the one holding the trailer excluded) each get their own BPCH row, picked from
+** a cost map of the base so that textured tiles take more bits than smooth ones. The depth of every tile is stored as one byte
+** (0 => unused, d + 1 => BPCH row d) in the first tiles of the base, the head tiles, at the fixed row MapRow. The stream fills the
+** other tiles in raster order (shuffled by ChunkOrder when keyed), every tile row of a used tile on a byte boundary, and the
+** trailer holds the stream length.
+*/
+constexpr unsigned int TileSize{64U};
+constexpr unsigned int MapRow{1U};
+
+// Tile grid and depth map of the adaptive layout
+struct TileLayout {
+	unsigned int TilesX{0}, TilesY{0}, tiles{0}, HeadTiles{0};
+	// One entry per tile, 0 => unused, d + 1 => BPCH row d
+	std::vector<unsigned char> depths;
+};
+
+/**
+ * @brief Hiding cost of every tile of a base (mean absolute difference between neighbouring samples), computed by the pool in a
+ * single pass over the base
+ * @param BaseImage -> Base image
+ * @return One cost per tile in raster order, larger => more texture to hide bits in
+ */
+std::vector<float> TileCosts(const cv::Mat& BaseImage);
+/**
+ * @brief Picks the depth of every tile, greedily giving the next bit per pixel to the tile where it is the least visible
+ * @param BaseImage -> Base image
+ * @param costs -> Tile costs, see TileCosts()
+ * @param length -> Number of stream bytes
+ * @param layout -> Planned layout
+ * @return true => The stream fits in the tiles
+ */
+bool PlanTiles(const cv::Mat& BaseImage, const std::vector<float>& costs, unsigned int length, TileLayout& layout);
+/**
+ * @brief Embeds the depth map and the stream in the tiles, one pool task per tile. The tiles are shuffled if a key is set and
+ * encrypted by their task if a cipher key is set.
+ * @param BaseImage -> Base image
+ * @param layout -> Layout planned by PlanTiles()
+ * @param stream -> Stream bytes
+ * @param length -> Number of stream bytes
+ */
+void EmbedTiles(cv::Mat& BaseImage, const TileLayout& layout, const unsigned char* stream, unsigned int length);
+/**
+ * @brief Reads the depth map of an encoded image and extracts the stream from the tiles, one pool task per tile
+ * @param SourceImage -> Encoded image
+ * @param length -> Number of stream bytes (trailer length)
+ * @param marker -> Layout of the stream (keyed, encrypted), see ReadMarker()
+ * @param stream -> Extracted stream, decrypted and without its nonce if encrypted
+ * @return true => Success, false => The depth map is damaged
+ */
+bool ExtractTiles(const cv::Mat& SourceImage, unsigned int length, const PayloadMarker& marker, std::vector<unsigned char>& stream);
+
+/**
+ * @brief Clips a region to an image, a width or height of 0 extends the region to the edge of the image
+ * @param region -> Requested region
+ * @param rows -> Image rows
+ * @param cols -> Image columns
+ * @return Part of the region inside the image, empty if none
+ */
+cv::Rect ClipRegion(const cv::Rect& region, int rows, int cols);
+/**
+ * @brief Samples every step-th row and column of a region of a decoded image, starting with its top left pixel
+ * @param image -> Decoded image
+ * @param region -> Region inside the image
+ * @param step -> Sampling step, 1 => whole region
+ * @return Sampled pixels
+ */
+cv::Mat SampleRegion(const cv::Mat& image, const cv::Rect& region, unsigned int step);
+/**
+ * @brief Decodes every step-th row and column of a region of the hidden image, seeking to the bits of each decoded pixel so that
+ * only the base channels which carry them are read (compressed payloads are decoded in full, then sampled)
+ * @param SourceImage -> Encoded image
+ * @param region -> Region of the hidden image, see ClipRegion()
+ * @param step -> Sampling step, 1 => every pixel of the region
+ * @param DecodedRegion -> Decoded pixels, [ceil(height / step) x ceil(width / step)]
+ * @return true => Success
+ */
+bool DecodeRegion(const cv::Mat& SourceImage, const cv::Rect& region, unsigned int step, cv::Mat& DecodedRegion);
+/**
+ * @brief Decodes the region set by "roi" and "preview" and saves it, ParallelDecode() hands region decodes over to it
+ * @param SourceImage -> Encoded image
+ * @param output -> Output image path
+ * @return true => Success
+ */
+bool ParallelDecodeRegion(const cv::Mat& SourceImage, const std::string& output);
+/**
+ * @brief Decodes an image which is already loaded, Decode() hands extended streams and region decodes over to it
+ * @param SourceImage -> Encoded image
+ * @param output -> Output image path
+ * @return true => Success
+ */
+bool ParallelDecode(const cv::Mat& SourceImage, const std::string& output);
+
+// Carrier or entry k is saved as <output stem>_<k + 1><output extension>
+std::string NumberedPath(const std::string& output, unsigned int k);
+/**
+ * @brief Builds the extended stream of a source as it is, never reduced: the packed source image, or the file in file mode
+ * @param source -> Source image or file path
+ * @param stream -> Stream bytes (header + body)
+ * @return true => Success
+ */
+bool BuildStream(const std::string& source, std::vector<unsigned char>& stream);
+/**
+ * @brief Builds the extended stream of a file payload, standard input if source is "-"
+ * @param source -> Source file path
+ * @param stream -> Stream bytes (header + file)
+ * @return true => Success
+ */
+bool BuildFileStream(const std::string& source, std::vector<unsigned char>& stream);
+/**
+ * @brief Writes an extended stream extracted in full: file payloads to disk, image payloads to an image, cropped by "roi", and
+ * the entries of containers with SaveContainer()
+ * @param stream -> Stream bytes
+ * @param length -> Number of stream bytes
+ * @param output -> Output image path of image payloads
+ * @param FileOutput -> Output path of file payloads, empty => name stored in the payload header
+ * @return true => Success
+ */
+bool SaveStream(const unsigned char* stream, std::size_t length, const std::string& output, const std::string& FileOutput);
+/**
+ * @brief Writes the entries of a container stream with SaveStream(), the one set by "entry" or all of them. Image entry k of
+ * several is saved at NumberedPath(output, k - 1), file entries under the names stored in their headers.
+ * @param stream -> Container stream
+ * @param length -> Number of stream bytes
+ * @param output -> Output image path
+ * @return true => Success
+ */
+bool SaveContainer(const unsigned char* stream, std::size_t length, const std::string& output);
+/**
+ * @brief Decodes the entry set by "entry" of the container held by an encoded image. Uniform layouts seek to the directory, then
+ * to the entry, and read only the base channels which carry them; error corrected and adaptive layouts are extracted in full.
+ * @param SourceImage -> Encoded image
+ * @param output -> Output image path
+ * @return true => Success
+ */
+bool DecodeEntry(const cv::Mat& SourceImage, const std::string& output);
+
+}
@@ -3,9 +3,109 @@
 #pragma once
 
 #include <vector>
+#include <functional>
 #include <thread>
 #include "SteganoCommon.h"
 
 namespace Stegano {
-extern unsigned int threads;
+extern unsigned int threads, affinity, numanodes;
+extern bool autotune;
+
+// Worker placement modes for the "affinity" flag
+enum AffinityMode : unsigned int { AFFINITY_NONE = 0U, AFFINITY_COMPACT = 1U, AFFINITY_SCATTER = 2U };
+
+/**
+ * @brief Number of logical processors usable by the workers, across all processor groups and the selected NUMA nodes
+ */
+unsigned int LogicalProcessorCount();
+/**
+ * @brief Number of NUMA nodes usable by the workers (1 on non NUMA machines)
+ */
+unsigned int NumaNodeCount();
+/**
+ * @brief Pins the calling thread to the logical processor assigned to worker k by the affinity mode
+ * @param k -> Worker index
+ * @return true => Thread pinned
+ */
+bool PinThread(unsigned int k);
+
+/**
+ * @brief Persistent worker threads shared by the kernels and by OpenCV's parallel_for_ (OpenCV 4.5.2 onwards), so that the whole
+ * process stays within the concurrency budget set by "threads"
+ */
+class WorkerPool {
+	struct State;
+	State* state;
+
+	WorkerPool();
+	void Execute(void* job);
+	void Submit(unsigned int tasks, const std::function<void(unsigned int)>& body, bool fixed);
+
+public:
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+	~WorkerPool();
+
+	static WorkerPool& Instance();
+	/**
+	 * @brief Restarts the pool with the given number of threads (calling thread included), the workers pinned as per affinity
+	 */
+	void Resize(unsigned int size);
+	/**
+	 * @brief Number of threads taking part in a Run(), calling thread included
+	 */
+	unsigned int Size() const;
+	/**
+	 * @brief Calls body(task) for every task in [0, tasks) and returns once all of them are done. The calling thread executes
+	 * tasks as well. Safe to call concurrently and from inside a task. Once a task throws, the tasks not started yet are skipped
+	 * and the first exception is rethrown after every task is accounted for.
+	 */
+	void Run(unsigned int tasks, const std::function<void(unsigned int)>& body);
+	/**
+	 * @brief Same as Run(tasks, body), with at most "concurrency" threads working on the tasks
+	 */
+	void Run(unsigned int tasks, const std::function<void(unsigned int)>& body, unsigned int concurrency);
+	/**
+	 * @brief Same as Run(tasks, body), on a static schedule: task t always runs on worker 1 + t % (Size() - 1), so that with
+	 * affinity the NUMA node of every task is known. The calling thread only waits. From inside a task, or without workers,
+	 * this is Run(tasks, body).
+	 */
+	void RunStatic(unsigned int tasks, const std::function<void(unsigned int)>& body);
+	/**
+	 * @brief 0 for threads outside the pool, k for pool worker k
+	 */
+	static unsigned int CurrentWorker();
+};
+
+/**
+ * @brief Sizes the worker pool and makes OpenCV use it. OpenCV older than 4.5.2 cannot use it and keeps its own threading,
+ * which is not counted in the budget.
+ * @param size -> Concurrency budget
+ */
+void SetupWorkerPool(unsigned int size);
+
+// Number of threads working on a job and number of bands the job is split into
+struct JobPlan {
+	unsigned int workers, chunks;
+};
+
+/**
+ * @brief Loads the cost model of this host from the tune file, calibrating the kernels and saving the model if it is missing or stale
+ * @param processors -> Logical processors available to the workers
+ */
+void LoadCostModel(unsigned int processors);
+/**
+ * @brief Picks the worker count and chunk count of a job, {threads, threads} unless autotuning
+ * @param PayloadBytes -> Number of payload bytes
+ * @param BitsPerPixel -> Zero indexed row of BPCH
+ * @param PixelChannels -> Channels per base pixel, walked by the kernel for every pixel
+ * @param extract -> Decoding job
+ */
+JobPlan PlanJob(unsigned int PayloadBytes, unsigned int BitsPerPixel, unsigned int PixelChannels, bool extract);
+/**
+ * @brief Picks the worker count and chunk count of a job which copies or scans bytes without the BPCH kernels (tiled TIFF
+ * files, JPEG coefficients), {threads, threads} unless autotuning
+ * @param bytes -> Number of bytes copied or scanned
+ */
+JobPlan PlanCopy(std::size_t bytes);
 }
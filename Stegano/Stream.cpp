@@ -0,0 +1,670 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include "SteganoKernels.h"
+#include "SteganoPayload.h"
+#include <algorithm>
+
+namespace Stegano {
+
+namespace {
+// Chunks per block when streaming, reading or writing block b + 1 overlaps with processing block b
+constexpr unsigned int ChunksPerBlock{256U};
+// The tail of a checked stream ends with the payload length and the CRC32C of the tail
+constexpr unsigned int TailBytes{8U};
+// Damaged regions listed one by one before only counting them
+constexpr unsigned int ReportedRegions{16U};
+
+// Zero indexed row of BPCH for a stream of the given length, rows => does not fit
+unsigned int Depth(const unsigned long long length, const unsigned int AvailableBasePixels, const unsigned int rows) {
+	return static_cast<unsigned int>(std::min<unsigned long long>(length * 8U / AvailableBasePixels, rows));
+}
+
+void PutLittleEndian(unsigned char* const out, const unsigned int value) {
+	for(unsigned int b{0}; b < 4U; ++b) {
+		out[b] = static_cast<unsigned char>(value >> (8U * b));
+	}
+}
+
+unsigned int GetLittleEndian(const unsigned char* const data) {
+	return static_cast<unsigned int>(data[0]) | static_cast<unsigned int>(data[1]) << 8U | static_cast<unsigned int>(data[2]) << 16U
+		   | static_cast<unsigned int>(data[3]) << 24U;
+}
+
+// Tile order: tiles holding the slots of the chunks [first, first + count), in ascending order
+std::vector<unsigned int> SlotTiles(const TileWalk& walk, const ChunkOrder& order, const unsigned int UsablePixels,
+									const unsigned int SlotPixels, const unsigned int first, const unsigned int count) {
+	std::vector<unsigned int> tiles;
+	for(unsigned int c{first}; c < first + count; ++c) {
+		const unsigned long long begin{static_cast<unsigned long long>(order.Place(c)) * SlotPixels};
+		if(begin >= UsablePixels) {
+			continue;
+		}
+		const unsigned int end{static_cast<unsigned int>(std::min<unsigned long long>(begin + SlotPixels, UsablePixels))};
+		for(unsigned int t{walk.Tile(static_cast<unsigned int>(begin))}; t <= walk.Tile(end - 1U); ++t) {
+			tiles.push_back(t);
+		}
+	}
+	std::sort(tiles.begin(), tiles.end());
+	tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+	return tiles;
+}
+
+// Tile order: calls body(pixel, position, count, slot, chunk) for the runs of pixels of tile t holding one of the chunks
+// [first, first + count), in position order, split at slot boundaries
+template <typename Body>
+void SlotRuns(const TileWalk& walk, const ChunkOrder& order, const unsigned int t, const unsigned int SlotPixels, const unsigned int first,
+			  const unsigned int count, Body&& body) {
+	walk.Runs(walk.Start(t), walk.Start(t + 1U), [&](unsigned int pixel, unsigned int position, unsigned int run) {
+		while(run) {
+			const unsigned int slot{position / SlotPixels};
+			const unsigned int piece{
+				static_cast<unsigned int>(std::min<unsigned long long>(run, (slot + 1ULL) * SlotPixels - position))};
+			const unsigned int c{order.Chunk(slot)};
+			if(c >= first && c - first < count) {
+				body(pixel, position, piece, slot, c);
+			}
+			pixel += piece;
+			position += piece;
+			run -= piece;
+		}
+	});
+}
+
+// Loop state of a run of pixels starting at position, see SlotRuns(): base relative to the first channel of the run and payload
+// relative to the block holding chunk c from byte (c - first) * chunk
+template <std::size_t Channels>
+KernelState RunStart(const unsigned int position, const unsigned int slot, const unsigned int c, const unsigned int first,
+					 const unsigned int stride, const unsigned int BitsPerPixel, const std::array<unsigned int, Channels>& bpch) {
+	constexpr unsigned int PixelChannels{static_cast<unsigned int>(Channels)};
+	const unsigned int chunk{ChunkBytes(BitsPerPixel)};
+	KernelState state{ChannelStart(position * PixelChannels, stride, BitsPerPixel, bpch)};
+	state.base -= position * PixelChannels;
+	state.payload = state.payload - slot * chunk + (c - first) * chunk;
+	return state;
+}
+
+// Tile order of EmbedChunks(): the chunks are checksummed and encrypted first, then embedded in place by one pool task per tile
+// holding their slots
+template <typename Channel>
+void EmbedTileChunks(Channel* const BaseImageData, const unsigned int UsableChannels, const unsigned int PixelChannels,
+					 const unsigned int stride, const unsigned int BitsPerPixel, const ChunkOrder& order, const TileWalk& walk,
+					 const unsigned char* const block, const unsigned int offset, const unsigned int size, const unsigned int workers,
+					 unsigned int* const crcs, const StreamCipher& cipher) {
+	const unsigned int chunk{ChunkBytes(BitsPerPixel)}, first{offset / chunk}, chunks{(size + chunk - 1U) / chunk};
+	std::vector<unsigned char> encrypted;
+	const unsigned char* data{block};
+	if(cipher.Enabled()) {
+		encrypted.assign(block, block + size);
+		data = encrypted.data();
+	}
+	if(crcs || cipher.Enabled()) {
+		WorkerPool::Instance().Run(
+			chunks,
+			[&](const unsigned int c) {
+				const unsigned int begin{c * chunk}, end{std::min(size, begin + chunk)};
+				if(cipher.Enabled()) {
+					cipher.Apply(encrypted.data() + begin, end - begin, static_cast<unsigned long long>(offset) + begin);
+				}
+				if(crcs) {
+					crcs[first + c] = Crc32c(data + begin, end - begin);
+				}
+			},
+			workers);
+	}
+	const unsigned int SlotPixels{ChunkPixels * (stride + 1U)};
+	const std::vector<unsigned int> tiles{SlotTiles(walk, order, UsableChannels / PixelChannels, SlotPixels, first, chunks)};
+	VisitBpch(PixelChannels, BitsPerPixel, [&](const auto& bpch) {
+		WorkerPool::Instance().Run(
+			static_cast<unsigned int>(tiles.size()),
+			[&](const unsigned int k) {
+				SlotRuns(walk, order, tiles[k], SlotPixels, first, chunks,
+						 [&](const unsigned int pixel, const unsigned int position, const unsigned int run, const unsigned int slot,
+							 const unsigned int c) {
+							 EmbedRange(BaseImageData + static_cast<std::size_t>(pixel) * PixelChannels, data,
+										std::min(size, (c - first + 1U) * chunk),
+										RunStart(position, slot, c, first, stride, BitsPerPixel, bpch), run * PixelChannels, stride, bpch);
+						 });
+			},
+			workers);
+	});
+}
+
+// Tile order of ExtractChunks(): one pool task per tile holding the slots extracts its runs in place, the bytes shared by two runs
+// are merged once every tile is read, then the chunks are checked and decrypted
+template <typename Channel>
+void ExtractTileChunks(const Channel* const SourceImageData, const unsigned int UsableChannels, const unsigned int PixelChannels,
+					   const unsigned int stride, const unsigned int BitsPerPixel, const ChunkOrder& order, const TileWalk& walk,
+					   unsigned char* const block, const unsigned int offset, const unsigned int size, const unsigned int workers,
+					   const unsigned int* const crcs, char* const damaged, const StreamCipher& cipher) {
+	const unsigned int chunk{ChunkBytes(BitsPerPixel)}, first{offset / chunk}, chunks{(size + chunk - 1U) / chunk};
+	const unsigned int SlotPixels{ChunkPixels * (stride + 1U)};
+	const std::vector<unsigned int> tiles{SlotTiles(walk, order, UsableChannels / PixelChannels, SlotPixels, first, chunks)};
+	// Fragments of the bytes shared by two runs, with the position of their run
+	std::vector<std::vector<std::pair<unsigned int, KernelFragment>>> shared(tiles.size());
+	VisitBpch(PixelChannels, BitsPerPixel, [&](const auto& bpch) {
+		WorkerPool::Instance().Run(
+			static_cast<unsigned int>(tiles.size()),
+			[&](const unsigned int k) {
+				SlotRuns(walk, order, tiles[k], SlotPixels, first, chunks,
+						 [&](const unsigned int pixel, const unsigned int position, const unsigned int run, const unsigned int slot,
+							 const unsigned int c) {
+							 KernelFragment head, tail;
+							 ExtractRange(SourceImageData + static_cast<std::size_t>(pixel) * PixelChannels, block,
+										  std::min(size, (c - first + 1U) * chunk),
+										  RunStart(position, slot, c, first, stride, BitsPerPixel, bpch), run * PixelChannels, stride,
+										  bpch, head, tail);
+							 for(const KernelFragment& fragment : {head, tail}) {
+								 if(fragment.bits) {
+									 shared[k].emplace_back(position, fragment);
+								 }
+							 }
+						 });
+			},
+			workers);
+	});
+	// The runs sharing a byte are consecutive in position order
+	std::vector<std::pair<unsigned int, KernelFragment>> pieces;
+	for(const auto& tile : shared) {
+		pieces.insert(pieces.end(), tile.begin(), tile.end());
+	}
+	std::sort(pieces.begin(), pieces.end(), [](const auto& a, const auto& b) {
+		return a.second.index != b.second.index ? a.second.index < b.second.index : a.first < b.first;
+	});
+	std::vector<KernelFragment> fragments(pieces.size());
+	std::transform(pieces.begin(), pieces.end(), fragments.begin(), [](const auto& piece) { return piece.second; });
+	MergeFragments(block, size, fragments);
+	if(crcs || cipher.Enabled()) {
+		WorkerPool::Instance().Run(
+			chunks,
+			[&](const unsigned int c) {
+				const unsigned int begin{c * chunk}, end{std::min(size, begin + chunk)};
+				if(crcs && Crc32c(block + begin, end - begin) != crcs[first + c]) {
+					damaged[first + c] = 1;
+				}
+				cipher.Apply(block + begin, end - begin, static_cast<unsigned long long>(offset) + begin);
+			},
+			workers);
+	}
+}
+
+// Embeds the stream bytes [offset, offset + size), held by block, one pool task per chunk, every chunk in its slot. With crcs,
+// every task also stores the CRC32C of its chunk in crcs[chunk], while the chunk is hot in cache. With a cipher, every task
+// encrypts its chunk into a buffer of its own first, the chunk checksums cover the encrypted bytes. In tile order, see
+// EmbedTileChunks().
+template <typename Channel>
+void EmbedChunks(Channel* const BaseImageData, const unsigned int UsableChannels, const unsigned int PixelChannels,
+				 const unsigned int stride, const unsigned int BitsPerPixel, const ChunkOrder& order, const TileWalk& walk,
+				 const unsigned char* const block, const unsigned int offset, const unsigned int size, const unsigned int workers,
+				 unsigned int* const crcs = nullptr, const StreamCipher& cipher = StreamCipher()) {
+	if(!walk.RowOrder()) {
+		EmbedTileChunks(BaseImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, block, offset, size, workers, crcs,
+						cipher);
+		return;
+	}
+	const unsigned int chunk{ChunkBytes(BitsPerPixel)}, first{offset / chunk};
+	VisitBpch(PixelChannels, BitsPerPixel, [&](const auto& bpch) {
+		WorkerPool::Instance().Run(
+			(size + chunk - 1U) / chunk,
+			[&](const unsigned int c) {
+				KernelState state{ChunkStart(order.Place(first + c), stride, BitsPerPixel, PixelChannels)};
+				// Payload index relative to the block
+				state.payload = c * chunk;
+				unsigned int end{std::min(size, state.payload + chunk)};
+				const unsigned char* data{block};
+				thread_local std::vector<unsigned char> encrypted;
+				if(cipher.Enabled()) {
+					encrypted.assign(block + state.payload, block + end);
+					cipher.Apply(encrypted.data(), end - state.payload, static_cast<unsigned long long>(offset) + state.payload);
+					data = encrypted.data();
+					end -= state.payload;
+					state.payload = 0U;
+				}
+				if(crcs) {
+					crcs[first + c] = Crc32c(data + state.payload, end - state.payload);
+				}
+				EmbedRange(BaseImageData, data, end, state, UsableChannels, stride, bpch);
+			},
+			workers);
+	});
+}
+
+// Extracts the stream bytes [offset, offset + size) to block, one pool task per chunk, every chunk from its slot. With crcs,
+// every task checks its chunk against crcs[chunk] and flags it in damaged on a mismatch. With a cipher, every task then decrypts
+// its chunk in place, while it is hot in cache. In tile order, see ExtractTileChunks().
+template <typename Channel>
+void ExtractChunks(const Channel* const SourceImageData, const unsigned int UsableChannels, const unsigned int PixelChannels,
+				   const unsigned int stride, const unsigned int BitsPerPixel, const ChunkOrder& order, const TileWalk& walk,
+				   unsigned char* const block, const unsigned int offset, const unsigned int size, const unsigned int workers,
+				   const unsigned int* const crcs = nullptr, char* const damaged = nullptr, const StreamCipher& cipher = StreamCipher()) {
+	if(!walk.RowOrder()) {
+		ExtractTileChunks(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, block, offset, size, workers,
+						  crcs, damaged, cipher);
+		return;
+	}
+	const unsigned int chunk{ChunkBytes(BitsPerPixel)}, first{offset / chunk};
+	VisitBpch(PixelChannels, BitsPerPixel, [&](const auto& bpch) {
+		WorkerPool::Instance().Run(
+			(size + chunk - 1U) / chunk,
+			[&](const unsigned int c) {
+				KernelState state{ChunkStart(order.Place(first + c), stride, BitsPerPixel, PixelChannels)};
+				state.payload = c * chunk;
+				const unsigned int begin{state.payload}, end{std::min(size, state.payload + chunk)};
+				// Chunks start and end on byte boundaries, no byte is shared with the neighbouring chunks
+				KernelFragment head, tail;
+				ExtractRange(SourceImageData, block, end, state, UsableChannels, stride, bpch, head, tail);
+				if(crcs && Crc32c(block + begin, end - begin) != crcs[first + c]) {
+					damaged[first + c] = 1;
+				}
+				cipher.Apply(block + begin, end - begin, static_cast<unsigned long long>(offset) + begin);
+			},
+			workers);
+	});
+}
+
+// Number of bytes embedded for a stream of length bytes, tail included
+template <typename Channel>
+unsigned int Embedded(const unsigned int length, const unsigned int UsableChannels, const unsigned int PixelChannels) {
+	return static_cast<unsigned int>(EmbeddedLength(length, UsableChannels / PixelChannels, BpchRows(sizeof(Channel), PixelChannels)));
+}
+
+// Slots of the chunks of a stream, shuffled with the key given on the command line
+ChunkOrder StreamOrder(const std::string& passphrase, const unsigned int embedded, const unsigned int BitsPerPixel) {
+	const unsigned int chunk{ChunkBytes(BitsPerPixel)};
+	return ChunkOrder(passphrase, static_cast<unsigned int>((static_cast<unsigned long long>(embedded) + chunk - 1U) / chunk));
+}
+
+// Embeds the tail of a checked stream: the CRC32C of every chunk, zero padding, the payload length, the CRC32C of the tail
+template <typename Channel>
+void EmbedTail(Channel* const BaseImageData, const unsigned int UsableChannels, const unsigned int PixelChannels, const unsigned int stride,
+			   const unsigned int BitsPerPixel, const ChunkOrder& order, const TileWalk& walk, const unsigned int length,
+			   const std::vector<unsigned int>& crcs, const unsigned int workers) {
+	const unsigned int start{static_cast<unsigned int>(crcs.size()) * ChunkBytes(BitsPerPixel)};
+	const unsigned int embedded{Embedded<Channel>(length, UsableChannels, PixelChannels)};
+	std::vector<unsigned char> tail(embedded - start, 0U);
+	for(std::size_t c{0}; c < crcs.size(); ++c) {
+		PutLittleEndian(tail.data() + c * 4U, crcs[c]);
+	}
+	PutLittleEndian(tail.data() + tail.size() - TailBytes, length);
+	PutLittleEndian(tail.data() + tail.size() - 4U, Crc32c(tail.data(), tail.size() - 4U));
+	EmbedChunks(BaseImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, tail.data(), start,
+				static_cast<unsigned int>(tail.size()), workers);
+}
+
+// Logs the runs of damaged chunks as ranges of payload bytes
+void ReportDamage(const std::vector<char>& damaged, const unsigned int chunk, const unsigned int length) {
+	unsigned int regions{0}, chunks{0};
+	for(std::size_t c{0}; c < damaged.size(); ++c) {
+		if(!damaged[c]) {
+			continue;
+		}
+		std::size_t last{c};
+		while(last + 1U < damaged.size() && damaged[last + 1U]) {
+			++last;
+		}
+		if(regions < ReportedRegions) {
+			Stegano::Logger::Error("Warning!", " Payload bytes [", c * chunk, ", ", std::min<std::size_t>((last + 1U) * chunk, length),
+								   ") are damaged", '\n');
+		}
+		++regions;
+		chunks += static_cast<unsigned int>(last - c + 1U);
+		c = last;
+	}
+	if(regions > ReportedRegions) {
+		Stegano::Logger::Error("Warning!", " ", regions - ReportedRegions, " more damaged regions", '\n');
+	}
+	if(chunks) {
+		Stegano::Logger::Error("Warning!", " ", chunks, " of ", damaged.size(), " chunks failed their CRC32C check", '\n');
+	}
+}
+}
+
+unsigned long long EmbeddedLength(const unsigned long long length, const unsigned int AvailableBasePixels, const unsigned int rows) {
+	// Larger depths mean larger chunks and fewer checksums, the depth is raised until the layout is stable
+	for(unsigned int depth{Depth(length, AvailableBasePixels, rows)}; depth < rows;) {
+		const unsigned long long chunk{ChunkBytes(depth)}, chunks{(length + chunk - 1U) / chunk};
+		const unsigned long long embedded{chunks * (chunk + 4U) + TailBytes};
+		const unsigned int next{Depth(embedded, AvailableBasePixels, rows)};
+		if(next == depth) {
+			return embedded;
+		}
+		if(next < depth) {
+			// Fewer checksums than at the previous depth, padded up to the depth the chunks are laid out for
+			return (static_cast<unsigned long long>(depth) * AvailableBasePixels + 7U) / 8U;
+		}
+		depth = next;
+	}
+	return static_cast<unsigned long long>(rows) * AvailableBasePixels / 8U + 1U;
+}
+
+unsigned int FittingLength(const unsigned int AvailableBasePixels, const unsigned int rows) {
+	unsigned long long low{0}, high{std::min(static_cast<unsigned long long>(rows) * AvailableBasePixels / 8U, 0xFFFFFFFFULL)};
+	while(low < high) {
+		const unsigned long long middle{(low + high + 1U) / 2U};
+		if(Depth(EmbeddedLength(middle, AvailableBasePixels, rows), AvailableBasePixels, rows) < rows) {
+			low = middle;
+		}
+		else {
+			high = middle - 1U;
+		}
+	}
+	return static_cast<unsigned int>(low);
+}
+
+bool LengthFits(const unsigned long long length, const unsigned int AvailableBasePixels, const unsigned int rows) {
+	return length * 8U <= static_cast<unsigned long long>(rows) * AvailableBasePixels;
+}
+
+template <typename Channel>
+void EmbedStream(Channel* const BaseImageData, const unsigned int UsableChannels, const unsigned int PixelChannels,
+				 const unsigned int stride, const unsigned int BitsPerPixel, const TileWalk& walk, const unsigned char* const stream,
+				 const unsigned int length) {
+	const JobPlan plan{PlanJob(length, BitsPerPixel, PixelChannels, false)};
+	const unsigned int chunk{ChunkBytes(BitsPerPixel)};
+	// Error corrected streams are encrypted by the coding tasks, the chunks then hold the coded stream as it is
+	std::vector<unsigned char> coded;
+	const unsigned char* data{stream};
+	unsigned int size{length};
+	StreamCipher cipher{PayloadCipher(stream)};
+	if(fecparity) {
+		coded = FecEncode(stream, length, fecparity, cipher, plan.workers);
+		data = coded.data();
+		size = static_cast<unsigned int>(coded.size());
+		cipher = StreamCipher();
+	}
+	const ChunkOrder order{StreamOrder(key, Embedded<Channel>(size, UsableChannels, PixelChannels), BitsPerPixel)};
+	std::vector<unsigned int> crcs((size + chunk - 1U) / chunk);
+	EmbedChunks(BaseImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, data, 0U, size, plan.workers, crcs.data(),
+				cipher);
+	EmbedTail(BaseImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, size, crcs, plan.workers);
+}
+
+template <typename Channel>
+bool EmbedStream(Channel* const BaseImageData, const unsigned int UsableChannels, const unsigned int PixelChannels,
+				 const unsigned int stride, const unsigned int BitsPerPixel, const TileWalk& walk, const unsigned int length,
+				 const StreamReader& read) {
+	if(fecparity) {
+		// Codewords interleave the bytes of a whole block, the stream is coded in memory
+		std::vector<unsigned char> stream(length);
+		if(read(stream.data(), length) != length) {
+			return false;
+		}
+		EmbedStream(BaseImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, walk, stream.data(), length);
+		return true;
+	}
+	const unsigned int chunk{ChunkBytes(BitsPerPixel)};
+	const unsigned int BlockBytes{chunk * ChunksPerBlock};
+	const unsigned int FirstBlock{std::min(length, BlockBytes)};
+	const JobPlan plan{PlanJob(FirstBlock, BitsPerPixel, PixelChannels, false)};
+	const ChunkOrder order{StreamOrder(key, Embedded<Channel>(length, UsableChannels, PixelChannels), BitsPerPixel)};
+	std::array<std::vector<unsigned char>, 2> blocks{std::vector<unsigned char>(FirstBlock), std::vector<unsigned char>(FirstBlock)};
+	std::vector<unsigned int> crcs((length + chunk - 1U) / chunk);
+
+	bool complete{read(blocks[0].data(), FirstBlock) == FirstBlock};
+	// The nonce is at the start of the first block
+	const StreamCipher cipher{PayloadCipher(blocks[0].data())};
+	for(unsigned int offset{0}, current{0}; complete && offset < length; offset += BlockBytes, current ^= 1U) {
+		const unsigned int size{std::min(BlockBytes, length - offset)};
+		const unsigned int NextSize{std::min(BlockBytes, length - offset - size)};
+		std::thread reader;
+		if(NextSize) {
+			reader = std::thread([&, NextSize] { complete = read(blocks[current ^ 1U].data(), NextSize) == NextSize; });
+		}
+		EmbedChunks(BaseImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, blocks[current].data(), offset, size,
+					plan.workers, crcs.data(), cipher);
+		if(reader.joinable()) {
+			reader.join();
+		}
+	}
+	if(complete) {
+		EmbedTail(BaseImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, length, crcs, plan.workers);
+	}
+	return complete;
+}
+
+template <typename Channel>
+std::vector<unsigned int> UpdateStream(Channel* const BaseImageData, const unsigned int UsableChannels, const unsigned int PixelChannels,
+									   const unsigned int stride, const unsigned int BitsPerPixel, const TileWalk& walk,
+									   const unsigned char* const stream, const unsigned int length,
+									   const std::function<void(const std::vector<unsigned int>&)>& rewriting) {
+	const JobPlan plan{PlanJob(length, BitsPerPixel, PixelChannels, false)};
+	const unsigned int chunk{ChunkBytes(BitsPerPixel)};
+	// Bytes as they are embedded: coded (and encrypted by the coding tasks), or encrypted
+	const StreamCipher cipher{PayloadCipher(stream)};
+	std::vector<unsigned char> data;
+	if(fecparity) {
+		data = FecEncode(stream, length, fecparity, cipher, plan.workers);
+	}
+	else {
+		data.assign(stream, stream + length);
+		cipher.Apply(data.data(), length, 0U);
+	}
+	const unsigned int size{static_cast<unsigned int>(data.size())};
+	const unsigned int embedded{Embedded<Channel>(size, UsableChannels, PixelChannels)};
+	const ChunkOrder order{StreamOrder(key, embedded, BitsPerPixel)};
+	const unsigned int chunks{(size + chunk - 1U) / chunk};
+	std::vector<unsigned int> crcs(chunks);
+	std::vector<char> dirty(chunks, 0);
+	// Every task reads back the chunk its slot holds, a chunk is rewritten only if it differs
+	WorkerPool::Instance().Run(
+		chunks,
+		[&](const unsigned int c) {
+			const unsigned int begin{c * chunk}, end{std::min(size, begin + chunk)};
+			thread_local std::vector<unsigned char> held;
+			held.resize(end - begin);
+			ExtractBytes(static_cast<const Channel*>(BaseImageData), UsableChannels, PixelChannels, stride, BitsPerPixel,
+						 order.Place(c) * chunk, end - begin, held.data(), ChunkOrder(), walk);
+			crcs[c] = Crc32c(data.data() + begin, end - begin);
+			dirty[c] = !std::equal(held.begin(), held.end(), data.begin() + begin);
+		},
+		plan.workers);
+
+	// The tail holds the checksums of every chunk, it is always rewritten
+	std::vector<unsigned int> slots;
+	for(unsigned int c{0}; c < (embedded + chunk - 1U) / chunk; ++c) {
+		if(c >= chunks || dirty[c]) {
+			slots.push_back(order.Place(c));
+		}
+	}
+	std::sort(slots.begin(), slots.end());
+	if(rewriting) {
+		rewriting(slots);
+	}
+
+	for(unsigned int c{0}; c < chunks; ++c) {
+		if(!dirty[c]) {
+			continue;
+		}
+		unsigned int last{c};
+		while(last + 1U < chunks && dirty[last + 1U]) {
+			++last;
+		}
+		const unsigned int begin{c * chunk}, end{std::min(size, (last + 1U) * chunk)};
+		EmbedChunks(BaseImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, data.data() + begin, begin,
+					end - begin, plan.workers);
+		c = last;
+	}
+	EmbedTail(BaseImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, size, crcs, plan.workers);
+	return slots;
+}
+
+template <typename Channel>
+bool ExtractStream(const Channel* const SourceImageData, const unsigned int UsableChannels, const unsigned int PixelChannels,
+				   const unsigned int stride, const unsigned int BitsPerPixel, const TileWalk& walk, unsigned int length,
+				   const PayloadMarker& marker,
+				   const StreamWriter& write) {
+	if(!LengthFits(length, UsableChannels / PixelChannels, BpchRows(sizeof(Channel), PixelChannels))) {
+		Stegano::Logger::Error("Error!", " The trailer of the given image is damaged, it records more data than the image can hold", '\n');
+		return false;
+	}
+	const unsigned int chunk{ChunkBytes(BitsPerPixel)};
+	const ChunkOrder order{StreamOrder(marker.keyed ? key : std::string(), length, BitsPerPixel)};
+	std::vector<unsigned int> crcs;
+	std::vector<char> damaged;
+	bool verified{false};
+	if(marker.checked) {
+		if(length < TailBytes) {
+			Stegano::Logger::Error("Error!", " The checksum table of the embedded payload is damaged", '\n');
+			return false;
+		}
+		// Payload length from the end of the tail, then the whole tail. The length is only trusted once the checksum of the tail
+		// matches, otherwise the payload is taken as long as the embedded length leaves room for.
+		const unsigned int embedded{length}, last{(embedded - TailBytes) / chunk * chunk};
+		const unsigned int room{static_cast<unsigned int>((embedded - TailBytes) / (chunk + 4ULL) * chunk)};
+		std::vector<unsigned char> tail(embedded - last);
+		ExtractChunks(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, tail.data(), last,
+					  embedded - last, 0U);
+		const unsigned int stored{GetLittleEndian(tail.data() + tail.size() - TailBytes)};
+		if(stored <= room) {
+			const unsigned int chunks{(stored + chunk - 1U) / chunk}, start{chunks * chunk};
+			tail.resize(embedded - start);
+			ExtractChunks(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, tail.data(), start,
+						  embedded - start, 0U);
+			if(Crc32c(tail.data(), tail.size() - 4U) == GetLittleEndian(tail.data() + tail.size() - 4U)) {
+				verified = true;
+				length = stored;
+				crcs.resize(chunks);
+				damaged.assign(chunks, 0);
+				for(std::size_t c{0}; c < crcs.size(); ++c) {
+					crcs[c] = GetLittleEndian(tail.data() + c * 4U);
+				}
+			}
+		}
+		if(!verified) {
+			Stegano::Logger::Error("Warning!", " The checksum table of the embedded payload is damaged, it cannot be verified", '\n');
+			length = room;
+		}
+	}
+
+	if(marker.fec) {
+		// Unless the tail vouches for it, the coded length is read from the header of the coded stream by majority vote
+		if(!verified) {
+			std::array<unsigned char, FecHeaderBytes> header{};
+			if(length >= FecHeaderBytes) {
+				ExtractChunks(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, header.data(), 0U,
+							  FecHeaderBytes, 0U);
+			}
+			const unsigned long long coded{FecCodedLength(header.data())};
+			if(!coded || coded > length) {
+				Stegano::Logger::Error("Error!", " The error correction header of the embedded payload is damaged", '\n');
+				return false;
+			}
+			length = static_cast<unsigned int>(coded);
+		}
+		// The coded stream is extracted in full, then corrected and decrypted block by block
+		std::vector<unsigned char> coded(length), stream;
+		const JobPlan plan{PlanJob(length, BitsPerPixel, PixelChannels, true)};
+		ExtractChunks(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, coded.data(), 0U, length,
+					  plan.workers);
+		return FecDecode(coded, marker.encrypted, plan.workers, stream) && write(stream.data(), stream.size());
+	}
+
+	StreamCipher cipher;
+	if(marker.encrypted) {
+		if(length < NonceBytes) {
+			Stegano::Logger::Error("Error!", " The nonce of the encrypted payload is damaged", '\n');
+			return false;
+		}
+		std::array<unsigned char, NonceBytes> nonce;
+		ExtractChunks(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, nonce.data(), 0U, NonceBytes, 0U);
+		cipher = StreamCipher(cipherkey, nonce.data());
+	}
+
+	const unsigned int BlockBytes{chunk * ChunksPerBlock};
+	const unsigned int FirstBlock{std::min(length, BlockBytes)};
+	const JobPlan plan{PlanJob(FirstBlock, BitsPerPixel, PixelChannels, true)};
+	std::array<std::vector<unsigned char>, 2> blocks{std::vector<unsigned char>(FirstBlock), std::vector<unsigned char>(FirstBlock)};
+
+	bool written{true};
+	std::thread writer;
+	for(unsigned int offset{0}, current{0}; offset < length; offset += BlockBytes, current ^= 1U) {
+		const unsigned int size{std::min(BlockBytes, length - offset)};
+		// The writer of the previous block uses the other buffer
+		ExtractChunks(SourceImageData, UsableChannels, PixelChannels, stride, BitsPerPixel, order, walk, blocks[current].data(), offset,
+					  size, plan.workers, crcs.empty() ? nullptr : crcs.data(), damaged.empty() ? nullptr : damaged.data(), cipher);
+		if(writer.joinable()) {
+			writer.join();
+		}
+		if(!written) {
+			return false;
+		}
+		// The writer never sees the nonce
+		const unsigned int skip{offset == 0U && cipher.Enabled() ? NonceBytes : 0U};
+		writer = std::thread([&, current, size, skip] { written = write(blocks[current].data() + skip, size - skip); });
+	}
+	if(writer.joinable()) {
+		writer.join();
+	}
+	ReportDamage(damaged, chunk, length);
+	return written;
+}
+
+template <typename Channel>
+void WriteExtendedTrailer(Channel* const BaseImageData, const unsigned int TotalBaseChannels, const unsigned int PixelChannels,
+						  const unsigned int length) {
+	// Same trailer layout as ParallelEncode(), holding the stream length
+	std::array<unsigned char, 5> trailer{0, 0, 0, 0, 0};
+	for(unsigned int i{0}; i < 4U; ++i) {
+		trailer[i] = static_cast<unsigned char>(length >> (24U - 8U * i));
+	}
+	trailer[4] = static_cast<unsigned char>(TrailerChecksum(trailer, BaseImageData, TotalBaseChannels, PixelChannels) ^ CheckedMarker
+											^ (key.empty() ? 0U : KeyedMarker) ^ (encrypt ? EncryptedMarker : 0U)
+											^ (fecparity ? FecMarker : 0U) ^ TileOrderMarker(tileorder));
+	WriteTrailer(BaseImageData, TotalBaseChannels, trailer);
+}
+
+static_assert(MarkersApart(BgraMarker), "A layout marker XOR BgraMarker must never be another layout marker");
+
+template <typename Channel>
+bool ReadExtendedTrailer(const Channel* const SourceImageData, const unsigned int TotalSourceChannels, const unsigned int PixelChannels,
+						 unsigned int& length, PayloadMarker& marker) {
+	const std::array<unsigned char, 5> trailer{ReadTrailer(SourceImageData, TotalSourceChannels)};
+	const unsigned int checksum{TrailerChecksum(trailer, SourceImageData, TotalSourceChannels, PixelChannels)};
+	marker = ReadMarker(checksum, trailer[4]);
+	// Tiled, encrypted, error corrected and tile order streams are only ever whole payloads, never shards
+	if(!marker.extended || marker.tiled || marker.encrypted || marker.fec || marker.tileorder) {
+		return false;
+	}
+	length = 0U;
+	for(unsigned int i{0}; i < 4U; ++i) {
+		length = length * PowersOfTwo[8] + trailer[i];
+	}
+	return true;
+}
+
+// Base channels of 8 bit, 16 bit and floating point images, see VisitChannels()
+template void EmbedStream(unsigned char*, unsigned int, unsigned int, unsigned int, unsigned int, const TileWalk&, const unsigned char*,
+						  unsigned int);
+template void EmbedStream(unsigned short*, unsigned int, unsigned int, unsigned int, unsigned int, const TileWalk&, const unsigned char*,
+						  unsigned int);
+template void EmbedStream(unsigned int*, unsigned int, unsigned int, unsigned int, unsigned int, const TileWalk&, const unsigned char*,
+						  unsigned int);
+template bool EmbedStream(unsigned char*, unsigned int, unsigned int, unsigned int, unsigned int, const TileWalk&, unsigned int,
+						  const StreamReader&);
+template bool EmbedStream(unsigned short*, unsigned int, unsigned int, unsigned int, unsigned int, const TileWalk&, unsigned int,
+						  const StreamReader&);
+template bool EmbedStream(unsigned int*, unsigned int, unsigned int, unsigned int, unsigned int, const TileWalk&, unsigned int,
+						  const StreamReader&);
+template std::vector<unsigned int> UpdateStream(unsigned char*, unsigned int, unsigned int, unsigned int, unsigned int, const TileWalk&,
+												const unsigned char*, unsigned int,
+												const std::function<void(const std::vector<unsigned int>&)>&);
+template std::vector<unsigned int> UpdateStream(unsigned short*, unsigned int, unsigned int, unsigned int, unsigned int, const TileWalk&,
+												const unsigned char*, unsigned int,
+												const std::function<void(const std::vector<unsigned int>&)>&);
+template std::vector<unsigned int> UpdateStream(unsigned int*, unsigned int, unsigned int, unsigned int, unsigned int, const TileWalk&,
+												const unsigned char*, unsigned int,
+												const std::function<void(const std::vector<unsigned int>&)>&);
+template bool ExtractStream(const unsigned char*, unsigned int, unsigned int, unsigned int, unsigned int, const TileWalk&, unsigned int,
+							 const PayloadMarker&, const StreamWriter&);
+template bool ExtractStream(const unsigned short*, unsigned int, unsigned int, unsigned int, unsigned int, const TileWalk&, unsigned int,
+							 const PayloadMarker&, const StreamWriter&);
+template bool ExtractStream(const unsigned int*, unsigned int, unsigned int, unsigned int, unsigned int, const TileWalk&, unsigned int,
+							 const PayloadMarker&, const StreamWriter&);
+template void WriteExtendedTrailer(unsigned char*, unsigned int, unsigned int, unsigned int);
+template void WriteExtendedTrailer(unsigned short*, unsigned int, unsigned int, unsigned int);
+template void WriteExtendedTrailer(unsigned int*, unsigned int, unsigned int, unsigned int);
+template bool ReadExtendedTrailer(const unsigned char*, unsigned int, unsigned int, unsigned int&, PayloadMarker&);
+template bool ReadExtendedTrailer(const unsigned short*, unsigned int, unsigned int, unsigned int&, PayloadMarker&);
+template bool ReadExtendedTrailer(const unsigned int*, unsigned int, unsigned int, unsigned int&, PayloadMarker&);
+
+}
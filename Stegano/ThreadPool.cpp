@@ -0,0 +1,258 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+
+#if(CV_VERSION_MAJOR > 4) || (CV_VERSION_MAJOR == 4 && (CV_VERSION_MINOR > 5 || (CV_VERSION_MINOR == 5 && CV_VERSION_REVISION >= 2)))
+	// OpenCV 4.5.2 onwards accepts a custom parallel_for backend
+	#define STEGANO_CV_PARALLEL_BACKEND 1
+	#include <opencv2/core/parallel/parallel_backend.hpp>
+#endif
+
+namespace Stegano {
+
+namespace {
+// 0 for threads outside the pool, k for pool worker k
+thread_local unsigned int WorkerIndex{0U};
+
+struct Job {
+	const std::function<void(unsigned int)>* body;
+	unsigned int tasks;
+	std::atomic<unsigned int> next{0U}, done{0U};
+	// Static jobs (see RunStatic()) give task t to worker 1 + t % workers, joined => the worker took its tasks
+	bool fixed{false};
+	std::vector<bool> joined;
+	// First exception thrown by a task, rethrown by the owner once every task is accounted for
+	std::atomic<bool> failed{false};
+	std::exception_ptr error;
+};
+}
+
+struct WorkerPool::State {
+	std::vector<std::thread> workers;
+	std::deque<std::shared_ptr<Job>> queue;
+	std::mutex mutex;
+	std::condition_variable wake, finished;
+	bool stop{false};
+
+	// First job worker k can take part in, called with the mutex held
+	std::shared_ptr<Job> Pending(const unsigned int k) {
+		for(const auto& job : queue) {
+			if(job->fixed ? !job->joined[k - 1U] : job->next.load() < job->tasks) {
+				if(job->fixed) {
+					job->joined[k - 1U] = true;
+				}
+				return job;
+			}
+		}
+		return nullptr;
+	}
+};
+
+WorkerPool::WorkerPool() : state(new State) {
+}
+
+WorkerPool::~WorkerPool() {
+	Resize(1U);
+	delete state;
+}
+
+WorkerPool& WorkerPool::Instance() {
+	static WorkerPool pool;
+	return pool;
+}
+
+void WorkerPool::Resize(const unsigned int size) {
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->stop = true;
+	}
+	state->wake.notify_all();
+	for(auto& worker : state->workers) {
+		worker.join();
+	}
+	state->workers.clear();
+	state->stop = false;
+
+	// The calling thread takes part in every Run(), so size - 1 workers are spawned. Only they are pinned, the caller keeps
+	// running the serial stages wherever the scheduler puts it.
+	for(unsigned int k{1}; k < size; ++k) {
+		state->workers.emplace_back([this, k] {
+			WorkerIndex = k;
+			PinThread(k);
+			std::unique_lock<std::mutex> lock(state->mutex);
+			while(true) {
+				// Exhausted jobs stay queued until their owner retires them, workers skip them
+				std::shared_ptr<Job> job;
+				state->wake.wait(lock, [this, k, &job] { return state->stop || (job = state->Pending(k)) != nullptr; });
+				if(state->stop) {
+					return;
+				}
+				lock.unlock();
+				Execute(job.get());
+				lock.lock();
+			}
+		});
+	}
+}
+
+unsigned int WorkerPool::Size() const {
+	return static_cast<unsigned int>(state->workers.size()) + 1U;
+}
+
+unsigned int WorkerPool::CurrentWorker() {
+	return WorkerIndex;
+}
+
+void WorkerPool::Execute(void* const pending) {
+	Job* const job{static_cast<Job*>(pending)};
+	const auto perform = [this, job](const unsigned int task) {
+		// Tasks left once a task has thrown are counted without running them
+		if(!job->failed.load()) {
+			try {
+				(*job->body)(task);
+			}
+			catch(...) {
+				if(!job->failed.exchange(true)) {
+					job->error = std::current_exception();
+				}
+			}
+		}
+		if(job->done.fetch_add(1U) + 1U == job->tasks) {
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->finished.notify_all();
+		}
+	};
+	if(job->fixed) {
+		const unsigned int workers{static_cast<unsigned int>(job->joined.size())};
+		for(unsigned int task{WorkerIndex - 1U}; task < job->tasks; task += workers) {
+			perform(task);
+		}
+		return;
+	}
+	for(unsigned int task{job->next.fetch_add(1U)}; task < job->tasks; task = job->next.fetch_add(1U)) {
+		perform(task);
+	}
+}
+
+void WorkerPool::Submit(const unsigned int tasks, const std::function<void(unsigned int)>& body, const bool fixed) {
+	auto job{std::make_shared<Job>()};
+	job->body = &body;
+	job->tasks = tasks;
+	job->fixed = fixed;
+	if(fixed) {
+		job->joined.assign(state->workers.size(), false);
+	}
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->queue.push_back(job);
+	}
+
+	// Whichever way this call returns, body outlives every task: the job leaves the queue only once all of them are done
+	struct Retire {
+		State* state;
+		const std::shared_ptr<Job>& job;
+		~Retire() {
+			std::unique_lock<std::mutex> lock(state->mutex);
+			state->finished.wait(lock, [this] { return job->done.load() == job->tasks; });
+			for(auto it{state->queue.begin()}; it != state->queue.end(); ++it) {
+				if(*it == job) {
+					state->queue.erase(it);
+					break;
+				}
+			}
+		}
+	};
+	{
+		const Retire retire{state, job};
+		state->wake.notify_all();
+		// The caller works on its own dynamic job, so nested Run() calls from workers cannot deadlock
+		if(!fixed) {
+			Execute(job.get());
+		}
+	}
+	if(job->error) {
+		std::rethrow_exception(job->error);
+	}
+}
+
+void WorkerPool::Run(const unsigned int tasks, const std::function<void(unsigned int)>& body) {
+	if(tasks == 0U) {
+		return;
+	}
+	if(tasks == 1U || state->workers.empty()) {
+		for(unsigned int task{0}; task < tasks; ++task) {
+			body(task);
+		}
+		return;
+	}
+	Submit(tasks, body, false);
+}
+
+void WorkerPool::RunStatic(const unsigned int tasks, const std::function<void(unsigned int)>& body) {
+	// A worker waiting on a static job would hold back its own share, from inside a task the tasks go to whoever is free
+	if(tasks == 0U || state->workers.empty() || WorkerIndex != 0U) {
+		Run(tasks, body);
+		return;
+	}
+	Submit(tasks, body, true);
+}
+
+void WorkerPool::Run(const unsigned int tasks, const std::function<void(unsigned int)>& body, const unsigned int concurrency) {
+	if(concurrency == 0U || concurrency >= tasks) {
+		Run(tasks, body);
+		return;
+	}
+	// Each runner keeps pulling tasks until none are left
+	std::atomic<unsigned int> next{0U};
+	Run(concurrency, [&next, &body, tasks](unsigned int) {
+		for(unsigned int task{next.fetch_add(1U)}; task < tasks; task = next.fetch_add(1U)) {
+			body(task);
+		}
+	});
+}
+
+#if STEGANO_CV_PARALLEL_BACKEND
+namespace {
+// Routes cv::parallel_for_ (resize, cvtColor, imread, quality metrics...) through the worker pool
+class PoolParallelBackend : public cv::parallel::ParallelForAPI {
+public:
+	void parallel_for(int tasks, FN_parallel_for_body_cb_t body_callback, void* callback_data) override {
+		WorkerPool::Instance().Run(static_cast<unsigned int>(tasks), [body_callback, callback_data](const unsigned int task) {
+			body_callback(static_cast<int>(task), static_cast<int>(task) + 1, callback_data);
+		});
+	}
+	int getThreadNum() const override {
+		return static_cast<int>(WorkerPool::CurrentWorker());
+	}
+	int getNumThreads() const override {
+		return static_cast<int>(WorkerPool::Instance().Size());
+	}
+	int setNumThreads(int) override {
+		// The budget is owned by the "threads" flag
+		return getNumThreads();
+	}
+	const char* getName() const override {
+		return "stegano";
+	}
+};
+}
+#endif
+
+void SetupWorkerPool(const unsigned int size) {
+	WorkerPool::Instance().Resize(size);
+#if STEGANO_CV_PARALLEL_BACKEND
+	cv::parallel::setParallelForBackend(std::make_shared<PoolParallelBackend>(), false);
+	Stegano::Logger::Verbose("OpenCV parallel backend = stegano worker pool", '\n');
+#else
+	// Older OpenCV cannot host a custom backend, its own threading is left as it is and runs outside the budget of the pool
+	Stegano::Logger::Verbose("OpenCV parallel backend = OpenCV ", CV_VERSION, " default, outside the worker pool", '\n');
+#endif
+}
+
+}
@@ -0,0 +1,34 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoKernels.h"
+#include <algorithm>
+
+namespace Stegano {
+
+TileWalk::TileWalk(const unsigned int edge, const unsigned int rows, const unsigned int cols)
+	: edge{cols > edge ? edge : 0U}, rows{rows}, cols{cols} {
+	if(!this->edge) {
+		return;
+	}
+	TilesX = (cols + edge - 1U) / edge;
+	TilesY = (rows + edge - 1U) / edge;
+	starts.assign(static_cast<std::size_t>(TilesX) * TilesY + 1U, 0U);
+	// The trailer only cuts the last row of the image, cols > edge > 7
+	const unsigned int TrailerStart{cols - 7U};
+	for(unsigned int t{0}; t < TilesX * TilesY; ++t) {
+		const unsigned int x{t % TilesX * edge}, y{t / TilesX * edge};
+		const unsigned int w{std::min(edge, cols - x)}, h{std::min(edge, rows - y)};
+		const unsigned int cut{y + h == rows && x + w > TrailerStart ? x + w - std::max(x, TrailerStart) : 0U};
+		starts[t + 1U] = starts[t] + w * h - cut;
+	}
+}
+
+std::pair<int, int> TileWalk::Rows(const unsigned int first, const unsigned int last) const {
+	if(!edge) {
+		return {static_cast<int>(first / cols), static_cast<int>((last - 1U) / cols + 1U)};
+	}
+	const unsigned int from{Tile(first) / TilesX}, to{Tile(last - 1U) / TilesX};
+	return {static_cast<int>(from * edge), static_cast<int>(std::min((to + 1U) * edge, rows))};
+}
+
+}
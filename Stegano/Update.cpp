@@ -0,0 +1,218 @@
+/* Copyright 2020 Prakhar Agarwal*/
+
+#include "SteganoThreadedCommon.h"
+#include "SteganoKernels.h"
+#include "SteganoPayload.h"
+#include <opencv2/quality.hpp>
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <limits>
+
+namespace Stegano {
+
+namespace {
+// Adds the rows [from, to) to ascending row bands, merged with the last band when they touch it
+void AddBand(std::vector<std::pair<int, int>>& bands, const int from, const int to) {
+	if(!bands.empty() && from <= bands.back().second) {
+		bands.back().second = std::max(bands.back().second, to);
+	}
+	else {
+		bands.emplace_back(from, to);
+	}
+}
+
+/**
+ * @brief Rows of an encoded image holding the rewritten chunk slots and the trailer
+ * @param image -> Encoded image
+ * @param slots -> Rewritten chunk slots in ascending order, see UpdateStream()
+ * @param stride -> Pixels skipped between two encoding pixels
+ * @param walk -> Pixels holding the stream, whole rows of tiles in tile order
+ * @return [first, last) row ranges in ascending order, neighbouring ranges merged
+ */
+std::vector<std::pair<int, int>> RowBands(const cv::Mat& image, const std::vector<unsigned int>& slots, const unsigned int stride,
+										  const TileWalk& walk) {
+	const unsigned int UsablePixels{static_cast<unsigned int>(image.rows * image.cols - 7)};
+	const unsigned long long SlotPixels{ChunkPixels * (stride + 1ULL)};
+	std::vector<std::pair<int, int>> bands;
+	for(const unsigned int slot : slots) {
+		const unsigned long long first{slot * SlotPixels}, last{std::min<unsigned long long>((slot + 1ULL) * SlotPixels, UsablePixels)};
+		if(first < last) {
+			const auto [from, to] = walk.Rows(static_cast<unsigned int>(first), static_cast<unsigned int>(last));
+			AddBand(bands, from, to);
+		}
+	}
+	// The trailer takes the last 7 pixels
+	AddBand(bands, static_cast<int>(UsablePixels / static_cast<unsigned int>(image.cols)), image.rows);
+	return bands;
+}
+}
+
+bool UpdateCarrier(const std::string& carrier, const std::string& source, const std::string& output) {
+	Stegano::Logger::Verbose("Compress payload = ", compress ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Payload encryption = ", encrypt ? "true" : "false", '\n');
+	Stegano::Logger::Verbose("Error correction parity = ", fecparity, '\n');
+
+	cv::Mat BaseImage;
+	std::thread loadbase([&carrier, &BaseImage] {
+		Stegano::Logger::Verbose("Reading encoded image", '\n');
+		BaseImage = ReadCarrier(carrier);
+	});
+	std::vector<unsigned char> stream;
+	const bool built{BuildStream(source, stream)};
+	loadbase.join();
+	if(!built) {
+		return false;
+	}
+	if(!BaseImage.data) {
+		Stegano::Logger::Error("Error!", " Cannot open the encoded image.", " Please check if the path is correct and if the file is an",
+							   " 8 bit, 16 bit or floating point color image.", '\n');
+		return false;
+	}
+	if(!CheckCarrierDepth(BaseImage, output)) {
+		return false;
+	}
+
+	const unsigned int PixelChannels{static_cast<unsigned int>(BaseImage.channels())};
+	// Using 7 pixels for the trailer
+	const unsigned int AvailableBasePixels{static_cast<unsigned int>(BaseImage.rows * BaseImage.cols - 7)};
+	const unsigned int TotalBaseChannels{(AvailableBasePixels + 7U) * PixelChannels};
+
+	// Layout of the payload the image holds
+	const std::array<unsigned char, 5> trailer{
+		VisitChannels(BaseImage, [&](const auto* const BaseImageData) { return ReadTrailer(BaseImageData, TotalBaseChannels); })};
+	const unsigned int checksum{VisitChannels(
+		BaseImage,
+		[&](const auto* const BaseImageData) { return TrailerChecksum(trailer, BaseImageData, TotalBaseChannels, PixelChannels); })};
+	const PayloadMarker marker{ReadMarker(checksum, trailer[4])};
+	if(!marker.valid) {
+		Stegano::Logger::Error("Error!", " The given image does not have any data embedded using this application", '\n');
+		Stegano::Logger::Log("Encode it with \"encode\" first, \"update\" only replaces the payload of an encoded image", '\n');
+		return false;
+	}
+	unsigned int PreviousLength{0};
+	for(unsigned int i{0}; marker.extended && i < 4U; ++i) {
+		PreviousLength = PreviousLength * PowersOfTwo[8] + trailer[i];
+	}
+	// The image keeps the order its payload was embedded in, the new trailer records it again
+	tileorder = marker.tileorder;
+
+	if(encrypt) {
+		// A fresh nonce, reusing the previous one would expose the XOR of both payloads
+		const std::array<unsigned char, NonceBytes> nonce{MakeNonce()};
+		stream.insert(stream.begin(), nonce.begin(), nonce.end());
+	}
+	if(FecLength(stream.size(), fecparity) > 0xFFFFFFFFULL) {
+		Stegano::Logger::Error("Error!", " Source too large.", " Cannot embed more than 4 GiB.", '\n');
+		return false;
+	}
+	const unsigned int StreamLength{static_cast<unsigned int>(stream.size())};
+	const unsigned int UsableRows{BpchRows(BaseImage.elemSize1(), PixelChannels)};
+	const unsigned long long BitsToEncode{EmbeddedLength(FecLength(StreamLength, fecparity), AvailableBasePixels, UsableRows) * 8U};
+	Stegano::Logger::Verbose("Encoded image size = [", BaseImage.rows, " x ", BaseImage.cols, " x ", BaseImage.channels(), ']', '\n',
+							 "Payload stream = ", StreamLength, " bytes", "\n\n");
+	if(BitsToEncode / AvailableBasePixels >= UsableRows) {
+		Stegano::Logger::Error("Error!", " The encoded image is not large enough to store the new payload", '\n');
+		return false;
+	}
+
+	// The same embedded length gives the same depth, stride and chunk slots, only the chunks which differ are rewritten. Any other
+	// layout would leave the previous payload in the pixels the new one no longer reaches, so the update is refused.
+	if(!marker.checked || PreviousLength != BitsToEncode / 8U) {
+		Stegano::Logger::Error("Error!", marker.checked ? " The new payload crosses a chunk boundary of the previous one"
+														: " The image holds no checked stream",
+							   ", the layout would change and leave parts of the previous payload in the image", '\n');
+		Stegano::Logger::Log("Encode the new payload into the original base with \"encode\" instead", '\n');
+		return false;
+	}
+	if(encrypt) {
+		Stegano::Logger::Verbose("Encrypted payload, the fresh nonce changes every chunk", '\n');
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	const std::shared_ptr<const LayoutPlan> layout{PlanLayout(BaseImage, BitsToEncode, StreamLength, false)};
+	const unsigned int BitsPerPixel{layout->BitsPerPixel}, stride{layout->stride};
+
+	// The previous image is not kept, it is analysed before the update and only its rewritten rows are copied
+	const LsbStatistics PreviousStatistics{analyse ? AnalyseLsb(BaseImage) : LsbStatistics{}};
+	Stegano::Logger::Verbose("Updating now...", '\n');
+	const TileWalk walk(tileorder, static_cast<unsigned int>(BaseImage.rows), static_cast<unsigned int>(BaseImage.cols));
+	std::vector<std::pair<int, int>> bands;
+	std::vector<cv::Mat> PreviousBands;
+	const std::function<void(const std::vector<unsigned int>&)> rewriting{[&](const std::vector<unsigned int>& slots) {
+		bands = RowBands(BaseImage, slots, stride, walk);
+		for(const auto& [first, last] : bands) {
+			PreviousBands.push_back(BaseImage.rowRange(first, last).clone());
+		}
+	}};
+	std::vector<unsigned int> slots;
+	VisitChannels(BaseImage, [&](auto* const BaseImageData) {
+		slots = UpdateStream(BaseImageData, AvailableBasePixels * PixelChannels, PixelChannels, stride, BitsPerPixel, walk, stream.data(),
+							 StreamLength, rewriting);
+		WriteExtendedTrailer(BaseImageData, TotalBaseChannels, PixelChannels, static_cast<unsigned int>(BitsToEncode / 8U));
+	});
+
+	int changed{0};
+	for(const auto& [first, last] : bands) {
+		changed += last - first;
+	}
+	const unsigned int chunk{ChunkBytes(BitsPerPixel)};
+	Stegano::Logger::Verbose("Rewrote ", slots.size(), " of ", (BitsToEncode / 8U + chunk - 1U) / chunk, " chunks (tail included), ",
+							 changed, " of ", BaseImage.rows, " rows in ", bands.size(), " bands", '\n');
+
+	// Uncompressed files of the same format are patched in place, only the rows of the bands are written
+	bool saved{false};
+	const ImageFormat format{OutputFormat(output)};
+	if((format == FORMAT_PAM || format == FORMAT_BMP) && format == OutputFormat(carrier)) {
+		std::error_code ec;
+		if(!std::filesystem::equivalent(carrier, output, ec)) {
+			ec.clear();
+			std::filesystem::copy_file(carrier, output, std::filesystem::copy_options::overwrite_existing, ec);
+		}
+		if(!ec && PatchImage(output, BaseImage, bands)) {
+			Stegano::Logger::Log("Image saved at - ", output, " (", changed, " of ", BaseImage.rows, " rows rewritten)", '\n');
+			saved = true;
+		}
+	}
+	if(!saved) {
+		Stegano::Logger::Verbose("Saving updated image", '\n');
+		saved = SaveImage(output, BaseImage, "Encoded", tileorder);
+	}
+
+	if(showimages) {
+		cv::Mat EncodedCopy{BaseImage};
+#if _WIN32
+		ResizeToSmall(BaseImage, EncodedCopy, "Encoded Image");
+#endif
+		cv::namedWindow("Updated Image", cv::WINDOW_AUTOSIZE);
+		cv::imshow("Updated Image", EncodedCopy);
+		cv::waitKey(0);
+	}
+	else {
+		auto end = std::chrono::steady_clock::now();
+		const double timetaken = static_cast<double>(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) / 1000.0;
+		Stegano::Logger::Verbose('\n', "Update took: ", timetaken, " seconds");
+	}
+
+	// Rows outside the bands are unchanged, the squared error of the image is that of the bands
+	cv::Scalar SquaredError;
+	for(std::size_t b{0}; b < bands.size(); ++b) {
+		const cv::Mat rows{BaseImage.rowRange(bands[b].first, bands[b].second)};
+		SquaredError += cv::quality::QualityMSE::compute(rows, PreviousBands[b], cv::noArray()) * static_cast<double>(rows.total());
+	}
+	const double peak{PeakValue(BaseImage)};
+	cv::Scalar PSNR;
+	for(int c{0}; c < 4; ++c) {
+		const double MSE{SquaredError[c] / static_cast<double>(BaseImage.total())};
+		PSNR[c] = MSE == 0.0 ? std::numeric_limits<double>::infinity() : 10.0 * std::log10(peak * peak / MSE);
+	}
+	Stegano::Logger::Verbose("\n\n", "Per channel PSNR against the previous image = ", PSNR, '\n');
+
+	if(analyse) {
+		ReportDetectability(PreviousStatistics, AnalyseLsb(BaseImage), "updated image");
+	}
+	return saved;
+}
+
+}